@@ -331,6 +331,7 @@ SOURCES += src/qt/bitcoin.cpp \
     src/shavite.c \
     src/echo.c \
     src/simd.c \
+    src/hashblock.cpp \
     src/checkpointsync.cpp
 
 RESOURCES += src/qt/bitcoin.qrc
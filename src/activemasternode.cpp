@@ -105,16 +105,11 @@ void CActiveMasternode::RegisterAsMasterNode(bool stop)
 
             pwalletMain->LockCoin(vinMasternode.prevout);
 
-            bool found = false;
-            BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes)
-                if(mn.vin == vinMasternode)
-                    found = true;
-
-            if(!found) {                
+            if(!masternodeList.Has(vinMasternode)) {
                 LogPrintf("CActiveMasternode::RegisterAsMasterNode() - Adding myself to masternode list %s - %s\n", masterNodeSignAddr.ToString().c_str(), vinMasternode.ToString().c_str());
                 CMasterNode mn(masterNodeSignAddr, vinMasternode, pubkeyMasterNode, vchMasterNodeSignature, masterNodeSignatureTime, pubkey2);
                 mn.UpdateLastSeen(masterNodeSignatureTime);
-                darkSendMasterNodes.push_back(mn);
+                masternodeList.Add(mn);
                 LogPrintf("CActiveMasternode::RegisterAsMasterNode() - Masternode input = %s\n", vinMasternode.ToString().c_str());
             }
         
@@ -140,16 +135,7 @@ void CActiveMasternode::RegisterAsMasterNode(bool stop)
         return;
     }
 
-    bool found = false;
-    BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes) {
-        //LogPrintf(" -- %s\n", mn.vin.ToString().c_str());
-
-        if(mn.vin == vinMasternode) {
-            found = true;
-            mn.UpdateLastSeen();
-        }
-    }
-    if(!found){
+    if(!masternodeList.UpdateLastSeen(vinMasternode)){
         LogPrintf("CActiveMasternode::RegisterAsMasterNode() - Darksend Masternode List doesn't include our masternode, Shutting down masternode pinging service! %s\n", vinMasternode.ToString().c_str());
         isCapableMasterNode = MASTERNODE_STOPPED;
         return;
@@ -190,8 +176,8 @@ bool CActiveMasternode::RegisterAsMasterNodeRemoteOnly(std::string strMasterNode
     }
 
     CService masterNodeSignAddr = CService(strMasterNodeAddr);
-    BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes){
-        if(mn.addr == masterNodeSignAddr){
+    BOOST_FOREACH(const CMasterNodePtr& pmn, masternodeList.GetAll()){
+        if(pmn->addr == masterNodeSignAddr){
             LogPrintf("     - Address in use");
             return false;
         }
@@ -222,8 +208,8 @@ bool CActiveMasternode::RegisterAsMasterNodeRemoteOnly(std::string strMasterNode
     // Choose coins to use
     while (GetMasterNodeVin(vinMasternode, pubkeyMasterNode, SecretKey)) {
         // don't use a vin that's registered
-        BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes)
-            if(mn.vin == vinMasternode)
+        BOOST_FOREACH(const CMasterNodePtr& pmn, masternodeList.GetAll())
+            if(pmn->vin == vinMasternode)
                 continue;
 
         if(GetInputAge(vinMasternode) < MASTERNODE_MIN_CONFIRMATIONS)
@@ -27,6 +27,10 @@ private:
     // Mutex to protect the inner state
     boost::mutex mutex;
 
+    // Held by the CCheckQueueControl using the queue, so that masters that
+    // don't hold cs_main while they wait can't interleave their batches
+    boost::mutex mutexControl;
+
     // Worker threads block on this when out of work
     boost::condition_variable condWorker;
 
@@ -164,6 +168,7 @@ public:
     CCheckQueueControl(CCheckQueue<T> *pqueueIn) : pqueue(pqueueIn), fDone(false) {
         // passed queue is supposed to be unused, or NULL
         if (pqueue != NULL) {
+            pqueue->mutexControl.lock();
             assert(pqueue->nTotal == pqueue->nIdle);
             assert(pqueue->nTodo == 0);
             assert(pqueue->fAllOk == true);
@@ -186,6 +191,8 @@ public:
     ~CCheckQueueControl() {
         if (!fDone)
             Wait();
+        if (pqueue != NULL)
+            pqueue->mutexControl.unlock();
     }
 };
 
@@ -12,6 +12,7 @@
 #include <boost/lexical_cast.hpp>
 
 #include <algorithm>
+#include <deque>
 #include <boost/assign/list_of.hpp>
 
 using namespace std;
@@ -24,6 +25,8 @@ CDarkSendPool darkSendPool;
 CDarkSendSigner darkSendSigner;
 /** All denominations used by darksend */
 std::vector<int64> darkSendDenominations;
+/** The same denominations, for lookups */
+std::set<int64> setDarkSendDenominations;
 /** The current darksends in progress on the network */
 std::vector<CDarksendQueue> vecDarksendQueue;
 /** Keep track of the used masternodes */
@@ -98,16 +101,16 @@ void ProcessMessageDarksend(CNode* pfrom, std::string& strCommand, CDataStream&
         vRecv >> nDenom >> txCollateral;
 
         std::string error = "";
-        int mn = GetMasternodeByVin(activeMasternode.vinMasternode);
-        if(mn == -1){
+        CMasterNodePtr pmn = masternodeList.Get(activeMasternode.vinMasternode);
+        if(!pmn){
             std::string strError = "Not in the masternode list";
             pfrom->PushMessage("dssu", darkSendPool.sessionID, darkSendPool.GetState(), darkSendPool.GetEntriesCount(), MASTERNODE_REJECTED, strError);
             return;            
         }
 
-        if(darkSendMasterNodes[mn].nLastDsq != 0 && 
-            darkSendMasterNodes[mn].nLastDsq + (int)darkSendMasterNodes.size()/5 > darkSendPool.nDsqCount){
-            //LogPrintf("dsa -- last dsq too recent, must wait. %s \n", darkSendMasterNodes[mn].addr.ToString().c_str());
+        if(pmn->nLastDsq != 0 && 
+            pmn->nLastDsq + (int)masternodeList.size()/5 > darkSendPool.nDsqCount){
+            //LogPrintf("dsa -- last dsq too recent, must wait. %s \n", pmn->addr.ToString().c_str());
             std::string strError = "Last darksend was too recent";
             pfrom->PushMessage("dssu", darkSendPool.sessionID, darkSendPool.GetState(), darkSendPool.GetEntriesCount(), MASTERNODE_REJECTED, strError);
             return;
@@ -137,8 +140,8 @@ void ProcessMessageDarksend(CNode* pfrom, std::string& strCommand, CDataStream&
 
         if(dsq.IsExpired()) return;
 
-        int mn = GetMasternodeByVin(dsq.vin);
-        if(mn == -1) return;
+        CMasterNodePtr pmn = masternodeList.Get(dsq.vin);
+        if(!pmn) return;
 
 
         // if the queue is ready, submit if we can
@@ -157,14 +160,13 @@ void ProcessMessageDarksend(CNode* pfrom, std::string& strCommand, CDataStream&
             }
             
             //don't allow a few nodes to dominate the queuing process
-            if(darkSendMasterNodes[mn].nLastDsq != 0 && 
-                darkSendMasterNodes[mn].nLastDsq + (int)darkSendMasterNodes.size()/5 > darkSendPool.nDsqCount){
-                LogPrintf("dsq -- masternode sending too many dsq messages. %s \n", darkSendMasterNodes[mn].addr.ToString().c_str());
+            if(pmn->nLastDsq != 0 && 
+                pmn->nLastDsq + (int)masternodeList.size()/5 > darkSendPool.nDsqCount){
+                LogPrintf("dsq -- masternode sending too many dsq messages. %s \n", pmn->addr.ToString().c_str());
                 return;
             }
             darkSendPool.nDsqCount++;
-            darkSendMasterNodes[mn].nLastDsq = darkSendPool.nDsqCount; 
-            darkSendMasterNodes[mn].allowFreeTx = true;
+            masternodeList.UpdateLastDsq(dsq.vin, darkSendPool.nDsqCount);
 
             if (fDebug)  LogPrintf("new darksend queue object - %s\n", addr.ToString().c_str());
             vecDarksendQueue.push_back(dsq);
@@ -348,37 +350,48 @@ void ProcessMessageDarksend(CNode* pfrom, std::string& strCommand, CDataStream&
 
 int randomizeList (int i) { return std::rand()%i;}
 
-// Recursively determine the rounds of a given input (How deep is the darksend chain for a given input)
-int GetInputDarksendRounds(CTxIn in, int rounds)
+void InitDarkSendDenominations()
 {
-    if(rounds >= 9) return rounds;
+    darkSendDenominations.clear();
+    darkSendDenominations.push_back( (500   * COIN)+1 );
+    darkSendDenominations.push_back( (100   * COIN)+1 );
+    darkSendDenominations.push_back( (10    * COIN)+1 );
+    darkSendDenominations.push_back( (1     * COIN)+1 );
+
+    setDarkSendDenominations.clear();
+    setDarkSendDenominations.insert(darkSendDenominations.begin(), darkSendDenominations.end());
+}
 
-    std::string padding = "";
-    padding.insert(0, ((rounds+1)*5)+3, ' ');
+bool IsDenominatedAmount(int64 nInputAmount)
+{
+    return setDarkSendDenominations.count(nInputAmount) != 0;
+}
+
+// Does the actual work for GetInputDarksendRounds(), which caches the results; requires pwalletMain->cs_wallet
+static int GetInputDarksendRoundsUncached(const CTxIn& in, int rounds)
+{
+    std::map<uint256, CWalletTx>::const_iterator mi = pwalletMain->mapWallet.find(in.prevout.hash);
+    if(mi != pwalletMain->mapWallet.end()){
+        const CWalletTx& tx = (*mi).second;
 
-    CWalletTx tx;
-    if(pwalletMain->GetTransaction(in.prevout.hash,tx)){
         // bounds check
         if(in.prevout.n >= tx.vout.size()) return -4;
 
         if(tx.vout[in.prevout.n].nValue == DARKSEND_FEE) return -3;
 
         if(rounds == 0){ //make sure the final output is non-denominate
-            bool found = false;
-            BOOST_FOREACH(int64 d, darkSendDenominations)
-                if(tx.vout[in.prevout.n].nValue == d) found = true;
-
-            if(!found) {
+            if(!IsDenominatedAmount(tx.vout[in.prevout.n].nValue)) {
                 //LogPrintf(" - NOT DENOM\n");
                 return -2;
             }
         }
         bool found = false;
 
-        BOOST_FOREACH(CTxOut out, tx.vout){
-            BOOST_FOREACH(int64 d, darkSendDenominations)
-                if(out.nValue == d)
-                    found = true;
+        BOOST_FOREACH(const CTxOut& out, tx.vout){
+            if(IsDenominatedAmount(out.nValue)) {
+                found = true;
+                break;
+            }
         }
         
         if(!found) {
@@ -387,20 +400,40 @@ int GetInputDarksendRounds(CTxIn in, int rounds)
         }
 
         // find my vin and look that up
-        BOOST_FOREACH(CTxIn in2, tx.vin) {
+        BOOST_FOREACH(const CTxIn& in2, tx.vin) {
             if(pwalletMain->IsMine(in2)){
-                //LogPrintf("rounds :: %s %s %d NEXT\n", padding.c_str(), in.ToString().c_str(), rounds);  
+                //LogPrintf("rounds :: %d NEXT\n", rounds);
                 int n = GetInputDarksendRounds(in2, rounds+1);
                 if(n != -3) return n;
+            } else if(!pwalletMain->mapWallet.count(in2.prevout.hash)) {
+                // IsMine() can't see this input until its transaction shows up
+                pwalletMain->setDarksendRoundsMissing.insert(in2.prevout.hash);
             }
         }
     } else {
-        //LogPrintf("rounds :: %s %s %d NOTFOUND\n", padding.c_str(), in.ToString().c_str(), rounds);
+        //LogPrintf("rounds :: %d NOTFOUND\n", rounds);
+        pwalletMain->setDarksendRoundsMissing.insert(in.prevout.hash);
     }
 
     return rounds-1;
 }
 
+// Recursively determine the rounds of a given input (How deep is the darksend chain for a given input)
+int GetInputDarksendRounds(CTxIn in, int rounds)
+{
+    if(rounds >= 9) return rounds;
+
+    LOCK(pwalletMain->cs_wallet);
+
+    std::pair<COutPoint, int> key = make_pair(in.prevout, rounds);
+    std::map<std::pair<COutPoint, int>, int>::const_iterator mi = pwalletMain->mapDarksendRounds.find(key);
+    if(mi != pwalletMain->mapDarksendRounds.end()) return (*mi).second;
+
+    int n = GetInputDarksendRoundsUncached(in, rounds);
+    pwalletMain->mapDarksendRounds[key] = n;
+    return n;
+}
+
 void CDarkSendPool::SetNull(bool clearEverything){
     finalTransaction.vin.clear();
     finalTransaction.vout.clear();
@@ -1117,6 +1150,9 @@ bool CDarkSendPool::SignFinalTransaction(CTransaction& finalTransactionNew, CNod
     
     vector<CTxIn> sigs;
 
+    // Only scriptSigs change while signing, so all my inputs share one signature hash context
+    CSignatureHashContext sighash(finalTransaction);
+
     //make sure my inputs/outputs are present, otherwise refuse to sign
     BOOST_FOREACH(const CDarkSendEntry e, myEntries) {
         BOOST_FOREACH(const CDarkSendEntryVin s, e.sev) {
@@ -1159,7 +1195,7 @@ bool CDarkSendPool::SignFinalTransaction(CTransaction& finalTransactionNew, CNod
                 }
 
                 if(fDebug) LogPrintf("CDarkSendPool::Sign - Signing my input %i\n", mine);
-                if(!SignSignature(*pwalletMain, prevPubKey, finalTransaction, mine, int(SIGHASH_ALL|SIGHASH_ANYONECANPAY))) { // changes scriptSig
+                if(!SignSignature(*pwalletMain, prevPubKey, finalTransaction, mine, int(SIGHASH_ALL|SIGHASH_ANYONECANPAY), &sighash)) { // changes scriptSig
                     if(fDebug) LogPrintf("CDarkSendPool::Sign - Unable to sign my own transaction! \n");
                     // not sure what to do here, it will timeout...?
                 }
@@ -1482,30 +1518,31 @@ bool CDarkSendPool::DoAutomaticDenominating(bool fDryRun, bool ready)
         // otherwise, try one randomly
         if(sessionTries++ < 10){
             //pick a random masternode to use
-            int max_value = darkSendMasterNodes.size();
+            std::vector<CMasterNodePtr> vpmn = masternodeList.GetAll();
+            int max_value = vpmn.size();
             if(max_value <= 0) return false;
-            int i = (rand() % max_value);
+            const CMasterNode& mn = *vpmn[rand() % max_value];
 
             //don't reuse masternodes
             BOOST_FOREACH(CTxIn usedVin, vecMasternodesUsed) {
-                if(darkSendMasterNodes[i].vin == usedVin){
+                if(mn.vin == usedVin){
                     return DoAutomaticDenominating();
                 }
             }
 
-            if(darkSendMasterNodes[i].nLastDsq != 0 && 
-                darkSendMasterNodes[i].nLastDsq + (int)darkSendMasterNodes.size()/5 > darkSendPool.nDsqCount){
+            if(mn.nLastDsq != 0 && 
+                mn.nLastDsq + max_value/5 > darkSendPool.nDsqCount){
                 return DoAutomaticDenominating();
             }
 
             lastTimeChanged = GetTimeMillis();
-            LogPrintf("DoAutomaticDenominating -- attempt %d connection to masternode %s\n", sessionTries, darkSendMasterNodes[i].addr.ToString().c_str());
-            if(ConnectNode((CAddress)darkSendMasterNodes[i].addr, NULL, true)){
-                submittedToMasternode = darkSendMasterNodes[i].addr;
+            LogPrintf("DoAutomaticDenominating -- attempt %d connection to masternode %s\n", sessionTries, mn.addr.ToString().c_str());
+            if(ConnectNode((CAddress)mn.addr, NULL, true)){
+                submittedToMasternode = mn.addr;
                 LOCK(cs_vNodes);
                 BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    if(darkSendMasterNodes[i].addr != pnode->addr) continue;
+                    if(mn.addr != pnode->addr) continue;
 
                     std::string strReason;
                     if(txCollateral == CTransaction()){
@@ -1515,7 +1552,7 @@ bool CDarkSendPool::DoAutomaticDenominating(bool fDryRun, bool ready)
                         }
                     }
 
-                    vecMasternodesUsed.push_back(darkSendMasterNodes[i].vin);
+                    vecMasternodesUsed.push_back(mn.vin);
                     sessionDenom = GetDenominationsByAmount(sessionTotalValue);
                     pnode->PushMessage("dsa", sessionDenom, txCollateral);
                     LogPrintf("DoAutomaticDenominating --- connected, sending dsa for %d - denom %d\n", sessionDenom, GetDenominationsByAmount(sessionTotalValue));
@@ -1856,18 +1893,50 @@ bool CDarkSendSigner::SignMessage(std::string strMessage, std::string& errorMess
     return true;
 }
 
+// Signers recovered by VerifyMessage, keyed by Hash(message hash, signature). dsee, dseep and mnw
+// signatures are recovered once by the message handler threads before the message waits for cs_main
+// (see PreVerifyMessageMasternode), and again from the cache when it's handled. The oldest entries
+// are evicted first, so an entry outlives the wait for cs_main unless MAX_RECOVERED_KEYS newer
+// signatures arrive in the meantime.
+static const unsigned int MAX_RECOVERED_KEYS = 10000;
+static CCriticalSection cs_mapRecoveredKeys;
+static map<uint256, CKeyID> mapRecoveredKeys;
+static std::deque<uint256> dqRecoveredKeys;   // keys of mapRecoveredKeys, oldest first
+
 bool CDarkSendSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
 {
     CHashWriter ss(SER_GETHASH, 0);
     ss << strMessageMagic;
     ss << strMessage;
+    uint256 hashMessage = ss.GetHash();
+    uint256 hashCache = Hash(BEGIN(hashMessage), END(hashMessage), vchSig.begin(), vchSig.end());
+
+    {
+        LOCK(cs_mapRecoveredKeys);
+        map<uint256, CKeyID>::iterator mi = mapRecoveredKeys.find(hashCache);
+        if (mi != mapRecoveredKeys.end())
+            return ((*mi).second == pubkey.GetID());
+    }
 
     CPubKey pubkey2;
-    if (!pubkey2.RecoverCompact(ss.GetHash(), vchSig)) {
+    if (!pubkey2.RecoverCompact(hashMessage, vchSig)) {
         errorMessage = "Error recovering pubkey";
         return false;
     }
 
+    {
+        LOCK(cs_mapRecoveredKeys);
+        if (mapRecoveredKeys.insert(make_pair(hashCache, pubkey2.GetID())).second)
+        {
+            dqRecoveredKeys.push_back(hashCache);
+            while (dqRecoveredKeys.size() > MAX_RECOVERED_KEYS)
+            {
+                mapRecoveredKeys.erase(dqRecoveredKeys.front());
+                dqRecoveredKeys.pop_front();
+            }
+        }
+    }
+
     return (pubkey2.GetID() == pubkey.GetID());
 }
 
@@ -1902,11 +1971,14 @@ bool CDarksendQueue::Sign()
 
 bool CDarksendQueue::Relay()
 {
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << (*this);
+    CNetMessageRef msg = MakeNetMessage("dsq", ss);
 
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes){
         // always relay to everyone
-        pnode->PushMessage("dsq", (*this));
+        pnode->PushSharedMessage(msg);
     }
 
     return true;
@@ -1914,21 +1986,17 @@ bool CDarksendQueue::Relay()
 
 bool CDarksendQueue::CheckSignature()
 {
-    BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes) {
+    CMasterNodePtr pmn = masternodeList.Get(vin);
+    if(!pmn) return false;
 
-        if(mn.vin == vin) {
-            std::string strMessage = vin.ToString() + boost::lexical_cast<std::string>(nDenom) + boost::lexical_cast<std::string>(time) + boost::lexical_cast<std::string>(ready); 
-
-            std::string errorMessage = "";
-            if(!darkSendSigner.VerifyMessage(mn.pubkey2, vchSig, strMessage, errorMessage)){
-                return error("Got bad masternode address signature %s \n", vin.ToString().c_str());
-            }
+    std::string strMessage = vin.ToString() + boost::lexical_cast<std::string>(nDenom) + boost::lexical_cast<std::string>(time) + boost::lexical_cast<std::string>(ready); 
 
-            return true;
-        }
+    std::string errorMessage = "";
+    if(!darkSendSigner.VerifyMessage(pmn->pubkey2, vchSig, strMessage, errorMessage)){
+        return error("Got bad masternode address signature %s \n", vin.ToString().c_str());
     }
 
-    return false;
+    return true;
 }
 
 
@@ -1945,16 +2013,7 @@ void ThreadCheckDarkSendPool()
         darkSendPool.CheckTimeout();
         
         if(c % 60 == 0){
-            vector<CMasterNode>::iterator it = darkSendMasterNodes.begin();
-            while(it != darkSendMasterNodes.end()){
-                (*it).Check();
-                if((*it).enabled == 4 || (*it).enabled == 3){
-                    LogPrintf("Removing inactive masternode %s\n", (*it).addr.ToString().c_str());
-                    it = darkSendMasterNodes.erase(it);
-                } else {
-                    ++it;
-                }
-            }
+            masternodeList.CheckAndRemove();
 
             masternodePayments.CleanPaymentList();
         }
@@ -1990,7 +2049,7 @@ void ThreadCheckDarkSendPool()
 
         if(c % 60 == 0){
             //if we've used 1/5 of the masternode list, then clear the list.
-            if((int)vecMasternodesUsed.size() > (int)darkSendMasterNodes.size() / 5) 
+            if((int)vecMasternodesUsed.size() > (int)masternodeList.size() / 5) 
                 vecMasternodesUsed.clear();
 
         }
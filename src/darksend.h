@@ -36,6 +36,7 @@ class CDarksendQueue;
 extern CDarkSendPool darkSendPool;
 extern CDarkSendSigner darkSendSigner;
 extern std::vector<int64> darkSendDenominations;
+extern std::set<int64> setDarkSendDenominations;
 extern std::vector<CDarksendQueue> vecDarksendQueue;
 extern std::string strMasterNodePrivKey;
 
@@ -48,6 +49,12 @@ void ProcessMessageDarksend(CNode* pfrom, std::string& strCommand, CDataStream&
 // get the darksend chain depth for a given input
 int GetInputDarksendRounds(CTxIn in, int rounds=0);
 
+// set up the denominations, from large to small
+void InitDarkSendDenominations();
+
+// is this amount one of the darksend denominations
+bool IsDenominatedAmount(int64 nInputAmount);
+
 
 // An input in the darksend pool
 class CDarkSendEntryVin
@@ -154,13 +161,7 @@ public:
 
     int GetAddress(CService &addr)
     {
-        BOOST_FOREACH(CMasterNode mn, darkSendMasterNodes) {
-            if(mn.vin == vin){
-                addr = mn.addr;
-                return true;
-            }
-        }
-        return false;
+        return masternodeList.GetAddr(vin, addr);
     }
 
     bool Sign();
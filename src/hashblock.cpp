@@ -0,0 +1,783 @@
+// Copyright (c) 2014 The Darkcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "hashblock.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_X11_SIMD 1
+#endif
+
+//
+// Multi-buffer X11
+//
+// Hash9Multi() runs the eleven X11 stages breadth-first: every lane finishes
+// stage N before any lane starts stage N+1. The table driven functions
+// (groestl, shavite, echo) then keep their tables hot across lanes.
+//
+// The add-rotate-xor stages (blake, bmw, skein, keccak, cubehash) have
+// lane-parallel SSE2/AVX2 kernels that hash one message per vector element.
+// Groestl, shavite and echo are AES-style table lookups, which a vector unit
+// without gather can not do per element; simd's NTT and the bitsliced jh and
+// luffa permutations need shuffle-based kernels of their own. Those six
+// stages call the scalar sph code once per lane.
+//
+
+namespace {
+
+/** Stage contexts with the initial state already set up, copied instead of re-initialised for every lane */
+struct CX11InitialState
+{
+    sph_blake512_context     blake;
+    sph_bmw512_context       bmw;
+    sph_groestl512_context   groestl;
+    sph_skein512_context     skein;
+    sph_jh512_context        jh;
+    sph_keccak512_context    keccak;
+    sph_luffa512_context     luffa;
+    sph_cubehash512_context  cubehash;
+    sph_shavite512_context   shavite;
+    sph_simd512_context      simd;
+    sph_echo512_context      echo;
+
+    CX11InitialState()
+    {
+        sph_blake512_init(&blake);
+        sph_bmw512_init(&bmw);
+        sph_groestl512_init(&groestl);
+        sph_skein512_init(&skein);
+        sph_jh512_init(&jh);
+        sph_keccak512_init(&keccak);
+        sph_luffa512_init(&luffa);
+        sph_cubehash512_init(&cubehash);
+        sph_shavite512_init(&shavite);
+        sph_simd512_init(&simd);
+        sph_echo512_init(&echo);
+    }
+};
+
+const CX11InitialState& X11InitialState()
+{
+    static CX11InitialState state;
+    return state;
+}
+
+// Run one 512-bit -> 512-bit stage over all lanes with the scalar sph_* code
+#define X11_STAGE(name, nLanes, pin, pout) do { \
+    sph_##name##512_context ctx; \
+    for (unsigned int i = 0; i < (nLanes); i++) \
+    { \
+        memcpy(&ctx, &X11InitialState().name, sizeof(ctx)); \
+        sph_##name##512(&ctx, static_cast<const void*>(&(pin)[i]), 64); \
+        sph_##name##512_close(&ctx, static_cast<void*>(&(pout)[i])); \
+    } \
+} while (0)
+
+void Blake512MultiScalar(const unsigned char* const* ppInput, size_t nLen, uint512* pout, unsigned int nLanes)
+{
+    static unsigned char pblank[1];
+    sph_blake512_context ctx;
+    for (unsigned int i = 0; i < nLanes; i++)
+    {
+        memcpy(&ctx, &X11InitialState().blake, sizeof(ctx));
+        sph_blake512(&ctx, (nLen == 0 ? pblank : ppInput[i]), nLen);
+        sph_blake512_close(&ctx, static_cast<void*>(&pout[i]));
+    }
+}
+
+void Bmw512MultiScalar(const uint512* pin, uint512* pout, unsigned int nLanes)
+{
+    X11_STAGE(bmw, nLanes, pin, pout);
+}
+
+void Skein512MultiScalar(const uint512* pin, uint512* pout, unsigned int nLanes)
+{
+    X11_STAGE(skein, nLanes, pin, pout);
+}
+
+void Keccak512MultiScalar(const uint512* pin, uint512* pout, unsigned int nLanes)
+{
+    X11_STAGE(keccak, nLanes, pin, pout);
+}
+
+void CubeHash512MultiScalar(const uint512* pin, uint512* pout, unsigned int nLanes)
+{
+    X11_STAGE(cubehash, nLanes, pin, pout);
+}
+
+#ifdef USE_X11_SIMD
+//
+// Lane-parallel stages. V is a GCC vector with one word per lane; the same
+// template is instantiated for SSE2 and AVX2 through the target attribute of
+// the caller. The 64-bit word functions (blake, bmw, skein, keccak) run 2 and
+// 4 lanes, cubehash with its 32-bit words runs 4 and 8. Every lane is one
+// message; there is no data movement between vector elements.
+//
+typedef uint64_t x11_v2u64 __attribute__((vector_size(16)));
+typedef uint64_t x11_v4u64 __attribute__((vector_size(32)));
+typedef uint32_t x11_v4u32 __attribute__((vector_size(16)));
+typedef uint32_t x11_v8u32 __attribute__((vector_size(32)));
+
+#define X11_INLINE inline __attribute__((always_inline))
+
+// The helpers returning vectors are always inlined into their target("avx2")
+// callers, so GCC's note that such returns change the ABI does not apply
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+// Rotate every word of a vector by 0 < n < word size
+#define X11_ROTL64(v, n) (((v) << (n)) | ((v) >> (64 - (n))))
+#define X11_ROTR64(v, n) (((v) >> (n)) | ((v) << (64 - (n))))
+#define X11_ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+// M(k, a, b) for every k, spelled out so the state arrays stay in registers at -O2
+#define X11_REPEAT5(M, a, b) M(0, a, b) M(1, a, b) M(2, a, b) M(3, a, b) M(4, a, b)
+#define X11_REPEAT16(M, a, b) \
+    M( 0, a, b) M( 1, a, b) M( 2, a, b) M( 3, a, b) M( 4, a, b) M( 5, a, b) M( 6, a, b) M( 7, a, b) \
+    M( 8, a, b) M( 9, a, b) M(10, a, b) M(11, a, b) M(12, a, b) M(13, a, b) M(14, a, b) M(15, a, b)
+#define X11_REPEAT25(M, a, b) X11_REPEAT16(M, a, b) \
+    M(16, a, b) M(17, a, b) M(18, a, b) M(19, a, b) M(20, a, b) M(21, a, b) M(22, a, b) M(23, a, b) M(24, a, b)
+
+// The same word in every lane
+template<typename V, unsigned int N, typename W>
+X11_INLINE V X11Splat(W w)
+{
+    V v;
+    for (unsigned int j = 0; j < N; j++)
+        v[j] = w;
+    return v;
+}
+
+// Little endian word i of the 64 byte message of every lane
+template<typename V, unsigned int N, typename W>
+X11_INLINE V X11Load(const uint512* pin, int i)
+{
+    V v;
+    for (unsigned int j = 0; j < N; j++)
+    {
+        W w;
+        memcpy(&w, (const unsigned char*)&pin[j] + sizeof(W) * i, sizeof(W));
+        v[j] = w;
+    }
+    return v;
+}
+
+template<typename V, unsigned int N, typename W>
+X11_INLINE void X11Store(uint512* pout, int i, const V& v)
+{
+    for (unsigned int j = 0; j < N; j++)
+    {
+        W w = v[j];
+        memcpy((unsigned char*)&pout[j] + sizeof(W) * i, &w, sizeof(W));
+    }
+}
+
+//
+// BLAKE-512, over the nLen byte input of the first stage
+//
+const uint64_t pBlakeIV[8] =
+{
+    0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+    0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+};
+
+const uint64_t pBlakeConstants[16] =
+{
+    0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL, 0xA4093822299F31D0ULL, 0x082EFA98EC4E6C89ULL,
+    0x452821E638D01377ULL, 0xBE5466CF34E90C6CULL, 0xC0AC29B7C97C50DDULL, 0x3F84D5B5B5470917ULL,
+    0x9216D5D98979FB1BULL, 0xD1310BA698DFB5ACULL, 0x2FFD72DBD01ADFB7ULL, 0xB8E1AFED6A267E96ULL,
+    0xBA7C9045F12C7F99ULL, 0x24A19947B3916CF7ULL, 0x0801F2E2858EFC16ULL, 0x636920D871574E69ULL
+};
+
+// Message permutations; round r uses row r % 10
+const unsigned char pBlakeSigma[10][16] =
+{
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+    { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+    {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+    {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+    {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+    { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+    { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+    {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+    { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 }
+};
+
+template<typename V, unsigned int N>
+X11_INLINE void Blake512G(V& a, V& b, V& c, V& d, const V* m, int x, int y)
+{
+    a = a + b + (m[x] ^ X11Splat<V, N>(pBlakeConstants[y]));
+    d = X11_ROTR64(d ^ a, 32);
+    c = c + d;
+    b = X11_ROTR64(b ^ c, 25);
+    a = a + b + (m[y] ^ X11Splat<V, N>(pBlakeConstants[x]));
+    d = X11_ROTR64(d ^ a, 16);
+    c = c + d;
+    b = X11_ROTR64(b ^ c, 11);
+}
+
+#define X11_BLAKE_ROUND(r, u, w) \
+    Blake512G<V, N>(v[0], v[4], v[ 8], v[12], m, pBlakeSigma[(r) % 10][ 0], pBlakeSigma[(r) % 10][ 1]); \
+    Blake512G<V, N>(v[1], v[5], v[ 9], v[13], m, pBlakeSigma[(r) % 10][ 2], pBlakeSigma[(r) % 10][ 3]); \
+    Blake512G<V, N>(v[2], v[6], v[10], v[14], m, pBlakeSigma[(r) % 10][ 4], pBlakeSigma[(r) % 10][ 5]); \
+    Blake512G<V, N>(v[3], v[7], v[11], v[15], m, pBlakeSigma[(r) % 10][ 6], pBlakeSigma[(r) % 10][ 7]); \
+    Blake512G<V, N>(v[0], v[5], v[10], v[15], m, pBlakeSigma[(r) % 10][ 8], pBlakeSigma[(r) % 10][ 9]); \
+    Blake512G<V, N>(v[1], v[6], v[11], v[12], m, pBlakeSigma[(r) % 10][10], pBlakeSigma[(r) % 10][11]); \
+    Blake512G<V, N>(v[2], v[7], v[ 8], v[13], m, pBlakeSigma[(r) % 10][12], pBlakeSigma[(r) % 10][13]); \
+    Blake512G<V, N>(v[3], v[4], v[ 9], v[14], m, pBlakeSigma[(r) % 10][14], pBlakeSigma[(r) % 10][15]);
+
+// Compress one 128 byte block per lane; nCounter is the message bit count including this block
+template<typename V, unsigned int N>
+X11_INLINE void Blake512Compress(V* h, const unsigned char* const* ppBlock, uint64_t nCounter)
+{
+    V m[16], v[16];
+    for (int i = 0; i < 16; i++)
+        for (unsigned int j = 0; j < N; j++)
+        {
+            uint64_t w;
+            memcpy(&w, ppBlock[j] + 8 * i, 8);
+            m[i][j] = __builtin_bswap64(w);
+        }
+
+    for (int i = 0; i < 8; i++)
+        v[i] = h[i];
+    for (int i = 0; i < 4; i++)
+        v[8 + i] = X11Splat<V, N>(pBlakeConstants[i]);
+    v[12] = X11Splat<V, N>(nCounter ^ pBlakeConstants[4]);
+    v[13] = X11Splat<V, N>(nCounter ^ pBlakeConstants[5]);
+    v[14] = X11Splat<V, N>(pBlakeConstants[6]);
+    v[15] = X11Splat<V, N>(pBlakeConstants[7]);
+
+    X11_REPEAT16(X11_BLAKE_ROUND, 0, 0)
+
+    for (int i = 0; i < 8; i++)
+        h[i] ^= v[i] ^ v[i + 8];
+}
+
+template<typename V, unsigned int N>
+X11_INLINE void Blake512Lanes(const unsigned char* const* ppInput, size_t nLen, uint512* pout)
+{
+    V h[8];
+    for (int i = 0; i < 8; i++)
+        h[i] = X11Splat<V, N>(pBlakeIV[i]);
+
+    const unsigned char* ppBlock[N];
+    size_t nPos = 0;
+    for (; nLen - nPos >= 128; nPos += 128)
+    {
+        for (unsigned int j = 0; j < N; j++)
+            ppBlock[j] = ppInput[j] + nPos;
+        Blake512Compress<V, N>(h, ppBlock, (nPos + 128) * 8);
+    }
+
+    // Padding: 0x80 after the message, then a 1 bit just before the 128-bit
+    // big endian bit length. A block holding no message bits is compressed
+    // with a zero counter.
+    size_t nRem = nLen - nPos;
+    uint64_t nBits = (uint64_t)nLen * 8;
+    unsigned char pblock[N][128];
+    for (unsigned int j = 0; j < N; j++)
+    {
+        memset(pblock[j], 0, 128);
+        if (nRem > 0)
+            memcpy(pblock[j], ppInput[j] + nPos, nRem);
+        pblock[j][nRem] = 0x80;
+        ppBlock[j] = pblock[j];
+    }
+    if (nRem >= 112)
+    {
+        Blake512Compress<V, N>(h, ppBlock, nBits);
+        for (unsigned int j = 0; j < N; j++)
+            memset(pblock[j], 0, 128);
+    }
+    for (unsigned int j = 0; j < N; j++)
+    {
+        pblock[j][111] |= 1;
+        uint64_t w = __builtin_bswap64(nBits);
+        memcpy(pblock[j] + 120, &w, 8);
+    }
+    Blake512Compress<V, N>(h, ppBlock, (nRem > 0 && nRem < 112) ? nBits : 0);
+
+    for (int i = 0; i < 8; i++)
+        for (unsigned int j = 0; j < N; j++)
+        {
+            uint64_t w = __builtin_bswap64(h[i][j]);
+            memcpy((unsigned char*)&pout[j] + 8 * i, &w, 8);
+        }
+}
+
+//
+// BMW-512
+//
+const uint64_t pBmwIV[16] =
+{
+    0x8081828384858687ULL, 0x88898A8B8C8D8E8FULL, 0x9091929394959697ULL, 0x98999A9B9C9D9E9FULL,
+    0xA0A1A2A3A4A5A6A7ULL, 0xA8A9AAABACADAEAFULL, 0xB0B1B2B3B4B5B6B7ULL, 0xB8B9BABBBCBDBEBFULL,
+    0xC0C1C2C3C4C5C6C7ULL, 0xC8C9CACBCCCDCECFULL, 0xD0D1D2D3D4D5D6D7ULL, 0xD8D9DADBDCDDDEDFULL,
+    0xE0E1E2E3E4E5E6E7ULL, 0xE8E9EAEBECEDEEEFULL, 0xF0F1F2F3F4F5F6F7ULL, 0xF8F9FAFBFCFDFEFFULL
+};
+
+template<typename V>
+X11_INLINE V Bmw512S(int n, const V& x)
+{
+    switch (n)
+    {
+    case 0:  return (x >> 1) ^ (x << 3) ^ X11_ROTL64(x,  4) ^ X11_ROTL64(x, 37);
+    case 1:  return (x >> 1) ^ (x << 2) ^ X11_ROTL64(x, 13) ^ X11_ROTL64(x, 43);
+    case 2:  return (x >> 2) ^ (x << 1) ^ X11_ROTL64(x, 19) ^ X11_ROTL64(x, 53);
+    case 3:  return (x >> 2) ^ (x << 2) ^ X11_ROTL64(x, 28) ^ X11_ROTL64(x, 59);
+    case 4:  return (x >> 1) ^ x;
+    default: return (x >> 2) ^ x;
+    }
+}
+
+template<typename V, unsigned int N>
+X11_INLINE V Bmw512AddElt(const V* m, const V* h, int j)
+{
+    int a = j & 15, b = (j + 3) & 15, c = (j + 10) & 15;
+    return (X11_ROTL64(m[a], a + 1) + X11_ROTL64(m[b], b + 1) - X11_ROTL64(m[c], c + 1) +
+            X11Splat<V, N>((uint64_t)(16 + j) * 0x0555555555555555ULL)) ^ h[(j + 7) & 15];
+}
+
+// One BMW compression of the 16 word block m under chaining value h into dh
+template<typename V, unsigned int N>
+X11_INLINE void Bmw512Compress(const V* m, const V* h, V* dh)
+{
+    V x[16], w[16], q[32];
+    for (int i = 0; i < 16; i++)
+        x[i] = m[i] ^ h[i];
+
+    w[ 0] = x[ 5] - x[ 7] + x[10] + x[13] + x[14];
+    w[ 1] = x[ 6] - x[ 8] + x[11] + x[14] - x[15];
+    w[ 2] = x[ 0] + x[ 7] + x[ 9] - x[12] + x[15];
+    w[ 3] = x[ 0] - x[ 1] + x[ 8] - x[10] + x[13];
+    w[ 4] = x[ 1] + x[ 2] + x[ 9] - x[11] - x[14];
+    w[ 5] = x[ 3] - x[ 2] + x[10] - x[12] + x[15];
+    w[ 6] = x[ 4] - x[ 0] - x[ 3] - x[11] + x[13];
+    w[ 7] = x[ 1] - x[ 4] - x[ 5] - x[12] - x[14];
+    w[ 8] = x[ 2] - x[ 5] - x[ 6] + x[13] - x[15];
+    w[ 9] = x[ 0] - x[ 3] + x[ 6] - x[ 7] + x[14];
+    w[10] = x[ 8] - x[ 1] - x[ 4] - x[ 7] + x[15];
+    w[11] = x[ 8] - x[ 0] - x[ 2] - x[ 5] + x[ 9];
+    w[12] = x[ 1] + x[ 3] - x[ 6] - x[ 9] + x[10];
+    w[13] = x[ 2] + x[ 4] + x[ 7] + x[10] + x[11];
+    w[14] = x[ 3] - x[ 5] + x[ 8] - x[11] - x[12];
+    w[15] = x[12] - x[ 4] - x[ 6] - x[ 9] + x[13];
+
+    for (int i = 0; i < 16; i++)
+        q[i] = Bmw512S(i % 5, w[i]) + h[(i + 1) & 15];
+
+    // Two rounds of expand1, then expand2
+    for (int i = 16; i < 18; i++)
+    {
+        V s = Bmw512AddElt<V, N>(m, h, i - 16);
+        for (int k = 0; k < 16; k++)
+            s += Bmw512S((k + 1) & 3, q[i - 16 + k]);
+        q[i] = s;
+    }
+    for (int i = 18; i < 32; i++)
+        q[i] = q[i - 16] + X11_ROTL64(q[i - 15],  5) + q[i - 14] + X11_ROTL64(q[i - 13], 11) +
+               q[i - 12] + X11_ROTL64(q[i - 11], 27) + q[i - 10] + X11_ROTL64(q[i -  9], 32) +
+               q[i -  8] + X11_ROTL64(q[i -  7], 37) + q[i -  6] + X11_ROTL64(q[i -  5], 43) +
+               q[i -  4] + X11_ROTL64(q[i -  3], 53) + Bmw512S(4, q[i - 2]) + Bmw512S(5, q[i - 1]) +
+               Bmw512AddElt<V, N>(m, h, i - 16);
+
+    V xl = q[16] ^ q[17] ^ q[18] ^ q[19] ^ q[20] ^ q[21] ^ q[22] ^ q[23];
+    V xh = xl ^ q[24] ^ q[25] ^ q[26] ^ q[27] ^ q[28] ^ q[29] ^ q[30] ^ q[31];
+    dh[ 0] = ((xh <<  5) ^ (q[16] >> 5) ^ m[ 0]) + (xl ^ q[24] ^ q[ 0]);
+    dh[ 1] = ((xh >>  7) ^ (q[17] << 8) ^ m[ 1]) + (xl ^ q[25] ^ q[ 1]);
+    dh[ 2] = ((xh >>  5) ^ (q[18] << 5) ^ m[ 2]) + (xl ^ q[26] ^ q[ 2]);
+    dh[ 3] = ((xh >>  1) ^ (q[19] << 5) ^ m[ 3]) + (xl ^ q[27] ^ q[ 3]);
+    dh[ 4] = ((xh >>  3) ^  q[20]       ^ m[ 4]) + (xl ^ q[28] ^ q[ 4]);
+    dh[ 5] = ((xh <<  6) ^ (q[21] >> 6) ^ m[ 5]) + (xl ^ q[29] ^ q[ 5]);
+    dh[ 6] = ((xh >>  4) ^ (q[22] << 6) ^ m[ 6]) + (xl ^ q[30] ^ q[ 6]);
+    dh[ 7] = ((xh >> 11) ^ (q[23] << 2) ^ m[ 7]) + (xl ^ q[31] ^ q[ 7]);
+    dh[ 8] = X11_ROTL64(dh[4],  9) + (xh ^ q[24] ^ m[ 8]) + ((xl << 8) ^ q[23] ^ q[ 8]);
+    dh[ 9] = X11_ROTL64(dh[5], 10) + (xh ^ q[25] ^ m[ 9]) + ((xl >> 6) ^ q[16] ^ q[ 9]);
+    dh[10] = X11_ROTL64(dh[6], 11) + (xh ^ q[26] ^ m[10]) + ((xl << 6) ^ q[17] ^ q[10]);
+    dh[11] = X11_ROTL64(dh[7], 12) + (xh ^ q[27] ^ m[11]) + ((xl << 4) ^ q[18] ^ q[11]);
+    dh[12] = X11_ROTL64(dh[0], 13) + (xh ^ q[28] ^ m[12]) + ((xl >> 3) ^ q[19] ^ q[12]);
+    dh[13] = X11_ROTL64(dh[1], 14) + (xh ^ q[29] ^ m[13]) + ((xl >> 4) ^ q[20] ^ q[13]);
+    dh[14] = X11_ROTL64(dh[2], 15) + (xh ^ q[30] ^ m[14]) + ((xl >> 7) ^ q[21] ^ q[14]);
+    dh[15] = X11_ROTL64(dh[3], 16) + (xh ^ q[31] ^ m[15]) + ((xl >> 2) ^ q[22] ^ q[15]);
+}
+
+template<typename V, unsigned int N>
+X11_INLINE void Bmw512Lanes(const uint512* pin, uint512* pout)
+{
+    // A 64 byte message and its padding (0x80, bit length 512) fill one block
+    V m[16], h[16], h2[16];
+    for (int i = 0; i < 8; i++)
+        m[i] = X11Load<V, N, uint64_t>(pin, i);
+    m[8] = X11Splat<V, N>((uint64_t)0x80);
+    for (int i = 9; i < 15; i++)
+        m[i] = X11Splat<V, N>((uint64_t)0);
+    m[15] = X11Splat<V, N>((uint64_t)512);
+    for (int i = 0; i < 16; i++)
+        h[i] = X11Splat<V, N>(pBmwIV[i]);
+    Bmw512Compress<V, N>(m, h, h2);
+
+    // Final compression of the chaining value under the constant 0xaaaaaaaaaaaaaaa0 + i
+    for (int i = 0; i < 16; i++)
+        h[i] = X11Splat<V, N>(0xaaaaaaaaaaaaaaa0ULL + i);
+    Bmw512Compress<V, N>(h2, h, m);
+    for (int i = 0; i < 8; i++)
+        X11Store<V, N, uint64_t>(pout, i, m[8 + i]);
+}
+
+//
+// Skein-512-512
+//
+const uint64_t pSkeinIV[8] =
+{
+    0x4903ADFF749C51CEULL, 0x0D95DE399746DF03ULL, 0x8FD1934127C79BCEULL, 0x9A255629FF352CB1ULL,
+    0x5DB62599DF6CA7B0ULL, 0xEABE394CA9D5C3F4ULL, 0x991112C71A75B523ULL, 0xAE18A40B660FCC33ULL
+};
+
+#define X11_SKEIN_MIX(a, b, rc) do { p[a] += p[b]; p[b] = X11_ROTL64(p[b], rc) ^ p[a]; } while (0)
+
+// Eight Threefish rounds with subkeys s and s + 1
+#define X11_SKEIN_ROUNDS(s) do { \
+    Skein512AddKey<V, N>(p, k, t, s); \
+    X11_SKEIN_MIX(0, 1, 46); X11_SKEIN_MIX(2, 3, 36); X11_SKEIN_MIX(4, 5, 19); X11_SKEIN_MIX(6, 7, 37); \
+    X11_SKEIN_MIX(2, 1, 33); X11_SKEIN_MIX(4, 7, 27); X11_SKEIN_MIX(6, 5, 14); X11_SKEIN_MIX(0, 3, 42); \
+    X11_SKEIN_MIX(4, 1, 17); X11_SKEIN_MIX(6, 3, 49); X11_SKEIN_MIX(0, 5, 36); X11_SKEIN_MIX(2, 7, 39); \
+    X11_SKEIN_MIX(6, 1, 44); X11_SKEIN_MIX(0, 7,  9); X11_SKEIN_MIX(2, 5, 54); X11_SKEIN_MIX(4, 3, 56); \
+    Skein512AddKey<V, N>(p, k, t, (s) + 1); \
+    X11_SKEIN_MIX(0, 1, 39); X11_SKEIN_MIX(2, 3, 30); X11_SKEIN_MIX(4, 5, 34); X11_SKEIN_MIX(6, 7, 24); \
+    X11_SKEIN_MIX(2, 1, 13); X11_SKEIN_MIX(4, 7, 50); X11_SKEIN_MIX(6, 5, 10); X11_SKEIN_MIX(0, 3, 17); \
+    X11_SKEIN_MIX(4, 1, 25); X11_SKEIN_MIX(6, 3, 29); X11_SKEIN_MIX(0, 5, 39); X11_SKEIN_MIX(2, 7, 43); \
+    X11_SKEIN_MIX(6, 1,  8); X11_SKEIN_MIX(0, 7, 35); X11_SKEIN_MIX(2, 5, 56); X11_SKEIN_MIX(4, 3, 22); \
+} while (0)
+
+template<typename V, unsigned int N>
+X11_INLINE void Skein512AddKey(V* p, const V* k, const uint64_t* t, int s)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] += k[(s + i) % 9];
+    p[5] += X11Splat<V, N>(t[s % 3]);
+    p[6] += X11Splat<V, N>(t[(s + 1) % 3]);
+    p[7] += X11Splat<V, N>((uint64_t)s);
+}
+
+// One UBI block: Threefish-512 of m keyed by h and tweak (t0, t1), fed forward into h
+template<typename V, unsigned int N>
+X11_INLINE void Skein512Ubi(V* h, const V* m, uint64_t t0, uint64_t t1)
+{
+    V k[9], p[8];
+    k[8] = X11Splat<V, N>(0x1BD11BDAA9FC1A22ULL);
+    for (int i = 0; i < 8; i++)
+    {
+        k[i] = h[i];
+        k[8] ^= h[i];
+        p[i] = m[i];
+    }
+    const uint64_t t[3] = { t0, t1, t0 ^ t1 };
+
+    X11_SKEIN_ROUNDS(0);  X11_SKEIN_ROUNDS(2);  X11_SKEIN_ROUNDS(4);
+    X11_SKEIN_ROUNDS(6);  X11_SKEIN_ROUNDS(8);  X11_SKEIN_ROUNDS(10);
+    X11_SKEIN_ROUNDS(12); X11_SKEIN_ROUNDS(14); X11_SKEIN_ROUNDS(16);
+    Skein512AddKey<V, N>(p, k, t, 18);
+
+    for (int i = 0; i < 8; i++)
+        h[i] = m[i] ^ p[i];
+}
+
+template<typename V, unsigned int N>
+X11_INLINE void Skein512Lanes(const uint512* pin, uint512* pout)
+{
+    V h[8], m[8];
+    for (int i = 0; i < 8; i++)
+    {
+        h[i] = X11Splat<V, N>(pSkeinIV[i]);
+        m[i] = X11Load<V, N, uint64_t>(pin, i);
+    }
+    // Message block (first and final), then the output block
+    Skein512Ubi<V, N>(h, m, 64, 0xF000000000000000ULL);
+    for (int i = 0; i < 8; i++)
+        m[i] = X11Splat<V, N>((uint64_t)0);
+    Skein512Ubi<V, N>(h, m, 8, 0xFF00000000000000ULL);
+    for (int i = 0; i < 8; i++)
+        X11Store<V, N, uint64_t>(pout, i, h[i]);
+}
+
+//
+// Keccak-512. A 64 byte message fits in one 72 byte block, so absorbing is
+// a single permutation.
+//
+const uint64_t pKeccakRoundConstants[24] =
+{
+    0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808AULL, 0x8000000080008000ULL,
+    0x000000000000808BULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+    0x000000000000008AULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000AULL,
+    0x000000008000808BULL, 0x800000000000008BULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+    0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800AULL, 0x800000008000000AULL,
+    0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+
+// Rotation offsets, indexed by x + 5 * y
+const int pKeccakRotations[25] =
+{
+     0,  1, 62, 28, 27,
+    36, 44,  6, 55, 20,
+     3, 10, 43, 25, 39,
+    41, 45, 15, 21,  8,
+    18,  2, 61, 56, 14
+};
+
+// Round steps for state word i = x + 5 * y. Pi moves word (x, y) to (y, 2x + 3y).
+#define X11_KECCAK_THETA_C(x, u, v) c[x] = a[x] ^ a[(x) + 5] ^ a[(x) + 10] ^ a[(x) + 15] ^ a[(x) + 20];
+#define X11_KECCAK_THETA_D(x, u, v) d[x] = c[((x) + 4) % 5] ^ X11_ROTL64(c[((x) + 1) % 5], 1);
+#define X11_KECCAK_THETA(i, u, v) a[i] ^= d[(i) % 5];
+#define X11_KECCAK_RHO_PI(i, u, v) \
+    b[(i) / 5 + 5 * ((2 * ((i) % 5) + 3 * ((i) / 5)) % 5)] = \
+        (a[i] << pKeccakRotations[i]) | (a[i] >> ((64 - pKeccakRotations[i]) & 63));
+#define X11_KECCAK_CHI(i, u, v) \
+    a[i] = b[i] ^ (~b[(i) - (i) % 5 + ((i) + 1) % 5] & b[(i) - (i) % 5 + ((i) + 2) % 5]);
+
+template<typename V, unsigned int N>
+X11_INLINE void Keccak512Lanes(const uint512* pin, uint512* pout)
+{
+    V a[25], b[25], c[5], d[5];
+
+    // Absorb: message words, then Keccak padding (0x01 ... 0x80) at the end of the 72 byte rate
+    for (int i = 0; i < 25; i++)
+        a[i] = X11Splat<V, N>((uint64_t)0);
+    for (int i = 0; i < 8; i++)
+        a[i] = X11Load<V, N, uint64_t>(pin, i);
+    a[8] = X11Splat<V, N>(0x8000000000000001ULL);
+
+    for (int round = 0; round < 24; round++)
+    {
+        X11_REPEAT5(X11_KECCAK_THETA_C, 0, 0)
+        X11_REPEAT5(X11_KECCAK_THETA_D, 0, 0)
+        X11_REPEAT25(X11_KECCAK_THETA, 0, 0)
+        X11_REPEAT25(X11_KECCAK_RHO_PI, 0, 0)
+        X11_REPEAT25(X11_KECCAK_CHI, 0, 0)
+        a[0] ^= X11Splat<V, N>(pKeccakRoundConstants[round]);
+    }
+
+    // Squeeze the 64 byte digest
+    for (int i = 0; i < 8; i++)
+        X11Store<V, N, uint64_t>(pout, i, a[i]);
+}
+
+//
+// CubeHash16/32-512, on 32-bit words
+//
+const uint32_t pCubeHashIV[32] =
+{
+    0x2AEA2A61, 0x50F494D4, 0x2D538B8B, 0x4167D83E, 0x3FEE2313, 0xC701CF8C, 0xCC39968E, 0x50AC5695,
+    0x4D42C787, 0xA647A8B3, 0x97CF0BEF, 0x825B4537, 0xEEF864D2, 0xF22090C4, 0xD0E5CD33, 0xA23911AE,
+    0xFCD398D9, 0x148FE485, 0x1B017BEF, 0xB6444532, 0x6A536159, 0x2FF5781C, 0x91FA7934, 0x0DBADEA9,
+    0xD65C8A2B, 0xA5A70E75, 0xB1C62456, 0xBC796576, 0x1921C8F7, 0xE7989AF1, 0x7795D246, 0xD43E3B44
+};
+
+// Each round swaps halves of the state; two rounds restore the word order.
+// Instead of swapping, the odd round addresses the upper half through an
+// index offset of 15.
+#define X11_CUBEHASH_ADD(k, o, r) x[16 + ((k) ^ (o))] += x[k]; x[k] = X11_ROTL32(x[k], r);
+#define X11_CUBEHASH_XOR(k, o, r) x[k] ^= x[16 + ((k) ^ (o))];
+
+template<typename V, int o>
+X11_INLINE void CubeHashRound(V* x)
+{
+    X11_REPEAT16(X11_CUBEHASH_ADD, o, 7)
+    X11_REPEAT16(X11_CUBEHASH_XOR, o ^ 8, 0)
+    X11_REPEAT16(X11_CUBEHASH_ADD, o ^ 10, 11)
+    X11_REPEAT16(X11_CUBEHASH_XOR, o ^ 14, 0)
+}
+
+template<typename V>
+X11_INLINE void CubeHashRounds(V* x, int nRounds)
+{
+    for (int r = 0; r < nRounds; r += 2)
+    {
+        CubeHashRound<V, 0>(x);
+        CubeHashRound<V, 15>(x);
+    }
+}
+
+template<typename V, unsigned int N>
+X11_INLINE void CubeHash512Lanes(const uint512* pin, uint512* pout)
+{
+    V x[32];
+    for (int i = 0; i < 32; i++)
+        x[i] = X11Splat<V, N>(pCubeHashIV[i]);
+
+    // Two 32 byte message blocks, the padding block, then finalization
+    for (int i = 0; i < 8; i++)
+        x[i] ^= X11Load<V, N, uint32_t>(pin, i);
+    CubeHashRounds(x, 16);
+    for (int i = 0; i < 8; i++)
+        x[i] ^= X11Load<V, N, uint32_t>(pin, 8 + i);
+    CubeHashRounds(x, 16);
+    x[0] ^= X11Splat<V, N>((uint32_t)0x80);
+    CubeHashRounds(x, 16);
+    x[31] ^= X11Splat<V, N>((uint32_t)1);
+    CubeHashRounds(x, 160);
+
+    for (int i = 0; i < 16; i++)
+        X11Store<V, N, uint32_t>(pout, i, x[i]);
+}
+
+// Define Name512Multi<kernel> for a 64 byte -> 64 byte stage, N lanes per
+// vector. Lanes that do not fill a whole vector go to Fallback.
+#define X11_SIMD_STAGE(Name, kernel, isa, V, N, Fallback) \
+__attribute__((target(isa))) \
+void Name##512Multi##kernel(const uint512* pin, uint512* pout, unsigned int nLanes) \
+{ \
+    unsigned int i = 0; \
+    for (; i + N <= nLanes; i += N) \
+        Name##512Lanes<V, N>(&pin[i], &pout[i]); \
+    if (i < nLanes) \
+        Fallback(&pin[i], &pout[i], nLanes - i); \
+}
+
+X11_SIMD_STAGE(Bmw,      SSE2, "sse2", x11_v2u64, 2, Bmw512MultiScalar)
+X11_SIMD_STAGE(Bmw,      AVX2, "avx2", x11_v4u64, 4, Bmw512MultiSSE2)
+X11_SIMD_STAGE(Skein,    AVX2, "avx2", x11_v4u64, 4, Skein512MultiScalar)
+X11_SIMD_STAGE(Keccak,   SSE2, "sse2", x11_v2u64, 2, Keccak512MultiScalar)
+X11_SIMD_STAGE(Keccak,   AVX2, "avx2", x11_v4u64, 4, Keccak512MultiSSE2)
+X11_SIMD_STAGE(CubeHash, SSE2, "sse2", x11_v4u32, 4, CubeHash512MultiScalar)
+X11_SIMD_STAGE(CubeHash, AVX2, "avx2", x11_v8u32, 8, CubeHash512MultiSSE2)
+
+// Skein is rotate-bound, and SSE2 rotates a 64-bit word with three
+// instructions: two lanes per vector are slower than the scalar code.
+void Skein512MultiSSE2(const uint512* pin, uint512* pout, unsigned int nLanes)
+{
+    Skein512MultiScalar(pin, pout, nLanes);
+}
+
+__attribute__((target("sse2")))
+void Blake512MultiSSE2(const unsigned char* const* ppInput, size_t nLen, uint512* pout, unsigned int nLanes)
+{
+    unsigned int i = 0;
+    for (; i + 2 <= nLanes; i += 2)
+        Blake512Lanes<x11_v2u64, 2>(&ppInput[i], nLen, &pout[i]);
+    if (i < nLanes)
+        Blake512MultiScalar(&ppInput[i], nLen, &pout[i], nLanes - i);
+}
+
+__attribute__((target("avx2")))
+void Blake512MultiAVX2(const unsigned char* const* ppInput, size_t nLen, uint512* pout, unsigned int nLanes)
+{
+    unsigned int i = 0;
+    for (; i + 4 <= nLanes; i += 4)
+        Blake512Lanes<x11_v4u64, 4>(&ppInput[i], nLen, &pout[i]);
+    if (i < nLanes)
+        Blake512MultiSSE2(&ppInput[i], nLen, &pout[i], nLanes - i);
+}
+
+// Run a stage with a lane-parallel kernel through the one selected by kernel
+#define X11_MULTI_STAGE(Name, kernel, pin, pout, nLanes) do { \
+    switch (kernel) \
+    { \
+    case X11_KERNEL_AVX2: Name##512MultiAVX2(pin, pout, nLanes); break; \
+    case X11_KERNEL_SSE2: Name##512MultiSSE2(pin, pout, nLanes); break; \
+    default:              Name##512MultiScalar(pin, pout, nLanes); break; \
+    } \
+} while (0)
+#else
+#define X11_MULTI_STAGE(Name, kernel, pin, pout, nLanes) Name##512MultiScalar(pin, pout, nLanes)
+#endif // USE_X11_SIMD
+
+} // anon namespace
+
+bool X11KernelSupported(X11Kernel kernel)
+{
+    switch (kernel)
+    {
+    case X11_KERNEL_SCALAR:
+        return true;
+#ifdef USE_X11_SIMD
+    case X11_KERNEL_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case X11_KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+X11Kernel X11DefaultKernel()
+{
+    static X11Kernel kernel = X11KernelSupported(X11_KERNEL_AVX2) ? X11_KERNEL_AVX2 :
+                              X11KernelSupported(X11_KERNEL_SSE2) ? X11_KERNEL_SSE2 :
+                              X11_KERNEL_SCALAR;
+    return kernel;
+}
+
+const char* X11KernelName(X11Kernel kernel)
+{
+    switch (kernel)
+    {
+    case X11_KERNEL_SCALAR: return "scalar";
+    case X11_KERNEL_SSE2:   return "sse2";
+    case X11_KERNEL_AVX2:   return "avx2";
+    }
+    return "unknown";
+}
+
+void Hash9Multi(const unsigned char* const* ppInput, size_t nLen, unsigned int nLanes, uint256* phashOut, X11Kernel kernel)
+{
+    assert(nLanes <= X11_MAX_LANES);
+    if (!X11KernelSupported(kernel))
+        kernel = X11_KERNEL_SCALAR;
+
+    uint512 hashA[X11_MAX_LANES];
+    uint512 hashB[X11_MAX_LANES];
+
+#ifdef USE_X11_SIMD
+    switch (kernel)
+    {
+    case X11_KERNEL_AVX2: Blake512MultiAVX2(ppInput, nLen, hashA, nLanes); break;
+    case X11_KERNEL_SSE2: Blake512MultiSSE2(ppInput, nLen, hashA, nLanes); break;
+    default:              Blake512MultiScalar(ppInput, nLen, hashA, nLanes); break;
+    }
+#else
+    Blake512MultiScalar(ppInput, nLen, hashA, nLanes);
+#endif
+    X11_MULTI_STAGE(Bmw, kernel, hashA, hashB, nLanes);
+    X11_STAGE(groestl, nLanes, hashB, hashA);
+    X11_MULTI_STAGE(Skein, kernel, hashA, hashB, nLanes);
+    X11_STAGE(jh, nLanes, hashB, hashA);
+    X11_MULTI_STAGE(Keccak, kernel, hashA, hashB, nLanes);
+    X11_STAGE(luffa, nLanes, hashB, hashA);
+    X11_MULTI_STAGE(CubeHash, kernel, hashA, hashB, nLanes);
+    X11_STAGE(shavite, nLanes, hashB, hashA);
+    X11_STAGE(simd, nLanes, hashA, hashB);
+    X11_STAGE(echo, nLanes, hashB, hashA);
+
+    for (unsigned int i = 0; i < nLanes; i++)
+        phashOut[i] = hashA[i].trim256();
+}
+
+CX11NonceScanner::CX11NonceScanner(const unsigned char* pheaderIn, X11Kernel kernelIn)
+{
+    memcpy(pheader, pheaderIn, sizeof(pheader));
+    kernel = kernelIn;
+}
+
+void CX11NonceScanner::Hash(unsigned int nNonce, unsigned int nLanes, uint256* phashOut) const
+{
+    assert(nLanes <= X11_MAX_LANES);
+
+    unsigned char pheaders[X11_MAX_LANES][80];
+    const unsigned char* ppInput[X11_MAX_LANES];
+    for (unsigned int i = 0; i < nLanes; i++)
+    {
+        // The nonce is serialized little endian in the last four header bytes
+        unsigned int n = nNonce + i;
+        memcpy(pheaders[i], pheader, 76);
+        pheaders[i][76] = n;
+        pheaders[i][77] = n >> 8;
+        pheaders[i][78] = n >> 16;
+        pheaders[i][79] = n >> 24;
+        ppInput[i] = pheaders[i];
+    }
+    Hash9Multi(ppInput, 80, nLanes, phashOut, kernel);
+}
@@ -14,6 +14,9 @@
 #include "sph_simd.h"
 #include "sph_echo.h"
 
+#include <assert.h>
+#include <stddef.h>
+
 #ifndef QT_NO_DEBUG
 #include <string>
 #endif
@@ -129,6 +132,48 @@ inline uint256 Hash9(const T1 pbegin, const T1 pend)
     return hash[10].trim256();
 }
 
+/** Maximum number of independent messages hashed by one Hash9Multi() call */
+static const unsigned int X11_MAX_LANES = 8;
+
+/** Instruction sets for the lane-parallel stages of Hash9Multi(): blake, bmw,
+ * skein (AVX2 only), keccak and cubehash. Groestl, jh, luffa, shavite, simd
+ * and echo always run the scalar sph functions, one lane at a time.
+ */
+enum X11Kernel
+{
+    X11_KERNEL_SCALAR = 0,
+    X11_KERNEL_SSE2   = 1,
+    X11_KERNEL_AVX2   = 2
+};
+
+/** Return true if the CPU we are running on can execute kernel */
+bool X11KernelSupported(X11Kernel kernel);
+/** Fastest kernel supported by this CPU, detected once at first use */
+X11Kernel X11DefaultKernel();
+const char* X11KernelName(X11Kernel kernel);
+
+/** Hash nLanes (at most X11_MAX_LANES) independent nLen byte messages with X11.
+ * phashOut[i] receives the same value as Hash9(ppInput[i], ppInput[i] + nLen).
+ */
+void Hash9Multi(const unsigned char* const* ppInput, size_t nLen, unsigned int nLanes, uint256* phashOut,
+                X11Kernel kernel = X11DefaultKernel());
+
+/** Hashes an 80 byte block header for consecutive nonces, up to
+ * X11_MAX_LANES of them at a time with Hash9Multi.
+ */
+class CX11NonceScanner
+{
+private:
+    unsigned char pheader[80];
+    X11Kernel kernel;
+
+public:
+    CX11NonceScanner(const unsigned char* pheaderIn, X11Kernel kernelIn = X11DefaultKernel());
+
+    /** Hash nonces nNonce .. nNonce + nLanes - 1 (nLanes at most X11_MAX_LANES) */
+    void Hash(unsigned int nNonce, unsigned int nLanes, uint256* phashOut) const;
+};
+
 
 
 
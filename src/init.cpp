@@ -87,6 +87,8 @@ bool ShutdownRequested()
 }
 
 static CCoinsViewDB *pcoinsdbview;
+// only write mempool.dat after it has been loaded, or it would be clobbered by whatever arrived before
+static bool fDumpMempoolLater = false;
 
 void Shutdown()
 {
@@ -108,6 +110,14 @@ void Shutdown()
         bitdb.Flush(false);
     GenerateBitcoins(false, NULL);
     StopNode();
+    if (fDumpMempoolLater)
+        DumpMempool();
+    // an empty list means we never got as far as loading it, don't clobber the cache
+    if (masternodeList.size() > 0)
+    {
+        CMasternodeDB mndb;
+        mndb.Write(masternodeList, masternodePayments, vecMasternodeAskedFor);
+    }
     {
         LOCK(cs_main);
         if (pwalletMain)
@@ -309,6 +319,8 @@ std::string HelpMessage()
         "  -gen                   " + _("Generate coins (default: 0)") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -maxmempool=<n>        " + _("Keep the transaction memory pool below <n> megabytes (default: 300)") + "\n" +
+        "  -persistmempool        " + _("Save the memory pool on shutdown and load it on restart (default: 1)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Exclusively connect through socks proxy") + "\n" +
         "  -proxytoo=<ip:port>    " + _("Also connect through socks proxy") + "\n" +
@@ -332,7 +344,9 @@ std::string HelpMessage()
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -msghandthreads=<n>    " + _("Number of threads handling peer messages (1 to 16, default: number of cores, at most 4)") + "\n" +
         "  -bloomfilters          " + _("Allow peers to set bloom filters (default: 1)") + "\n" +
+        "  -compactblocks         " + _("Relay new blocks as compact blocks to peers that support them, and ask for them (default: 1)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
         "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n" +
@@ -374,11 +388,13 @@ std::string HelpMessage()
         "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n" +
         "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n" +
         "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
+        "  -checkbalances         " + _("Check the cached wallet balances against a full recount on every call (debug)") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 288, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-4, default: 3)") + "\n" +
         "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
+        "  -maxsigcachesize=<n>   " + _("Limit the signature cache to <n> megabytes (0 to 1024, default: 10)") + "\n" +
         "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
 
         "\n" + _("Masternode options:") + "\n" +
@@ -470,6 +486,13 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
             LoadExternalBlockFile(file);
         }
     }
+
+    // mempool.dat, once the chain it was validated against is loaded
+    if (GetBoolArg("-persistmempool", true)) {
+        if (!LoadMempool())
+            LogPrintf("Invalid or missing mempool.dat; starting with an empty memory pool\n");
+        fDumpMempoolLater = !ShutdownRequested();
+    }
 }
 
 /** Initialize bitcoin.
@@ -533,6 +556,8 @@ bool AppInit2(boost::thread_group& threadGroup)
     fBloomFilters = GetBoolArg("-bloomfilters", true);
     if (fBloomFilters)
         nLocalServices |= NODE_BLOOM;
+    if (GetBoolArg("-compactblocks", true))
+        nLocalServices |= NODE_COMPACT_BLOCKS;
 
     if (mapArgs.count("-bind")) {
         // when specifying an explicit binding address, you want to listen on it
@@ -597,6 +622,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    // -maxsigcachesize used to be a number of entries, reject old values rather than allocate gigabytes
+    int64 nSigCacheSize = GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE);
+    if (nSigCacheSize < 0 || nSigCacheSize > MAX_SIG_CACHE_SIZE)
+        return InitError(strprintf(_("Invalid -maxsigcachesize=<n>: '%s' (the signature cache size is in megabytes, at most %d)"), mapArgs["-maxsigcachesize"].c_str(), (int)MAX_SIG_CACHE_SIZE));
+    InitSignatureCache();
+
     // -debug implies fDebug*
     if (fDebug)
         fDebugNet = true;
@@ -696,6 +727,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     LogPrintf("DarkCoin version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     LogPrintf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    LogPrintf("Using %s kernel for X11\n", X11KernelName(X11DefaultKernel()));
     if (!fLogTimestamps)
         LogPrintf("Startup time: %s\n", DateTimeStrFormat("%Y-%m-%d %H:%M:%S", GetTime()).c_str());
     LogPrintf("Default data directory %s\n", GetDefaultDataDir().string().c_str());
@@ -710,6 +742,8 @@ bool AppInit2(boost::thread_group& threadGroup)
         LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadBlockPreCheck);
     }
 
     int64 nStart;
@@ -923,7 +957,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the coins cache and the batch being written to disk share it
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -935,6 +969,7 @@ bool AppInit2(boost::thread_group& threadGroup)
         nStart = GetTimeMillis();
         do {
             try {
+                coinsFlusher.WaitForFlush();
                 UnloadBlockIndex();
                 delete pcoinsTip;
                 delete pcoinsdbview;
@@ -942,7 +977,8 @@ bool AppInit2(boost::thread_group& threadGroup)
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
-                pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+                coinsFlusher.SetBackend(*pcoinsdbview);
+                pcoinsTip = new CCoinsViewCache(coinsFlusher);
 
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
@@ -1187,6 +1223,7 @@ bool AppInit2(boost::thread_group& threadGroup)
         BOOST_FOREACH(string strFile, mapMultiArgs["-loadblock"])
             vImportFiles.push_back(strFile);
     }
+    threadGroup.create_thread(&ThreadFlushCoins);
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
 
     // ********************************************************* Step 10: setup DarkSend
@@ -1259,10 +1296,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("Darksend rounds %d\n", nDarksendRounds);
     LogPrintf("Anonymize Darkcoin Amount %d\n", nAnonymizeDarkcoinAmount);
 
-    darkSendDenominations.push_back( (500   * COIN)+1 );
-    darkSendDenominations.push_back( (100   * COIN)+1 );
-    darkSendDenominations.push_back( (10    * COIN)+1 );
-    darkSendDenominations.push_back( (1     * COIN)+1 );
+    InitDarkSendDenominations();
 
     threadGroup.create_thread(boost::bind(&ThreadCheckDarkSendPool));
 
@@ -1297,6 +1331,14 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("Loaded %i addresses from peers.dat  %"PRI64d"ms\n",
            addrman.size(), GetTimeMillis() - nStart);
 
+    uiInterface.InitMessage(_("Loading masternode cache..."));
+
+    {
+        CMasternodeDB mndb;
+        if (!mndb.Read(masternodeList, masternodePayments, vecMasternodeAskedFor))
+            LogPrintf("Invalid or missing mncache.dat; will ask peers for the masternode list\n");
+    }
+
     // ********************************************************* Step 12: start node
 
     if (!CheckDiskSpace())
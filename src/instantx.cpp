@@ -28,7 +28,6 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
 	if (strCommand == "txlreq")
 	{
 		printf("ProcessMessageInstantX::txlreq\n");
-        CDataStream vMsg(vRecv);
         CTransaction tx;
         vRecv >> tx;
 
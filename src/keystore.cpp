@@ -51,6 +51,14 @@ bool CBasicKeyStore::GetCScript(const CScriptID &hash, CScript& redeemScriptOut)
     return false;
 }
 
+void CBasicKeyStore::GetCScripts(std::set<CScriptID> &setScriptIDs) const
+{
+    setScriptIDs.clear();
+    LOCK(cs_KeyStore);
+    for (ScriptMap::const_iterator mi = mapScripts.begin(); mi != mapScripts.end(); mi++)
+        setScriptIDs.insert((*mi).first);
+}
+
 bool CCryptoKeyStore::SetCrypted()
 {
     LOCK(cs_KeyStore);
@@ -56,7 +56,7 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
@@ -69,6 +69,10 @@ CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
+// Headers-first sync: index entries for headers whose blocks we don't have yet
+map<uint256, CBlockIndex*> mapHeaderIndex;
+CBlockIndex* pindexBestHeader = NULL;
+
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
@@ -147,6 +151,13 @@ void static SetBestChain(const CBlockLocator& loc)
         pwallet->SetBestChain(loc);
 }
 
+// notify wallets that blocks were disconnected from the best chain
+void static ReorganizedWallets()
+{
+    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+        pwallet->ClearDarksendRounds();
+}
+
 // notify wallets about an updated transaction
 void static UpdatedTransaction(const uint256& hashTx)
 {
@@ -191,7 +202,8 @@ bool CCoinsView::SetCoins(const uint256 &txid, const CCoins &coins) { return fal
 bool CCoinsView::HaveCoins(const uint256 &txid) { return false; }
 CBlockIndex *CCoinsView::GetBestBlock() { return NULL; }
 bool CCoinsView::SetBestBlock(CBlockIndex *pindex) { return false; }
-bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return false; }
+bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return false; }
+bool CCoinsView::BatchWriteAsync(CCoinsMap &mapCoins, CBlockIndex *pindex) { return BatchWrite(mapCoins, pindex); }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
 
 
@@ -202,43 +214,98 @@ bool CCoinsViewBacked::HaveCoins(const uint256 &txid) { return base->HaveCoins(t
 CBlockIndex *CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
 bool CCoinsViewBacked::SetBestBlock(CBlockIndex *pindex) { return base->SetBestBlock(pindex); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
+static uint64 GetCoinsKeySalt()
+{
+    static uint64 nSalt = GetRand(std::numeric_limits<uint64>::max());
+    return nSalt;
+}
 
-bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
-    if (cacheCoins.count(txid)) {
-        coins = cacheCoins[txid];
-        return true;
+CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetCoinsKeySalt()) { }
+
+size_t CCoinsKeyHasher::operator()(const uint256& key) const {
+    // fold the four words of the txid into the salt, with a multiply/xorshift step so the
+    // salt can't be factored out of the result
+    uint64 h = salt;
+    for (int i = 0; i < 4; i++) {
+        h ^= key.Get64(i);
+        h *= 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
     }
-    if (base->GetCoins(txid, coins)) {
-        cacheCoins[txid] = coins;
+    return (size_t)h;
+}
+
+CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL), cachedCoinsUsage(0) { }
+
+// memory of one cache entry: the hash table node and the outputs it owns
+static size_t CoinsEntryUsage(const CCoinsCacheEntry &entry) {
+    return sizeof(CCoinsMap::value_type) + 2 * sizeof(void*) + entry.coins.DynamicMemoryUsage();
+}
+
+void CCoinsViewCache::AddUsage(CCoinsCacheEntry &entry) {
+    if (!(entry.flags & CCoinsCacheEntry::UNCOUNTED))
+        cachedCoinsUsage += CoinsEntryUsage(entry);
+}
+
+void CCoinsViewCache::RemoveUsage(CCoinsCacheEntry &entry) {
+    if (!(entry.flags & CCoinsCacheEntry::UNCOUNTED))
+        cachedCoinsUsage -= CoinsEntryUsage(entry);
+}
+
+bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
+    CCoinsMap::iterator it = FetchCoins(txid);
+    if (it != cacheCoins.end()) {
+        coins = it->second.coins;
         return true;
     }
     return false;
 }
 
-std::map<uint256,CCoins>::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = cacheCoins.lower_bound(txid);
-    if (it != cacheCoins.end() && it->first == txid)
+CCoinsMap::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = cacheCoins.find(txid);
+    if (it != cacheCoins.end())
         return it;
     CCoins tmp;
     if (!base->GetCoins(txid,tmp))
         return cacheCoins.end();
-    std::map<uint256,CCoins>::iterator ret = cacheCoins.insert(it, std::make_pair(txid, CCoins()));
-    tmp.swap(ret->second);
+    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
+    tmp.swap(ret->second.coins);
+    // the parent only has an empty entry for this txid, so ours can be dropped instead of written back
+    if (ret->second.coins.IsPruned())
+        ret->second.flags = CCoinsCacheEntry::FRESH;
+    AddUsage(ret->second);
     return ret;
 }
 
 CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = FetchCoins(txid);
+    CCoinsMap::iterator it = FetchCoins(txid);
+    assert(it != cacheCoins.end());
+    it->second.flags |= CCoinsCacheEntry::DIRTY;
+    // the caller may resize the outputs, so measure the entry again in DynamicMemoryUsage
+    if (!(it->second.flags & CCoinsCacheEntry::UNCOUNTED)) {
+        RemoveUsage(it->second);
+        it->second.flags |= CCoinsCacheEntry::UNCOUNTED;
+        vUncounted.push_back(txid);
+    }
+    return it->second.coins;
+}
+
+const CCoins &CCoinsViewCache::AccessCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = FetchCoins(txid);
     assert(it != cacheCoins.end());
-    return it->second;
+    return it->second.coins;
 }
 
 bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins) {
-    cacheCoins[txid] = coins;
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    CCoinsCacheEntry &entry = ret.first->second;
+    if (!ret.second)
+        RemoveUsage(entry);
+    entry.coins = coins;
+    entry.flags |= CCoinsCacheEntry::DIRTY;
+    AddUsage(entry);
     return true;
 }
 
@@ -257,17 +324,52 @@ bool CCoinsViewCache::SetBestBlock(CBlockIndex *pindex) {
     return true;
 }
 
-bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        cacheCoins[it->first] = it->second;
+bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        CCoinsMap::iterator itUs = cacheCoins.find(it->first);
+        if (itUs == cacheCoins.end()) {
+            // a pruned entry our view never had doesn't need to be stored
+            if (it->second.coins.IsPruned() && (it->second.flags & CCoinsCacheEntry::FRESH))
+                continue;
+            CCoinsCacheEntry &entry = cacheCoins[it->first];
+            entry.coins.swap(it->second.coins);
+            // we didn't have it, so our parent doesn't either if it was fresh for the child
+            entry.flags = CCoinsCacheEntry::DIRTY | (it->second.flags & CCoinsCacheEntry::FRESH);
+            AddUsage(entry);
+        } else if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
+            // our parent never had it, and now it's spent: forget about it altogether
+            RemoveUsage(itUs->second);
+            cacheCoins.erase(itUs);
+        } else {
+            RemoveUsage(itUs->second);
+            itUs->second.coins.swap(it->second.coins);
+            itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+            AddUsage(itUs->second);
+        }
+    }
     pindexTip = pindex;
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
     bool fOk = base->BatchWrite(cacheCoins, pindexTip);
-    if (fOk)
+    if (fOk) {
+        cacheCoins.clear();
+        cachedCoinsUsage = 0;
+        vUncounted.clear();
+    }
+    return fOk;
+}
+
+bool CCoinsViewCache::FlushAsync() {
+    bool fOk = base->BatchWriteAsync(cacheCoins, pindexTip);
+    if (fOk) {
         cacheCoins.clear();
+        cachedCoinsUsage = 0;
+        vUncounted.clear();
+    }
     return fOk;
 }
 
@@ -275,6 +377,18 @@ unsigned int CCoinsViewCache::GetCacheSize() {
     return cacheCoins.size();
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() {
+    BOOST_FOREACH(const uint256 &txid, vUncounted) {
+        CCoinsMap::iterator it = cacheCoins.find(txid);
+        if (it != cacheCoins.end() && (it->second.flags & CCoinsCacheEntry::UNCOUNTED)) {
+            it->second.flags &= ~CCoinsCacheEntry::UNCOUNTED;
+            AddUsage(it->second);
+        }
+    }
+    vUncounted.clear();
+    return cachedCoinsUsage + cacheCoins.bucket_count() * sizeof(void*);
+}
+
 /** CCoinsView that brings transactions from a memorypool into view.
     It does not check for spendings by memory pool transactions. */
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
@@ -295,6 +409,8 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) {
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+static CCoinsView coinsDummy;
+CCoinsViewFlusher coinsFlusher(coinsDummy);
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -644,6 +760,74 @@ int64 CTransaction::GetMinFee(unsigned int nBlockSize, bool fAllowFree,
     return nMinFee;
 }
 
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& txIn, int64 nFeeIn, int64 nTimeIn, double dPriorityIn, int64 nValueInChainIn, unsigned int nHeightIn) :
+    tx(txIn), nFee(nFeeIn), nTime(nTimeIn), dPriority(dPriorityIn), nValueInChain(nValueInChainIn), nHeight(nHeightIn), nSequence(0)
+{
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nSizeWithAncestors = nSizeWithDescendants = nTxSize;
+    nFeesWithAncestors = nFeesWithDescendants = nFee;
+    nCountWithAncestors = nCountWithDescendants = 1;
+
+    nUsageSize = tx.vin.capacity() * sizeof(CTxIn) + tx.vout.capacity() * sizeof(CTxOut);
+    BOOST_FOREACH(const CTxIn &txin, tx.vin)
+        nUsageSize += txin.scriptSig.capacity();
+    BOOST_FOREACH(const CTxOut &txout, tx.vout)
+        nUsageSize += txout.scriptPubKey.capacity();
+    // plus the serialized copy GetHash() keeps to validate its cached hash
+    nUsageSize += nTxSize;
+}
+
+double CTxMemPoolEntry::GetPriority(unsigned int nCurrentHeight) const
+{
+    // Priority is sum(valuein * age) / txsize
+    double dResult = dPriority;
+    if (nCurrentHeight > nHeight)
+        dResult += (double)nValueInChain * (nCurrentHeight - nHeight);
+    return dResult / nTxSize;
+}
+
+void CTxMemPoolEntry::SetAncestorState(uint64 nSize, int64 nFees, unsigned int nCount)
+{
+    nSizeWithAncestors = nSize;
+    nFeesWithAncestors = nFees;
+    nCountWithAncestors = nCount;
+}
+
+void CTxMemPoolEntry::SetDescendantState(uint64 nSize, int64 nFees, unsigned int nCount)
+{
+    nSizeWithDescendants = nSize;
+    nFeesWithDescendants = nFees;
+    nCountWithDescendants = nCount;
+}
+
+// Look up the fee and the coin age priority of a transaction about to enter the pool.
+// Inputs the view doesn't have (when the inputs weren't checked) count as zero.
+static CTxMemPoolEntry MakeMemPoolEntry(const CTransaction &tx, CCoinsViewCache &view, int64 nTime)
+{
+    int nHeight = pindexBest ? pindexBest->nHeight : 0;
+    int64 nValueIn = 0;
+    int64 nValueInChain = 0;
+    double dPriority = 0;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        if (!view.HaveCoins(txin.prevout.hash))
+            continue;
+        const CCoins &coins = view.AccessCoins(txin.prevout.hash);
+        if (!coins.IsAvailable(txin.prevout.n))
+            continue;
+        int64 nValue = coins.vout[txin.prevout.n].nValue;
+        nValueIn += nValue;
+        // inputs from other pool transactions don't age until they are confirmed
+        if (coins.nHeight != MEMPOOL_HEIGHT)
+        {
+            nValueInChain += nValue;
+            dPriority += (double)nValue * (nHeight - coins.nHeight + 1);
+        }
+    }
+    int64 nFee = std::max(nValueIn - tx.GetValueOut(), (int64)0);
+    return CTxMemPoolEntry(tx, nFee, nTime, dPriority, nValueInChain, nHeight);
+}
+
 void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
 {
     LOCK(cs);
@@ -681,7 +865,7 @@ bool CTxMemPool::getTransactionFees(CTransaction& tx, int64& nFees)
 }
 
 bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree,
-                        bool* pfMissingInputs, bool ignoreFees)
+                        bool* pfMissingInputs, bool ignoreFees, bool fScriptChecks, int64 nAcceptTime)
 {
     if (pfMissingInputs)
         *pfMissingInputs = false;
@@ -712,7 +896,8 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
     }
 
     // Check for conflicts with in-memory transactions
-    CTransaction* ptxOld = NULL;
+    const CTransaction* ptxOld = NULL;
+    uint256 hashOld = 0;
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
         COutPoint outpoint = tx.vin[i].prevout;
@@ -739,11 +924,11 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         }
     }
 
+    CCoinsView dummy;
+    CCoinsViewCache view(dummy);
+
     if (fCheckInputs)
     {
-        CCoinsView dummy;
-        CCoinsViewCache view(dummy);
-
         {
         LOCK(cs);
         CCoinsViewMemPool viewMemPool(*pcoinsTip, *this);
@@ -794,6 +979,13 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
                              hash.ToString().c_str(),
                              nFees, txMinFee);
 
+            // Nor if it pays less than what had to be evicted to keep the pool in its budget
+            double dMinFeeRate = GetMinFeeRate();
+            if (fLimitFree && dMinFeeRate > 0 && (double)nFees * 1000 / nSize < dMinFeeRate)
+                return error("CTxMemPool::accept() : not enough fees for a full pool %s, %"PRI64d" < %.0f per kB",
+                             hash.ToString().c_str(),
+                             nFees, dMinFeeRate);
+
             // Continuously rate-limit free transactions
             // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
             // be annoying or make others' transactions take longer to confirm.
@@ -820,7 +1012,7 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC))
+        if (!tx.CheckInputs(state, view, fScriptChecks, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC))
         {
             return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().c_str());
         }
@@ -829,18 +1021,39 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
     // Store transaction in memory
     {
         LOCK(cs);
+        if (!fCheckInputs)
+        {
+            // the inputs haven't been looked up yet, do it for the fee and priority
+            CCoinsViewMemPool viewMemPool(*pcoinsTip, *this);
+            view.SetBackend(viewMemPool);
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                view.HaveCoins(txin.prevout.hash);
+            view.SetBackend(dummy);
+        }
+        string strChainError;
+        if (!CheckChainLimits(tx, strChainError))
+            return error("CTxMemPool::accept() : %s %s", hash.ToString().c_str(), strChainError.c_str());
+
+        CTxMemPoolEntry entry = MakeMemPoolEntry(tx, view, nAcceptTime ? nAcceptTime : GetTime());
+
         if (ptxOld)
         {
-            LogPrintf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
+            hashOld = ptxOld->GetHash();
+            LogPrintf("CTxMemPool::accept() : replacing tx %s with new version\n", hashOld.ToString().c_str());
             remove(*ptxOld);
         }
-        addUnchecked(hash, tx);
+        addUnchecked(hash, entry);
+
+        // Keep the pool within its memory budget, this transaction included
+        TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+        if (!exists(hash))
+            return error("CTxMemPool::accept() : mempool full, %s evicted", hash.ToString().c_str());
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
     // If updated, erase old tx from wallet
-    if (ptxOld)
-        EraseFromWallets(ptxOld->GetHash());
+    if (hashOld != 0)
+        EraseFromWallets(hashOld);
     SyncWithWallets(hash, tx, NULL, true);
 
     return true;
@@ -1078,24 +1291,234 @@ int GetInputAge(CTxIn& vin)
 
     if(!view.HaveCoins(vin.prevout.hash)) return -1;
 
-    const CCoins &coins = view.GetCoins(vin.prevout.hash);
+    const CCoins &coins = view.AccessCoins(vin.prevout.hash);
 
     return (pindexBest->nHeight+1) - coins.nHeight;
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx)
+// modifier for indexed_transaction_set::modify, numbering entries as they come in
+struct update_sequence
+{
+    uint64 nSequence;
+
+    update_sequence(uint64 nSequenceIn) : nSequence(nSequenceIn) {}
+
+    void operator()(CTxMemPoolEntry &entry)
+    {
+        entry.SetSequence(nSequence);
+    }
+};
+
+// memory of one parent/child link, which is kept on both ends
+static size_t LinkUsage()
+{
+    return 2 * (sizeof(CTxMemPool::txiter) + 4 * sizeof(void*));
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
     {
-        mapTx[hash] = tx;
+        std::pair<txiter, bool> ret = mapTx.insert(entry);
+        if (!ret.second)
+            return true;
+        txiter it = ret.first;
+        mapTx.modify(it, update_sequence(++nSequenceLast));
+        nTotalTxSize += it->GetTxSize();
+        cachedInnerUsage += it->DynamicMemoryUsage();
+        TxLinks &links = mapLinks[it];
+        const CTransaction &tx = it->GetTx();
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+        {
+            mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+            txiter itParent = mapTx.find(tx.vin[i].prevout.hash);
+            if (itParent != mapTx.end() && links.parents.insert(itParent).second)
+            {
+                mapLinks[itParent].children.insert(it);
+                cachedInnerUsage += LinkUsage();
+            }
+        }
+
+        // A transaction that comes back from a disconnected block can already have children here
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            std::map<COutPoint, CInPoint>::iterator itNext = mapNextTx.find(COutPoint(hash, i));
+            if (itNext == mapNextTx.end())
+                continue;
+            txiter itChild = mapTx.find(itNext->second.ptx->GetHash());
+            if (links.children.insert(itChild).second)
+            {
+                mapLinks[itChild].parents.insert(it);
+                cachedInnerUsage += LinkUsage();
+            }
+        }
+
+        UpdateAncestorState(it);
+        UpdateDescendantState(it);
+        if (!links.children.empty())
+        {
+            setEntries setDescendants;
+            CalculateDescendants(it, setDescendants);
+            BOOST_FOREACH(txiter itDescendant, setDescendants)
+                UpdateAncestorState(itDescendant);
+        }
+        if (!links.parents.empty())
+        {
+            setEntries setAncestors;
+            CalculateAncestors(it, setAncestors);
+            BOOST_FOREACH(txiter itAncestor, setAncestors)
+                UpdateDescendantState(itAncestor);
+        }
         nTransactionsUpdated++;
     }
     return true;
 }
 
+void CTxMemPool::CalculateAncestors(txiter it, setEntries &setAncestors)
+{
+    const setEntries &parents = mapLinks[it].parents;
+    std::vector<txiter> vWork(parents.begin(), parents.end());
+    while (!vWork.empty())
+    {
+        txiter itParent = vWork.back();
+        vWork.pop_back();
+        if (!setAncestors.insert(itParent).second)
+            continue;
+        const setEntries &grandparents = mapLinks[itParent].parents;
+        vWork.insert(vWork.end(), grandparents.begin(), grandparents.end());
+    }
+}
+
+void CTxMemPool::CalculateDescendants(txiter it, setEntries &setDescendants)
+{
+    const setEntries &children = mapLinks[it].children;
+    std::vector<txiter> vWork(children.begin(), children.end());
+    while (!vWork.empty())
+    {
+        txiter itChild = vWork.back();
+        vWork.pop_back();
+        if (!setDescendants.insert(itChild).second)
+            continue;
+        const setEntries &grandchildren = mapLinks[itChild].children;
+        vWork.insert(vWork.end(), grandchildren.begin(), grandchildren.end());
+    }
+}
+
+bool CTxMemPool::CheckChainLimits(const CTransaction &tx, std::string &strError)
+{
+    setEntries setAncestors;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        txiter itParent = mapTx.find(txin.prevout.hash);
+        if (itParent == mapTx.end() || setAncestors.count(itParent))
+            continue;
+        setAncestors.insert(itParent);
+        CalculateAncestors(itParent, setAncestors);
+        if (setAncestors.size() + 1 > MEMPOOL_MAX_ANCESTORS)
+        {
+            strError = strprintf("has too many unconfirmed ancestors (limit %u)", MEMPOOL_MAX_ANCESTORS);
+            return false;
+        }
+    }
+    BOOST_FOREACH(txiter itAncestor, setAncestors)
+    {
+        if (itAncestor->GetCountWithDescendants() + 1 > MEMPOOL_MAX_DESCENDANTS)
+        {
+            strError = strprintf("would give %s too many unconfirmed descendants (limit %u)",
+                                 itAncestor->GetTx().GetHash().ToString().c_str(), MEMPOOL_MAX_DESCENDANTS);
+            return false;
+        }
+    }
+    return true;
+}
+
+// modifier for indexed_transaction_set::modify, so the ancestor index is kept in order
+struct update_ancestor_state
+{
+    uint64 nSize;
+    int64 nFees;
+    unsigned int nCount;
+
+    update_ancestor_state(uint64 nSizeIn, int64 nFeesIn, unsigned int nCountIn) : nSize(nSizeIn), nFees(nFeesIn), nCount(nCountIn) {}
+
+    void operator()(CTxMemPoolEntry &entry)
+    {
+        entry.SetAncestorState(nSize, nFees, nCount);
+    }
+};
+
+void CTxMemPool::UpdateAncestorState(txiter it)
+{
+    setEntries setAncestors;
+    CalculateAncestors(it, setAncestors);
+    uint64 nSize = it->GetTxSize();
+    int64 nFees = it->GetFee();
+    BOOST_FOREACH(txiter itAncestor, setAncestors)
+    {
+        nSize += itAncestor->GetTxSize();
+        nFees += itAncestor->GetFee();
+    }
+    mapTx.modify(it, update_ancestor_state(nSize, nFees, setAncestors.size() + 1));
+}
+
+// modifier for indexed_transaction_set::modify, so the descendant index is kept in order
+struct update_descendant_state
+{
+    uint64 nSize;
+    int64 nFees;
+    unsigned int nCount;
+
+    update_descendant_state(uint64 nSizeIn, int64 nFeesIn, unsigned int nCountIn) : nSize(nSizeIn), nFees(nFeesIn), nCount(nCountIn) {}
+
+    void operator()(CTxMemPoolEntry &entry)
+    {
+        entry.SetDescendantState(nSize, nFees, nCount);
+    }
+};
+
+void CTxMemPool::UpdateDescendantState(txiter it)
+{
+    setEntries setDescendants;
+    CalculateDescendants(it, setDescendants);
+    uint64 nSize = it->GetTxSize();
+    int64 nFees = it->GetFee();
+    BOOST_FOREACH(txiter itDescendant, setDescendants)
+    {
+        nSize += itDescendant->GetTxSize();
+        nFees += itDescendant->GetFee();
+    }
+    mapTx.modify(it, update_descendant_state(nSize, nFees, setDescendants.size() + 1));
+}
+
+void CTxMemPool::removeUnchecked(txiter it)
+{
+    BOOST_FOREACH(const CTxIn& txin, it->GetTx().vin)
+        mapNextTx.erase(txin.prevout);
+
+    setEntries setDescendants, setAncestors;
+    CalculateDescendants(it, setDescendants);
+    CalculateAncestors(it, setAncestors);
+
+    const TxLinks &links = mapLinks[it];
+    cachedInnerUsage -= (links.parents.size() + links.children.size()) * LinkUsage();
+    BOOST_FOREACH(txiter itParent, links.parents)
+        mapLinks[itParent].children.erase(it);
+    BOOST_FOREACH(txiter itChild, links.children)
+        mapLinks[itChild].parents.erase(it);
+    mapLinks.erase(it);
+    nTotalTxSize -= it->GetTxSize();
+    cachedInnerUsage -= it->DynamicMemoryUsage();
+    mapTx.erase(it);
+
+    // whatever is left below it lost an ancestor, whatever is above it a descendant
+    BOOST_FOREACH(txiter itDescendant, setDescendants)
+        UpdateAncestorState(itDescendant);
+    BOOST_FOREACH(txiter itAncestor, setAncestors)
+        UpdateDescendantState(itAncestor);
+    nTransactionsUpdated++;
+}
+
 
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
 {
@@ -1110,13 +1533,9 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
                     remove(*it->second.ptx, true);
             }
         }
-        if (mapTx.count(hash))
-        {
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
-        }
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end())
+            removeUnchecked(it);
     }
     return true;
 }
@@ -1139,19 +1558,84 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
+    nTotalTxSize = 0;
+    cachedInnerUsage = 0;
     ++nTransactionsUpdated;
 }
 
+size_t CTxMemPool::DynamicMemoryUsage()
+{
+    LOCK(cs);
+    // An entry is a node in each of the five indexes of mapTx plus its mapLinks node; a spent
+    // outpoint is a mapNextTx node
+    return mapTx.size() * (sizeof(CTxMemPoolEntry) + 15 * sizeof(void*) +
+                           sizeof(std::pair<const txiter, TxLinks>) + 4 * sizeof(void*)) +
+           mapNextTx.size() * (sizeof(std::pair<const COutPoint, CInPoint>) + 4 * sizeof(void*)) +
+           cachedInnerUsage;
+}
+
+double CTxMemPool::GetMinFeeRate()
+{
+    LOCK(cs);
+    if (dMinFeeRate == 0)
+        return 0;
+
+    int64 nNow = GetTime();
+    if (nNow > nMinFeeRateTime + 10)
+    {
+        dMinFeeRate *= pow(0.5, (double)(nNow - nMinFeeRateTime) / (12 * 60 * 60));
+        nMinFeeRateTime = nNow;
+        // Once it's down to half the relay fee, there's nothing left to keep out
+        if (dMinFeeRate < CTransaction::nMinRelayTxFee / 2)
+            dMinFeeRate = 0;
+    }
+    return dMinFeeRate;
+}
+
+void CTxMemPool::TrimToSize(size_t nSizeLimit, std::vector<uint256>* pvRemoved)
+{
+    LOCK(cs);
+    unsigned int nEvicted = 0;
+    while (!mapTx.empty() && DynamicMemoryUsage() > nSizeLimit)
+    {
+        const CTxMemPoolEntry &entry = *mapTx.get<descendant_score>().begin();
+
+        // Whatever comes in next has to pay more than the package we throw out
+        double dPackageFeeRate = std::max(entry.GetFeeRate(), entry.GetDescendantFeeRate()) + CTransaction::nMinRelayTxFee;
+        if (dPackageFeeRate > GetMinFeeRate())
+        {
+            dMinFeeRate = dPackageFeeRate;
+            nMinFeeRateTime = GetTime();
+        }
+
+        txiter it = mapTx.iterator_to(entry);
+        setEntries setDescendants;
+        CalculateDescendants(it, setDescendants);
+        setDescendants.insert(it);
+        if (pvRemoved)
+        {
+            BOOST_FOREACH(txiter itRemove, setDescendants)
+                pvRemoved->push_back(itRemove->GetTx().GetHash());
+        }
+        nEvicted += setDescendants.size();
+        remove(it->GetTx(), true);
+    }
+    if (nEvicted > 0)
+        LogPrintf("CTxMemPool::TrimToSize() : evicted %u transactions, minimum fee rate now %.1f per kB\n",
+                  nEvicted, dMinFeeRate);
+}
+
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 {
     vtxid.clear();
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (txiter mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->GetTx().GetHash());
 }
 
 
@@ -1737,7 +2221,7 @@ void static InvalidBlockFound(CBlockIndex *pindex) {
     }
 }
 
-bool ConnectBestBlock(CValidationState &state) {
+bool ConnectBestBlock(CValidationState &state, CBlock* pblockNew) {
     do {
         CBlockIndex *pindexNewBest;
 
@@ -1776,7 +2260,7 @@ bool ConnectBestBlock(CValidationState &state) {
                 BOOST_FOREACH(CBlockIndex *pindexSwitch, vAttach) {
                     boost::this_thread::interruption_point();
                     try {
-                        if (!SetBestChain(state, pindexSwitch))
+                        if (!SetBestChain(state, pindexSwitch, pblockNew))
                             return false;
                     } catch(std::runtime_error &e) {
                         return state.Abort(_("System error: ") + e.what());
@@ -1798,14 +2282,129 @@ void CBlockHeader::UpdateTime(const CBlockIndex* pindexPrev)
         nBits = GetNextWorkRequired(pindexPrev, this);
 }
 
+// The hash caches of transactions and block headers are filled in by const
+// GetHash() calls, which the script check threads and the message handlers
+// make on the same shared objects. A small set of mutexes, picked by address,
+// guards them; the hashing itself is done outside the lock.
+static boost::mutex csHashCache[64];
+
+static boost::mutex& GetHashCacheMutex(const void* p)
+{
+    return csHashCache[((size_t)p / sizeof(void*)) % ARRAYLEN(csHashCache)];
+}
+
+CTransaction::CTransaction(const CTransaction& tx) : nVersion(tx.nVersion), vin(tx.vin), vout(tx.vout), nLockTime(tx.nLockTime)
+{
+    boost::unique_lock<boost::mutex> lock(GetHashCacheMutex(&tx));
+    hashCached = tx.hashCached;
+    vchHashed = tx.vchHashed;
+}
+
+CTransaction& CTransaction::operator=(const CTransaction& tx)
+{
+    if (this == &tx)
+        return *this;
+    nVersion = tx.nVersion;
+    vin = tx.vin;
+    vout = tx.vout;
+    nLockTime = tx.nLockTime;
+
+    uint256 hash;
+    std::vector<unsigned char> vchHashedCopy;
+    {
+        boost::unique_lock<boost::mutex> lock(GetHashCacheMutex(&tx));
+        hash = tx.hashCached;
+        vchHashedCopy = tx.vchHashed;
+    }
+    boost::unique_lock<boost::mutex> lock(GetHashCacheMutex(this));
+    hashCached = hash;
+    vchHashed.swap(vchHashedCopy);
+    return *this;
+}
+
+uint256 CTransaction::GetHash() const
+{
+    // Like the header below, the cached hash is only reused while the bytes
+    // it was computed from still match: vin and vout are public and get
+    // changed in place by signing, the miner and the wallet. Serializing is
+    // much cheaper than the double SHA256 it saves.
+    CDataStream ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << *this;
+    {
+        boost::unique_lock<boost::mutex> lock(GetHashCacheMutex(this));
+        if (vchHashed.size() == ss.size() && memcmp(&vchHashed[0], &ss[0], ss.size()) == 0)
+            return hashCached;
+    }
+    uint256 hash = Hash(ss.begin(), ss.end());
+    boost::unique_lock<boost::mutex> lock(GetHashCacheMutex(this));
+    vchHashed.assign(ss.begin(), ss.end());
+    hashCached = hash;
+    return hash;
+}
+
+CBlockHeader::CBlockHeader(const CBlockHeader& header) :
+    nVersion(header.nVersion), hashPrevBlock(header.hashPrevBlock), hashMerkleRoot(header.hashMerkleRoot),
+    nTime(header.nTime), nBits(header.nBits), nNonce(header.nNonce), vmnAdditional(header.vmnAdditional), vmn(header.vmn)
+{
+    boost::unique_lock<boost::mutex> lock(GetHashCacheMutex(&header));
+    hashCached = header.hashCached;
+    memcpy(pchHashedHeader, header.pchHashedHeader, sizeof(pchHashedHeader));
+    fHashCached = header.fHashCached;
+}
+
+CBlockHeader& CBlockHeader::operator=(const CBlockHeader& header)
+{
+    if (this == &header)
+        return *this;
+    nVersion = header.nVersion;
+    hashPrevBlock = header.hashPrevBlock;
+    hashMerkleRoot = header.hashMerkleRoot;
+    nTime = header.nTime;
+    nBits = header.nBits;
+    nNonce = header.nNonce;
+    vmnAdditional = header.vmnAdditional;
+    vmn = header.vmn;
+
+    uint256 hash;
+    unsigned char pchHashed[sizeof(pchHashedHeader)];
+    bool fCached;
+    {
+        boost::unique_lock<boost::mutex> lock(GetHashCacheMutex(&header));
+        hash = header.hashCached;
+        memcpy(pchHashed, header.pchHashedHeader, sizeof(pchHashed));
+        fCached = header.fHashCached;
+    }
+    boost::unique_lock<boost::mutex> lock(GetHashCacheMutex(this));
+    hashCached = hash;
+    memcpy(pchHashedHeader, pchHashed, sizeof(pchHashedHeader));
+    fHashCached = fCached;
+    return *this;
+}
+
 uint256 CBlockHeader::GetHash() const
-{   
-    return Hash9(BEGIN(nVersion), END(nNonce));
+{
+    // The hashed fields are public and get modified in place (miner, getwork),
+    // so rather than invalidating at every write the cached hash is reused
+    // only while the 80 header bytes still match the ones it was computed from.
+    unsigned char pchHeader[80];
+    assert(END(nNonce) - BEGIN(nVersion) == sizeof(pchHeader));
+    memcpy(pchHeader, BEGIN(nVersion), sizeof(pchHeader));
+    {
+        boost::unique_lock<boost::mutex> lock(GetHashCacheMutex(this));
+        if (fHashCached && memcmp(pchHashedHeader, pchHeader, sizeof(pchHeader)) == 0)
+            return hashCached;
+    }
+    uint256 hash = Hash9(pchHeader, pchHeader + sizeof(pchHeader));
+    boost::unique_lock<boost::mutex> lock(GetHashCacheMutex(this));
+    memcpy(pchHashedHeader, pchHeader, sizeof(pchHeader));
+    hashCached = hash;
+    fHashCached = true;
+    return hash;
 }
 
 const CTxOut &CTransaction::GetOutputFor(const CTxIn& input, CCoinsViewCache& view)
 {
-    const CCoins &coins = view.GetCoins(input.prevout.hash);
+    const CCoins &coins = view.AccessCoins(input.prevout.hash);
     assert(coins.IsAvailable(input.prevout.n));
     return coins.vout[input.prevout.n];
 }
@@ -1866,7 +2465,7 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
         // then check whether the actual outputs are available
         for (unsigned int i = 0; i < vin.size(); i++) {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
             if (!coins.IsAvailable(prevout.n))
                 return false;
         }
@@ -1876,7 +2475,7 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
 
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, psighash.get()))
         return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().c_str());
     return true;
 }
@@ -1906,7 +2505,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
             // If prev is coinbase, check that it's matured
             if (coins.IsCoinBase()) {
@@ -1940,12 +2539,17 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // Inputs share one serialization of the transaction for their signature hashes
+            boost::shared_ptr<const CSignatureHashContext> psighash;
+            if (vin.size() > 1)
+                psighash.reset(new CSignatureHashContext(*this));
+
             for (unsigned int i = 0; i < vin.size(); i++) {
                 const COutPoint &prevout = vin[i].prevout;
-                const CCoins &coins = inputs.GetCoins(prevout.hash);
+                const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
                 // Verify signature
-                CScriptCheck check(coins, *this, i, flags, 0);
+                CScriptCheck check(coins, *this, i, flags, 0, psighash);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1953,7 +2557,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
                     if (flags & SCRIPT_VERIFY_STRICTENC) {
                         // For now, check whether the failure was caused by non-canonical
                         // encodings or not; if so, don't trigger DoS protection.
-                        CScriptCheck check(coins, *this, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0);
+                        CScriptCheck check(coins, *this, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0, psighash);
                         if (check())
                             return state.Invalid();
                     }
@@ -2088,43 +2692,207 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
-bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck)
-{
+static CCheckQueue<CBlockPreCheck> blockprecheckqueue(4);
 
-    // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(state, !fJustCheck, !fJustCheck))
-        return false;
+void ThreadBlockPreCheck() {
+    RenameThread("bitcoin-blockch");
+    blockprecheckqueue.Thread();
+}
 
-    // verify that the view's current state corresponds to the previous block
-    assert(pindex->pprev == view.GetBestBlock());
+CCoinsViewFlusher::CCoinsViewFlusher(CCoinsView &baseIn) : CCoinsViewBacked(baseIn), pindexFlushing(NULL), fQueued(false), fWriting(false) { }
 
-    // Special case for the genesis block, skipping connection of its transactions
-    // (its coinbase is unspendable)
-    if (GetHash() == hashGenesisBlock) {
-        view.SetBestBlock(pindex);
-        pindexGenesisBlock = pindex;
-        return true;
+bool CCoinsViewFlusher::GetCoins(const uint256 &txid, CCoins &coins) {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fQueued) {
+            CCoinsMap::const_iterator it = mapFlushing.find(txid);
+            if (it != mapFlushing.end()) {
+                coins = it->second.coins;
+                return true;
+            }
+        }
     }
+    return base->GetCoins(txid, coins);
+}
 
-    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+bool CCoinsViewFlusher::SetCoins(const uint256 &txid, const CCoins &coins) {
+    if (!WaitForFlush())
+        return false;
+    return base->SetCoins(txid, coins);
+}
 
-    // Do not allow blocks that contain transactions which 'overwrite' older transactions,
-    // unless those are already completely spent.
-    // If such overwrites are allowed, coinbases and transactions depending upon those
-    // can be duplicated to remove the ability to spend the first instance -- even after
-    // being sent to another address.
-    // See BIP30 and http://r6.ca/blog/20120206T005236Z.html for more information.
-    // This logic is not necessary for memory pool transactions, as AcceptToMemoryPool
-    // already refuses previously-known transaction ids entirely.
-    // This rule was originally applied all blocks whose timestamp was after October 1, 2012, 0:00 UTC.
-    // Now that the whole chain is irreversibly beyond that time it is applied to all blocks,
-    // this prevents exploiting the issue against nodes in their initial block download.
-    bool fEnforceBIP30 = true;
+bool CCoinsViewFlusher::HaveCoins(const uint256 &txid) {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fQueued && mapFlushing.count(txid))
+            return true;
+    }
+    return base->HaveCoins(txid);
+}
 
-    if (fEnforceBIP30) {
-        for (unsigned int i=0; i<vtx.size(); i++) {
-            uint256 hash = GetTxHash(i);
-            if (view.HaveCoins(hash) && !view.GetCoins(hash).IsPruned())
+CBlockIndex *CCoinsViewFlusher::GetBestBlock() {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fQueued)
+            return pindexFlushing;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewFlusher::SetBestBlock(CBlockIndex *pindex) {
+    if (!WaitForFlush())
+        return false;
+    return base->SetBestBlock(pindex);
+}
+
+bool CCoinsViewFlusher::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    if (!WaitForFlush())
+        return false;
+    return base->BatchWrite(mapCoins, pindex);
+}
+
+bool CCoinsViewFlusher::BatchWriteAsync(CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    // a previous batch has to be on disk first, which bounds the memory held here
+    if (!WaitForFlush())
+        return false;
+    boost::unique_lock<boost::mutex> lock(cs);
+    mapFlushing.swap(mapCoins);
+    pindexFlushing = pindex;
+    fQueued = true;
+    condFlush.notify_all();
+    return true;
+}
+
+bool CCoinsViewFlusher::GetStats(CCoinsStats &stats) {
+    if (!WaitForFlush())
+        return false;
+    return base->GetStats(stats);
+}
+
+bool CCoinsViewFlusher::IsFlushing() {
+    boost::unique_lock<boost::mutex> lock(cs);
+    return fQueued;
+}
+
+bool CCoinsViewFlusher::WaitForFlush() {
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (fWriting)
+        condFlush.wait(lock);
+    if (fQueued)
+        return WriteQueued(lock);
+    return true;
+}
+
+bool CCoinsViewFlusher::ThreadWrite() {
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (!fQueued || fWriting)
+        condFlush.wait(lock);
+    return WriteQueued(lock);
+}
+
+bool CCoinsViewFlusher::WriteQueued(boost::unique_lock<boost::mutex> &lock) {
+    fWriting = true;
+    lock.unlock();
+
+    // Readers only look at mapFlushing while it is being written, so it can be used without the lock.
+    // The best block in the batch must not get ahead of the block data and index on disk.
+    int64 nStart = GetTimeMicros();
+    FlushBlockFile();
+    if (pblocktree)
+        pblocktree->Sync();
+    bool fOk = base->BatchWrite(mapFlushing, pindexFlushing);
+    if (fBenchmark)
+        LogPrintf("- Write %u coins in the background: %.2fms\n", (unsigned int)mapFlushing.size(), 0.001 * (GetTimeMicros() - nStart));
+
+    lock.lock();
+    fWriting = false;
+    if (fOk) {
+        mapFlushing.clear();
+        pindexFlushing = NULL;
+        fQueued = false;
+    }
+    condFlush.notify_all();
+    return fOk;
+}
+
+void ThreadFlushCoins() {
+    RenameThread("bitcoin-coinsfl");
+    while (coinsFlusher.ThreadWrite()) {}
+    // the batch stays queued, the flush at shutdown tries it once more
+    AbortNode(_("Failed to write to coin database"));
+}
+
+// Fill in the hash cache of a header with a hash computed elsewhere. As with
+// GetHash(), it is only used for as long as the header bytes are unchanged.
+static void SetCachedBlockHash(const CBlockHeader& header, const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(GetHashCacheMutex(&header));
+    memcpy(header.pchHashedHeader, BEGIN(header.nVersion), sizeof(header.pchHashedHeader));
+    header.hashCached = hash;
+    header.fHashCached = true;
+}
+
+bool CBlockPreCheck::operator()() const
+{
+    const unsigned char* ppHeader[X11_MAX_LANES];
+    uint256 hashes[X11_MAX_LANES];
+    assert(vpblock.size() <= X11_MAX_LANES);
+    for (unsigned int i = 0; i < vpblock.size(); i++)
+        ppHeader[i] = (const unsigned char*)BEGIN(vpblock[i]->nVersion);
+    Hash9Multi(ppHeader, 80, vpblock.size(), hashes);
+
+    for (unsigned int i = 0; i < vpblock.size(); i++)
+    {
+        // ProcessBlock() and AcceptBlock() look the hash up again on the import thread
+        SetCachedBlockHash(*vpblock[i], hashes[i]);
+        if (!CheckProofOfWork(hashes[i], vpblock[i]->nBits))
+            return false;
+        if (vpblock[i]->BuildMerkleTree() != vpblock[i]->hashMerkleRoot)
+            return false;
+    }
+    return true;
+}
+
+bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck, bool fChecked)
+{
+
+    // Check it again in case a previous version let a bad block in. A block
+    // ProcessBlock() has just checked keeps its proof of work and merkle tree.
+    if (!fChecked)
+        vMerkleTree.clear();
+    if (!CheckBlock(state, !fJustCheck && !fChecked, !fJustCheck && !fChecked))
+        return false;
+
+    // verify that the view's current state corresponds to the previous block
+    assert(pindex->pprev == view.GetBestBlock());
+
+    // Special case for the genesis block, skipping connection of its transactions
+    // (its coinbase is unspendable)
+    if (GetHash() == hashGenesisBlock) {
+        view.SetBestBlock(pindex);
+        pindexGenesisBlock = pindex;
+        return true;
+    }
+
+    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+
+    // Do not allow blocks that contain transactions which 'overwrite' older transactions,
+    // unless those are already completely spent.
+    // If such overwrites are allowed, coinbases and transactions depending upon those
+    // can be duplicated to remove the ability to spend the first instance -- even after
+    // being sent to another address.
+    // See BIP30 and http://r6.ca/blog/20120206T005236Z.html for more information.
+    // This logic is not necessary for memory pool transactions, as AcceptToMemoryPool
+    // already refuses previously-known transaction ids entirely.
+    // This rule was originally applied all blocks whose timestamp was after October 1, 2012, 0:00 UTC.
+    // Now that the whole chain is irreversibly beyond that time it is applied to all blocks,
+    // this prevents exploiting the issue against nodes in their initial block download.
+    bool fEnforceBIP30 = true;
+
+    if (fEnforceBIP30) {
+        for (unsigned int i=0; i<vtx.size(); i++) {
+            uint256 hash = GetTxHash(i);
+            if (view.HaveCoins(hash) && !view.AccessCoins(hash).IsPruned())
                 return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"));
         }
     }
@@ -2239,7 +3007,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     return true;
 }
 
-bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
+bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew, CBlock* pblockNew)
 {
     // All modifications to the coin state will be done in this cache.
     // Only when all have succeeded, we push it to pcoinsTip.
@@ -2299,11 +3067,12 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     // Connect longer branch
     vector<CTransaction> vDelete;
     BOOST_FOREACH(CBlockIndex *pindex, vConnect) {
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
+        CBlock blockRead;
+        CBlock& block = (pblockNew && pindex->GetBlockHash() == pblockNew->GetHash()) ? *pblockNew : blockRead;
+        if (&block == &blockRead && !block.ReadFromDisk(pindex))
             return state.Abort(_("Failed to read block"));
         int64 nStart = GetTimeMicros();
-        if (!block.ConnectBlock(state, pindex, view)) {
+        if (!block.ConnectBlock(state, pindex, view, false, &block == pblockNew)) {
             if (state.IsInvalid()) {
                 InvalidChainFound(pindexNew);
                 InvalidBlockFound(pindex);
@@ -2326,9 +3095,12 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     if (fBenchmark)
         LogPrintf("- Flush %i transactions: %.2fms (%.4fms/tx)\n", nModified, 0.001 * nTime, 0.001 * nTime / nModified);
 
-    // Make sure it's successfully written to disk before changing memory structure
+    // Hand the coins cache to the background writer once it uses half of -dbcache, so the batch
+    // being written and the cache filling up behind it stay within the budget together. At the
+    // tip, also hand it over whenever the writer is idle, to keep the database close to the best chain.
     bool fIsInitialDownload = IsInitialBlockDownload();
-    if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
+    size_t nCoinsUsage = pcoinsTip->DynamicMemoryUsage();
+    if (nCoinsUsage > nCoinCacheUsage / 2 || (!fIsInitialDownload && !coinsFlusher.IsFlushing())) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
@@ -2336,13 +3108,14 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         // overwrite one. Still, use a conservative safety factor of 2.
         if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error();
-        FlushBlockFile();
-        pblocktree->Sync();
-        if (!pcoinsTip->Flush())
+        nStart = GetTimeMicros();
+        if (!pcoinsTip->FlushAsync())
             return state.Abort(_("Failed to write to coin database"));
+        if (fBenchmark)
+            LogPrintf("- Queue coins flush (%u bytes): %.2fms\n", (unsigned int)nCoinsUsage, 0.001 * (GetTimeMicros() - nStart));
     }
 
-    // At this point, all changes have been done to the database.
+    // At this point, all changes have been done to the coins view.
     // Proceed by updating the memory structures.
 
     // Disconnect shorter branch
@@ -2369,6 +3142,9 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         mempool.removeConflicts(tx);
     }
 
+    if (!vDisconnect.empty())
+        ReorganizedWallets();
+
     // Update best block in wallet (so we can detect restored wallets)
     if ((pindexNew->nHeight % 20160) == 0 || (!fIsInitialDownload && (pindexNew->nHeight % 144) == 0))
     {
@@ -2377,7 +3153,12 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     }
 
     // New best block
-    hashBestChain = pindexNew->GetBlockHash();
+    {
+        // long polling getblocktemplate reads hashBestChain under csBestBlock only
+        boost::lock_guard<boost::mutex> lock(csBestBlock);
+        hashBestChain = pindexNew->GetBlockHash();
+        cvBlockChange.notify_all();
+    }
     pindexBest = pindexNew;
     pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
@@ -2449,8 +3230,9 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
     if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew)))
         return state.Abort(_("Failed to write block index"));
 
-    // New best?
-    if (!ConnectBestBlock(state))
+    // New best? Blocks get here from AcceptBlock() after CheckBlock(), or as
+    // the hardcoded genesis block, so this one can be connected as it is.
+    if (!ConnectBestBlock(state, this))
         return false;
 
     if (pindexNew == pindexBest)
@@ -2659,7 +3441,11 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
     // Build the merkle tree already. We need it anyway later, and it makes the
     // block cache the transaction hashes, which means they don't need to be
     // recalculated many times during this block's validation.
-    BuildMerkleTree();
+    // Callers that skip the root check and leave a tree in place have built
+    // and verified it themselves: CBlockPreCheck for imported blocks, and
+    // ProcessBlock() for the block ConnectBlock() is handed from memory.
+    if (fCheckMerkleRoot || vMerkleTree.empty())
+        BuildMerkleTree();
 
     // Check for duplicate txids. This is caught by ConnectInputs(),
     // but catching it earlier avoids a potential DoS attack:
@@ -2679,12 +3465,60 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
         return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
 
     // Check merkle root
-    if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
+    if (fCheckMerkleRoot && hashMerkleRoot != vMerkleTree.back())
         return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
     return true;
 }
 
+// Checks of a block header that depend on its place in the chain. Shared by
+// AcceptBlock and by headers-first sync, which runs them before the block is
+// downloaded.
+static bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex* pindexPrev)
+{
+    int nHeight = pindexPrev->nHeight+1;
+
+    if(fTestNet) {
+        if (block.nBits != GetNextWorkRequired(pindexPrev, &block))
+            return state.DoS(100, error("ContextualCheckBlockHeader() : incorrect proof of work"));
+    } else {
+        // Check proof of work (Here for the architecture issues with DGW v1 and v2)
+        if(nHeight <= 68589){
+            unsigned int nBitsNext = GetNextWorkRequired(pindexPrev, &block);
+            double n1 = ConvertBitsToDouble(block.nBits);
+            double n2 = ConvertBitsToDouble(nBitsNext);
+
+            if (abs(n1-n2) > n1*0.5) 
+                return state.DoS(100, error("ContextualCheckBlockHeader() : incorrect proof of work (DGW pre-fork) - %f", abs(n1-n2)));
+        } else {
+            if (block.nBits != GetNextWorkRequired(pindexPrev, &block))
+                return state.DoS(100, error("ContextualCheckBlockHeader() : incorrect proof of work"));
+        }
+    }
+
+    // Prevent blocks from too far in the future
+    if(fTestNet || nHeight >= 45000){
+        if (block.GetBlockTime() > GetAdjustedTime() + 15 * 60) {
+            return error("ContextualCheckBlockHeader() : block's timestamp too far in the future");
+        }
+
+        // Check timestamp is not too far in the past
+        if (block.GetBlockTime() <= pindexPrev->GetBlockTime() - 15 * 60) {
+            return error("ContextualCheckBlockHeader() : block's timestamp is too early compare to last block");
+        }
+    }
+
+    // Check timestamp against prev
+    if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return state.Invalid(error("ContextualCheckBlockHeader() : block's timestamp is too early"));
+
+    // Check that the block chain matches the known block chain up to a checkpoint
+    if (!Checkpoints::CheckBlock(nHeight, block.GetHash()))
+        return state.DoS(100, error("ContextualCheckBlockHeader() : rejected by checkpoint lock-in at %d", nHeight));
+
+    return true;
+}
+
 bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
 {
     // Check for duplicate
@@ -2702,49 +3536,14 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
         pindexPrev = (*mi).second;
         nHeight = pindexPrev->nHeight+1;
 
-        if(fTestNet) {
-            if (nBits != GetNextWorkRequired(pindexPrev, this))
-                return state.DoS(100, error("AcceptBlock() : incorrect proof of work"));
-        } else {
-            // Check proof of work (Here for the architecture issues with DGW v1 and v2)
-            if(nHeight <= 68589){
-                unsigned int nBitsNext = GetNextWorkRequired(pindexPrev, this);
-                double n1 = ConvertBitsToDouble(nBits);
-                double n2 = ConvertBitsToDouble(nBitsNext);
-
-                if (abs(n1-n2) > n1*0.5) 
-                    return state.DoS(100, error("AcceptBlock() : incorrect proof of work (DGW pre-fork) - %f", abs(n1-n2)));
-            } else {
-                if (nBits != GetNextWorkRequired(pindexPrev, this))
-                    return state.DoS(100, error("AcceptBlock() : incorrect proof of work"));
-            }
-        }
-
-        // Prevent blocks from too far in the future
-        if(fTestNet || nHeight >= 45000){
-            if (GetBlockTime() > GetAdjustedTime() + 15 * 60) {
-                return error("AcceptBlock() : block's timestamp too far in the future");
-            }
-
-            // Check timestamp is not too far in the past
-            if (GetBlockTime() <= pindexPrev->GetBlockTime() - 15 * 60) {
-                return error("AcceptBlock() : block's timestamp is too early compare to last block");
-            }
-        }
-
-        // Check timestamp against prev
-        if (GetBlockTime() <= pindexPrev->GetMedianTimePast())
-            return state.Invalid(error("AcceptBlock() : block's timestamp is too early"));
+        if (!ContextualCheckBlockHeader(*this, state, pindexPrev))
+            return false;
 
         // Check that all transactions are finalized
         BOOST_FOREACH(const CTransaction& tx, vtx)
             if (!tx.IsFinal(nHeight, GetBlockTime()))
                 return state.DoS(10, error("AcceptBlock() : contains a non-final transaction"));
 
-        // Check that the block chain matches the known block chain up to a checkpoint
-        if (!Checkpoints::CheckBlock(nHeight, hash))
-            return state.DoS(100, error("AcceptBlock() : rejected by checkpoint lock-in at %d", nHeight));
-
 		// Check that the block satisfies synchronized checkpoint
         if (IsSyncCheckpointEnforced() && !IsInitialBlockDownload() && !CheckSyncCheckpoint(hash, pindexPrev))
             return error("AcceptBlock() : rejected by synchronized checkpoint");
@@ -2820,7 +3619,7 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp, bool fPreChecked)
 {
     // Check for duplicate
     uint256 hash = pblock->GetHash();
@@ -2830,7 +3629,7 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString().c_str()));
 
     // Preliminary checks
-    if (!pblock->CheckBlock(state))
+    if (!pblock->CheckBlock(state, !fPreChecked, !fPreChecked))
         return error("ProcessBlock() : CheckBlock FAILED");
 
     CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
@@ -2857,8 +3656,10 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
             mapOrphanBlocks.insert(make_pair(hash, pblock2));
             mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
-            // Ask this guy to fill in what we're missing
-            if (pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2)))
+            // Ask this guy to fill in what we're missing, unless headers-first sync
+            // already knows the chain and is downloading it
+            if (!mapHeaderIndex.count(pblock2->hashPrevBlock) &&
+                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2)))
                 LogPrintf("send fill-in getblocks for %s peer=%d\n", hash.ToString().c_str(), pfrom->id);
         }
         return true;
@@ -2934,6 +3735,81 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 
 
 
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block)
+{
+    header = block.GetBlockHeader();
+    nNonce = GetRand(std::numeric_limits<uint64>::max());
+    SetKeys();
+
+    txCoinbase = block.vtx[0];
+    vShortTxIDs.reserve(block.vtx.size() - 1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        vShortTxIDs.push_back(GetShortID(block.vtx[i].GetHash()));
+}
+
+void CBlockHeaderAndShortTxIDs::SetKeys()
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header << nNonce;
+    uint64 nKey = Hash(ss.begin(), ss.end()).Get64();
+    nKey0 = (unsigned int)nKey;
+    nKey1 = (unsigned int)(nKey >> 32);
+}
+
+uint64 CBlockHeaderAndShortTxIDs::GetShortID(const uint256& hash) const
+{
+    // Called for every mempool transaction while filling a block; hash the
+    // txid in place rather than copying it into a vector
+    return ((uint64)MurmurHash3(nKey0, hash.begin(), hash.size()) << 32) | MurmurHash3(nKey1, hash.begin(), hash.size());
+}
+
+void CBlockHeaderAndShortTxIDs::FillBlock(CTxMemPool& pool, CBlock& block, std::vector<unsigned int>& vMissing) const
+{
+    block = CBlock(header);
+    block.vtx.resize(vShortTxIDs.size() + 1);
+    block.vtx[0] = txCoinbase;
+
+    // Position in vtx of each short ID; IDs that appear twice can't be resolved
+    map<uint64, unsigned int> mapPosition;
+    vector<bool> vHave(block.vtx.size(), false);
+    vector<bool> vAmbiguous(block.vtx.size(), false);
+    vHave[0] = true;
+    for (unsigned int i = 0; i < vShortTxIDs.size(); i++)
+    {
+        pair<map<uint64, unsigned int>::iterator, bool> ret = mapPosition.insert(make_pair(vShortTxIDs[i], i + 1));
+        if (!ret.second)
+            vAmbiguous[i + 1] = vAmbiguous[ret.first->second] = true;
+    }
+
+    if (!mapPosition.empty())
+    {
+        LOCK(pool.cs);
+        for (indexed_transaction_set::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end(); it++)
+        {
+            map<uint64, unsigned int>::iterator mi = mapPosition.find(GetShortID(it->GetTx().GetHash()));
+            if (mi == mapPosition.end())
+                continue;
+            unsigned int nPos = mi->second;
+            if (vHave[nPos])
+                vAmbiguous[nPos] = true;
+            block.vtx[nPos] = it->GetTx();
+            vHave[nPos] = true;
+        }
+    }
+
+    vMissing.clear();
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+    {
+        if (!vHave[i] || vAmbiguous[i])
+        {
+            block.vtx[i] = CTransaction();
+            vMissing.push_back(i);
+        }
+    }
+}
+
+
+
 
 
 
@@ -3245,7 +4121,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= 2 * nCoinCacheUsage) {
             bool fClean = true;
             if (!block.DisconnectBlock(state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
@@ -3460,6 +4336,48 @@ void PrintBlockTree()
     }
 }
 
+/** Pre-check the proof of work and merkle roots of a run of imported blocks
+ *  on the block check threads, then process them in file order. */
+static bool ProcessImportedBlocks(std::vector<CBlock>& vBlocks, std::vector<uint64>& vBlockPos, CDiskBlockPos *dbp, int& nLoaded)
+{
+    bool fPreChecked = false;
+    if (nScriptCheckThreads)
+    {
+        CCheckQueueControl<CBlockPreCheck> control(&blockprecheckqueue);
+        std::vector<CBlockPreCheck> vChecks;
+        for (unsigned int i = 0; i < vBlocks.size(); i += X11_MAX_LANES)
+        {
+            std::vector<const CBlock*> vpblock;
+            for (unsigned int j = i; j < vBlocks.size() && j < i + X11_MAX_LANES; j++)
+                vpblock.push_back(&vBlocks[j]);
+            vChecks.push_back(CBlockPreCheck(vpblock));
+        }
+        control.Add(vChecks);
+        // If anything in the run fails, every block gets the full checks
+        // below, which find and report the bad one.
+        fPreChecked = control.Wait();
+    }
+
+    bool fRet = true;
+    for (unsigned int i = 0; i < vBlocks.size(); i++)
+    {
+        LOCK(cs_main);
+        if (dbp)
+            dbp->nPos = vBlockPos[i];
+        CValidationState state;
+        if (ProcessBlock(state, NULL, &vBlocks[i], dbp, fPreChecked))
+            nLoaded++;
+        if (state.IsError())
+        {
+            fRet = false;
+            break;
+        }
+    }
+    vBlocks.clear();
+    vBlockPos.clear();
+    return fRet;
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
     int64 nStart = GetTimeMillis();
@@ -3469,6 +4387,11 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 
     int nLoaded = 0;
     try {
+        // Blocks read ahead of processing, so their context-free checks can run in parallel
+        std::vector<CBlock> vBlocks;
+        std::vector<uint64> vBlockPos;
+        vBlocks.reserve(IMPORT_PRECHECK_BLOCKS);
+
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64 nStartByte = 0;
         if (dbp) {
@@ -3508,25 +4431,27 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 // read block
                 uint64 nBlockPos = blkdat.GetPos();
                 blkdat.SetLimit(nBlockPos + nSize);
-                CBlock block;
-                blkdat >> block;
+                vBlocks.push_back(CBlock());
+                try {
+                    blkdat >> vBlocks.back();
+                } catch (std::exception &e) {
+                    vBlocks.pop_back();
+                    throw;
+                }
                 nRewind = blkdat.GetPos();
 
-                // process block
-                if (nBlockPos >= nStartByte) {
-                    LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                }
+                // queue block for processing
+                if (nBlockPos >= nStartByte)
+                    vBlockPos.push_back(nBlockPos);
+                else
+                    vBlocks.pop_back();
             } catch (std::exception &e) {
                 LogPrintf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
             }
+            if (vBlocks.size() >= IMPORT_PRECHECK_BLOCKS && !ProcessImportedBlocks(vBlocks, vBlockPos, dbp, nLoaded))
+                break;
         }
+        ProcessImportedBlocks(vBlocks, vBlockPos, dbp, nLoaded);
         fclose(fileIn);
     } catch(std::runtime_error &e) {
         AbortNode(_("Error: system error: ") + e.what());
@@ -3536,6 +4461,205 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
     return nLoaded > 0;
 }
 
+// Parents before children: an ancestor always has fewer ancestors than its descendants
+class CompareTxIterByAncestorCount
+{
+public:
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+    }
+};
+
+// Pool iterators in the order of the ancestor_score index
+class CompareTxIterByAncestorScore
+{
+public:
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        return CompareTxMemPoolEntryByAncestorFeeRate()(*a, *b);
+    }
+};
+
+static const int MEMPOOL_DUMP_VERSION = 1;
+/** Transactions validated together when loading mempool.dat */
+static const unsigned int MEMPOOL_LOAD_BATCH = 500;
+
+bool DumpMempool()
+{
+    int64 nStart = GetTimeMillis();
+
+    // Parents before children, so that loading can add them front to back
+    std::vector<std::pair<CTransaction, int64> > vEntries;
+    {
+        LOCK(mempool.cs);
+        std::vector<CTxMemPool::txiter> vIters;
+        for (CTxMemPool::txiter mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            vIters.push_back(mi);
+        std::sort(vIters.begin(), vIters.end(), CompareTxIterByAncestorCount());
+        vEntries.reserve(vIters.size());
+        BOOST_FOREACH(CTxMemPool::txiter it, vIters)
+            vEntries.push_back(std::make_pair(it->GetTx(), it->GetTime()));
+    }
+
+    unsigned char pchMessageStart[4];
+    GetMessageStart(pchMessageStart);
+
+    // serialize the entries, checksum data up to that point, then append csum
+    CDataStream ssMempool(SER_DISK, CLIENT_VERSION);
+    ssMempool << FLATDATA(pchMessageStart);
+    ssMempool << MEMPOOL_DUMP_VERSION;
+    ssMempool << vEntries;
+    uint256 hash = Hash(ssMempool.begin(), ssMempool.end());
+    ssMempool << hash;
+
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpMempool() : open failed");
+
+    try {
+        fileout << ssMempool;
+    }
+    catch (std::exception &e) {
+        return error("DumpMempool() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, pathMempool))
+        return error("DumpMempool() : Rename-into-place failed");
+
+    LogPrintf("Dumped %"PRIszu" transactions to mempool.dat  %"PRI64d"ms\n", vEntries.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadMempool()
+{
+    int64 nStart = GetTimeMillis();
+
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    FILE *file = fopen(pathMempool.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("LoadMempool() : open failed");
+
+    // use file size to size memory buffer
+    int fileSize = GetFilesize(filein);
+    int dataSize = fileSize - sizeof(uint256);
+    //Don't try to resize to a negative number if file is small
+    if ( dataSize < 0 ) dataSize = 0;
+    vector<unsigned char> vchData;
+    vchData.resize(dataSize);
+    uint256 hashIn;
+
+    // read data and checksum from file
+    try {
+        filein.read((char *)&vchData[0], dataSize);
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        return error("LoadMempool() : I/O error or stream data corrupted");
+    }
+    filein.fclose();
+
+    CDataStream ssMempool(vchData, SER_DISK, CLIENT_VERSION);
+
+    // verify stored checksum matches input data
+    if (hashIn != Hash(ssMempool.begin(), ssMempool.end()))
+        return error("LoadMempool() : checksum mismatch; data corrupted");
+
+    unsigned char pchMessageStart[4];
+    GetMessageStart(pchMessageStart);
+    unsigned char pchMsgTmp[4];
+    int nVersion;
+    std::vector<std::pair<CTransaction, int64> > vEntries;
+    try {
+        ssMempool >> FLATDATA(pchMsgTmp);
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+            return error("LoadMempool() : invalid network magic number");
+        ssMempool >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("LoadMempool() : unknown version %d", nVersion);
+        ssMempool >> vEntries;
+    }
+    catch (std::exception &e) {
+        return error("LoadMempool() : I/O error or stream data corrupted");
+    }
+
+    // Validate in batches. The scripts of a batch are collected under cs_main, against the
+    // inputs as the batch spends them, and verified on the script check threads with the lock
+    // released; the transactions are then added under cs_main with the usual checks, minus the
+    // scripts that already passed. If any script in the batch fails, the whole batch goes
+    // through the full checks. A script only depends on the output it spends, so a block
+    // connected in between can't change the result.
+    unsigned int nLoaded = 0, nFailed = 0;
+    for (unsigned int i = 0; i < vEntries.size() && !ShutdownRequested(); i += MEMPOOL_LOAD_BATCH)
+    {
+        unsigned int nEnd = std::min((unsigned int)vEntries.size(), i + MEMPOOL_LOAD_BATCH);
+
+        bool fPreChecked = false;
+        std::set<uint256> setPreChecked;
+        if (nScriptCheckThreads)
+        {
+            std::vector<CScriptCheck> vBatchChecks;
+            {
+                LOCK2(cs_main, mempool.cs);
+                CCoinsView dummy;
+                CCoinsViewCache view(dummy);
+                CCoinsViewMemPool viewMemPool(*pcoinsTip, mempool);
+                view.SetBackend(viewMemPool);
+
+                // Don't spend script checks on what the pool would turn away for its fee
+                double dMinFeeRate = mempool.GetMinFeeRate();
+                for (unsigned int j = i; j < nEnd; j++)
+                {
+                    const CTransaction &tx = vEntries[j].first;
+                    CValidationState state;
+                    std::vector<CScriptCheck> vChecks;
+                    // whatever fails here fails again when it's added
+                    if (tx.IsCoinBase() || !tx.HaveInputs(view))
+                        continue;
+                    if (dMinFeeRate > 0 && (double)(tx.GetValueIn(view) - tx.GetValueOut()) * 1000 / ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION) < dMinFeeRate)
+                        continue;
+                    if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, &vChecks))
+                        continue;
+                    unsigned int nChecks = vBatchChecks.size();
+                    vBatchChecks.resize(nChecks + vChecks.size());
+                    for (unsigned int k = 0; k < vChecks.size(); k++)
+                        vBatchChecks[nChecks + k].swap(vChecks[k]);
+                    setPreChecked.insert(tx.GetHash());
+
+                    CTxUndo txundo;
+                    tx.UpdateCoins(state, view, txundo, pindexBest->nHeight + 1, tx.GetHash());
+                }
+                view.SetBackend(dummy);
+            }
+
+            CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+            control.Add(vBatchChecks);
+            fPreChecked = control.Wait();
+        }
+
+        LOCK(cs_main);
+        for (unsigned int j = i; j < nEnd; j++)
+        {
+            CTransaction &tx = vEntries[j].first;
+            CValidationState state;
+            bool fScriptChecks = !(fPreChecked && setPreChecked.count(tx.GetHash()));
+            if (mempool.accept(state, tx, true, true, NULL, false, fScriptChecks, vEntries[j].second))
+                nLoaded++;
+            else
+                nFailed++;
+        }
+    }
+
+    LogPrintf("Loaded %u transactions from mempool.dat, %u failed  %"PRI64d"ms\n", nLoaded, nFailed, GetTimeMillis() - nStart);
+    return true;
+}
+
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -3666,34 +4790,39 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
-                bool send = true;
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                pfrom->nBlocksRequested++;
-                if (mi != mapBlockIndex.end())
+                // Only the block index lookup needs cs_main, the block itself
+                // is read from disk without holding up the other peers
+                CBlockIndex* pindex = NULL;
+                uint256 hashBest;
                 {
-                    // If the requested block is at a height below our last
-                    // checkpoint, only serve it if it's in the checkpointed chain
-                    int nHeight = ((*mi).second)->nHeight;
-                    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
-                    if (pcheckpoint && nHeight < pcheckpoint->nHeight) {
-                       if (!((*mi).second)->IsInMainChain())
-                       {
-                         LogPrintf("ProcessGetData(): ignoring request for old block that isn't in the main chain\n");
-                         send = false;
-                       }
+                    LOCK(cs_main);
+                    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        pindex = (*mi).second;
+                        // If the requested block is at a height below our last
+                        // checkpoint, only serve it if it's in the checkpointed chain
+                        CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+                        if (pcheckpoint && pindex->nHeight < pcheckpoint->nHeight && !pindex->IsInMainChain())
+                        {
+                            LogPrintf("ProcessGetData(): ignoring request for old block that isn't in the main chain\n");
+                            pindex = NULL;
+                        }
                     }
-                } else {
-                    send = false;
+                    hashBest = hashBestChain;
                 }
-                if (send)
+                pfrom->nBlocksRequested++;
+                if (pindex)
                 {
                     // Send block from disk
                     CBlock block;
-                    block.ReadFromDisk((*mi).second);
+                    block.ReadFromDisk(pindex);
                     if (inv.type == MSG_BLOCK)
                         pfrom->PushMessage("block", block);
+                    else if (inv.type == MSG_CMPCT_BLOCK)
+                        pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
                     else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
@@ -3709,8 +4838,15 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                            {
+                                bool fKnown;
+                                {
+                                    LOCK(pfrom->cs_inventory);
+                                    fKnown = pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second));
+                                }
+                                if (!fKnown)
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            }
                         }
                         // else
                             // no response
@@ -3723,11 +4859,13 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+                        vInv.push_back(CInv(MSG_BLOCK, hashBest));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
                 }
+                else if (inv.type == MSG_BLOCK)
+                    vNotFound.push_back(inv);
             }
             else if (inv.IsKnownType())
             {
@@ -3735,9 +4873,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CNetMessageRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSharedMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -3760,7 +4898,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -3779,13 +4917,293 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
+//
+// Headers-first sync
+//
+// One peer at a time is asked for headers with getheaders. The headers are
+// checked (proof of work, difficulty, timestamps, checkpoints) and linked into
+// mapHeaderIndex, then SendMessages spreads getdata for the blocks of the best
+// header chain over all peers, a window at a time. Blocks that arrive ahead of
+// their parents wait in mapOrphanBlocks as before, and a block a peer answers
+// notfound for is left to the other peers.
+//
+
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+static const int64 BLOCK_DOWNLOAD_TIMEOUT = 60;
+static const int64 HEADERS_SYNC_TIMEOUT = 120;
+
+// The best header chain by height, from genesis up to pindexBestHeader
+static vector<CBlockIndex*> vBestHeaderChain;
+// Blocks asked for by the download scheduler: hash -> (peer, time asked)
+static map<uint256, pair<NodeId, int64> > mapBlocksInFlight;
+static map<NodeId, int> mapBlocksInFlightCount;
+// Blocks a peer answered notfound for: hash -> peer, so they're asked elsewhere
+static map<uint256, NodeId> mapBlocksNotFound;
+// The peer we're getting headers from
+static NodeId nodeHeadersSync = -1;
+static int64 nHeadersSyncTime = 0;
+
+// Salts for the address relay and transaction trickle choices. They're set once by
+// InitRelaySalts before the message handler threads start and only read afterwards.
+static uint256 hashAddrRelaySalt;
+static uint256 hashTrickleSalt;
+
+void InitRelaySalts()
 {
-    RandAddSeedPerfmon();
-    LogPrint("net2", "received: %s (%"PRIszu" bytes) peer=%d\n", strCommand.c_str(), vRecv.size(), pfrom->id);
-    if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
-    {
-        LogPrintf("dropmessagestest DROPPING RECV MESSAGE\n");
+    hashAddrRelaySalt = GetRandHash();
+    hashTrickleSalt = GetRandHash();
+}
+
+void static SetBestHeader(CBlockIndex* pindex)
+{
+    pindexBestHeader = pindex;
+    vBestHeaderChain.resize(pindex->nHeight + 1);
+    for (CBlockIndex* pindexWalk = pindex; pindexWalk && vBestHeaderChain[pindexWalk->nHeight] != pindexWalk; pindexWalk = pindexWalk->pprev)
+        vBestHeaderChain[pindexWalk->nHeight] = pindexWalk;
+}
+
+// The last checkpoint we know of, as a downloaded block or only as a header
+static CBlockIndex* GetLastCheckpointHeader()
+{
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+    CBlockIndex* pcheckpointHeader = Checkpoints::GetLastCheckpoint(mapHeaderIndex);
+    if (pcheckpointHeader && (!pcheckpoint || pcheckpointHeader->nHeight > pcheckpoint->nHeight))
+        return pcheckpointHeader;
+    return pcheckpoint;
+}
+
+bool AcceptBlockHeader(CBlockHeader& header, CValidationState& state, CBlockIndex** ppindex)
+{
+    // Check for duplicate
+    uint256 hash = header.GetHash();
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+    {
+        *ppindex = (*mi).second;
+        return true;
+    }
+    mi = mapHeaderIndex.find(hash);
+    if (mi != mapHeaderIndex.end())
+    {
+        *ppindex = (*mi).second;
+        return true;
+    }
+
+    if (!CheckProofOfWork(hash, header.nBits))
+        return state.DoS(50, error("AcceptBlockHeader() : proof of work failed"));
+
+    // Get prev block index
+    CBlockIndex* pindexPrev = NULL;
+    mi = mapBlockIndex.find(header.hashPrevBlock);
+    if (mi != mapBlockIndex.end())
+        pindexPrev = (*mi).second;
+    else
+    {
+        mi = mapHeaderIndex.find(header.hashPrevBlock);
+        if (mi != mapHeaderIndex.end())
+            pindexPrev = (*mi).second;
+    }
+    if (!pindexPrev)
+        return state.Invalid(error("AcceptBlockHeader() : prev block not found"));
+    if (pindexPrev->nStatus & BLOCK_FAILED_MASK)
+        return state.DoS(100, error("AcceptBlockHeader() : prev block invalid"));
+
+    // Every header below the last checkpoint we have is already indexed, so a
+    // new one there forks off the checkpointed chain
+    CBlockIndex* pcheckpoint = GetLastCheckpointHeader();
+    if (pcheckpoint && pindexPrev->nHeight + 1 < pcheckpoint->nHeight)
+        return state.DoS(100, error("AcceptBlockHeader() : forked chain older than last checkpoint (height %d)", pindexPrev->nHeight + 1));
+
+    if (!ContextualCheckBlockHeader(header, state, pindexPrev))
+        return false;
+
+    CBlockIndex* pindexNew = new CBlockIndex(header);
+    mi = mapHeaderIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+    pindexNew->pprev = pindexPrev;
+    pindexNew->nHeight = pindexPrev->nHeight + 1;
+    pindexNew->nChainWork = pindexPrev->nChainWork + pindexNew->GetBlockWork().getuint256();
+    if (pindexNew->nChainWork > (pindexBestHeader ? pindexBestHeader->nChainWork : nBestChainWork))
+        SetBestHeader(pindexNew);
+
+    *ppindex = pindexNew;
+    return true;
+}
+
+void static MarkBlockReceived(const uint256& hash)
+{
+    map<uint256, pair<NodeId, int64> >::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi == mapBlocksInFlight.end())
+        return;
+    mapBlocksInFlightCount[(*mi).second.first]--;
+    mapBlocksInFlight.erase(mi);
+    mapBlocksNotFound.erase(hash);
+}
+
+// The peer doesn't have a block we asked it for; free it up for another peer
+void static MarkBlockNotFound(const uint256& hash, NodeId node)
+{
+    map<uint256, pair<NodeId, int64> >::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi == mapBlocksInFlight.end() || (*mi).second.first != node)
+        return;
+    mapBlocksInFlightCount[node]--;
+    mapBlocksInFlight.erase(mi);
+    mapBlocksNotFound[hash] = node;
+}
+
+// Forget the blocks asked from peers that are gone, disconnect the ones that
+// stopped sending, and drop the header index once the chain has caught up
+void static CheckBlocksInFlight()
+{
+    if (pindexBestHeader && nBestChainWork >= pindexBestHeader->nChainWork && mapBlocksInFlight.empty())
+    {
+        LogPrintf("headers-first sync done at height %d\n", nBestHeight);
+        for (map<uint256, CBlockIndex*>::iterator mi = mapHeaderIndex.begin(); mi != mapHeaderIndex.end(); ++mi)
+            delete (*mi).second;
+        mapHeaderIndex.clear();
+        vBestHeaderChain.clear();
+        pindexBestHeader = NULL;
+    }
+
+    int64 nNow = GetTime();
+    set<NodeId> setStalled;
+    map<NodeId, CNode*> mapNodes;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (!pnode->fDisconnect)
+                mapNodes[pnode->id] = pnode;
+
+        map<uint256, pair<NodeId, int64> >::iterator mi = mapBlocksInFlight.begin();
+        while (mi != mapBlocksInFlight.end())
+        {
+            NodeId node = (*mi).second.first;
+            if (mapNodes.count(node) && !setStalled.count(node) && nNow - (*mi).second.second > BLOCK_DOWNLOAD_TIMEOUT)
+            {
+                LogPrintf("block download stalled, disconnecting peer=%d\n", node);
+                mapNodes[node]->fDisconnect = true;
+                setStalled.insert(node);
+            }
+            if (!mapNodes.count(node) || setStalled.count(node))
+            {
+                mapBlocksInFlightCount[node]--;
+                mapBlocksInFlight.erase(mi++);
+            }
+            else
+                ++mi;
+        }
+
+        map<uint256, NodeId>::iterator mi2 = mapBlocksNotFound.begin();
+        while (mi2 != mapBlocksNotFound.end())
+        {
+            if (!mapNodes.count((*mi2).second))
+                mapBlocksNotFound.erase(mi2++);
+            else
+                ++mi2;
+        }
+    }
+
+    map<NodeId, int>::iterator it = mapBlocksInFlightCount.begin();
+    while (it != mapBlocksInFlightCount.end())
+    {
+        if ((*it).second <= 0)
+            mapBlocksInFlightCount.erase(it++);
+        else
+            ++it;
+    }
+
+    if (nodeHeadersSync != -1 && !mapNodes.count(nodeHeadersSync))
+        nodeHeadersSync = -1;
+}
+
+// Ask pto for the next blocks of the best header chain, up to
+// MAX_BLOCKS_IN_TRANSIT_PER_PEER at a time
+void static FindBlocksToDownload(CNode* pto, vector<CInv>& vGetData)
+{
+    if (!pindexBestHeader || pindexBestHeader->nChainWork <= nBestChainWork)
+        return;
+    if (pto->fClient || pto->fDisconnect || !pto->fSuccessfullyConnected ||
+        (pto->nVersion >= NOBLKS_VERSION_START && pto->nVersion < NOBLKS_VERSION_END))
+        return;
+    int& nInFlight = mapBlocksInFlightCount[pto->id];
+    if (nInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+        return;
+
+    // The last block of the header chain we have, usually our best block
+    int nStart = std::min(nBestHeight, pindexBestHeader->nHeight);
+    while (nStart > 0 && !mapBlockIndex.count(vBestHeaderChain[nStart]->GetBlockHash()))
+        nStart--;
+
+    // The peer we sync headers from has them all, the others only what they
+    // announced when they connected
+    int nEnd = std::min(pindexBestHeader->nHeight, nStart + BLOCK_DOWNLOAD_WINDOW);
+    if (pto->id != nodeHeadersSync)
+        nEnd = std::min(nEnd, pto->nStartingHeight);
+
+    int64 nNow = GetTime();
+    for (int nHeight = nStart + 1; nHeight <= nEnd && nInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER; nHeight++)
+    {
+        const uint256& hash = vBestHeaderChain[nHeight]->GetBlockHash();
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash) || mapBlocksInFlight.count(hash))
+            continue;
+        map<uint256, NodeId>::iterator mi = mapBlocksNotFound.find(hash);
+        if (mi != mapBlocksNotFound.end() && (*mi).second == pto->id)
+            continue;
+        mapBlocksInFlight[hash] = make_pair(pto->id, nNow);
+        nInFlight++;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+    }
+}
+
+void static ProcessNetBlock(CNode* pfrom, CBlock& block)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+    MarkBlockReceived(inv.hash);
+
+    CValidationState state;
+    if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
+        mapAlreadyAskedFor.erase(inv);
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+        if (nDoS > 0)
+            pfrom->Misbehaving(nDoS);
+}
+
+// Compact blocks waiting for the transactions asked for with getblocktxn
+struct CPartialBlock
+{
+    CBlock block;
+    std::vector<unsigned int> vMissing;
+    NodeId nodeFrom;
+    int64 nTime;
+};
+static map<uint256, CPartialBlock> mapPartialBlocks;
+static const unsigned int MAX_PARTIAL_BLOCKS = 16;
+
+void static ProcessCompactBlock(CNode* pfrom, CBlock& block)
+{
+    // A short ID that matched the wrong transaction shows up as a bad merkle
+    // root. Nobody is to blame for that, so just fetch the whole block.
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+    {
+        LogPrint("net", "compact block %s didn't rebuild, asking for the full block peer=%d\n", block.GetHash().ToString().c_str(), pfrom->id);
+        pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, block.GetHash())));
+        return;
+    }
+    LogPrintf("received block %s peer=%d (compact)\n", block.GetHash().ToString().c_str(), pfrom->id);
+    ProcessNetBlock(pfrom, block);
+}
+
+bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
+{
+    RandAddSeedPerfmon();
+    LogPrint("net2", "received: %s (%"PRIszu" bytes) peer=%d\n", strCommand.c_str(), vRecv.size(), pfrom->id);
+    if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
+    {
+        LogPrintf("dropmessagestest DROPPING RECV MESSAGE\n");
         return true;
     }
 
@@ -3965,11 +5383,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
                     // at a time so the setAddrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
                     uint64 hashAddr = addr.GetHash();
-                    uint256 hashRand = hashSalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
+                    uint256 hashRand = hashAddrRelaySalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
                     multimap<uint256, CNode*> mapMix;
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -4031,7 +5446,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 LogPrintf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
             if (!fAlreadyHave) {
-                if (!fImporting && !fReindex)
+                if (!fImporting && !fReindex && !(inv.type == MSG_BLOCK && mapBlocksInFlight.count(inv.hash)))
                     pfrom->AskFor(inv);
             } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
                 if (pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash])))
@@ -4073,6 +5488,23 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "notfound")
+    {
+        vector<CInv> vInv;
+        vRecv >> vInv;
+        if (vInv.size() > MAX_INV_SZ)
+        {
+            pfrom->Misbehaving(20);
+            return error("message notfound size() = %"PRIszu"", vInv.size());
+        }
+
+        // Blocks the download scheduler asked this peer for go to the others
+        BOOST_FOREACH(const CInv& inv, vInv)
+            if (inv.type == MSG_BLOCK)
+                MarkBlockNotFound(inv.hash, pfrom->id);
+    }
+
+
     else if (strCommand == "getblocks")
     {
         CBlockLocator locator;
@@ -4144,11 +5576,56 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers")
+    {
+        // we get CBlocks with an empty transaction list, see getheaders
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %"PRIszu"", vHeaders.size());
+        }
+
+        CBlockIndex* pindexLast = NULL;
+        BOOST_FOREACH(CBlock& header, vHeaders)
+        {
+            CValidationState state;
+            if (pindexLast && header.hashPrevBlock != pindexLast->GetBlockHash())
+            {
+                pfrom->Misbehaving(20);
+                return error("headers not in sequence peer=%d", pfrom->id);
+            }
+            if (!AcceptBlockHeader(header, state, &pindexLast))
+            {
+                int nDoS = 0;
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    pfrom->Misbehaving(nDoS);
+                if (pfrom->id == nodeHeadersSync)
+                    nodeHeadersSync = -1;
+                return error("invalid header %s peer=%d", header.GetHash().ToString().c_str(), pfrom->id);
+            }
+        }
+
+        if (pfrom->id == nodeHeadersSync)
+        {
+            LogPrintf("received %"PRIszu" headers up to %d peer=%d\n", vHeaders.size(), pindexLast ? pindexLast->nHeight : -1, pfrom->id);
+            // A full batch means there are more
+            if (vHeaders.size() == MAX_HEADERS_RESULTS)
+            {
+                nHeadersSyncTime = GetTime();
+                pfrom->PushMessage("getheaders", CBlockLocator(pindexLast), uint256(0));
+            }
+            else
+                nodeHeadersSync = -1;
+        }
+    }
+
+
     else if (strCommand == "tx" || strCommand == "dstx")
     {
         vector<uint256> vWorkQueue;
         vector<uint256> vEraseQueue;
-        CDataStream vMsg(vRecv);
         CTransaction tx;
 
         //masternode signed transaction
@@ -4163,25 +5640,26 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             //these allow masternodes to publish a limited amount of free transactions
             vRecv >> tx >> vin >> vchSig >> sigTime;
 
-            BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes) {
-                if(mn.vin == vin) {
-                    if(!mn.allowFreeTx){
-                        //multiple peers can send us a valid masternode transaction
-                        return true;
-                    }
-
-                    std::string strMessage = tx.GetHash().ToString() + boost::lexical_cast<std::string>(sigTime); 
+            CMasterNodePtr pmn = masternodeList.Get(vin);
+            if(pmn) {
+                if(!pmn->allowFreeTx){
+                    //multiple peers can send us a valid masternode transaction
+                    return true;
+                }
 
-                    std::string errorMessage = "";
-                    if(!darkSendSigner.VerifyMessage(mn.pubkey2, vchSig, strMessage, errorMessage)){
-                        LogPrintf("dstx: Got bad masternode address signature %s \n", vin.ToString().c_str());
-                        //pfrom->Misbehaving(20);
-                        return false;
-                    }
+                std::string strMessage = tx.GetHash().ToString() + boost::lexical_cast<std::string>(sigTime); 
 
-                    allowFree = true;
-                    mn.allowFreeTx = false;
+                std::string errorMessage = "";
+                if(!darkSendSigner.VerifyMessage(pmn->pubkey2, vchSig, strMessage, errorMessage)){
+                    LogPrintf("dstx: Got bad masternode address signature %s \n", vin.ToString().c_str());
+                    //pfrom->Misbehaving(20);
+                    return false;
                 }
+
+                //another peer's copy of the transaction may have used it up meanwhile
+                if(!masternodeList.TakeFreeTx(vin))
+                    return true;
+                allowFree = true;
             }
         }
 
@@ -4269,21 +5747,138 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         LogPrintf("received block %s peer=%d\n", block.GetHash().ToString().c_str(), pfrom->id);
         // block.print();
 
-        CInv inv(MSG_BLOCK, block.GetHash());
+        ProcessNetBlock(pfrom, block);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hash = cmpctblock.header.GetHash();
+
+        LogPrint("net", "received compact block %s (%"PRIszu" txs) peer=%d\n", hash.ToString().c_str(), cmpctblock.vShortTxIDs.size() + 1, pfrom->id);
+
+        CInv inv(MSG_BLOCK, hash);
         pfrom->AddInventoryKnown(inv);
+        if (AlreadyHave(inv) || mapPartialBlocks.count(hash))
+            return true;
+
+        // Don't go through the memory pool for a header that isn't even valid
+        if (cmpctblock.vShortTxIDs.size() > MAX_BLOCK_SIZE / 60 || !CheckProofOfWork(hash, cmpctblock.header.nBits))
+        {
+            pfrom->Misbehaving(20);
+            return error("message cmpctblock : invalid compact block %s", hash.ToString().c_str());
+        }
 
+        // Only reconstruct blocks that connect to one we have, and whose header
+        // fits there; anything else goes through the normal block path
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(cmpctblock.header.hashPrevBlock);
+        if (mi == mapBlockIndex.end())
+        {
+            LogPrint("net", "compact block %s has unknown parent, asking peer=%d for the full block\n", hash.ToString().c_str(), pfrom->id);
+            pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+            return true;
+        }
         CValidationState state;
-        if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
-            mapAlreadyAskedFor.erase(inv);
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-            if (nDoS > 0)
+        if (!ContextualCheckBlockHeader(cmpctblock.header, state, (*mi).second))
+        {
+            int nDoS = 0;
+            if (state.IsInvalid(nDoS) && nDoS > 0)
                 pfrom->Misbehaving(nDoS);
+            return error("message cmpctblock : header of compact block %s rejected", hash.ToString().c_str());
+        }
+
+        CBlock block;
+        vector<unsigned int> vMissing;
+        cmpctblock.FillBlock(mempool, block, vMissing);
+        if (vMissing.empty())
+            ProcessCompactBlock(pfrom, block);
+        else
+        {
+            // Forget the blocks whose transactions never came
+            int64 nNow = GetTime();
+            for (map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.begin(); mi != mapPartialBlocks.end(); )
+            {
+                if ((*mi).second.nTime < nNow - 60)
+                    mapPartialBlocks.erase(mi++);
+                else
+                    mi++;
+            }
+
+            if (mapPartialBlocks.size() >= MAX_PARTIAL_BLOCKS)
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+            else
+            {
+                LogPrint("net", "compact block %s missing %"PRIszu" txs, asking peer=%d\n", hash.ToString().c_str(), vMissing.size(), pfrom->id);
+                CPartialBlock& partial = mapPartialBlocks[hash];
+                partial.block = block;
+                partial.vMissing = vMissing;
+                partial.nodeFrom = pfrom->id;
+                partial.nTime = nNow;
+                pfrom->PushMessage("getblocktxn", CBlockTransactionsRequest(hash, vMissing));
+            }
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end())
+            return true;
+        CBlock block;
+        if (!block.ReadFromDisk((*mi).second))
+            return error("message getblocktxn : failed to read block %s", req.blockhash.ToString().c_str());
+
+        CBlockTransactions resp;
+        resp.blockhash = req.blockhash;
+        resp.vtx.reserve(req.vIndexes.size());
+        BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                pfrom->Misbehaving(100);
+                return error("message getblocktxn : index %u out of range", nIndex);
+            }
+            resp.vtx.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.find(resp.blockhash);
+        if (mi == mapPartialBlocks.end() || (*mi).second.nodeFrom != pfrom->id)
+            return true;
+
+        CBlock block = (*mi).second.block;
+        vector<unsigned int> vMissing = (*mi).second.vMissing;
+        mapPartialBlocks.erase(mi);
+        if (resp.vtx.size() != vMissing.size())
+        {
+            pfrom->Misbehaving(20);
+            return error("message blocktxn : got %"PRIszu" txs, asked for %"PRIszu"", resp.vtx.size(), vMissing.size());
+        }
+        for (unsigned int i = 0; i < vMissing.size(); i++)
+            block.vtx[vMissing[i]] = resp.vtx[i];
+
+        ProcessCompactBlock(pfrom, block);
     }
 
     else if (strCommand == "getaddr")
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrKnown);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -4457,6 +6052,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
+// Messages that only touch per-peer state, the address manager, the relay
+// memory and blocks already on disk are handled without cs_main, so the
+// message handler threads serve them for many peers at once. Everything that
+// reads or changes the chain, the memory pool or the masternode list stays
+// serialized behind cs_main.
+static bool MessageNeedsMainLock(const string& strCommand)
+{
+    return !(strCommand == "verack" || strCommand == "misbehave" || strCommand == "ping" ||
+             strCommand == "addr" || strCommand == "getaddr" || strCommand == "getdata");
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -4524,7 +6130,7 @@ bool ProcessMessages(CNode* pfrom)
 
         // Checksum
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
+        uint256 hash = msg.GetChecksumHash();
         unsigned int nChecksum = 0;
         memcpy(&nChecksum, &hash, sizeof(nChecksum));
         if (nChecksum != hdr.nChecksum)
@@ -4538,10 +6144,15 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
+            if (MessageNeedsMainLock(strCommand))
             {
+                // Recover masternode message signers before queueing up for cs_main
+                PreVerifyMessageMasternode(strCommand, vRecv);
                 LOCK(cs_main);
                 fRet = ProcessMessage(pfrom, strCommand, vRecv);
             }
+            else
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
             boost::this_thread::interruption_point();
         }
         catch (std::ios_base::failure& e)
@@ -4578,7 +6189,11 @@ bool ProcessMessages(CNode* pfrom)
 
     // In case the connection got shut down, its receive buffer was wiped
     if (!pfrom->fDisconnect)
+    {
+        for (std::deque<CNetMessage>::iterator mi = pfrom->vRecvMsg.begin(); mi != it; mi++)
+            (*mi).Recycle();
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
 
     return fOk;
 }
@@ -4602,15 +6217,26 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 pto->PushMessage("ping");
         }
 
-        // Start block sync
+        // Start block sync: headers come from one peer at a time, the blocks
+        // are then fetched from all of them below
         if (!pto->fAskedForBlocks && !fImporting && !fReindex && !pto->fClient && !pto->fOneShot &&
             !pto->fDisconnect && pto->fSuccessfullyConnected &&
             (pto->nStartingHeight > (nBestHeight - 144)) &&
-            (pto->nVersion < NOBLKS_VERSION_START || pto->nVersion >= NOBLKS_VERSION_END)) {
+            (pto->nVersion < NOBLKS_VERSION_START || pto->nVersion >= NOBLKS_VERSION_END) &&
+            (nodeHeadersSync == -1 || GetTime() - nHeadersSyncTime > HEADERS_SYNC_TIMEOUT)) {
             nAskedForBlocks++;
             pto->fAskedForBlocks = true;
-            if (pto->PushGetBlocks(pindexBest, uint256(0)))
-                LogPrintf("send initial getblocks peer=%d\n", pto->id);
+            nodeHeadersSync = pto->id;
+            nHeadersSyncTime = GetTime();
+            pto->PushMessage("getheaders", CBlockLocator(pindexBestHeader ? pindexBestHeader : pindexBest), uint256(0));
+            LogPrintf("send initial getheaders peer=%d\n", pto->id);
+        }
+
+        static int64 nLastBlocksInFlightCheck;
+        if (GetTime() != nLastBlocksInFlightCheck)
+        {
+            nLastBlocksInFlightCheck = GetTime();
+            CheckBlocksInFlight();
         }
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -4631,7 +6257,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
+                    {
+                        LOCK(pnode->cs_addrKnown);
                         pnode->setAddrKnown.clear();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -4651,24 +6280,20 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (fSendTrickle)
         {
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                LOCK(pto->cs_addrKnown);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddr.push_back(addr);
                 }
+                pto->vAddrToSend.clear();
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
+            // receiver rejects addr messages larger than 1000
+            for (unsigned int i = 0; i < vAddr.size(); i += 1000)
+                pto->PushMessage("addr", vector<CAddress>(vAddr.begin() + i, vAddr.begin() + min(vAddr.size(), (size_t)i + 1000)));
         }
 
 
@@ -4690,10 +6315,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 if (inv.type == MSG_TX && !fSendTrickle)
                 {
                     // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
+                    uint256 hashRand = inv.hash ^ hashTrickleSalt;
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
                     bool fTrickleWait = ((hashRand & 3) != 0);
 
@@ -4742,7 +6364,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 if (fDebugNet)
                     LogPrintf("sending getdata: %s peer=%d\n", inv.ToString().c_str(), pto->id);
-                vGetData.push_back(inv);
+                // New blocks come as compact blocks from the peers that can send them. While
+                // catching up our memory pool wouldn't have their transactions anyway.
+                if (inv.type == MSG_BLOCK && (nLocalServices & NODE_COMPACT_BLOCKS) && (pto->nServices & NODE_COMPACT_BLOCKS) && !IsInitialBlockDownload())
+                    vGetData.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                else
+                    vGetData.push_back(inv);
                 if (vGetData.size() >= 1000)
                 {
                     pto->PushMessage("getdata", vGetData);
@@ -4751,6 +6378,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
             pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
+        if (!fImporting && !fReindex)
+            FindBlocksToDownload(pto, vGetData);
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
@@ -4812,58 +6441,161 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
+uint64 nLastBlockTx = 0;
+uint64 nLastBlockSize = 0;
+
+// We want to sort transactions by priority, so:
+typedef std::pair<double, CTxMemPool::txiter> TxPriority;
+class TxPriorityCompare
 {
 public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
-
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
-    }
-
-    void print() const
+    bool operator()(const TxPriority& a, const TxPriority& b)
     {
-        LogPrintf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().c_str(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            LogPrintf("   setDependsOn %s\n", hash.ToString().c_str());
+        return a.first > b.first;
     }
 };
 
+// Add a memory pool transaction to the block being assembled, if it fits and connects to view
+static bool AddToBlock(const CTxMemPoolEntry& entry, CBlockTemplate* pblocktemplate, CCoinsViewCache& view, int nHeight,
+                       unsigned int nBlockMaxSize, uint64& nBlockSize, int& nBlockSigOps, int64& nFees)
+{
+    const CTransaction& tx = entry.GetTx();
+    if (tx.IsCoinBase() || !tx.IsFinal(nHeight))
+        return false;
+
+    // Size limits
+    if (nBlockSize + entry.GetTxSize() >= nBlockMaxSize)
+        return false;
 
-uint64 nLastBlockTx = 0;
-uint64 nLastBlockSize = 0;
+    // Legacy limits on sigOps:
+    unsigned int nTxSigOps = tx.GetLegacySigOpCount();
+    if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
 
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
-class TxPriorityCompare
+    if (!tx.HaveInputs(view))
+        return false;
+
+    int64 nTxFees = tx.GetValueIn(view)-tx.GetValueOut();
+
+    nTxSigOps += tx.GetP2SHSigOpCount(view);
+    if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+
+    CValidationState state;
+    if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH))
+        return false;
+
+    CTxUndo txundo;
+    tx.UpdateCoins(state, view, txundo, nHeight, tx.GetHash());
+
+    pblocktemplate->block.vtx.push_back(tx);
+    pblocktemplate->vTxFees.push_back(nTxFees);
+    pblocktemplate->vTxSigOps.push_back(nTxSigOps);
+    nBlockSize += entry.GetTxSize();
+    nBlockSigOps += nTxSigOps;
+    nFees += nTxFees;
+    return true;
+}
+
+
+// Split the block value between the miner and, if the coinbase pays one, the masternode
+static void SetCoinbaseValue(CBlockTemplate* pblocktemplate, CBlockIndex* pindexPrev, int64 nFees)
 {
-    bool byFee;
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    CTransaction& txCoinbase = pblocktemplate->block.vtx[0];
+    int64 blockValue = GetBlockValue(pindexPrev->nBits, pindexPrev->nHeight, nFees);
+    int64 masternodePayment = GetMasternodePayment(pindexPrev->nHeight+1, blockValue);
+
+    //create masternode payment
+    if(txCoinbase.vout.size() > 1){
+        txCoinbase.vout.back().nValue = masternodePayment;
+        blockValue -= masternodePayment;
+    }
+    txCoinbase.vout[0].nValue = blockValue;
+
+    pblocktemplate->vTxFees[0] = -nFees;
+}
+
+// Largest block you're willing to create, and the size to fill with free transactions
+static void GetBlockSizeLimits(unsigned int& nBlockMaxSize, unsigned int& nBlockMinSize)
+{
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    nBlockMinSize = GetArg("-blockminsize", 0);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+}
+
+// Add the package of it: the transaction together with its ancestors that aren't in the
+// block yet, parents first. Returns the number of transactions added.
+static unsigned int AddPackageToBlock(CTxMemPool::txiter it, CBlockTemplate* pblocktemplate, CCoinsViewCache& view,
+                                      int nHeight, unsigned int nBlockMaxSize, unsigned int nBlockMinSize,
+                                      uint64& nBlockSize, int& nBlockSigOps, int64& nFees,
+                                      CTxMemPool::setEntries& setInBlock, CTxMemPool::setEntries& setFailed,
+                                      bool fPrintPriority)
+{
+    if (setInBlock.count(it) || setFailed.count(it))
+        return 0;
+
+    CTxMemPool::setEntries setAncestors;
+    mempool.CalculateAncestors(it, setAncestors);
+    vector<CTxMemPool::txiter> vPackage;
+    uint64 nPackageSize = it->GetTxSize();
+    int64 nPackageFees = it->GetFee();
+    BOOST_FOREACH(CTxMemPool::txiter itAncestor, setAncestors)
     {
-        if (byFee)
+        if (setInBlock.count(itAncestor))
+            continue;
+        if (setFailed.count(itAncestor))
         {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+            setFailed.insert(it);
+            return 0;
         }
-        else
+        vPackage.push_back(itAncestor);
+        nPackageSize += itAncestor->GetTxSize();
+        nPackageFees += itAncestor->GetFee();
+    }
+    vPackage.push_back(it);
+
+    if (nBlockSize + nPackageSize >= nBlockMaxSize)
+        return 0;
+
+    // Skip free transactions if we're past the minimum block size:
+    double dFeePerKb = (double)nPackageFees * 1000 / nPackageSize;
+    if ((dFeePerKb < CTransaction::nMinTxFee) && (nBlockSize + nPackageSize >= nBlockMinSize))
+        return 0;
+
+    unsigned int nAdded = 0;
+    std::sort(vPackage.begin(), vPackage.end(), CompareTxIterByAncestorCount());
+    BOOST_FOREACH(CTxMemPool::txiter itPackage, vPackage)
+    {
+        if (!AddToBlock(*itPackage, pblocktemplate, view, nHeight, nBlockMaxSize, nBlockSize, nBlockSigOps, nFees))
         {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            // whatever depends on it can't go in either
+            setFailed.insert(itPackage);
+            break;
         }
+        setInBlock.insert(itPackage);
+        ++nAdded;
+        if (fPrintPriority)
+            LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
+                   itPackage->GetPriority(nHeight - 1), itPackage->GetFeeRate(), itPackage->GetTx().GetHash().ToString().c_str());
     }
-};
+    return nAdded;
+}
 
+// Check that the block would connect on top of pindexPrev, without its proof of work
+static bool TestBlockTemplate(CBlock& block, CBlockIndex* pindexPrev)
+{
+    CBlockIndex indexDummy(block);
+    indexDummy.pprev = pindexPrev;
+    indexDummy.nHeight = pindexPrev->nHeight + 1;
+    CCoinsViewCache viewNew(*pcoinsTip, true);
+    CValidationState state;
+    return block.ConnectBlock(state, &indexDummy, viewNew, true);
+}
 
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
 {
@@ -4906,9 +6638,9 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
             //spork
             if(!masternodePayments.GetBlockPayee(pindexPrev->nHeight+1, pblock->payee)){
                 //no masternode detected
-                int winningNode = GetCurrentMasterNode(1);
-                if(winningNode >= 0){
-                    pblock->payee.SetDestination(darkSendMasterNodes[winningNode].pubkey.GetID());
+                CMasterNode mnWinner;
+                if(masternodeList.GetCurrentMasterNode(mnWinner, 1)){
+                    pblock->payee.SetDestination(mnWinner.pubkey.GetID());
                 } else { 
                     LogPrintf("CreateNewBlock: Failed to detect masternode to pay\n");
                     hasPayment = false;
@@ -4937,213 +6669,70 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
 
         // end masternode payments
 
-        // Largest block you're willing to create:
-        unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-        // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-        nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+        unsigned int nBlockMaxSize, nBlockMinSize;
+        GetBlockSizeLimits(nBlockMaxSize, nBlockMinSize);
 
         // How much of the block should be dedicated to high-priority transactions,
         // included regardless of the fees they pay
         unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
         nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
 
-        // Minimum block size you want to create; block will be filled with free transactions
-        // until there are no more or the block reaches this size:
-        unsigned int nBlockMinSize = GetArg("-blockminsize", 0);
-        nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
         // Collect memory pool transactions into the block
         {
-            // Priority order to process transactions
-            list<COrphan> vOrphan; // list memory doesn't move
-            map<uint256, vector<COrphan*> > mapDependers;
             bool fPrintPriority = GetBoolArg("-printpriority");
-
-            // This vector will be sorted into a priority queue:
-            vector<TxPriority> vecPriority;
-            vecPriority.reserve(mempool.mapTx.size());
-            for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
-            {
-                CTransaction& tx = (*mi).second;
-                if (tx.IsCoinBase() || !tx.IsFinal())
-                    continue;
-
-                COrphan* porphan = NULL;
-                double dPriority = 0;
-                int64 nTotalIn = 0;
-                bool fMissingInputs = false;
-                BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                {
-                    // Read prev transaction
-                    if (!view.HaveCoins(txin.prevout.hash))
-                    {
-                        // This should never happen; all transactions in the memory
-                        // pool should connect to either transactions in the chain
-                        // or other transactions in the memory pool.
-                        if (!mempool.mapTx.count(txin.prevout.hash))
-                        {
-                            LogPrintf("ERROR: mempool transaction missing input %s\n", txin.prevout.hash.ToString().c_str());
-                            if (!fTestNet && fDebug) assert("mempool transaction missing input" == 0);
-                            fMissingInputs = true;
-                            if (porphan)
-                                vOrphan.pop_back();
-                            break;
-                        }
-
-                        // Has to wait for dependencies
-                        if (!porphan)
-                        {
-                            // Use list for automatic deletion
-                            vOrphan.push_back(COrphan(&tx));
-                            porphan = &vOrphan.back();
-                        }
-                        mapDependers[txin.prevout.hash].push_back(porphan);
-                        porphan->setDependsOn.insert(txin.prevout.hash);
-                        nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                        continue;
-                    }
-                    const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-                    int64 nValueIn = coins.vout[txin.prevout.n].nValue;
-                    nTotalIn += nValueIn;
-
-                    int nConf = pindexPrev->nHeight - coins.nHeight + 1;
-
-                    dPriority += (double)nValueIn * nConf;
-                }
-                if (fMissingInputs) continue;
-
-                // Priority is sum(valuein * age) / txsize
-                unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-                dPriority /= nTxSize;
-
-                // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-                // client code rounds up the size to the nearest 1K. That's good, because it gives an
-                // incentive to create smaller transactions.
-                double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-                if (porphan)
-                {
-                    porphan->dPriority = dPriority;
-                    porphan->dFeePerKb = dFeePerKb;
-                }
-                else
-                    vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-            }
-
-            // Collect transactions into block
+            int nHeight = pindexPrev->nHeight + 1;
             uint64 nBlockSize = 1000;
             uint64 nBlockTx = 0;
             int nBlockSigOps = 100;
-            bool fSortedByFee = (nBlockPrioritySize <= 0);
+            CTxMemPool::setEntries setInBlock;
+            CTxMemPool::setEntries setFailed;
 
-            TxPriorityCompare comparer(fSortedByFee);
-            std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-            // Create coinbase tx
-            CTransaction txMerged;
-
-            while (!vecPriority.empty())
+            // Fill the priority area first. Priority keeps growing while a transaction waits, so it
+            // can't be indexed; only the transactions that qualify and don't wait for another pool
+            // transaction are sorted. Their children are picked up by fee below.
+            if (nBlockPrioritySize > 0)
             {
-                // Take highest priority transaction off the priority queue:
-                double dPriority = vecPriority.front().get<0>();
-                double dFeePerKb = vecPriority.front().get<1>();
-                CTransaction& tx = *(vecPriority.front().get<2>());
-
-                std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                vecPriority.pop_back();
-
-                // Size limits
-                unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-                if (nBlockSize + nTxSize >= nBlockMaxSize)
-                    continue;
-
-                // Legacy limits on sigOps:
-                unsigned int nTxSigOps = tx.GetLegacySigOpCount();
-                if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                    continue;
-
-                // Skip free transactions if we're past the minimum block size:
-                if (fSortedByFee && (dFeePerKb < CTransaction::nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                    continue;
-
-                // Prioritize by fee once past the priority size or we run out of high-priority
-                // transactions:
-                if (!fSortedByFee &&
-                    ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 576 / 250)))
+                vector<TxPriority> vecPriority;
+                for (CTxMemPool::txiter mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
                 {
-                    fSortedByFee = true;
-                    comparer = TxPriorityCompare(fSortedByFee);
-                    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                    double dPriority = mi->GetPriority(pindexPrev->nHeight);
+                    if (mi->GetCountWithAncestors() == 1 && dPriority >= COIN * 576 / 250)
+                        vecPriority.push_back(TxPriority(dPriority, mi));
                 }
+                std::sort(vecPriority.begin(), vecPriority.end(), TxPriorityCompare());
 
-                if (!tx.HaveInputs(view))
-                    continue;
-
-                int64 nTxFees = tx.GetValueIn(view)-tx.GetValueOut();
-
-                nTxSigOps += tx.GetP2SHSigOpCount(view);
-                if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                    continue;
-
-                CValidationState state;
-                if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH))
-                    continue;
-
-                CTxUndo txundo;
-                uint256 hash = tx.GetHash();
-                tx.UpdateCoins(state, view, txundo, pindexPrev->nHeight+1, hash);
-
-                // Added
-                pblock->vtx.push_back(tx);
-
-                //* END MERGE *//
-                pblocktemplate->vTxFees.push_back(nTxFees);
-                pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-                nBlockSize += nTxSize;
-                ++nBlockTx;
-                nBlockSigOps += nTxSigOps;
-                nFees += nTxFees;
-
-                if (fPrintPriority)
-                {
-                    LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
-                           dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
-                }
-
-                // Add transactions that depend on this one to the priority queue
-                if (mapDependers.count(hash))
+                BOOST_FOREACH(const TxPriority& item, vecPriority)
                 {
-                    BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+                    CTxMemPool::txiter mi = item.second;
+                    if (nBlockSize + mi->GetTxSize() >= nBlockPrioritySize)
+                        break;
+                    if (!AddToBlock(*mi, pblocktemplate.get(), view, nHeight, nBlockMaxSize, nBlockSize, nBlockSigOps, nFees))
                     {
-                        if (!porphan->setDependsOn.empty())
-                        {
-                            porphan->setDependsOn.erase(hash);
-                            if (porphan->setDependsOn.empty())
-                            {
-                                vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                                std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                            }
-                        }
+                        setFailed.insert(mi);
+                        continue;
                     }
+                    setInBlock.insert(mi);
+                    ++nBlockTx;
+                    if (fPrintPriority)
+                        LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
+                               item.first, mi->GetFeeRate(), mi->GetTx().GetHash().ToString().c_str());
                 }
             }
 
+            // Then take transactions by the fee rate of their package: the transaction together
+            // with its ancestors that aren't in the block yet, added parents first.
+            typedef indexed_transaction_set::index<ancestor_score>::type::reverse_iterator ancestor_iter;
+            const indexed_transaction_set::index<ancestor_score>::type& byAncestorScore = mempool.mapTx.get<ancestor_score>();
+            for (ancestor_iter mi = byAncestorScore.rbegin(); mi != byAncestorScore.rend(); ++mi)
+                nBlockTx += AddPackageToBlock(mempool.mapTx.iterator_to(*mi), pblocktemplate.get(), view, nHeight,
+                                              nBlockMaxSize, nBlockMinSize, nBlockSize, nBlockSigOps, nFees,
+                                              setInBlock, setFailed, fPrintPriority);
+
             nLastBlockTx = nBlockTx;
             nLastBlockSize = nBlockSize;
             LogPrintf("CreateNewBlock(): total size %"PRI64u"\n", nBlockSize);
 
-            int64 blockValue = GetBlockValue(pindexPrev->nBits, pindexPrev->nHeight, nFees);
-            int64 masternodePayment = GetMasternodePayment(pindexPrev->nHeight+1, blockValue);
-            
-            //create masternode payment
-            if(payments > 1){
-                pblock->vtx[0].vout[payments-1].nValue = masternodePayment;
-                blockValue -= masternodePayment;
-            }
-            pblock->vtx[0].vout[0].nValue = blockValue;
-
-            pblocktemplate->vTxFees[0] = -nFees;
+            SetCoinbaseValue(pblocktemplate.get(), pindexPrev, nFees);
 
             // Fill in header
             pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
@@ -5154,12 +6743,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
             pblocktemplate->vTxSigOps[0] = pblock->vtx[0].GetLegacySigOpCount();
             
 
-            CBlockIndex indexDummy(*pblock);
-            indexDummy.pprev = pindexPrev;
-            indexDummy.nHeight = pindexPrev->nHeight + 1;
-            CCoinsViewCache viewNew(*pcoinsTip, true);
-            CValidationState state;
-            if (!pblock->ConnectBlock(state, &indexDummy, viewNew, true))
+            if (!TestBlockTemplate(*pblock, pindexPrev))
                 throw std::runtime_error("CreateNewBlock() : ConnectBlock failed");
         }
     }
@@ -5176,7 +6760,163 @@ CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey)
         return NULL;
 
     CScript scriptPubKey = CScript() << pubkey << OP_CHECKSIG;
-    return CreateNewBlock(scriptPubKey);
+    return blockTemplateCache.Get(scriptPubKey);
+}
+
+CBlockTemplateCache blockTemplateCache;
+boost::mutex csBestBlock;
+boost::condition_variable cvBlockChange;
+
+CBlockTemplateCache::CBlockTemplateCache() : ptemplate(NULL), pindexPrev(NULL), nTimeCreated(0), nTimeUpdated(0),
+    nTransactionsUpdatedLast(0), nSequenceLast(0), nVersion(0) { }
+
+CBlockTemplateCache::~CBlockTemplateCache()
+{
+    delete ptemplate;
+}
+
+void CBlockTemplateCache::Clear()
+{
+    LOCK(cs_main);
+    delete ptemplate;
+    ptemplate = NULL;
+    pindexPrev = NULL;
+    nVersion++;
+}
+
+bool CBlockTemplateCache::Update(int64 nMinInterval)
+{
+    LOCK2(cs_main, mempool.cs);
+    int64 nNow = GetTime();
+
+    // A new best block needs a new template. Otherwise the template is patched up with what
+    // entered the pool since, and only rebuilt now and then so that the best paying
+    // transactions make it back to the front.
+    if (ptemplate && pindexPrev == pindexBest)
+    {
+        if (nTransactionsUpdatedLast == nTransactionsUpdated || nNow - nTimeUpdated < nMinInterval)
+            return true;
+
+        if (nNow - nTimeCreated < 60)
+        {
+            if (UpdateIncremental())
+            {
+                nTimeUpdated = nNow;
+                nVersion++;
+                return true;
+            }
+            LogPrintf("CBlockTemplateCache::Update() : patched template failed to connect, rebuilding\n");
+        }
+    }
+
+    unsigned int nTransactionsUpdatedNew = nTransactionsUpdated;
+    uint64 nSequenceNew = mempool.GetSequence();
+    CBlockTemplate* ptemplateNew = CreateNewBlock(CScript() << OP_TRUE);
+    if (!ptemplateNew)
+        return false;
+    delete ptemplate;
+    ptemplate = ptemplateNew;
+    pindexPrev = pindexBest;
+    nTimeCreated = nTimeUpdated = nNow;
+    nTransactionsUpdatedLast = nTransactionsUpdatedNew;
+    nSequenceLast = nSequenceNew;
+    nVersion++;
+    return true;
+}
+
+bool CBlockTemplateCache::UpdateIncremental()
+{
+    CBlock& block = ptemplate->block;
+    CCoinsViewCache view(*pcoinsTip, true);
+    int nHeight = pindexPrev->nHeight + 1;
+
+    unsigned int nBlockMaxSize, nBlockMinSize;
+    GetBlockSizeLimits(nBlockMaxSize, nBlockMinSize);
+
+    // Keep the transactions that are still in the pool, minus the ones that spend a
+    // transaction that has gone. They were checked when they went in, so only their
+    // coins have to be replayed.
+    std::vector<CTransaction> vtxOld(block.vtx.begin() + 1, block.vtx.end());
+    std::vector<int64_t> vTxFeesOld(ptemplate->vTxFees);
+    std::vector<int64_t> vTxSigOpsOld(ptemplate->vTxSigOps);
+    block.vtx.resize(1);
+    ptemplate->vTxFees.resize(1);
+    ptemplate->vTxSigOps.resize(1);
+
+    uint64 nBlockSize = 1000;
+    int nBlockSigOps = 100;
+    int64 nFees = 0;
+    set<uint256> setDropped;
+    for (unsigned int i = 0; i < vtxOld.size(); i++)
+    {
+        const CTransaction& tx = vtxOld[i];
+        uint256 hash = tx.GetHash();
+        bool fKeep = mempool.exists(hash);
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (setDropped.count(txin.prevout.hash))
+                fKeep = false;
+        if (!fKeep || !tx.HaveInputs(view))
+        {
+            setDropped.insert(hash);
+            continue;
+        }
+
+        CValidationState state;
+        CTxUndo txundo;
+        tx.UpdateCoins(state, view, txundo, nHeight, hash);
+
+        block.vtx.push_back(tx);
+        ptemplate->vTxFees.push_back(vTxFeesOld[i + 1]);
+        ptemplate->vTxSigOps.push_back(vTxSigOpsOld[i + 1]);
+        nBlockSize += ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        nBlockSigOps += vTxSigOpsOld[i + 1];
+        nFees += vTxFeesOld[i + 1];
+    }
+
+    // Append what entered the pool since the last update, best ancestor fee rate first and
+    // each together with its ancestors that aren't in the block, as CreateNewBlock does
+    CTxMemPool::setEntries setInBlock;
+    CTxMemPool::setEntries setFailed;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        setInBlock.insert(mempool.mapTx.find(block.vtx[i].GetHash()));
+
+    vector<CTxMemPool::txiter> vNew;
+    typedef indexed_transaction_set::index<entry_sequence>::type::const_iterator sequence_iter;
+    const indexed_transaction_set::index<entry_sequence>::type& bySequence = mempool.mapTx.get<entry_sequence>();
+    for (sequence_iter mi = bySequence.upper_bound(nSequenceLast); mi != bySequence.end(); ++mi)
+        vNew.push_back(mempool.mapTx.iterator_to(*mi));
+    std::sort(vNew.begin(), vNew.end(), CompareTxIterByAncestorScore());
+
+    bool fPrintPriority = GetBoolArg("-printpriority");
+    for (vector<CTxMemPool::txiter>::reverse_iterator it = vNew.rbegin(); it != vNew.rend(); ++it)
+        AddPackageToBlock(*it, ptemplate, view, nHeight, nBlockMaxSize, nBlockMinSize, nBlockSize, nBlockSigOps, nFees,
+                          setInBlock, setFailed, fPrintPriority);
+
+    nLastBlockTx = block.vtx.size() - 1;
+    nLastBlockSize = nBlockSize;
+    if (fDebug)
+        LogPrintf("CBlockTemplateCache::UpdateIncremental() : dropped %"PRIszu", total size %"PRI64u"\n",
+                  setDropped.size(), nBlockSize);
+
+    SetCoinbaseValue(ptemplate, pindexPrev, nFees);
+    nTransactionsUpdatedLast = nTransactionsUpdated;
+    nSequenceLast = mempool.GetSequence();
+
+    // The same check as CreateNewBlock; a failure makes Update() rebuild from scratch
+    return TestBlockTemplate(block, pindexPrev);
+}
+
+CBlockTemplate* CBlockTemplateCache::Get(const CScript& scriptPubKeyIn, int64 nMinInterval)
+{
+    LOCK(cs_main);
+    if (!Update(nMinInterval))
+        return NULL;
+
+    CBlockTemplate* pblocktemplate = new CBlockTemplate(*ptemplate);
+    CTransaction& txCoinbase = pblocktemplate->block.vtx[0];
+    txCoinbase.vout[0].scriptPubKey = scriptPubKeyIn;
+    pblocktemplate->vTxSigOps[0] = txCoinbase.GetLegacySigOpCount();
+    return pblocktemplate;
 }
 
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
@@ -5310,44 +7050,42 @@ void static DarkCoinMiner(CWallet *pwallet)
         LogPrintf("Running DarkCoinMiner with %"PRIszu" transactions in block (%u bytes)\n", pblock->vtx.size(),
                ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
 
-        //
-        // Pre-build hash buffers
-        //
-        char pmidstatebuf[32+16]; char* pmidstate = alignup<16>(pmidstatebuf);
-        char pdatabuf[128+16];    char* pdata     = alignup<16>(pdatabuf);
-        char phash1buf[64+16];    char* phash1    = alignup<16>(phash1buf);
-
-        FormatHashBuffers(pblock, pmidstate, pdata, phash1);
-
-        unsigned int& nBlockTime = *(unsigned int*)(pdata + 64 + 4);
-        unsigned int& nBlockBits = *(unsigned int*)(pdata + 64 + 8);
-        //unsigned int& nBlockNonce = *(unsigned int*)(pdata + 64 + 12);
-
-
         //
         // Search
         //
         int64 nStart = GetTime();
         uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        // Most nonces already fail on the top 64 bits of the target
+        uint64 nTargetHigh = hashTarget.Get64(3);
+        // Nonces are hashed X11_MAX_LANES at a time
+        CX11NonceScanner scanner((const unsigned char*)BEGIN(pblock->nVersion));
         loop
         {
             unsigned int nHashesDone = 0;
 
-            uint256 thash;
+            uint256 hashes[X11_MAX_LANES];
+            bool fFound = false;
             loop
             {
-                thash = pblock->GetHash();
-                if (thash <= hashTarget)
+                scanner.Hash(pblock->nNonce, X11_MAX_LANES, hashes);
+                for (unsigned int i = 0; i < X11_MAX_LANES; i++)
                 {
+                    if (hashes[i].Get64(3) > nTargetHigh || hashes[i] > hashTarget)
+                        continue;
+
                     // Found a solution
+                    pblock->nNonce += i;
                     SetThreadPriority(THREAD_PRIORITY_NORMAL);
                     CheckWork(pblock, *pwallet, reservekey);
                     SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                    fFound = true;
                     break;
                 }
-                pblock->nNonce += 1;
-                nHashesDone += 1;
-                if ((pblock->nNonce & 0xFF) == 0)
+                if (fFound)
+                    break;
+                pblock->nNonce += X11_MAX_LANES;
+                nHashesDone += X11_MAX_LANES;
+                if ((pblock->nNonce & 0xFF) < X11_MAX_LANES)
                     break;
             }
 
@@ -5393,13 +7131,13 @@ void static DarkCoinMiner(CWallet *pwallet)
 
             // Update nTime every few seconds
             pblock->UpdateTime(pindexPrev);
-            nBlockTime = ByteReverse(pblock->nTime);
             if (fTestNet)
             {
                 // Changing pblock->nTime can change work required on testnet:
-                nBlockBits = ByteReverse(pblock->nBits);
                 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+                nTargetHigh = hashTarget.Get64(3);
             }
+            scanner = CX11NonceScanner((const unsigned char*)BEGIN(pblock->nVersion));
         }
     } }
     catch (boost::thread_interrupted)
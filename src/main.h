@@ -17,6 +17,10 @@
 #include <list>
 #include <algorithm>
 #include <boost/lexical_cast.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/identity.hpp>
 
 
 #define START_MASTERNODE_PAYMENTS_TESTNET 1403568776 //Tue, 24 Jun 2014 00:12:56 GMT
@@ -42,6 +46,11 @@ static const unsigned int MAX_BLOCK_SIZE_GEN = MAX_BLOCK_SIZE/4;         // 250K
 static const unsigned int DEFAULT_BLOCK_MAX_SIZE = 250000;
 /** Default for -blockprioritysize, maximum space for zero/low-fee transactions **/
 static const unsigned int DEFAULT_BLOCK_PRIORITY_SIZE = 17000;
+/** Default for -maxmempool, memory budget of the transaction memory pool in megabytes */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Most unconfirmed ancestors, and descendants, a memory pool transaction can have, itself included */
+static const unsigned int MEMPOOL_MAX_ANCESTORS = 25;
+static const unsigned int MEMPOOL_MAX_DESCENDANTS = 25;
 /** The maximum size for transactions we're willing to relay/mine */
 static const unsigned int MAX_STANDARD_TX_SIZE = 100000;
 /** The maximum allowed number of signature check operations in a block (network rule) */
@@ -71,6 +80,8 @@ static const int COINBASE_MATURITY = 100;
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Number of blocks read ahead and pre-checked together during import/reindex */
+static const unsigned int IMPORT_PRECHECK_BLOCKS = 64;
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
 #else
@@ -105,7 +116,7 @@ extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern int nAskedForBlocks;    // Nodes sent a getblocks 0
 extern bool fTxIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
 extern CWallet pmainWallet;
 extern std::map<uint256, CBlock*> mapOrphanBlocks;
 
@@ -137,7 +148,7 @@ void UnregisterWallet(CWallet* pwalletIn);
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false);
 /** Process an incoming block */
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL, bool fPreChecked = false);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -146,6 +157,10 @@ FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Write the memory pool to mempool.dat */
+bool DumpMempool();
+/** Validate and add the transactions of mempool.dat to the memory pool */
+bool LoadMempool();
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -162,8 +177,14 @@ CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 /** Send queued protocol messages to be sent to a give node */
 bool SendMessages(CNode* pto, bool fSendTrickle);
+/** Pick the random salts used when relaying addresses and trickling transactions */
+void InitRelaySalts();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the block pre-checking thread used during import */
+void ThreadBlockPreCheck();
+/** Run the thread that writes the coins cache to disk */
+void ThreadFlushCoins();
 //** Get age of an input */
 int GetInputAge(CTxIn& vin);
 // masternode payments for block value
@@ -192,10 +213,12 @@ std::string GetWarnings(std::string strFor);
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock, bool fAllowSlow = false);
 int64 GetTransactionFees(CTransaction& tx);
-/** Connect/disconnect blocks until pindexNew is the new tip of the active block chain */
-bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew);
+/** Connect/disconnect blocks until pindexNew is the new tip of the active block chain.
+ *  pblockNew, if given, is a block that passed CheckBlock() and is connected from
+ *  memory instead of being read back from disk. */
+bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew, CBlock* pblockNew = NULL);
 /** Find the best known block, and make it the tip of the block chain */
-bool ConnectBestBlock(CValidationState &state);
+bool ConnectBestBlock(CValidationState &state, CBlock* pblockNew = NULL);
 /** Create a new block index entry for a given block hash */
 CBlockIndex * InsertBlockIndex(uint256 hash);
 /** Verify a signature */
@@ -289,11 +312,20 @@ public:
     std::vector<CTxOut> vout;
     unsigned int nLockTime;
 
+    // memory only: filled in by GetHash(), which may run on several threads
+    // at once, so it's only touched under the mutex GetHashCacheMutex() picks.
+    // vchHashed holds the serialization hashCached was computed from.
+    mutable uint256 hashCached;
+    mutable std::vector<unsigned char> vchHashed;
+
     CTransaction()
     {
         SetNull();
     }
 
+    CTransaction(const CTransaction& tx);
+    CTransaction& operator=(const CTransaction& tx);
+
     IMPLEMENT_SERIALIZE
     (
         READWRITE(this->nVersion);
@@ -316,10 +348,9 @@ public:
         return (vin.empty() && vout.empty());
     }
 
-    uint256 GetHash() const
-    {
-        return SerializeHash(*this);
-    }
+    /** The double SHA256 is cached and reused for as long as the serialized
+     *  transaction is unchanged, so callers may modify it freely. */
+    uint256 GetHash() const;
 
     bool IsFinal(int nBlockHeight=0, int64 nBlockTime=0) const
     {
@@ -778,6 +809,14 @@ public:
         return fCoinBase;
     }
 
+    // estimate of the heap memory held by the outputs
+    size_t DynamicMemoryUsage() const {
+        size_t nUsage = vout.capacity() * sizeof(CTxOut);
+        BOOST_FOREACH(const CTxOut &out, vout)
+            nUsage += out.scriptPubKey.capacity();
+        return nUsage;
+    }
+
     unsigned int GetSerializeSize(int nType, int nVersion) const {
         unsigned int nSize = 0;
         unsigned int nMaskSize = 0, nMaskCode = 0;
@@ -904,7 +943,8 @@ public:
 };
 
 /** Closure representing one script verification
- *  Note that this stores references to the spending transaction */
+ *  Note that this stores references to the spending transaction, and shares
+ *  its signature hash context with the checks of the transaction's other inputs */
 class CScriptCheck
 {
 private:
@@ -913,12 +953,14 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    boost::shared_ptr<const CSignatureHashContext> psighash;
 
 public:
     CScriptCheck() {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSignatureHashContext>& psighashIn = boost::shared_ptr<const CSignatureHashContext>()) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), psighash(psighashIn) { }
 
     bool operator()() const;
 
@@ -928,6 +970,26 @@ public:
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
+        psighash.swap(check.psighash);
+    }
+};
+
+/** Closure representing the context-free proof of work and merkle root
+ *  checks of up to X11_MAX_LANES blocks read ahead during import.
+ *  Note that this stores references to the blocks, and builds their merkle trees */
+class CBlockPreCheck
+{
+private:
+    std::vector<const CBlock*> vpblock;
+
+public:
+    CBlockPreCheck() {}
+    CBlockPreCheck(const std::vector<const CBlock*>& vpblockIn) : vpblock(vpblockIn) { }
+
+    bool operator()() const;
+
+    void swap(CBlockPreCheck &check) {
+        vpblock.swap(check.vpblock);
     }
 };
 
@@ -1175,11 +1237,20 @@ public:
     unsigned int vmnAdditional;
     std::vector<CMasterNodeVote> vmn;
 
+    // memory only: the last X11 hash computed and the header bytes it covers,
+    // guarded like the transaction hash cache
+    mutable uint256 hashCached;
+    mutable unsigned char pchHashedHeader[80];
+    mutable bool fHashCached;
+
     CBlockHeader()
     {
         SetNull();
     }
 
+    CBlockHeader(const CBlockHeader& header);
+    CBlockHeader& operator=(const CBlockHeader& header);
+
     IMPLEMENT_SERIALIZE
     (
         READWRITE(this->nVersion);
@@ -1199,6 +1270,7 @@ public:
         nTime = 0;
         nBits = 0;
         nNonce = 0;
+        fHashCached = false;
     }
 
     bool IsNull() const
@@ -1407,8 +1479,10 @@ public:
      *  of problems. Note that in any case, coins may be modified. */
     bool DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool *pfClean = NULL);
 
-    // Apply the effects of this block (with given index) on the UTXO set represented by coins
-    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false);
+    // Apply the effects of this block (with given index) on the UTXO set represented by coins.
+    // fChecked: the block passed CheckBlock() since it was received, so its proof of work
+    // and merkle tree are not checked again.
+    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false, bool fChecked=false);
 
     // Read a block from disk
     bool ReadFromDisk(const CBlockIndex* pindex);
@@ -2000,17 +2074,185 @@ public:
 
 
 
+/** A transaction in the memory pool, with what block assembly and eviction need to know about it.
+    The ancestor totals include the transaction itself and all of its unconfirmed ancestors, the
+    descendant totals the transaction itself and everything in the pool that spends it. */
+class CTxMemPoolEntry
+{
+private:
+    CTransaction tx;
+    int64 nFee;             // fee paid by the transaction
+    unsigned int nTxSize;   // serialized size
+    size_t nUsageSize;      // heap memory held by the transaction
+    int64 nTime;            // time it entered the pool
+    double dPriority;       // sum of value * confirmations of the inputs from the chain, at nHeight
+    int64 nValueInChain;    // value of the inputs that were already in the chain
+    unsigned int nHeight;   // best chain height when it entered the pool
+
+    uint64 nSizeWithAncestors;
+    int64 nFeesWithAncestors;
+    unsigned int nCountWithAncestors;
+
+    uint64 nSizeWithDescendants;
+    int64 nFeesWithDescendants;
+    unsigned int nCountWithDescendants;
+
+    uint64 nSequence;       // order in which transactions entered the pool
+
+public:
+    CTxMemPoolEntry(const CTransaction& txIn, int64 nFeeIn, int64 nTimeIn, double dPriorityIn, int64 nValueInChainIn, unsigned int nHeightIn);
+
+    const CTransaction& GetTx() const { return tx; }
+    int64 GetFee() const { return nFee; }
+    unsigned int GetTxSize() const { return nTxSize; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+    int64 GetTime() const { return nTime; }
+    unsigned int GetHeight() const { return nHeight; }
+
+    // Coin age priority when building on a block at nCurrentHeight; inputs from the chain keep aging while we wait
+    double GetPriority(unsigned int nCurrentHeight) const;
+
+    // Fee per 1000 bytes
+    double GetFeeRate() const { return (double)nFee * 1000 / nTxSize; }
+
+    uint64 GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    int64 GetFeesWithAncestors() const { return nFeesWithAncestors; }
+    unsigned int GetCountWithAncestors() const { return nCountWithAncestors; }
+    double GetAncestorFeeRate() const { return (double)nFeesWithAncestors * 1000 / nSizeWithAncestors; }
+
+    void SetAncestorState(uint64 nSize, int64 nFees, unsigned int nCount);
+
+    uint64 GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    int64 GetFeesWithDescendants() const { return nFeesWithDescendants; }
+    unsigned int GetCountWithDescendants() const { return nCountWithDescendants; }
+    double GetDescendantFeeRate() const { return (double)nFeesWithDescendants * 1000 / nSizeWithDescendants; }
+
+    void SetDescendantState(uint64 nSize, int64 nFees, unsigned int nCount);
+
+    uint64 GetSequence() const { return nSequence; }
+    void SetSequence(uint64 nSequenceIn) { nSequence = nSequenceIn; }
+};
+
+/** Key extractor for the entry order index of the memory pool */
+struct mempoolentry_sequence
+{
+    typedef uint64 result_type;
+    result_type operator()(const CTxMemPoolEntry &entry) const
+    {
+        return entry.GetSequence();
+    }
+};
+
+/** Key extractor for the txid index of the memory pool */
+struct mempoolentry_txid
+{
+    typedef uint256 result_type;
+    result_type operator()(const CTxMemPoolEntry &entry) const
+    {
+        return entry.GetTx().GetHash();
+    }
+};
+
+/** Sort by fee rate, ties broken by txid */
+class CompareTxMemPoolEntryByFeeRate
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double fa = a.GetFeeRate(), fb = b.GetFeeRate();
+        if (fa == fb)
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return fa < fb;
+    }
+};
+
+/** Sort by the fee rate of the transaction together with its unconfirmed ancestors, ties broken by txid */
+class CompareTxMemPoolEntryByAncestorFeeRate
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double fa = a.GetAncestorFeeRate(), fb = b.GetAncestorFeeRate();
+        if (fa == fb)
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return fa < fb;
+    }
+};
+
+/** Sort by the better of the fee rate of the transaction alone and together with its descendants,
+    ties broken by txid. The lowest entry is what the pool can best do without. */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double fa = std::max(a.GetFeeRate(), a.GetDescendantFeeRate());
+        double fb = std::max(b.GetFeeRate(), b.GetDescendantFeeRate());
+        if (fa == fb)
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return fa < fb;
+    }
+};
+
+// Tags for the secondary indexes of the memory pool
+struct fee_rate {};
+struct ancestor_score {};
+struct descendant_score {};
+struct entry_sequence {};
+
+/** The memory pool, indexed by txid, by fee rate, by ancestor and descendant fee rate and by entry order */
+typedef boost::multi_index_container<
+    CTxMemPoolEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<mempoolentry_txid>,
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<fee_rate>,
+            boost::multi_index::identity<CTxMemPoolEntry>,
+            CompareTxMemPoolEntryByFeeRate
+        >,
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolEntry>,
+            CompareTxMemPoolEntryByAncestorFeeRate
+        >,
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<descendant_score>,
+            boost::multi_index::identity<CTxMemPoolEntry>,
+            CompareTxMemPoolEntryByDescendantScore
+        >,
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<entry_sequence>,
+            mempoolentry_sequence
+        >
+    >
+> indexed_transaction_set;
+
 class CTxMemPool
 {
 public:
+    typedef indexed_transaction_set::iterator txiter;
+
+    struct CompareIteratorByHash
+    {
+        bool operator()(const txiter &a, const txiter &b) const
+        {
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
-    bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs, bool ignoreFees=false);
+    CTxMemPool() : nSequenceLast(0), nTotalTxSize(0), cachedInnerUsage(0), dMinFeeRate(0), nMinFeeRateTime(0) {}
+
+    // fScriptChecks=false when the scripts were verified beforehand; nAcceptTime overrides the entry time
+    bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs, bool ignoreFees=false,
+                bool fScriptChecks=true, int64 nAcceptTime=0);
     bool acceptable(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs, bool fScriptChecks=true);
     bool acceptableInputs(CValidationState &state, CTransaction &tx, bool fLimitFree);
-    bool addUnchecked(const uint256& hash, const CTransaction &tx);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
@@ -2018,6 +2260,32 @@ public:
     void pruneSpent(const uint256& hash, CCoins &coins);
     bool getTransactionFees(CTransaction& tx, int64& nFees);
 
+    // Collect the unconfirmed ancestors or descendants of a pool transaction (not including itself)
+    void CalculateAncestors(txiter it, setEntries &setAncestors);
+    void CalculateDescendants(txiter it, setEntries &setDescendants);
+
+    // Whether tx stays within MEMPOOL_MAX_ANCESTORS and MEMPOOL_MAX_DESCENDANTS, which bound the
+    // walks every add and removal makes over the chain. Requires cs.
+    bool CheckChainLimits(const CTransaction &tx, std::string &strError);
+
+    // Evict the packages with the lowest descendant score, with everything that spends them, until
+    // the pool uses no more than nSizeLimit bytes. The hashes of evicted transactions go to pvRemoved.
+    void TrimToSize(size_t nSizeLimit, std::vector<uint256>* pvRemoved = NULL);
+
+    // Fee per 1000 bytes a new transaction needs to get in, raised by evictions and decaying
+    // back to zero with a half-life of 12 hours
+    double GetMinFeeRate();
+
+    // Estimate of the memory used by the pool, including its indexes
+    size_t DynamicMemoryUsage();
+
+    // Sum of the serialized sizes of the pool transactions
+    uint64 GetTotalTxSize()
+    {
+        LOCK(cs);
+        return nTotalTxSize;
+    }
+
     unsigned long size()
     {
         LOCK(cs);
@@ -2029,10 +2297,37 @@ public:
         return (mapTx.count(hash) != 0);
     }
 
-    CTransaction& lookup(uint256 hash)
+    // Sequence number of the last transaction added, see CTxMemPoolEntry::GetSequence()
+    uint64 GetSequence()
     {
-        return mapTx[hash];
+        return nSequenceLast;
     }
+
+    // Check exists() first
+    const CTransaction& lookup(uint256 hash)
+    {
+        txiter it = mapTx.find(hash);
+        assert(it != mapTx.end());
+        return it->GetTx();
+    }
+
+private:
+    struct TxLinks
+    {
+        setEntries parents;
+        setEntries children;
+    };
+    // in-pool parents and children of every pool transaction
+    std::map<txiter, TxLinks, CompareIteratorByHash> mapLinks;
+    uint64 nSequenceLast;
+    uint64 nTotalTxSize;
+    size_t cachedInnerUsage;    // memory held by the entries and their links, see DynamicMemoryUsage()
+    double dMinFeeRate;
+    int64 nMinFeeRateTime;
+
+    void UpdateAncestorState(txiter it);
+    void UpdateDescendantState(txiter it);
+    void removeUnchecked(txiter it);
 };
 
 extern CTxMemPool mempool;
@@ -2050,6 +2345,35 @@ struct CCoinsStats
     CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
 };
 
+/** Hashes txids for the coins cache with a random per-process salt, so that peers can't pick
+    transactions whose ids all land in the same bucket */
+class CCoinsKeyHasher
+{
+private:
+    uint64 salt;
+
+public:
+    CCoinsKeyHasher();
+    size_t operator()(const uint256& key) const;
+};
+
+/** A CCoins in a CCoinsViewCache, with what the cache knows about its relation to the parent view */
+struct CCoinsCacheEntry
+{
+    CCoins coins;
+    unsigned char flags;
+
+    enum Flags {
+        DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
+        FRESH = (1 << 1), // The parent view does not have this entry (or it is pruned).
+        UNCOUNTED = (1 << 2) // Handed out for modification, the memory use of the cache doesn't include it until it is measured again.
+    };
+
+    CCoinsCacheEntry() : coins(), flags(0) {}
+};
+
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+
 /** Abstract view on the open txout dataset. */
 class CCoinsView
 {
@@ -2070,8 +2394,13 @@ public:
     // Modify the currently active block index
     virtual bool SetBestBlock(CBlockIndex *pindex);
 
-    // Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    // Do a bulk modification (multiple SetCoins + one SetBestBlock) with the DIRTY entries of mapCoins.
+    // The entries may be moved out of mapCoins, so the caller has to discard it afterwards.
+    virtual bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
+
+    // Same as BatchWrite, but the view may return before the modification reaches its storage.
+    // Views that can't write in the background just call BatchWrite.
+    virtual bool BatchWriteAsync(CCoinsMap &mapCoins, CBlockIndex *pindex);
 
     // Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
@@ -2094,7 +2423,7 @@ public:
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
 };
 
@@ -2103,7 +2432,11 @@ class CCoinsViewCache : public CCoinsViewBacked
 {
 protected:
     CBlockIndex *pindexTip;
-    std::map<uint256,CCoins> cacheCoins;
+    CCoinsMap cacheCoins;
+
+    // Memory used by the entries of cacheCoins, except the UNCOUNTED ones listed in vUncounted
+    size_t cachedCoinsUsage;
+    std::vector<uint256> vUncounted;
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
@@ -2114,22 +2447,71 @@ public:
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
 
     // Return a modifiable reference to a CCoins. Check HaveCoins first.
     // Many methods explicitly require a CCoinsViewCache because of this method, to reduce
-    // copying.
+    // copying. The entry is marked dirty, use AccessCoins to only read it.
     CCoins &GetCoins(const uint256 &txid);
 
+    // Return a reference to a CCoins for reading. Check HaveCoins first.
+    const CCoins &AccessCoins(const uint256 &txid);
+
     // Push the modifications applied to this cache to its base.
+    // Only entries that changed are written.
     // Failure to call this method before destruction will cause the changes to be forgotten.
     bool Flush();
 
+    // Same as Flush, but let the base write the modifications in the background.
+    bool FlushAsync();
+
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize();
 
+    // Calculate the memory used by the cache (in bytes)
+    size_t DynamicMemoryUsage();
+
 private:
-    std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
+    CCoinsMap::iterator FetchCoins(const uint256 &txid);
+    void AddUsage(CCoinsCacheEntry &entry);
+    void RemoveUsage(CCoinsCacheEntry &entry);
+};
+
+/** CCoinsView that writes batches to its base from a background thread (see ThreadFlushCoins).
+    Only one batch is in flight at a time. Its entries stay visible to reads until they are
+    on disk, and it is written in one database batch together with its best block, so a crash
+    never leaves the base with part of a flush. */
+class CCoinsViewFlusher : public CCoinsViewBacked
+{
+private:
+    boost::mutex cs;
+    boost::condition_variable condFlush;
+    CCoinsMap mapFlushing;
+    CBlockIndex *pindexFlushing;
+    bool fQueued;   // mapFlushing holds a batch that is not on disk yet
+    bool fWriting;  // a thread is writing mapFlushing to the base
+
+    bool WriteQueued(boost::unique_lock<boost::mutex> &lock);
+
+public:
+    CCoinsViewFlusher(CCoinsView &baseIn);
+    bool GetCoins(const uint256 &txid, CCoins &coins);
+    bool SetCoins(const uint256 &txid, const CCoins &coins);
+    bool HaveCoins(const uint256 &txid);
+    CBlockIndex *GetBestBlock();
+    bool SetBestBlock(CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
+    bool BatchWriteAsync(CCoinsMap &mapCoins, CBlockIndex *pindex);
+    bool GetStats(CCoinsStats &stats);
+
+    // Whether a batch is waiting for or being written
+    bool IsFlushing();
+
+    // Write the queued batch, if the background thread hasn't taken it yet, and wait until it is on disk
+    bool WaitForFlush();
+
+    // Wait for a batch to be queued and write it
+    bool ThreadWrite();
 };
 
 /** CCoinsView that brings transactions from a memorypool into view.
@@ -2148,6 +2530,9 @@ public:
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Writes pcoinsTip to the coins database in the background */
+extern CCoinsViewFlusher coinsFlusher;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
@@ -2158,6 +2543,49 @@ struct CBlockTemplate
     std::vector<int64_t> vTxSigOps;
 };
 
+/** Keeps the last block template and brings it up to date with the memory pool.
+    A new best block (or an old template) builds it from scratch with CreateNewBlock.
+    Otherwise transactions that left the pool are dropped together with their descendants
+    in the template, and only transactions that entered the pool since are validated and
+    appended, best ancestor fee rate first. A patched template that fails ConnectBlock is
+    rebuilt. */
+class CBlockTemplateCache
+{
+private:
+    CBlockTemplate* ptemplate;
+    CBlockIndex* pindexPrev;
+    int64 nTimeCreated;
+    int64 nTimeUpdated;
+    unsigned int nTransactionsUpdatedLast;
+    uint64 nSequenceLast;
+    uint64 nVersion;
+
+    // Returns false if the patched template fails to connect
+    bool UpdateIncremental();
+
+public:
+    CBlockTemplateCache();
+    ~CBlockTemplateCache();
+
+    // Bring the template up to date with the best chain and the memory pool. Pool changes
+    // are only taken in if the last update is at least nMinInterval seconds old.
+    bool Update(int64 nMinInterval = 0);
+
+    // Update, then return a copy of the template paying to scriptPubKeyIn. The caller owns it.
+    CBlockTemplate* Get(const CScript& scriptPubKeyIn, int64 nMinInterval = 0);
+
+    // Changes whenever the content of the template does
+    uint64 GetVersion() const { return nVersion; }
+
+    void Clear();
+};
+
+extern CBlockTemplateCache blockTemplateCache;
+
+/** Signalled when the best block changes, for long polling getblocktemplate */
+extern boost::mutex csBestBlock;
+extern boost::condition_variable cvBlockChange;
+
 #if defined(_M_IX86) || defined(__i386__) || defined(__i386) || defined(_M_X64) || defined(__x86_64__) || defined(_M_AMD64)
 extern unsigned int cpuid_edx;
 #endif
@@ -2196,4 +2624,85 @@ public:
 
 
 
+/** Used to relay blocks as header + short transaction IDs to peers that
+ * announce NODE_COMPACT_BLOCKS. The receiver rebuilds the block from its
+ * memory pool and asks for the transactions it doesn't have with getblocktxn.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    // Keys for the short IDs, derived from the header and nonce so they
+    // can't be ground for collisions ahead of time (not relayed)
+    unsigned int nKey0;
+    unsigned int nKey1;
+
+    void SetKeys();
+
+public:
+    CBlockHeader header;
+    uint64 nNonce;
+    // The coinbase can never be in the memory pool, so it's sent in full
+    CTransaction txCoinbase;
+    // Short IDs of vtx[1..]
+    std::vector<uint64> vShortTxIDs;
+
+    CBlockHeaderAndShortTxIDs()
+    {
+        nKey0 = nKey1 = 0;
+        nNonce = 0;
+    }
+
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(nNonce);
+        READWRITE(txCoinbase);
+        READWRITE(vShortTxIDs);
+        if (fRead)
+            const_cast<CBlockHeaderAndShortTxIDs*>(this)->SetKeys();
+    )
+
+    uint64 GetShortID(const uint256& hash) const;
+
+    // Rebuild the block from the transactions in pool. The positions in
+    // block.vtx that are left empty, because no transaction or more than one
+    // matched, are returned in vMissing.
+    void FillBlock(CTxMemPool& pool, CBlock& block, std::vector<unsigned int>& vMissing) const;
+};
+
+/** getblocktxn: the transactions of a compact block that its receiver couldn't find */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<unsigned int> vIndexes;
+
+    CBlockTransactionsRequest() {}
+    CBlockTransactionsRequest(const uint256& blockhashIn, const std::vector<unsigned int>& vIndexesIn) : blockhash(blockhashIn), vIndexes(vIndexesIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vIndexes);
+    )
+};
+
+/** blocktxn: the answer to getblocktxn, transactions in the order they were asked for */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vtx);
+    )
+};
+
+
+
 #endif
@@ -7,7 +7,7 @@
 
 
 /** The list of active masternodes */
-std::vector<CMasterNode> darkSendMasterNodes;
+CMasternodeList masternodeList;
 /** Object for who's going to get paid on which blocks */
 CMasternodePayments masternodePayments;
 /** Which masternodes we're asked other clients for */
@@ -31,6 +31,15 @@ void ProcessMasternodeConnections(){
     }
 }
 
+// Whether the list holds exactly this signed dsee, whose signature was verified when it was stored
+static bool IsKnownDsee(const CTxIn& vin, const CService& addr, const vector<unsigned char>& vchSig, int64 sigTime,
+                        const CPubKey& pubkey, const CPubKey& pubkey2)
+{
+    CMasterNodePtr pmn = masternodeList.Get(vin);
+    return pmn && pmn->now == sigTime && pmn->sig == vchSig && pmn->addr == addr &&
+           pmn->pubkey == pubkey && pmn->pubkey2 == pubkey2;
+}
+
 void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (strCommand == "dsee") { //DarkSend Election Entry   
@@ -53,6 +62,11 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
         vRecv >> vin >> addr >> vchSig >> sigTime >> pubkey >> pubkey2 >> count >> current >> lastUpdated;
 
         bool isLocal = false; // addr.IsRFC1918();
+
+        if (sigTime > GetAdjustedTime() + 60 * 60) {
+            LogPrintf("dsee - Signature rejected, too far into the future %s\n", vin.ToString().c_str());
+            return;
+        }
         std::string vchPubKey(pubkey.begin(), pubkey.end());
         std::string vchPubKey2(pubkey2.begin(), pubkey2.end());
         
@@ -77,7 +91,7 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
         }
 
         std::string errorMessage = "";
-        if(!darkSendSigner.VerifyMessage(pubkey, vchSig, strMessage, errorMessage)){
+        if(!IsKnownDsee(vin, addr, vchSig, sigTime, pubkey, pubkey2) && !darkSendSigner.VerifyMessage(pubkey, vchSig, strMessage, errorMessage)){
             LogPrintf("dsee - Got bad masternode address signature\n");
             pfrom->Misbehaving(100);
             return;
@@ -87,30 +101,21 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
 
         //LogPrintf("Searching existing masternodes : %s - %s\n", addr.ToString().c_str(),  vin.ToString().c_str());
         
-        BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes) {
-            //LogPrintf(" -- %s\n", mn.vin.ToString().c_str());
+        if(masternodeList.Has(vin)) {
+            if(masternodeList.UpdateLastSeenAfter(vin, MASTERNODE_MIN_SECONDS)){
+                if(masternodeList.UpdateSignature(vin, pubkey2, vchSig, sigTime)){ //take the newest entry
+                    LogPrintf("dsee - Got updated entry for %s\n", addr.ToString().c_str());
 
-            if(mn.vin.prevout == vin.prevout) {
-                if(!mn.UpdatedWithin(MASTERNODE_MIN_SECONDS)){
-                    mn.UpdateLastSeen();
-
-                    if(mn.now < sigTime){ //take the newest entry
-                        LogPrintf("dsee - Got updated entry for %s\n", addr.ToString().c_str());
-                        mn.pubkey2 = pubkey2;
-                        mn.now = sigTime;
-                        mn.sig = vchSig;
-
-                        if(pubkey2 == activeMasternode.pubkeyMasterNode2){
-                            activeMasternode.EnableHotColdMasterNode(vin, sigTime, addr);
-                        }
-
-                        if(count == -1) //count == -1 when it's a new entry
-                            RelayDarkSendElectionEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated);
+                    if(pubkey2 == activeMasternode.pubkeyMasterNode2){
+                        activeMasternode.EnableHotColdMasterNode(vin, sigTime, addr);
                     }
-                }
 
-                return;
+                    if(count == -1) //count == -1 when it's a new entry
+                        RelayDarkSendElectionEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated);
+                }
             }
+
+            return;
         }
 
         if(!darkSendSigner.IsVinAssociatedWithPubkey(vin, pubkey)) {
@@ -139,7 +144,7 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
 
             CMasterNode mn(addr, vin, pubkey, vchSig, sigTime, pubkey2);
             mn.UpdateLastSeen(lastUpdated);
-            darkSendMasterNodes.push_back(mn);
+            masternodeList.Add(mn);
 
             if(pubkey2 == activeMasternode.pubkeyMasterNode2){
                 activeMasternode.EnableHotColdMasterNode(vin, sigTime, addr);
@@ -187,33 +192,27 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
 
         //LogPrintf("Searching existing masternodes : %s - %s\n", addr.ToString().c_str(),  vin.ToString().c_str());
 
-        BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes) {
-            if(mn.vin == vin) {
-                if(mn.lastDseep < sigTime){ //take this only if it's newer
-                    mn.lastDseep = sigTime;
+        CMasterNodePtr pmn = masternodeList.Get(vin);
+        if(pmn) {
+            if(masternodeList.UpdateLastDseep(vin, sigTime)){ //take this only if it's newer
+                std::string strMessage = pmn->addr.ToString() + boost::lexical_cast<std::string>(sigTime) + boost::lexical_cast<std::string>(stop); 
 
-                    std::string strMessage = mn.addr.ToString() + boost::lexical_cast<std::string>(sigTime) + boost::lexical_cast<std::string>(stop); 
-
-                    std::string errorMessage = "";
-                    if(!darkSendSigner.VerifyMessage(mn.pubkey2, vchSig, strMessage, errorMessage)){
-                        LogPrintf("dseep: Got bad masternode address signature %s \n", vin.ToString().c_str());
-                        //pfrom->Misbehaving(20);
-                        return;
-                    }
+                std::string errorMessage = "";
+                if(!darkSendSigner.VerifyMessage(pmn->pubkey2, vchSig, strMessage, errorMessage)){
+                    LogPrintf("dseep: Got bad masternode address signature %s \n", vin.ToString().c_str());
+                    //pfrom->Misbehaving(20);
+                    return;
+                }
 
-                    if(stop) {
-                        if(mn.IsEnabled()){
-                            mn.Disable();
-                            mn.Check();
-                            RelayDarkSendElectionEntryPing(vin, vchSig, sigTime, stop);
-                        }
-                    } else if(!mn.UpdatedWithin(MASTERNODE_MIN_SECONDS)){
-                        mn.UpdateLastSeen();
+                if(stop) {
+                    if(masternodeList.Disable(vin)){
                         RelayDarkSendElectionEntryPing(vin, vchSig, sigTime, stop);
                     }
+                } else if(masternodeList.UpdateLastSeenAfter(vin, MASTERNODE_MIN_SECONDS)){
+                    RelayDarkSendElectionEntryPing(vin, vchSig, sigTime, stop);
                 }
-                return;
             }
+            return;
         }
 
         // ask for the dsee info once from the node that sent dseep
@@ -246,21 +245,22 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
             pfrom->FulfilledRequest("dseg");
         } //else, asking for a specific node which is ok
 
-        int count = darkSendMasterNodes.size()-1;
+        if(vin == CTxIn()) masternodeList.CheckAll();
+        std::vector<CMasterNodePtr> vpmn = masternodeList.GetAll();
+        int count = vpmn.size()-1;
         int i = 0;
 
-        BOOST_FOREACH(CMasterNode mn, darkSendMasterNodes) {    
-            LogPrintf("Sending master node entry - %s \n", mn.addr.ToString().c_str());
+        BOOST_FOREACH(const CMasterNodePtr& pmn, vpmn) {
+            LogPrintf("Sending master node entry - %s \n", pmn->addr.ToString().c_str());
 
-            if(mn.addr.IsRFC1918()) continue; //local network
+            if(pmn->addr.IsRFC1918()) continue; //local network
 
             if(vin == CTxIn()){
-                mn.Check();
-                if(mn.IsEnabled()) {
-                    pfrom->PushMessage("dsee", mn.vin, mn.addr, mn.sig, mn.now, mn.pubkey, mn.pubkey2, count, i, mn.lastTimeSeen);
+                if(pmn->enabled == 1) {
+                    pfrom->PushMessage("dsee", pmn->vin, pmn->addr, pmn->sig, pmn->now, pmn->pubkey, pmn->pubkey2, count, i, pmn->lastTimeSeen);
                 }
-            } else if (vin == mn.vin) {
-                pfrom->PushMessage("dsee", mn.vin, mn.addr, mn.sig, mn.now, mn.pubkey, mn.pubkey2, count, i, mn.lastTimeSeen);
+            } else if (vin == pmn->vin) {
+                pfrom->PushMessage("dsee", pmn->vin, pmn->addr, pmn->sig, pmn->now, pmn->pubkey, pmn->pubkey2, count, i, pmn->lastTimeSeen);
             }
             i++;
         }
@@ -316,134 +316,434 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
     }
 }
 
-struct CompareValueOnly
+void PreVerifyMessageMasternode(const std::string& strCommand, const CDataStream& vRecvIn)
 {
-    bool operator()(const pair<int64, CTxIn>& t1,
-                    const pair<int64, CTxIn>& t2) const
+    if (strCommand != "dsee" && strCommand != "dseep" && strCommand != "mnw")
+        return;
+
+    // Read the message in place, ProcessMessageMasternode reads it again. Whatever the
+    // handler drops without looking at the signature is dropped here first, so that
+    // junk costs no signature recovery.
+    CDataStreamPeek vRecv(vRecvIn);
+    std::string errorMessage = "";
+    try
     {
-        return t1.first < t2.first;
+        if (strCommand == "dsee") {
+            CTxIn vin;
+            CService addr;
+            CPubKey pubkey;
+            CPubKey pubkey2;
+            vector<unsigned char> vchSig;
+            int64 sigTime;
+            vRecv >> vin >> addr >> vchSig >> sigTime >> pubkey >> pubkey2;
+
+            if (sigTime > GetAdjustedTime() + 60 * 60)
+                return;
+            if (IsKnownDsee(vin, addr, vchSig, sigTime, pubkey, pubkey2))
+                return;
+
+            std::string vchPubKey(pubkey.begin(), pubkey.end());
+            std::string vchPubKey2(pubkey2.begin(), pubkey2.end());
+            std::string strMessage = addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey + vchPubKey2;
+            darkSendSigner.VerifyMessage(pubkey, vchSig, strMessage, errorMessage);
+        }
+        else if (strCommand == "dseep") {
+            CTxIn vin;
+            vector<unsigned char> vchSig;
+            int64 sigTime;
+            bool stop;
+            vRecv >> vin >> vchSig >> sigTime >> stop;
+
+            if (sigTime > GetAdjustedTime() + 60 * 60)
+                return;
+            // Unknown masternodes are asked for, pings older than the last one are ignored
+            CMasterNodePtr pmn = masternodeList.Get(vin);
+            if (!pmn || pmn->lastDseep >= sigTime)
+                return;
+
+            std::string strMessage = pmn->addr.ToString() + boost::lexical_cast<std::string>(sigTime) + boost::lexical_cast<std::string>(stop);
+            darkSendSigner.VerifyMessage(pmn->pubkey2, vchSig, strMessage, errorMessage);
+        }
+        else {
+            CMasternodePaymentWinner winner;
+            vRecv >> winner;
+
+            if (winner.vin.nSequence != std::numeric_limits<unsigned int>::max())
+                return;
+            int nHeight = nBestHeight;
+            if (winner.nBlockHeight < nHeight - 10 || winner.nBlockHeight > nHeight + 20)
+                return;
+            masternodePayments.CheckSignature(winner);
+        }
     }
-};
+    catch (std::exception& e) {
+        // Malformed messages are reported when they're handled
+    }
+}
 
-struct CompareValueOnly2
+struct CompareScoreOnly
 {
-    bool operator()(const pair<int64, int>& t1,
-                    const pair<int64, int>& t2) const
+    template<typename T>
+    bool operator()(const pair<unsigned int, T>& t1,
+                    const pair<unsigned int, T>& t2) const
     {
         return t1.first < t2.first;
     }
 };
 
+unsigned int CMasternodeList::size() const
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs);
+    return vMasternodes.size();
+}
 
-int GetMasternodeByVin(CTxIn& vin)
+CMasterNodePtr CMasternodeList::FindEntry(const CTxIn& vin) const
 {
-    int i = 0;
+    std::map<COutPoint, unsigned int>::const_iterator mi = mapIndex.find(vin.prevout);
+    if (mi == mapIndex.end())
+        return CMasterNodePtr();
+    return vMasternodes[mi->second];
+}
 
-    BOOST_FOREACH(CMasterNode mn, darkSendMasterNodes) {
-        if (mn.vin == vin) return i;
-        i++;
+CMasterNode* CMasternodeList::EditEntry(const CTxIn& vin)
+{
+    std::map<COutPoint, unsigned int>::const_iterator mi = mapIndex.find(vin.prevout);
+    if (mi == mapIndex.end())
+        return NULL;
+    CMasterNode* pmn = new CMasterNode(*vMasternodes[mi->second]);
+    vMasternodes[mi->second] = CMasterNodePtr(pmn);
+    return pmn;
+}
+
+CMasterNodePtr CMasternodeList::Get(const CTxIn& vin) const
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs);
+    return FindEntry(vin);
+}
+
+bool CMasternodeList::Has(const CTxIn& vin) const
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs);
+    return mapIndex.count(vin.prevout) > 0;
+}
+
+bool CMasternodeList::GetAddr(const CTxIn& vin, CService& addrRet) const
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs);
+    CMasterNodePtr pmn = FindEntry(vin);
+    if (!pmn)
+        return false;
+    addrRet = pmn->addr;
+    return true;
+}
+
+bool CMasternodeList::Add(const CMasterNode& mn)
+{
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs);
+        if (mapIndex.count(mn.vin.prevout))
+            return false;
+        mapIndex[mn.vin.prevout] = vMasternodes.size();
+        vMasternodes.push_back(CMasterNodePtr(new CMasterNode(mn)));
     }
+    InvalidateRanks();
+    return true;
+}
 
-    return -1;
+std::vector<CMasterNodePtr> CMasternodeList::GetAll() const
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs);
+    return vMasternodes;
 }
 
-int GetCurrentMasterNode(int mod, int64 nBlockHeight)
+void CMasternodeList::RebuildIndex()
 {
-    int i = 0;
-    unsigned int score = 0;
-    int winner = -1;
+    mapIndex.clear();
+    for (unsigned int i = 0; i < vMasternodes.size(); i++)
+        mapIndex[vMasternodes[i]->vin.prevout] = i;
+}
 
-    // scan for winner
-    BOOST_FOREACH(CMasterNode mn, darkSendMasterNodes) {
-        mn.Check();
-        if(!mn.IsEnabled()) {
-            i++;
-            continue;
-        }
+CMasterNodePtr CMasternodeList::CheckEntry(const CMasterNodePtr& pmn)
+{
+    // The input check looks at the mempool, so it runs without cs held, on the version of the
+    // entry passed in. The result is applied to the current one.
+    bool fCheckInput = pmn->enabled != 3 && pmn->UpdatedWithin(MASTERNODE_EXPIRATION_SECONDS);
+    bool fInputUnspent = !fCheckInput || pmn->IsInputUnspent();
 
-        // calculate the score for each masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
-        
-        // determine the winner
-        if(n2 > score){
-            score = n2;
-            winner = i; 
+    CMasterNodePtr pmnCurrent;
+    bool fChanged;
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs);
+        pmnCurrent = FindEntry(pmn->vin);
+        if (!pmnCurrent)
+            return pmnCurrent;
+        int nEnabled = pmnCurrent->GetCheckedState(fInputUnspent);
+        fChanged = (nEnabled != pmnCurrent->enabled);
+        if (fChanged) {
+            EditEntry(pmn->vin)->enabled = nEnabled;
+            pmnCurrent = FindEntry(pmn->vin);
         }
-        i++;
     }
+    // the rankings only hold the entries that were enabled when they were built
+    if (fChanged)
+        InvalidateRanks();
+    return pmnCurrent;
+}
 
-    return winner;
+void CMasternodeList::CheckAll()
+{
+    std::vector<CMasterNodePtr> vpmn;
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs);
+        vpmn = vMasternodes;
+    }
+    BOOST_FOREACH(const CMasterNodePtr& pmn, vpmn)
+        CheckEntry(pmn);
 }
 
-int GetMasternodeByRank(int findRank, int64 nBlockHeight)
+void CMasternodeList::CheckAndRemove()
 {
-    int i = 0;
- 
-    std::vector<pair<unsigned int, int> > vecMasternodeScores;
+    CheckAll();
 
-    i = 0;
-    BOOST_FOREACH(CMasterNode mn, darkSendMasterNodes) {
-        mn.Check();
-        if(!mn.IsEnabled()) {
-            i++;
-            continue;
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs);
+        std::vector<CMasterNodePtr> vKeep;
+        vKeep.reserve(vMasternodes.size());
+        BOOST_FOREACH(const CMasterNodePtr& pmn, vMasternodes) {
+            if(pmn->enabled == 4 || pmn->enabled == 3)
+                LogPrintf("Removing inactive masternode %s\n", pmn->addr.ToString().c_str());
+            else
+                vKeep.push_back(pmn);
         }
+        if (vKeep.size() == vMasternodes.size())
+            return;
+        vMasternodes.swap(vKeep);
+        RebuildIndex();
+    }
+    InvalidateRanks();
+}
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
+void CMasternodeList::Clear()
+{
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs);
+        vMasternodes.clear();
+        mapIndex.clear();
+    }
+    InvalidateRanks();
+}
 
-        vecMasternodeScores.push_back(make_pair(n2, i));
-        i++;
+bool CMasternodeList::UpdateLastSeen(const CTxIn& vin, int64 override)
+{
+    boost::unique_lock<boost::shared_mutex> lock(cs);
+    CMasterNode* pmn = EditEntry(vin);
+    if (!pmn)
+        return false;
+    pmn->UpdateLastSeen(override);
+    return true;
+}
+
+bool CMasternodeList::UpdateLastSeenAfter(const CTxIn& vin, int nSeconds)
+{
+    boost::unique_lock<boost::shared_mutex> lock(cs);
+    CMasterNodePtr pmn = FindEntry(vin);
+    if (!pmn || pmn->UpdatedWithin(nSeconds))
+        return false;
+    EditEntry(vin)->UpdateLastSeen();
+    return true;
+}
+
+bool CMasternodeList::UpdateSignature(const CTxIn& vin, const CPubKey& pubkey2, const std::vector<unsigned char>& vchSig, int64 sigTime)
+{
+    boost::unique_lock<boost::shared_mutex> lock(cs);
+    CMasterNodePtr pmn = FindEntry(vin);
+    if (!pmn || pmn->now >= sigTime)
+        return false;
+    CMasterNode* pmnEdit = EditEntry(vin);
+    pmnEdit->pubkey2 = pubkey2;
+    pmnEdit->now = sigTime;
+    pmnEdit->sig = vchSig;
+    return true;
+}
+
+bool CMasternodeList::UpdateLastDseep(const CTxIn& vin, int64 sigTime)
+{
+    boost::unique_lock<boost::shared_mutex> lock(cs);
+    CMasterNodePtr pmn = FindEntry(vin);
+    if (!pmn || pmn->lastDseep >= sigTime)
+        return false;
+    EditEntry(vin)->lastDseep = sigTime;
+    return true;
+}
+
+bool CMasternodeList::Disable(const CTxIn& vin)
+{
+    CMasterNodePtr pmn;
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs);
+        pmn = FindEntry(vin);
+        if (!pmn || !pmn->IsEnabled())
+            return false;
+        EditEntry(vin)->Disable();
+        pmn = FindEntry(vin);
     }
+    CheckEntry(pmn);
+    return true;
+}
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly2());
-    
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, int)& s, vecMasternodeScores){
-        rank++;
-        if(rank == findRank) return s.second;
+bool CMasternodeList::UpdateLastDsq(const CTxIn& vin, int64 nDsqCount)
+{
+    boost::unique_lock<boost::shared_mutex> lock(cs);
+    CMasterNode* pmn = EditEntry(vin);
+    if (!pmn)
+        return false;
+    pmn->nLastDsq = nDsqCount;
+    pmn->allowFreeTx = true;
+    return true;
+}
+
+bool CMasternodeList::TakeFreeTx(const CTxIn& vin)
+{
+    boost::unique_lock<boost::shared_mutex> lock(cs);
+    CMasterNodePtr pmn = FindEntry(vin);
+    if (!pmn || !pmn->allowFreeTx)
+        return false;
+    EditEntry(vin)->allowFreeTx = false;
+    return true;
+}
+
+int CMasternodeList::GetMasternodeInputAge(const CTxIn& vin)
+{
+    // Looking the input up takes cs_main, so it's done on a copy and the result stored afterwards
+    CMasterNodePtr pmn = Get(vin);
+    if (!pmn)
+        return 0;
+    CMasterNode mn(*pmn);
+    int nAge = mn.GetMasternodeInputAge();
+    if (pmn->cacheInputAge == 0 && mn.cacheInputAge != 0) {
+        boost::unique_lock<boost::shared_mutex> lock(cs);
+        pmn = FindEntry(vin);
+        if (pmn && pmn->cacheInputAge == 0) {
+            CMasterNode* pmnEdit = EditEntry(vin);
+            pmnEdit->cacheInputAge = mn.cacheInputAge;
+            pmnEdit->cacheInputAgeBlock = mn.cacheInputAgeBlock;
+        }
     }
+    return nAge;
+}
 
-    return -1;
+// Takes cs_ranks, so never call this with cs held: GetRanking() takes cs inside cs_ranks
+void CMasternodeList::InvalidateRanks()
+{
+    LOCK(cs_ranks);
+    mapRanks.clear();
+    nRanksGeneration++;
 }
 
-int GetMasternodeRank(CTxIn& vin, int64 nBlockHeight)
+CMasternodeList::CRankingPtr CMasternodeList::GetRanking(int mod, int64 nBlockHeight)
 {
-    std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores;
+    uint256 hashTip;
+    std::pair<int64, int> key;
+    {
+        LOCK(cs_ranks);
 
-    BOOST_FOREACH(CMasterNode mn, darkSendMasterNodes) {
-        mn.Check();
-        if(!mn.IsEnabled()) {
-            continue;
+        // a new tip, or a reorg, changes the block hashes the scores are based on
+        hashTip = pindexBest ? pindexBest->GetBlockHash() : 0;
+        if (hashTip != hashRanksTip) {
+            mapRanks.clear();
+            hashRanksTip = hashTip;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
+        // nBlockHeight 0 means the block after the tip
+        if (nBlockHeight == 0 && pindexBest != NULL)
+            nBlockHeight = pindexBest->nHeight + 1;
+
+        key = make_pair(nBlockHeight, mod);
+        std::map<std::pair<int64, int>, CRankingPtr>::const_iterator mi = mapRanks.find(key);
+        if (mi != mapRanks.end()) {
+            nRankCacheHits++;
+            return mi->second;
+        }
+        nRankCacheMisses++;
+    }
+
+    // The entries are checked here, once per ranking, and the disabled ones left out. The input
+    // checks take mempool.cs, so they run without cs_ranks held. An entry whose state changes
+    // afterwards drops the rankings through InvalidateRanks().
+    CheckAll();
+
+    uint64 nGeneration;
+    {
+        LOCK(cs_ranks);
+        nGeneration = nRanksGeneration;
+    }
+    std::vector<CMasterNodePtr> vpmn = GetAll();
+
+    // the score only depends on vin, which doesn't change
+    CMasternodeRanking* pranking = new CMasternodeRanking();
+    CRankingPtr ranking(pranking);
+    pranking->reserve(vpmn.size());
+    BOOST_FOREACH(const CMasterNodePtr& pmn, vpmn) {
+        if (!pmn->IsEnabled())
+            continue;
+        uint256 n = pmn->CalculateScore(mod, nBlockHeight);
         unsigned int n2 = 0;
         memcpy(&n2, &n, sizeof(n2));
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
+        pranking->push_back(make_pair(n2, pmn));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly());
-    
-    unsigned int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CTxIn)& s, vecMasternodeScores){
-        rank++;
-        if(s.second == vin) return rank;
-    }
+    sort(pranking->rbegin(), pranking->rend(), CompareScoreOnly());
+
+    // a ranking the list or the tip changed under is handed out once, not kept
+    LOCK(cs_ranks);
+    if (nGeneration == nRanksGeneration && hashTip == hashRanksTip)
+        mapRanks[key] = ranking;
+    return ranking;
+}
+
+bool CMasternodeList::GetCurrentMasterNode(CMasterNode& mnRet, int mod, int64 nBlockHeight)
+{
+    // the best scoring enabled masternode wins
+    CRankingPtr ranking = GetRanking(mod, nBlockHeight);
+    if (ranking->empty() || ranking->front().first == 0)
+        return false;
+    mnRet = *ranking->front().second;
+    return true;
+}
+
+bool CMasternodeList::GetMasternodeByRank(int findRank, CMasterNode& mnRet, int64 nBlockHeight)
+{
+    CRankingPtr ranking = GetRanking(1, nBlockHeight);
+    if (findRank < 1 || findRank > (int)ranking->size())
+        return false;
+    mnRet = *(*ranking)[findRank - 1].second;
+    return true;
+}
+
+int CMasternodeList::GetMasternodeRank(const CTxIn& vin, int64 nBlockHeight)
+{
+    CRankingPtr ranking = GetRanking(1, nBlockHeight);
+    for (unsigned int i = 0; i < ranking->size(); i++)
+        if ((*ranking)[i].second->vin.prevout == vin.prevout)
+            return i + 1;
 
     return -1;
 }
 
+void CMasternodeList::GetRankCacheStats(uint64& nHitsRet, uint64& nMissesRet)
+{
+    LOCK(cs_ranks);
+    nHitsRet = nRankCacheHits;
+    nMissesRet = nRankCacheMisses;
+}
+
 // 
 // Deterministically calculate a given "score" for a masternode depending on how close it's hash is to 
 // the proof of work for that block. The further away they are the better, the furthest will win the election 
 // and get paid this block
 // 
-uint256 CMasterNode::CalculateScore(int mod, int64 nBlockHeight)
+uint256 CMasterNode::CalculateScore(int mod, int64 nBlockHeight) const
 {
     if(pindexBest == NULL) return 0;
 
@@ -461,36 +761,36 @@ uint256 CMasterNode::CalculateScore(int mod, int64 nBlockHeight)
     return n3;
 }
 
-void CMasterNode::Check()
+bool CMasterNode::IsInputUnspent() const
 {
-    //once spent, stop doing the checks
-    if(enabled==3) return;
+    if(unitTest) return true;
 
+    CValidationState state;
+    CTransaction tx = CTransaction();
+    CTxOut vout = CTxOut(999.99*COIN, darkSendPool.collateralPubKey);
+    tx.vin.push_back(vin);
+    tx.vout.push_back(vout);
 
-    if(!UpdatedWithin(MASTERNODE_REMOVAL_SECONDS)){
-        enabled = 4;
-        return;
-    }
+    return tx.AcceptableInputs(state, true);
+}
 
-    if(!UpdatedWithin(MASTERNODE_EXPIRATION_SECONDS)){
-        enabled = 2;
-        return;
-    }
+int CMasterNode::GetCheckedState(bool fInputUnspent) const
+{
+    //once spent, stop doing the checks
+    if(enabled==3) return 3;
 
-    if(!unitTest){
-        CValidationState state;
-        CTransaction tx = CTransaction();
-        CTxOut vout = CTxOut(999.99*COIN, darkSendPool.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
+    if(!UpdatedWithin(MASTERNODE_REMOVAL_SECONDS)) return 4;
 
-        if(!tx.AcceptableInputs(state, true)) {
-            enabled = 3;
-            return; 
-        }
-    }
+    if(!UpdatedWithin(MASTERNODE_EXPIRATION_SECONDS)) return 2;
 
-    enabled = 1; // OK
+    if(!fInputUnspent) return 3;
+
+    return 1; // OK
+}
+
+void CMasterNode::Check(bool fInputUnspent)
+{
+    enabled = GetCheckedState(fInputUnspent);
 }
 
 bool CMasternodePayments::CheckSignature(CMasternodePaymentWinner& winner)
@@ -534,7 +834,7 @@ bool CMasternodePayments::Sign(CMasternodePaymentWinner& winner)
     return true;
 }
 
-uint64 CMasternodePayments::CalculateScore(uint256 blockHash, CTxIn& vin)
+uint64 CMasternodePayments::CalculateScore(uint256 blockHash, const CTxIn& vin)
 {
     uint256 n1 = blockHash;
     uint256 n2 = Hash9(BEGIN(n1), END(n1));
@@ -628,11 +928,11 @@ void CMasternodePayments::CleanPaymentList()
     }
 }
 
-int CMasternodePayments::LastPayment(CMasterNode& mn)
+int CMasternodePayments::LastPayment(const CMasterNode& mn)
 {
     if(pindexBest == NULL) return 0;
 
-    int ret = mn.GetMasternodeInputAge();
+    int ret = masternodeList.GetMasternodeInputAge(mn.vin);
 
     BOOST_FOREACH(CMasternodePaymentWinner& winner, vWinning){
         if(winner.vin == mn.vin && pindexBest->nHeight - winner.nBlockHeight < ret)
@@ -650,20 +950,20 @@ bool CMasternodePayments::ProcessBlock(int nBlockHeight)
     uint256 blockHash = 0;
     if(!darkSendPool.GetBlockHash(blockHash, nBlockHeight-576)) return false;
 
-    BOOST_FOREACH(CMasterNode& mn, darkSendMasterNodes) {
-        mn.Check();
-
-        if(!mn.IsEnabled()) {
+    masternodeList.CheckAll();
+    std::vector<CMasterNodePtr> vpmn = masternodeList.GetAll();
+    BOOST_FOREACH(const CMasterNodePtr& pmn, vpmn) {
+        if(!pmn->IsEnabled()) {
             continue;
         }
 
-        if(LastPayment(mn) < darkSendMasterNodes.size()*.9) continue;
+        if(LastPayment(*pmn) < vpmn.size()*.9) continue;
 
-        uint64 score = CalculateScore(blockHash, mn.vin);
+        uint64 score = CalculateScore(blockHash, pmn->vin);
         if(score > winner.score){
             winner.score = score;
             winner.nBlockHeight = nBlockHeight;
-            winner.vin = mn.vin;
+            winner.vin = pmn->vin;
         }
     }
 
@@ -681,12 +981,16 @@ bool CMasternodePayments::ProcessBlock(int nBlockHeight)
 
 void CMasternodePayments::Relay(CMasternodePaymentWinner& winner)
 {    
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << winner;
+    CNetMessageRef msg = MakeNetMessage("mnw", ss);
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes){
         if(!pnode->fRelayTxes)
             continue;
 
-        pnode->PushMessage("mnw", winner);
+        pnode->PushSharedMessage(msg);
     }
 }
 
@@ -714,3 +1018,155 @@ bool CMasternodePayments::SetPrivKey(std::string strPrivKey)
         return false;
     }
 }
+
+//
+// CMasternodeDB
+//
+
+CMasternodeDB::CMasternodeDB()
+{
+    pathMN = GetDataDir() / "mncache.dat";
+}
+
+bool CMasternodeDB::Write(const CMasternodeList& list, const CMasternodePayments& payments, const std::vector<CTxIn>& vecAskedFor)
+{
+    unsigned char pchMessageStart[4];
+    GetMessageStart(pchMessageStart);
+
+    std::vector<CMasterNodePtr> vMasternodes = list.GetAll();
+
+    // Generate random temporary filename
+    std::string tmpfn = strprintf("mncache.dat.%04x", (unsigned int)GetRand(0x10000));
+
+    // serialize the list, checksum data up to that point, then append csum
+    CDataStream ssMN(SER_DISK, CLIENT_VERSION);
+    ssMN << FLATDATA(pchMessageStart);
+    ssMN << (int)MASTERNODE_CACHE_VERSION;
+    ssMN << (pindexBest ? pindexBest->GetBlockHash() : uint256(0));
+    ssMN << GetAdjustedTime();
+    // the same format as a std::vector<CMasterNode>, which Read() expects
+    WriteCompactSize(ssMN, vMasternodes.size());
+    BOOST_FOREACH(const CMasterNodePtr& pmn, vMasternodes)
+        ssMN << *pmn;
+    ssMN << payments;
+    ssMN << vecAskedFor;
+    uint256 hash = Hash(ssMN.begin(), ssMN.end());
+    ssMN << hash;
+
+    // open temp output file, and associate with CAutoFile
+    boost::filesystem::path pathTmp = GetDataDir() / tmpfn;
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("CMasternodeDB::Write() : open failed");
+
+    // Write and commit header, data
+    try {
+        fileout << ssMN;
+    }
+    catch (std::exception &e) {
+        return error("CMasternodeDB::Write() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    // replace existing mncache.dat, if any, with new mncache.dat.XXXX
+    if (!RenameOver(pathTmp, pathMN))
+        return error("CMasternodeDB::Write() : Rename-into-place failed");
+
+    LogPrintf("Wrote %"PRIszu" masternodes to mncache.dat\n", vMasternodes.size());
+    return true;
+}
+
+bool CMasternodeDB::Read(CMasternodeList& list, CMasternodePayments& payments, std::vector<CTxIn>& vecAskedFor)
+{
+    unsigned char pchMessageStart[4];
+    GetMessageStart(pchMessageStart);
+
+    // open input file, and associate with CAutoFile
+    FILE *file = fopen(pathMN.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("CMasternodeDB::Read() : open failed");
+
+    // use file size to size memory buffer
+    int fileSize = GetFilesize(filein);
+    int dataSize = fileSize - sizeof(uint256);
+    //Don't try to resize to a negative number if file is small
+    if ( dataSize < 0 ) dataSize = 0;
+    vector<unsigned char> vchData;
+    vchData.resize(dataSize);
+    uint256 hashIn;
+
+    // read data and checksum from file
+    try {
+        filein.read((char *)&vchData[0], dataSize);
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        return error("CMasternodeDB::Read() 2 : I/O error or stream data corrupted");
+    }
+    filein.fclose();
+
+    CDataStream ssMN(vchData, SER_DISK, CLIENT_VERSION);
+
+    // verify stored checksum matches input data
+    uint256 hashTmp = Hash(ssMN.begin(), ssMN.end());
+    if (hashIn != hashTmp)
+        return error("CMasternodeDB::Read() : checksum mismatch; data corrupted");
+
+    unsigned char pchMsgTmp[4];
+    int nVersion;
+    uint256 hashBestBlock;
+    int64 nTime;
+    bool fOnMainChain = false;
+    std::vector<CMasterNode> vMasternodes;
+    std::vector<CTxIn> vecAskedForTmp;
+    try {
+        // de-serialize file header (pchMessageStart magic number) and
+        ssMN >> FLATDATA(pchMsgTmp);
+
+        // verify the network matches ours
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+            return error("CMasternodeDB::Read() : invalid network magic number");
+
+        ssMN >> nVersion;
+        if (nVersion != MASTERNODE_CACHE_VERSION)
+            return error("CMasternodeDB::Read() : unknown version %d", nVersion);
+
+        ssMN >> hashBestBlock >> nTime;
+
+        // Masternodes that weren't seen for too long would only be dropped by the next CheckAndRemove()
+        if (GetAdjustedTime() - nTime > MASTERNODE_REMOVAL_SECONDS)
+            return error("CMasternodeDB::Read() : cache is too old");
+
+        // The payment winners were scored against the chain the cache was written with. If that tip
+        // is no longer in our main chain they can't be trusted, and neither can the cached input ages.
+        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBestBlock);
+        fOnMainChain = (mi != mapBlockIndex.end() && (*mi).second->IsInMainChain());
+
+        ssMN >> vMasternodes;
+        if (fOnMainChain) {
+            ssMN >> payments;
+        } else {
+            CMasternodePayments paymentsStale;
+            ssMN >> paymentsStale;
+            LogPrintf("CMasternodeDB::Read() : cache tip %s is not in the main chain, dropping payment winners\n", hashBestBlock.ToString().c_str());
+        }
+        ssMN >> vecAskedForTmp;
+    }
+    catch (std::exception &e) {
+        return error("CMasternodeDB::Read() : I/O error or stream data corrupted");
+    }
+
+    int nLoaded = 0;
+    BOOST_FOREACH(CMasterNode& mn, vMasternodes) {
+        if (!mn.UpdatedWithin(MASTERNODE_REMOVAL_SECONDS)) continue;
+        if (!fOnMainChain) mn.cacheInputAge = 0;
+        if (list.Add(mn)) nLoaded++;
+    }
+    vecAskedFor = vecAskedForTmp;
+
+    LogPrintf("Loaded %d masternodes from mncache.dat\n", nLoaded);
+    return true;
+}
@@ -36,9 +36,14 @@ class CMasternodePayments;
 #define MASTERNODE_EXPIRATION_SECONDS          (65*60)
 #define MASTERNODE_REMOVAL_SECONDS             (70*60)
 
+// version of the mncache.dat layout, bump when CMasterNode or CMasternodePaymentWinner change
+#define MASTERNODE_CACHE_VERSION               1
+
 using namespace std;
 
-extern std::vector<CMasterNode> darkSendMasterNodes;
+class CMasternodeList;
+
+extern CMasternodeList masternodeList;
 extern CMasternodePayments masternodePayments;
 extern std::vector<CTxIn> vecMasternodeAskedFor;
 extern map<uint256, int> mapSeenMasternodeVotes;
@@ -47,15 +52,12 @@ extern map<uint256, int> mapSeenMasternodeVotes;
 // manage the masternode connections
 void ProcessMasternodeConnections();
 
-// Get the current winner for this block
-int GetCurrentMasterNode(int mod=1, int64 nBlockHeight=0);
-
-int GetMasternodeByVin(CTxIn& vin);
-int GetMasternodeRank(CTxIn& vin, int64 nBlockHeight=0);
-int GetMasternodeByRank(int findRank, int64 nBlockHeight=0);
-
 void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
+// Recover the signer of a dsee, dseep or mnw message without holding cs_main, so
+// ProcessMessageMasternode finds it in the darksend signer cache
+void PreVerifyMessageMasternode(const std::string& strCommand, const CDataStream& vRecv);
+
 // 
 // The Masternode Class. For managing the darksend process. It contains the input of the 1000DRK, signature to prove
 // it's the one who own that ip address and code for calculating the payment election.
@@ -80,6 +82,19 @@ public:
     //the dsq count from the last dsq broadcast of this node
     int64 nLastDsq;
 
+    CMasterNode()
+    {
+        lastTimeSeen = 0;
+        now = 0;
+        lastDseep = 0;
+        cacheInputAge = 0;
+        cacheInputAgeBlock = 0;
+        enabled = 1;
+        unitTest = false;
+        allowFreeTx = true;
+        nLastDsq = 0;
+    }
+
     CMasterNode(CService newAddr, CTxIn newVin, CPubKey newPubkey, std::vector<unsigned char> newSig, int64 newNow, CPubKey newPubkey2)
     {
         addr = newAddr;
@@ -98,7 +113,23 @@ public:
         allowFreeTx = true;
     }
 
-    uint256 CalculateScore(int mod=1, int64 nBlockHeight=0);
+    IMPLEMENT_SERIALIZE(
+        READWRITE(addr);
+        READWRITE(vin);
+        READWRITE(lastTimeSeen);
+        READWRITE(pubkey);
+        READWRITE(pubkey2);
+        READWRITE(sig);
+        READWRITE(now);
+        READWRITE(lastDseep);
+        READWRITE(cacheInputAge);
+        READWRITE(cacheInputAgeBlock);
+        READWRITE(enabled);
+        READWRITE(allowFreeTx);
+        READWRITE(nLastDsq);
+    )
+
+    uint256 CalculateScore(int mod=1, int64 nBlockHeight=0) const;
 
     void UpdateLastSeen(int64 override=0)
     {
@@ -109,9 +140,15 @@ public:
         }
     }
 
-    void Check();
+    // Whether the 1000DRK input can still be spent, looks at the mempool
+    bool IsInputUnspent() const;
 
-    bool UpdatedWithin(int seconds)
+    // What enabled should be, from the time this masternode was last seen and whether its input is unspent
+    int GetCheckedState(bool fInputUnspent) const;
+    // Update enabled to it
+    void Check(bool fInputUnspent);
+
+    bool UpdatedWithin(int seconds) const
     {
         //LogPrintf("UpdatedWithin %"PRI64u", %"PRI64u" --  %d \n", GetTimeMicros() , lastTimeSeen, (GetTimeMicros() - lastTimeSeen) < seconds);
 
@@ -123,7 +160,7 @@ public:
         lastTimeSeen = 0;
     }
 
-    bool IsEnabled()
+    bool IsEnabled() const
     {
         return enabled == 1;
     }
@@ -141,6 +178,115 @@ public:
     }
 };
 
+typedef boost::shared_ptr<const CMasterNode> CMasterNodePtr;
+
+//
+// The list of known masternodes, indexed by the outpoint of their 1000DRK input.
+//
+// An entry never changes once it's in the list: the list's own update methods copy it, change the
+// copy and swap it in with the lock held exclusively. Lookups take the lock shared, run in parallel
+// and hand out the entry itself; whoever holds it keeps seeing that version, and keeps it alive if it
+// is removed meanwhile.
+//
+// The lock is never held while calling out of the list (the input check takes mempool.cs), so it
+// can be used from any thread regardless of the locks already held.
+//
+class CMasternodeList
+{
+private:
+    mutable boost::shared_mutex cs;
+    // in the order the entries were added
+    std::vector<CMasterNodePtr> vMasternodes;
+    // position of each entry in vMasternodes
+    std::map<COutPoint, unsigned int> mapIndex;
+
+    // The enabled masternodes sorted by score, best first, for each (block height, mod) asked for.
+    // Scores only depend on the chain, so a ranking is built once per tip, after checking every entry,
+    // and shared with the lookups. The rankings are dropped when the tip or the list changes, or when
+    // an entry is enabled or disabled.
+    typedef std::vector<std::pair<unsigned int, CMasterNodePtr> > CMasternodeRanking;
+    typedef boost::shared_ptr<const CMasternodeRanking> CRankingPtr;
+    CCriticalSection cs_ranks;
+    uint256 hashRanksTip;
+    std::map<std::pair<int64, int>, CRankingPtr> mapRanks;
+    // bumped by InvalidateRanks(), so a ranking built meanwhile isn't kept
+    uint64 nRanksGeneration;
+    uint64 nRankCacheHits;
+    uint64 nRankCacheMisses;
+
+    // requires cs
+    CMasterNodePtr FindEntry(const CTxIn& vin) const;
+    // swaps a copy of the entry in and returns it to be changed, NULL if there's none; requires cs exclusively
+    CMasterNode* EditEntry(const CTxIn& vin);
+    void RebuildIndex();
+    // takes cs
+    // returns the checked version of the entry, null if it was removed
+    CMasterNodePtr CheckEntry(const CMasterNodePtr& pmn);
+    void InvalidateRanks();
+    CRankingPtr GetRanking(int mod, int64 nBlockHeight);
+
+public:
+    CMasternodeList()
+    {
+        hashRanksTip = 0;
+        nRanksGeneration = 0;
+        nRankCacheHits = 0;
+        nRankCacheMisses = 0;
+    }
+
+    unsigned int size() const;
+
+    // The masternode for this input, null if there's none
+    CMasterNodePtr Get(const CTxIn& vin) const;
+    bool Has(const CTxIn& vin) const;
+
+    // Address of the masternode for this input, which doesn't change once it's added
+    bool GetAddr(const CTxIn& vin, CService& addrRet) const;
+
+    // Returns false if a masternode with this input is already known
+    bool Add(const CMasterNode& mn);
+
+    // The current entries
+    std::vector<CMasterNodePtr> GetAll() const;
+
+    // Check every entry, updating whether it's enabled
+    void CheckAll();
+
+    // Check every entry and drop the ones that expired or whose input was spent
+    void CheckAndRemove();
+
+    void Clear();
+
+    //
+    // Updates of a single masternode. They return false if there's no masternode for the input,
+    // or when the update didn't apply as described.
+    //
+    bool UpdateLastSeen(const CTxIn& vin, int64 override=0);
+    // Mark it seen now, unless it already was within the last nSeconds
+    bool UpdateLastSeenAfter(const CTxIn& vin, int nSeconds);
+    // Take the hot wallet key and signature of a dsee signed after the one we have
+    bool UpdateSignature(const CTxIn& vin, const CPubKey& pubkey2, const std::vector<unsigned char>& vchSig, int64 sigTime);
+    // Take the time of a dseep signed after the last one
+    bool UpdateLastDseep(const CTxIn& vin, int64 sigTime);
+    // Disable an enabled masternode, for a dseep that stops it
+    bool Disable(const CTxIn& vin);
+    // A new dsq from this masternode, which also allows it another free transaction
+    bool UpdateLastDsq(const CTxIn& vin, int64 nDsqCount);
+    // Use up the masternode's free transaction
+    bool TakeFreeTx(const CTxIn& vin);
+
+    // Confirmations of the masternode's input, cached in the entry
+    int GetMasternodeInputAge(const CTxIn& vin);
+
+    // Get the current winner for this block
+    bool GetCurrentMasterNode(CMasterNode& mnRet, int mod=1, int64 nBlockHeight=0);
+
+    bool GetMasternodeByRank(int findRank, CMasterNode& mnRet, int64 nBlockHeight=0);
+    int GetMasternodeRank(const CTxIn& vin, int64 nBlockHeight=0);
+
+    void GetRankCacheStats(uint64& nHitsRet, uint64& nMissesRet);
+};
+
 
 // for storing the winning payments
 class CMasternodePaymentWinner
@@ -193,6 +339,10 @@ public:
         strTestPubKey = "046f78dcf911fbd61910136f7f0f8d90578f68d0b3ac973b5040fb7afb501b5939f39b108b0569dca71488f5bbf498d92e4d1194f6f941307ffd95f75e76869f0e";
     }
 
+    IMPLEMENT_SERIALIZE(
+        READWRITE(vWinning);
+    )
+
     bool SetPrivKey(std::string strPrivKey);
     bool CheckSignature(CMasternodePaymentWinner& winner);
     bool Sign(CMasternodePaymentWinner& winner);
@@ -202,17 +352,28 @@ public:
     // and get paid this block
     // 
 
-    uint64 CalculateScore(uint256 blockHash, CTxIn& vin);
+    uint64 CalculateScore(uint256 blockHash, const CTxIn& vin);
     bool GetWinningMasternode(int nBlockHeight, CTxIn& vinOut);
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
     bool ProcessBlock(int nBlockHeight);
     void Relay(CMasternodePaymentWinner& winner);
     void Sync(CNode* node);
     void CleanPaymentList();
-    int LastPayment(CMasterNode& mn);
+    int LastPayment(const CMasterNode& mn);
 
     //slow
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
 };
 
+/** Access to the masternode list cache (mncache.dat), so a restarted node doesn't have to wait for dseg */
+class CMasternodeDB
+{
+private:
+    boost::filesystem::path pathMN;
+public:
+    CMasternodeDB();
+    bool Write(const CMasternodeList& list, const CMasternodePayments& payments, const std::vector<CTxIn>& vecAskedFor);
+    bool Read(CMasternodeList& list, CMasternodePayments& payments, std::vector<CTxIn>& vecAskedFor);
+};
+
 #endif
\ No newline at end of file
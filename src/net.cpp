@@ -16,6 +16,11 @@
 #include <string.h>
 #endif
 
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniwget.h>
 #include <miniupnpc/miniupnpc.h>
@@ -30,6 +35,8 @@ using namespace std;
 using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 8;
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 4;
 
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
 
@@ -57,7 +64,7 @@ int nMaxConnections = 125;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CNetMessageRef> mapRelay;
 deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -634,6 +641,47 @@ void CNode::copyStats(CNodeStats &stats)
 }
 #undef X
 
+// Payload buffers of handled messages, reused by the next large messages so
+// they don't each allocate, fault in and cleanse a buffer of their own
+static const unsigned int MIN_POOLED_RECV_BUFFER = 0x4000;
+static const unsigned int MAX_POOLED_RECV_BUFFER = 0x200000;
+static const unsigned int MAX_POOLED_RECV_BUFFERS = 8;
+static CCriticalSection cs_vRecvBufferPool;
+static std::vector<CSerializeData> vRecvBufferPool;
+
+// Take the smallest pooled buffer that fits nSize bytes, or the largest there is
+static void TakeRecvBuffer(CSerializeData& data, unsigned int nSize)
+{
+    LOCK(cs_vRecvBufferPool);
+    if (vRecvBufferPool.empty())
+        return;
+    unsigned int nBest = 0;
+    for (unsigned int i = 1; i < vRecvBufferPool.size(); i++)
+    {
+        size_t nCapacity = vRecvBufferPool[i].capacity();
+        size_t nBestCapacity = vRecvBufferPool[nBest].capacity();
+        if (nBestCapacity < nSize ? nCapacity > nBestCapacity : (nCapacity >= nSize && nCapacity < nBestCapacity))
+            nBest = i;
+    }
+    data.swap(vRecvBufferPool[nBest]);
+    vRecvBufferPool[nBest].swap(vRecvBufferPool.back());
+    vRecvBufferPool.pop_back();
+    data.clear();
+}
+
+static void GiveRecvBuffer(CSerializeData& data)
+{
+    if (data.capacity() < MIN_POOLED_RECV_BUFFER || data.capacity() > MAX_POOLED_RECV_BUFFER)
+        return;
+    LOCK(cs_vRecvBufferPool);
+    if (vRecvBufferPool.size() >= MAX_POOLED_RECV_BUFFERS)
+        return;
+    // Reserved up front, so growing the pool never copies the buffers in it
+    vRecvBufferPool.reserve(MAX_POOLED_RECV_BUFFERS);
+    vRecvBufferPool.push_back(CSerializeData());
+    vRecvBufferPool.back().swap(data);
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
@@ -690,6 +738,13 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 
     // switch state to reading message data
     in_data = true;
+    SHA256_Init(&ctxChecksum);
+    if (hdr.nMessageSize >= MIN_POOLED_RECV_BUFFER)
+    {
+        CSerializeData data;
+        TakeRecvBuffer(data, hdr.nMessageSize);
+        vRecv.Swap(data);
+    }
     vRecv.resize(hdr.nMessageSize);
 
     return nCopy;
@@ -701,11 +756,37 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
     memcpy(&vRecv[nDataPos], pch, nCopy);
-    nDataPos += nCopy;
+    DataReceived(nCopy);
 
     return nCopy;
 }
 
+void CNetMessage::DataReceived(unsigned int nBytes)
+{
+    // Hashed as it arrives, while it's still in the cache
+    SHA256_Update(&ctxChecksum, &vRecv[nDataPos], nBytes);
+    nDataPos += nBytes;
+}
+
+uint256 CNetMessage::GetChecksumHash()
+{
+    uint256 hash1;
+    SHA256_Final((unsigned char*)&hash1, &ctxChecksum);
+    uint256 hash2;
+    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    return hash2;
+}
+
+void CNetMessage::Recycle()
+{
+    if (!in_data || hdr.nMessageSize < MIN_POOLED_RECV_BUFFER)
+        return;
+    CSerializeData data;
+    vRecv.GetAndClear(data);
+    GiveRecvBuffer(data);
+}
+
+
 
 
 
@@ -713,14 +794,30 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+CNetMessageRef MakeNetMessage(const char* pszCommand, const CDataStream& ssPayload)
+{
+    CMessageHeader hdr(pszCommand, ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    CDataStream ssMsg(SER_NETWORK, PROTOCOL_VERSION);
+    ssMsg.reserve(CMessageHeader::HEADER_SIZE + ssPayload.size());
+    ssMsg << hdr;
+    if (!ssPayload.empty())
+        ssMsg.write(&ssPayload.begin()[0], ssPayload.size());
+
+    CSerializeData* pdata = new CSerializeData();
+    ssMsg.GetAndClear(*pdata);
+    return CNetMessageRef(pdata);
+}
 
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CNetMessageRef>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        const CSerializeData &data = **it;
         assert(data.size() > pnode->nSendOffset);
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
@@ -759,75 +856,427 @@ void SocketSendData(CNode *pnode)
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+// Disconnect the nodes that are done with, and delete the ones no other thread uses anymore.
+// The ids of the nodes taken out of vNodes are added to vRemoved.
+static void DisconnectNodes(unsigned int& nPrevNodeCount, std::vector<NodeId>& vRemoved)
 {
-    unsigned int nPrevNodeCount = 0;
-    loop
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                vRemoved.push_back(pnode->id);
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+                pnode->Cleanup();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
+        }
 
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+        {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+    if (vNodes.size() != nPrevNodeCount)
+    {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(vNodes.size());
+    }
+}
+
+// Accept a connection waiting on a listening socket
+static void AcceptConnection(SOCKET hListenSocket)
+{
+#ifdef USE_IPV6
+    struct sockaddr_storage sockaddr;
+#else
+    struct sockaddr sockaddr;
+#endif
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    LogPrintf("maxconnections check %d\n", nMaxConnections - MAX_OUTBOUND_CONNECTIONS);
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %d\n", nErr);
+    }
+    else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+    {
+        {
+            LOCK(cs_setservAddNodeAddresses);
+            if (!setservAddNodeAddresses.count(addr))
+                closesocket(hSocket);
+        }
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+        closesocket(hSocket);
+    }
+    else
+    {
+        LogPrintf("accepted connection %s\n", addr.ToString().c_str());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+    }
+}
+
+// Whether there is room in the receive buffer, see ThreadSocketHandler
+static bool ReceiveBufferFull(CNode* pnode)
+{
+    return !pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() &&
+           pnode->GetTotalRecvSize() > ReceiveFloodSize();
+}
+
+static const unsigned int MIN_DIRECT_RECV = 0x4000;
+
+// Read once from the socket of a node, cs_vRecvMsg held. Returns false once the
+// socket has nothing more to give, because it would block or it was closed.
+static bool SocketRecvData(CNode* pnode)
+{
+    // Large payloads are read straight into the message being received,
+    // everything else through a buffer that can take several messages at once
+    CNetMessage* pmsg = NULL;
+    if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.back().GetDataRemaining() >= MIN_DIRECT_RECV)
+        pmsg = &pnode->vRecvMsg.back();
+
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes;
+    if (pmsg)
+        nBytes = recv(pnode->hSocket, pmsg->GetDataSpace(), pmsg->GetDataRemaining(), MSG_DONTWAIT);
+    else
+        nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (pmsg)
+            pmsg->DataReceived(nBytes);
+        else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        return pnode->hSocket != INVALID_SOCKET;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrintf("socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr == WSAEINTR)
+            return true;
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %d\n", nErr);
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+// Disconnect peers that stopped talking to us
+static void InactivityCheck(CNode* pnode)
+{
+    if (pnode->vSendMsg.empty())
+        pnode->nLastSendEmpty = GetTime();
+    if (GetTime() - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrintf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
+        {
+            LogPrintf("socket not sending\n");
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastRecv > 90*60)
+        {
+            LogPrintf("socket inactivity timeout\n");
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+// Service a socket that has readiness left over: send what is queued while it is
+// writable, and as with select() only read once the send queue has drained.
+// Returns true if data was received.
+bool SocketServiceNode(CNode* pnode)
+{
+    bool fSendPending = true;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+        {
+            if (pnode->fSocketWritable && !pnode->vSendMsg.empty())
+                SocketSendData(pnode);
+            fSendPending = !pnode->vSendMsg.empty();
+            // Whatever is left waits for the next EPOLLOUT. With nothing queued,
+            // PushMessage sends directly and EPOLLOUT comes back if that blocks.
+            pnode->fSocketWritable = false;
+        }
+    }
+
+    if (pnode->fSocketReadable && !fSendPending && pnode->hSocket != INVALID_SOCKET)
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv && !ReceiveBufferFull(pnode))
+        {
+            if (SocketRecvData(pnode))
+                return true;
+            pnode->fSocketReadable = false;
+        }
+    }
+    return false;
+}
+
+#ifdef USE_EPOLL
+//
+// Edge-triggered epoll backend. The kernel reports a socket once when it becomes
+// readable or writable; the node keeps that readiness (fSocketReadable,
+// fSocketWritable) until a recv or send runs into EWOULDBLOCK. Only nodes with
+// new events or readiness left over are serviced, so idle peers cost nothing
+// per wakeup and there is no FD_SETSIZE limit.
+//
+
+// epoll_event.data of the listening sockets, above any NodeId
+static const uint64 EPOLL_LISTEN_TAG = 1ULL << 32;
+
+static void ThreadSocketHandlerEpoll(int epollfd)
+{
+    unsigned int nPrevNodeCount = 0;
+    int64 nLastInactivityCheck = 0;
+    int nTimeout = 50;
+    // registered nodes, and the ones with readiness left over
+    std::map<NodeId, CNode*> mapRegistered;
+    std::set<NodeId> setActive;
+    struct epoll_event events[256];
+
+    for (unsigned int i = 0; i < vhListenSocket.size(); i++)
+    {
+        // level-triggered: accept one connection per wakeup, like select() did
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = EPOLL_LISTEN_TAG + i;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, vhListenSocket[i], &event) == SOCKET_ERROR)
+            LogPrintf("socket epoll_ctl listen error %d\n", errno);
+    }
+
+    loop
+    {
+        std::vector<NodeId> vRemoved;
+        DisconnectNodes(nPrevNodeCount, vRemoved);
+        BOOST_FOREACH(NodeId id, vRemoved)
+        {
+            // closing the socket took it out of the epoll set
+            mapRegistered.erase(id);
+            setActive.erase(id);
+        }
+
+        // Register new nodes. Adding a socket that is already readable reports it right away.
+        {
+            LOCK(cs_vNodes);
+            if (vNodes.size() > mapRegistered.size())
+            {
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                {
+                    if (pnode->fSocketRegistered || pnode->hSocket == INVALID_SOCKET)
+                        continue;
+                    struct epoll_event event;
+                    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    event.data.u64 = (uint64)pnode->id;
+                    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, pnode->hSocket, &event) == SOCKET_ERROR)
                     {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                        LogPrintf("socket epoll_ctl error %d\n", errno);
+                        pnode->fDisconnect = true;
+                        continue;
                     }
+                    pnode->fSocketRegistered = true;
+                    mapRegistered[pnode->id] = pnode;
                 }
             }
         }
-        if (vNodes.size() != nPrevNodeCount)
+
+        int nEvents = epoll_wait(epollfd, events, ARRAYLEN(events), nTimeout);
+        boost::this_thread::interruption_point();
+        if (nEvents == SOCKET_ERROR)
         {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(vNodes.size());
+            if (errno != EINTR)
+            {
+                LogPrintf("socket epoll_wait error %d\n", errno);
+                MilliSleep(50);
+            }
+            nEvents = 0;
         }
 
+        for (int i = 0; i < nEvents; i++)
+        {
+            uint64 nTag = events[i].data.u64;
+            if (nTag >= EPOLL_LISTEN_TAG)
+            {
+                AcceptConnection(vhListenSocket[nTag - EPOLL_LISTEN_TAG]);
+                continue;
+            }
+            std::map<NodeId, CNode*>::iterator mi = mapRegistered.find((NodeId)nTag);
+            if (mi == mapRegistered.end())
+                continue;
+            CNode* pnode = mi->second;
+            // errors and hangups show up as a failing recv
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                pnode->fSocketReadable = true;
+            if (events[i].events & EPOLLOUT)
+                pnode->fSocketWritable = true;
+            setActive.insert(pnode->id);
+        }
+
+        //
+        // Service the active sockets
+        //
+        vector<CNode*> vNodesActive;
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(NodeId id, setActive)
+            {
+                CNode* pnode = mapRegistered[id];
+                pnode->AddRef();
+                vNodesActive.push_back(pnode);
+            }
+        }
+        bool fProgress = false;
+        BOOST_FOREACH(CNode* pnode, vNodesActive)
+        {
+            boost::this_thread::interruption_point();
+
+            if (pnode->hSocket == INVALID_SOCKET)
+            {
+                setActive.erase(pnode->id);
+                continue;
+            }
+
+            if (SocketServiceNode(pnode))
+                fProgress = true;
+
+            if (!pnode->fSocketReadable && !pnode->fSocketWritable)
+                setActive.erase(pnode->id);
+        }
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesActive)
+                pnode->Release();
+        }
+
+        //
+        // Inactivity checking, once a second
+        //
+        if (GetTime() != nLastInactivityCheck)
+        {
+            nLastInactivityCheck = GetTime();
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                InactivityCheck(pnode);
+        }
+
+        // Come straight back for sockets that still have data. Sockets that wait for the
+        // message handler or a lock are polled at the old select() loop pace.
+        nTimeout = fProgress ? 0 : setActive.empty() ? 50 : 10;
+    }
+}
+#endif
+
+void ThreadSocketHandler()
+{
+#ifdef USE_EPOLL
+    int epollfd = epoll_create(256);
+    if (epollfd != SOCKET_ERROR)
+    {
+        try {
+            ThreadSocketHandlerEpoll(epollfd);
+        }
+        catch (...) {
+            close(epollfd);
+            throw;
+        }
+        close(epollfd);
+        return;
+    }
+    LogPrintf("socket epoll_create error %d, falling back to select()\n", errno);
+#endif
+
+    unsigned int nPrevNodeCount = 0;
+    loop
+    {
+        //
+        // Disconnect nodes
+        //
+        std::vector<NodeId> vRemoved;
+        DisconnectNodes(nPrevNodeCount, vRemoved);
+
 
         //
         // Find which sockets have data to receive
@@ -884,9 +1333,7 @@ void ThreadSocketHandler()
                 }
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    if (lockRecv && !ReceiveBufferFull(pnode))
                         FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
@@ -915,61 +1362,8 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-#ifdef USE_IPV6
-            struct sockaddr_storage sockaddr;
-#else
-            struct sockaddr sockaddr;
-#endif
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    LogPrintf("Warning: Unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            LogPrintf("maxconnections check %d\n", nMaxConnections - MAX_OUTBOUND_CONNECTIONS);
-            
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    LogPrintf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-            {
-                {
-                    LOCK(cs_setservAddNodeAddresses);
-                    if (!setservAddNodeAddresses.count(addr))
-                        closesocket(hSocket);
-                }
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                LogPrintf("connection from %s dropped (banned)\n", addr.ToString().c_str());
-                closesocket(hSocket);
-            }
-            else
-            {
-                LogPrintf("accepted connection %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
-        }
+            if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
 
 
         //
@@ -995,38 +1389,7 @@ void ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrintf("socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    SocketRecvData(pnode);
             }
 
             //
@@ -1041,29 +1404,7 @@ void ThreadSocketHandler()
                     SocketSendData(pnode);
             }
 
-            //
-            // Inactivity checking
-            //
-            if (pnode->vSendMsg.empty())
-                pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrintf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
-                {
-                    LogPrintf("socket not sending\n");
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastRecv > 90*60)
-                {
-                    LogPrintf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1545,7 +1886,12 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
-void ThreadMessageHandler()
+// Several of these threads run at once. A peer's messages are still handled
+// in order, by whichever thread holds its cs_vRecvMsg; messages that don't
+// need cs_main (see ProcessMessages) are then handled concurrently across
+// peers. Thread 0 also picks the sync node and sends the periodic messages,
+// so trickling works as it did with a single thread.
+void ThreadMessageHandler(int nThread, int nThreads)
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
@@ -1563,18 +1909,21 @@ void ThreadMessageHandler()
             }
         }
 
-        if (!fHaveSyncNode)
+        if (nThread == 0 && !fHaveSyncNode)
             StartSync(vNodesCopy);
 
         // Poll the connected nodes for messages
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (nThread == 0 && !vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
         bool fSleep = true;
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        // Start each thread at a different node so they don't queue up behind each other
+        unsigned int nOffset = vNodesCopy.size() * nThread / nThreads;
+        for (unsigned int i = 0; i < vNodesCopy.size(); i++)
         {
+            CNode* pnode = vNodesCopy[(nOffset + i) % vNodesCopy.size()];
             if (pnode->fDisconnect)
                 continue;
 
@@ -1598,6 +1947,7 @@ void ThreadMessageHandler()
             boost::this_thread::interruption_point();
 
             // Send messages
+            if (nThread == 0)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
@@ -1789,6 +2139,7 @@ void StartNode(boost::thread_group& threadGroup)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
     Discover();
+    InitRelaySalts();
 
     //
     // Start threads
@@ -1814,7 +2165,11 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMessageHandlerThreads = GetArg("-msghandthreads", min((int)boost::thread::hardware_concurrency(), DEFAULT_MESSAGE_HANDLER_THREADS));
+    nMessageHandlerThreads = max(1, min(nMessageHandlerThreads, MAX_MESSAGE_HANDLER_THREADS));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand",
+                                              boost::function<void()>(boost::bind(&ThreadMessageHandler, i, nMessageHandlerThreads))));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1893,8 +2248,9 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved,
+        // ready to go out to every peer that asks for it
+        mapRelay.insert(std::make_pair(inv, MakeNetMessage(inv.GetCommand(), ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -1917,6 +2273,10 @@ void RelayTransactionLockReq(const CTransaction& tx, const uint256& hash)
 {
     CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
 
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx << pindexBest->nHeight-10;
+    CNetMessageRef msg = MakeNetMessage("txlreq", ss);
+
     //broadcast the new lock
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -1924,17 +2284,21 @@ void RelayTransactionLockReq(const CTransaction& tx, const uint256& hash)
         if(!pnode->fRelayTxes)
             continue;
 
-        pnode->PushMessage("txlreq", tx, pindexBest->nHeight-10);
+        pnode->PushSharedMessage(msg);
     }
 
 }
 
 void RelayDarkSendFinalTransaction(const int sessionID, const CTransaction& txNew)
 {
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << sessionID << txNew;
+    CNetMessageRef msg = MakeNetMessage("dsf", ss);
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
-        pnode->PushMessage("dsf", sessionID, txNew);
+        pnode->PushSharedMessage(msg);
     }
 }
 
@@ -1952,48 +2316,68 @@ void RelayDarkSendIn(const std::vector<CTxIn>& in, const int64& nAmount, const C
 
 void RelayDarkSendStatus(const int sessionID, const int newState, const int newEntriesCount, const int newAccepted, const std::string error)
 {
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << sessionID << newState << newEntriesCount << newAccepted << error;
+    CNetMessageRef msg = MakeNetMessage("dssu", ss);
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
-        pnode->PushMessage("dssu", sessionID, newState, newEntriesCount, newAccepted, error);
+        pnode->PushSharedMessage(msg);
     }
 }
 
 void RelayDarkSendElectionEntry(const CTxIn vin, const CService addr, const std::vector<unsigned char> vchSig, const int64 nNow, const CPubKey pubkey, const CPubKey pubkey2, const int count, const int current, const int64 lastUpdated)
 {
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << vin << addr << vchSig << nNow << pubkey << pubkey2 << count << current << lastUpdated;
+    CNetMessageRef msg = MakeNetMessage("dsee", ss);
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
         if(!pnode->fRelayTxes) continue;
 
-        pnode->PushMessage("dsee", vin, addr, vchSig, nNow, pubkey, pubkey2, count, current, lastUpdated);
+        pnode->PushSharedMessage(msg);
     }
 }
 
 void RelayDarkSendElectionEntryPing(const CTxIn vin, const std::vector<unsigned char> vchSig, const int64 nNow, const bool stop)
 {
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << vin << vchSig << nNow << stop;
+    CNetMessageRef msg = MakeNetMessage("dseep", ss);
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
         if(!pnode->fRelayTxes) continue;
         
-        pnode->PushMessage("dseep", vin, vchSig, nNow, stop);
+        pnode->PushSharedMessage(msg);
     }
 }
 
 void RelayDarkSendCompletedTransaction(const int sessionID, const bool error, const std::string errorMessage)
 {
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << sessionID << error << errorMessage;
+    CNetMessageRef msg = MakeNetMessage("dsc", ss);
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
-        pnode->PushMessage("dsc", sessionID, error, errorMessage);
+        pnode->PushSharedMessage(msg);
     }
 }
 
 void RelayDarkSendTransaction(const CTransaction txNew, const CTxIn vin, const std::vector<unsigned char> vchSig, const int64 sigTime){
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << txNew << vin << vchSig << sigTime;
+    CNetMessageRef msg = MakeNetMessage("dstx", ss);
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes) {
         if(!pnode->fRelayTxes) continue;
-        pnode->PushMessage("dstx", txNew, vin, vchSig, sigTime);
+        pnode->PushSharedMessage(msg);
     }
 }
\ No newline at end of file
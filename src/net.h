@@ -8,6 +8,7 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
@@ -30,6 +31,14 @@ extern int nBestHeight;
 
 
 
+/** A complete message, header and payload, serialized and checksummed once
+ *  and then queued to any number of peers without being copied */
+typedef boost::shared_ptr<const CSerializeData> CNetMessageRef;
+
+// The payload is serialized with SER_NETWORK, PROTOCOL_VERSION, so it can
+// only be shared for types whose encoding doesn't depend on the peer version
+CNetMessageRef MakeNetMessage(const char* pszCommand, const CDataStream& ssPayload);
+
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 
@@ -82,7 +91,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CNetMessageRef> mapRelay;
 extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64> mapAlreadyAskedFor;
@@ -126,6 +135,7 @@ public:
 
     CDataStream vRecv;              // received message data
     unsigned int nDataPos;
+    SHA256_CTX ctxChecksum;         // hash of the data received so far
 
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
@@ -149,10 +159,20 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
-};
 
+    // Bytes of the payload still to come, and where they go. The socket
+    // handler reads large payloads straight into vRecv and reports them
+    // with DataReceived(), instead of copying them in through readData().
+    unsigned int GetDataRemaining() const { return in_data ? hdr.nMessageSize - nDataPos : 0; }
+    char* GetDataSpace() { return &vRecv[nDataPos]; }
+    void DataReceived(unsigned int nBytes);
 
+    // Double SHA256 of the payload, for checking hdr.nChecksum once complete
+    uint256 GetChecksumHash();
 
+    // Hand the payload buffer back for the next messages, once handled
+    void Recycle();
+};
 
 
 /** Information about a peer */
@@ -166,7 +186,7 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64 nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CNetMessageRef> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -207,6 +227,10 @@ public:
     CBloomFilter* pfilter;
     int nRefCount;
     NodeId id;
+    // socket readiness reported by the epoll backend, kept until a recv or send would block
+    bool fSocketRegistered;
+    bool fSocketReadable;
+    bool fSocketWritable;
 protected:
 
     // Denial-of-service detection/prevention
@@ -226,6 +250,7 @@ public:
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
+    CCriticalSection cs_addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
     uint256 hashCheckpointKnown;
@@ -261,6 +286,9 @@ public:
         hashCheckpointKnown = 0;
         fAskedForBlocks = false;
         nRefCount = 0;
+        fSocketRegistered = false;
+        fSocketReadable = false;
+        fSocketWritable = false;
         nSendSize = 0;
         nSendOffset = 0;
         hashContinue = 0;
@@ -343,6 +371,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addrKnown);
         setAddrKnown.insert(addr);
     }
 
@@ -351,6 +380,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrKnown);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
@@ -449,17 +479,32 @@ public:
 
         LogPrint("net2", "(%d bytes)\n", nSize);
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        CSerializeData* pdata = new CSerializeData();
+        ssSend.GetAndClear(*pdata);
+        vSendMsg.push_back(CNetMessageRef(pdata));
+        nSendSize += pdata->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
 
         LEAVE_CRITICAL_SECTION(cs_vSend);
     }
 
+    // Queue a message from MakeNetMessage, shared with the other peers it goes to
+    void PushSharedMessage(const CNetMessageRef& msg)
+    {
+        LOCK(cs_vSend);
+        LogPrint("net2", "sending (peer=%d): shared message (%"PRIszu" bytes)\n", id, msg->size());
+
+        vSendMsg.push_back(msg);
+        nSendSize += msg->size();
+
+        // If write queue empty, attempt "optimistic write"
+        if (vSendMsg.size() == 1)
+            SocketSendData(this);
+    }
+
     void PushVersion();
 
 
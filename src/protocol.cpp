@@ -34,12 +34,19 @@ void GetMessageStart(unsigned char pchMessageStart[], bool fPersistent)
         memcpy(pchMessageStart, (fPersistent || GetAdjustedTime() > nMessageStartSwitchTime)? pchMessageStartDarkcoin : pchMessageStartLitecoin, sizeof(pchMessageStartDarkcoin));
 }
 
+// Indexed by inv type. Every entry counts as known to CInv::IsKnownType, so
+// the txlock types can be named in logs and looked up in getdata; since lock
+// requests are pushed to peers directly and never enter mapRelay, a getdata
+// for one still gets no reply.
 static const char* ppszTypeName[] =
 {
     "ERROR",
     "tx",
     "block",
-    "filtered block"
+    "filtered block",
+    "txlock request",
+    "txlock",
+    "compact block"
 };
 
 CMessageHeader::CMessageHeader()
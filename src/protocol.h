@@ -69,6 +69,8 @@ enum
 {
     NODE_NETWORK = (1 << 0),
     NODE_BLOOM = (1 << 1),
+    // Serves and understands cmpctblock, getblocktxn and blocktxn
+    NODE_COMPACT_BLOCKS = (1 << 2),
 };
 
 /** A CService with information about it as peer */
@@ -144,6 +146,8 @@ enum
     MSG_FILTERED_BLOCK,
     MSG_TXLOCK_REQUEST,
     MSG_TXLOCK,
+    // Only in getdata, to ask a NODE_COMPACT_BLOCKS peer for a cmpctblock
+    MSG_CMPCT_BLOCK,
 };
 
 #endif // __INCLUDED_PROTOCOL_H__
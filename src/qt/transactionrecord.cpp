@@ -173,9 +173,8 @@ QList<TransactionRecord> TransactionRecord::decomposeTransaction(const CWallet *
             {
                 const CTxOut& txout = wtx.vout[nOut];
 
-                BOOST_FOREACH(int64 d, darkSendDenominations)
-                    if(txout.nValue == d)
-                        isDarksent = true;
+                if(IsDenominatedAmount(txout.nValue))
+                    isDarksent = true;
             }
 
             parts.append(TransactionRecord(hash, nTime, isDarksent ? TransactionRecord::DarksendDenominate : TransactionRecord::Other, "", nNet, 0));
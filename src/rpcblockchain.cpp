@@ -135,6 +135,49 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns details on the state of the transaction memory pool:\n"
+            "  \"size\" : number of transactions\n"
+            "  \"bytes\" : sum of their serialized sizes\n"
+            "  \"usage\" : estimated memory usage of the pool\n"
+            "  \"maxmempool\" : memory budget of the pool, see -maxmempool\n"
+            "  \"mempoolminfee\" : fee per kB a new transaction needs to get in while the pool is full");
+
+    Object ret;
+    ret.push_back(Pair("size", (boost::int64_t)mempool.size()));
+    ret.push_back(Pair("bytes", (boost::int64_t)mempool.GetTotalTxSize()));
+    ret.push_back(Pair("usage", (boost::int64_t)mempool.DynamicMemoryUsage()));
+    ret.push_back(Pair("maxmempool", (boost::int64_t)GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount((int64)mempool.GetMinFeeRate())));
+    return ret;
+}
+
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns details on the signature cache:\n"
+            "  \"lookups\" : signatures looked up in the cache\n"
+            "  \"hits\" : lookups that found the signature already verified\n"
+            "  \"hitrate\" : hits per lookup\n"
+            "  \"bytes\" : size of the cache table, see -maxsigcachesize");
+
+    uint64 nLookups, nHits, nBytes;
+    GetSignatureCacheStats(nLookups, nHits, nBytes);
+
+    Object ret;
+    ret.push_back(Pair("lookups", (boost::int64_t)nLookups));
+    ret.push_back(Pair("hits", (boost::int64_t)nHits));
+    ret.push_back(Pair("hitrate", nLookups ? (double)nHits / nLookups : 0.0));
+    ret.push_back(Pair("bytes", (boost::int64_t)nBytes));
+    return ret;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
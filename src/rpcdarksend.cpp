@@ -76,10 +76,15 @@ Value getpoolinfo(const Array& params, bool fHelp)
 
     Object obj;
     obj.push_back(Pair("connected_to_masternode",        activeMasternode.masterNodeAddr));
-    obj.push_back(Pair("current_masternode",        GetCurrentMasterNode()));
+    CMasterNode mnCurrent;
+    obj.push_back(Pair("current_masternode",        masternodeList.GetCurrentMasterNode(mnCurrent) ? mnCurrent.addr.ToString() : "unknown"));
     obj.push_back(Pair("state",        darkSendPool.GetState()));
     obj.push_back(Pair("entries",      darkSendPool.GetEntriesCount()));
     obj.push_back(Pair("entries_accepted",      darkSendPool.GetCountEntriesAccepted()));
+    uint64 nRankCacheHits, nRankCacheMisses;
+    masternodeList.GetRankCacheStats(nRankCacheHits, nRankCacheMisses);
+    obj.push_back(Pair("rank_cache_hits",      (boost::int64_t)nRankCacheHits));
+    obj.push_back(Pair("rank_cache_misses",      (boost::int64_t)nRankCacheMisses));
     return obj;
 }
 
@@ -138,32 +143,33 @@ Value masternode(const Array& params, bool fHelp)
         }
 
         Object obj;
-        BOOST_FOREACH(CMasterNode mn, darkSendMasterNodes) {
-            mn.Check();   
+        masternodeList.CheckAll();
+        std::vector<CMasterNodePtr> vpmn = masternodeList.GetAll();
+        BOOST_FOREACH(const CMasterNodePtr& pmn, vpmn) {
 
             if(strCommand == "active"){
-                obj.push_back(Pair(mn.addr.ToString().c_str(),       (int)mn.IsEnabled()));
+                obj.push_back(Pair(pmn->addr.ToString().c_str(),       (int)pmn->IsEnabled()));
             } else if (strCommand == "vin") {
-                obj.push_back(Pair(mn.addr.ToString().c_str(),       mn.vin.prevout.hash.ToString().c_str()));
+                obj.push_back(Pair(pmn->addr.ToString().c_str(),       pmn->vin.prevout.hash.ToString().c_str()));
             } else if (strCommand == "pubkey") {
                 CScript pubkey;
-                pubkey.SetDestination(mn.pubkey.GetID());
+                pubkey.SetDestination(pmn->pubkey.GetID());
                 CTxDestination address1;
                 ExtractDestination(pubkey, address1);
                 CBitcoinAddress address2(address1);
 
-                obj.push_back(Pair(mn.addr.ToString().c_str(),       address2.ToString().c_str()));
+                obj.push_back(Pair(pmn->addr.ToString().c_str(),       address2.ToString().c_str()));
             } else if (strCommand == "lastseen") {
-                obj.push_back(Pair(mn.addr.ToString().c_str(),       (int64_t)mn.lastTimeSeen));
+                obj.push_back(Pair(pmn->addr.ToString().c_str(),       (int64_t)pmn->lastTimeSeen));
             } else if (strCommand == "activeseconds") {
-                obj.push_back(Pair(mn.addr.ToString().c_str(),       (int64_t)(mn.lastTimeSeen - mn.now)));
+                obj.push_back(Pair(pmn->addr.ToString().c_str(),       (int64_t)(pmn->lastTimeSeen - pmn->now)));
             } else if (strCommand == "rank") {
-                obj.push_back(Pair(mn.addr.ToString().c_str(),       (int)(GetMasternodeRank(mn.vin, 1))));
+                obj.push_back(Pair(pmn->addr.ToString().c_str(),       (int)(masternodeList.GetMasternodeRank(pmn->vin, 1))));
             }
         }
         return obj;
     }
-    if (strCommand == "count") return (int)darkSendMasterNodes.size();
+    if (strCommand == "count") return (int)masternodeList.size();
 
     if (strCommand == "start")
     {
@@ -256,9 +262,9 @@ Value masternode(const Array& params, bool fHelp)
 
     if (strCommand == "current")
     {
-        int winner = GetCurrentMasterNode(1);
-        if(winner >= 0) {
-            return darkSendMasterNodes[winner].addr.ToString().c_str();
+        CMasterNode mnWinner;
+        if(masternodeList.GetCurrentMasterNode(mnWinner, 1)) {
+            return mnWinner.addr.ToString().c_str();
         }
 
         return "unknown";
@@ -286,7 +286,9 @@ Value getworkex(const Array& params, bool fHelp)
         pblock->nNonce = pdata->nNonce;
 
         if(coinbase.size() == 0)
+        {
             pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
+        }
         else
             CDataStream(coinbase, SER_NETWORK, PROTOCOL_VERSION) >> pblock->vtx[0];
 
@@ -422,6 +424,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"transactions\" : contents of non-coinbase transactions that should be included in the next block\n"
             "  \"coinbaseaux\" : data that should be included in coinbase\n"
             "  \"coinbasevalue\" : maximum allowable input to coinbase transaction, including the generation award and transaction fees\n"
+            "  \"longpollid\" : pass back as \"longpollid\" to wait until the template changes\n"
             "  \"target\" : hash target\n"
             "  \"mintime\" : minimum timestamp appropriate for next block\n"
             "  \"curtime\" : current timestamp\n"
@@ -439,6 +442,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
+    Value lpval;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
@@ -451,6 +455,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
         }
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
+        lpval = find_value(oparam, "longpollid");
     }
 
     if (strMode != "template")
@@ -459,37 +464,69 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (vNodes.empty())
         throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "DarkCoin is not connected!");
 
-    if (IsInitialBlockDownload())
-        throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "DarkCoin is downloading blocks...");
+    {
+        LOCK(cs_main);
+        if (IsInitialBlockDownload())
+            throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "DarkCoin is downloading blocks...");
+    }
 
-    // Update block
-    static unsigned int nTransactionsUpdatedLast;
+    // Long polling: hold the request until the best block changes, or the memory pool has
+    // changed and at least a minute has passed. This runs without cs_main.
+    if (lpval.type() != null_type)
+    {
+        if (lpval.type() != str_type || lpval.get_str().size() < 64)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+
+        // Format: <hashBestChain><nTransactionsUpdated>
+        std::string lpstr = lpval.get_str();
+        uint256 hashWatchedChain;
+        hashWatchedChain.SetHex(lpstr.substr(0, 64));
+        unsigned int nTransactionsUpdatedLastLP = atoi(lpstr.substr(64));
+
+        boost::system_time checktxtime = boost::get_system_time() + boost::posix_time::minutes(1);
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        while (hashBestChain == hashWatchedChain && !ShutdownRequested())
+        {
+            if (!cvBlockChange.timed_wait(lock, checktxtime))
+            {
+                // Timeout: check the memory pool every ten seconds from here on
+                if (nTransactionsUpdated != nTransactionsUpdatedLastLP)
+                    break;
+                checktxtime += boost::posix_time::seconds(10);
+            }
+        }
+        if (ShutdownRequested())
+            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+    }
+
+    LOCK(cs_main);
+
+    // The template itself is kept up to date by blockTemplateCache; keep a copy of it for
+    // as long as it doesn't change, since the caller may be holding on to an older version.
+    // Memory pool changes are taken in at most every five seconds.
+    static const int64 nTemplateInterval = 5;
+    static uint64 nVersionLast = (uint64)-1;
     static CBlockIndex* pindexPrev;
-    static int64 nStart;
     static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != pindexBest ||
-        (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+    if (!pblocktemplate || pindexPrev != pindexBest || !blockTemplateCache.Update(nTemplateInterval) ||
+        nVersionLast != blockTemplateCache.GetVersion())
     {
         // Clear pindexPrev so future calls make a new block, despite any failures from here on
         pindexPrev = NULL;
-
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = nTransactionsUpdated;
         CBlockIndex* pindexPrevNew = pindexBest;
-        nStart = GetTime();
 
-        // Create new block
         if(pblocktemplate)
         {
             delete pblocktemplate;
             pblocktemplate = NULL;
         }
         CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = CreateNewBlock(scriptDummy);
+        pblocktemplate = blockTemplateCache.Get(scriptDummy, nTemplateInterval);
         if (!pblocktemplate)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+        nVersionLast = blockTemplateCache.GetVersion();
 
-        // Need to update only after we know CreateNewBlock succeeded
+        // Need to update only after we know the template was built
         pindexPrev = pindexPrevNew;
     }
     CBlock* pblock = &pblocktemplate->block; // pointer for convenience
@@ -552,6 +589,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
     result.push_back(Pair("transactions", transactions));
     result.push_back(Pair("coinbaseaux", aux));
+    result.push_back(Pair("longpollid", hashBestChain.GetHex() + strprintf("%u", nTransactionsUpdated)));
     result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].GetValueOut()));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
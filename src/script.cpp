@@ -3,7 +3,6 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 using namespace boost;
@@ -17,7 +16,7 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashContext* psighash);
 
 
 
@@ -290,7 +289,7 @@ bool IsCanonicalSignature(const valtype &vchSig) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashContext* psighash)
 {
     CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
@@ -844,7 +843,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                     bool fSuccess = (!fStrictEncodings || (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
                     if (fSuccess)
-                        fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighash);
 
                     popstack(stack);
                     popstack(stack);
@@ -906,7 +905,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         // Check signature
                         bool fOk = (!fStrictEncodings || (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
                         if (fOk)
-                            fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighash);
 
                         if (fOk) {
                             isig++;
@@ -1025,67 +1024,160 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
     return ss.GetHash();
 }
 
+// Every input is serialized with an empty scriptSig: prevout, one zero length byte, nSequence
+static const unsigned int SIGHASH_BLANK_INPUT_SIZE = 36 + 1 + 4;
 
-// Valid signature cache, to avoid doing expensive ECDSA signature checking
-// twice for every transaction (once when accepted into memory pool, and
-// again when accepted into the block chain)
+CSignatureHashContext::CSignatureHashContext(const CTransaction& txToIn) : txTo(txToIn), ssAnyoneCanPay(SER_GETHASH, 0)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    WriteCompactSize(ss, txTo.vin.size());
+    nInputsBegin = ss.size();
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
+        ss << txin.prevout << CScript() << txin.nSequence;
+    nOutputsBegin = ss.size();
+    ss << txTo.vout << txTo.nLockTime;
+    vchData.assign(ss.begin(), ss.end());
+
+    // Hash states just before each input
+    CHashWriter ssPrefix(SER_GETHASH, 0);
+    ssPrefix.write((const char*)&vchData[0], nInputsBegin);
+    vMidstate.reserve(txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        vMidstate.push_back(ssPrefix);
+        ssPrefix.write((const char*)&vchData[nInputsBegin + i * SIGHASH_BLANK_INPUT_SIZE], SIGHASH_BLANK_INPUT_SIZE);
+    }
 
-class CSignatureCache
+    // SIGHASH_ANYONECANPAY hashes the signed input as the only one
+    ssAnyoneCanPay << txTo.nVersion;
+    WriteCompactSize(ssAnyoneCanPay, 1);
+}
+
+uint256 CSignatureHashContext::SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const
 {
-private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    if (nIn >= txTo.vin.size() || (nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE)
+        return ::SignatureHash(scriptCode, txTo, nIn, nHashType);
 
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    unsigned int nInputBegin = nInputsBegin + nIn * SIGHASH_BLANK_INPUT_SIZE;
+    CHashWriter ss(nHashType & SIGHASH_ANYONECANPAY ? ssAnyoneCanPay : vMidstate[nIn]);
+    ss.write((const char*)&vchData[nInputBegin], 36);
+    ss << scriptCode;
+    ss.write((const char*)&vchData[nInputBegin + 37], 4);
+
+    // The other inputs, unless they're left out, then the outputs and nLockTime
+    unsigned int nRestBegin = (nHashType & SIGHASH_ANYONECANPAY) ? nOutputsBegin : nInputBegin + SIGHASH_BLANK_INPUT_SIZE;
+    ss.write((const char*)&vchData[nRestBegin], vchData.size() - nRestBegin);
+    ss << nHashType;
+    return ss.GetHash();
+}
+
+
+CSignatureCache::CSignatureCache(int64 nMaxCacheSize)
+{
+    uint256 salt = GetRandHash();
+    SHA256_Init(&ctxSalted);
+    SHA256_Update(&ctxSalted, salt.begin(), salt.size());
+
+    // DoS prevention: the table has a fixed size, set in megabytes.
+    // New entries push out old ones in their bucket.
+    nMaxCacheSize = std::min(std::max((int64)0, nMaxCacheSize), MAX_SIG_CACHE_SIZE);
+    nBuckets = (size_t)(nMaxCacheSize * 1000000 / sizeof(CBucket));
+    pBuckets = NULL;
+    if (nBuckets > 0)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        vchTable.assign(nBuckets * sizeof(CBucket) + BUCKET_ALIGN, 0);
+        pBuckets = (CBucket*)(((size_t)&vchTable[0] + BUCKET_ALIGN - 1) & ~(BUCKET_ALIGN - 1));
+    }
+    for (unsigned int i = 0; i < NUM_SHARDS; i++)
+        shards[i].nLookups = shards[i].nHits = 0;
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+uint256 CSignatureCache::GetKey(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+{
+    SHA256_CTX ctx = ctxSalted;
+    unsigned int nSigSize = vchSig.size();
+    SHA256_Update(&ctx, hash.begin(), hash.size());
+    SHA256_Update(&ctx, &nSigSize, sizeof(nSigSize));
+    if (nSigSize)
+        SHA256_Update(&ctx, &vchSig[0], nSigSize);
+    SHA256_Update(&ctx, pubKey.begin(), pubKey.size());
+    uint256 key;
+    SHA256_Final((unsigned char*)&key, &ctx);
+    return key;
+}
+
+bool CSignatureCache::Get(const uint256 &key)
+{
+    if (!nBuckets)
         return false;
+    size_t nBucket = key.Get64() % nBuckets;
+    CShard& shard = shards[nBucket % NUM_SHARDS];
+    boost::unique_lock<boost::mutex> lock(shard.mutex);
+    shard.nLookups++;
+    const CBucket& bucket = pBuckets[nBucket];
+    if (bucket.entry[0] == key || bucket.entry[1] == key)
+    {
+        shard.nHits++;
+        return true;
     }
+    return false;
+}
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+void CSignatureCache::Set(const uint256 &key)
+{
+    if (!nBuckets)
+        return;
+    size_t nBucket = key.Get64() % nBuckets;
+    CShard& shard = shards[nBucket % NUM_SHARDS];
+    boost::unique_lock<boost::mutex> lock(shard.mutex);
+    CBucket& bucket = pBuckets[nBucket];
+    if (bucket.entry[0] == key || bucket.entry[1] == key)
+        return;
+    // Fill an empty slot, or else evict the slot picked by a bit of the
+    // salted key, which peers can't predict
+    if (bucket.entry[0] == 0)
+        bucket.entry[0] = key;
+    else if (bucket.entry[1] == 0)
+        bucket.entry[1] = key;
+    else
+        bucket.entry[key.Get64(1) & 1] = key;
+}
+
+void CSignatureCache::GetStats(uint64& nLookups, uint64& nHits, uint64& nBytes)
+{
+    nLookups = nHits = 0;
+    nBytes = nBuckets * sizeof(CBucket);
+    for (unsigned int i = 0; i < NUM_SHARDS; i++)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        boost::unique_lock<boost::mutex> lock(shards[i].mutex);
+        nLookups += shards[i].nLookups;
+        nHits += shards[i].nHits;
+    }
+}
 
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+static CSignatureCache& GetSignatureCache()
+{
+    static CSignatureCache signatureCache(GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE));
+    return signatureCache;
+}
 
-        while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
-        }
+void InitSignatureCache()
+{
+    GetSignatureCache();
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
-    }
-};
+void GetSignatureCacheStats(uint64& nLookups, uint64& nHits, uint64& nBytes)
+{
+    GetSignatureCache().GetStats(nLookups, nHits, nBytes);
+}
 
 bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashContext* psighash)
 {
-    static CSignatureCache signatureCache;
+    CSignatureCache& signatureCache = GetSignatureCache();
 
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
@@ -1100,16 +1192,17 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = psighash ? psighash->SignatureHash(scriptCode, nIn, nHashType) : SignatureHash(scriptCode, txTo, nIn, nHashType);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    uint256 key = signatureCache.GetKey(sighash, vchSig, pubkey);
+    if (signatureCache.Get(key))
         return true;
 
     if (!pubkey.Verify(sighash, vchSig))
         return false;
 
     if (!(flags & SCRIPT_VERIFY_NOCACHE))
-        signatureCache.Set(sighash, vchSig, pubkey);
+        signatureCache.Set(key);
 
     return true;
 }
@@ -1118,7 +1211,6 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
 
 
 
-
 typedef struct {
     txnouttype      txType;
     CScript         *tScript;
@@ -1557,14 +1649,14 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CSignatureHashContext* psighash)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, psighash))
         return false;
     if (flags & SCRIPT_VERIFY_P2SH)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, psighash))
         return false;
     if (stack.empty())
         return false;
@@ -1587,7 +1679,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, psighash))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1598,14 +1690,15 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
 }
 
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashContext* psighash)
 {
+    assert(!psighash || &psighash->GetTransaction() == &txTo);
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
-    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
+    uint256 hash = psighash ? psighash->SignatureHash(fromPubKey, nIn, nHashType) : SignatureHash(fromPubKey, txTo, nIn, nHashType);
 
     txnouttype whichType;
     if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
@@ -1619,7 +1712,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         CScript subscript = txin.scriptSig;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
-        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
+        uint256 hash2 = psighash ? psighash->SignatureHash(subscript, nIn, nHashType) : SignatureHash(subscript, txTo, nIn, nHashType);
 
         txnouttype subType;
         bool fSolved =
@@ -1630,17 +1723,17 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     }
 
     // Test solution
-    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, 0);
+    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, 0, psighash);
 }
 
-bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashContext* psighash)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
     assert(txin.prevout.n < txFrom.vout.size());
     const CTxOut& txout = txFrom.vout[txin.prevout.n];
 
-    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
+    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType, psighash);
 }
 
 static CScript PushAll(const vector<valtype>& values)
@@ -1681,7 +1774,7 @@ static CScript CombineMultisig(CScript scriptPubKey, const CTransaction& txTo, u
             if (sigs.count(pubkey))
                 continue; // Already got a sig for this pubkey
 
-            if (CheckSig(sig, pubkey, scriptPubKey, txTo, nIn, 0, 0))
+            if (CheckSig(sig, pubkey, scriptPubKey, txTo, nIn, 0, 0, NULL))
             {
                 sigs[pubkey] = sig;
                 break;
@@ -13,11 +13,16 @@
 
 #include "keystore.h"
 #include "bignum.h"
+#include "hash.h"
 
 class CCoins;
 class CTransaction;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
+/** Default for -maxsigcachesize, the signature cache size in megabytes */
+static const int64 DEFAULT_MAX_SIG_CACHE_SIZE = 10;
+/** Largest accepted -maxsigcachesize, in megabytes */
+static const int64 MAX_SIG_CACHE_SIZE = 1024;
 
 /** Signature hash types/flags */
 enum
@@ -666,10 +671,35 @@ public:
     }
 };
 
+/** Signature hashes for the inputs of one transaction.
+ *  The transaction is serialized once with every scriptSig blanked, and the
+ *  hash state up to each input is kept, so each input's SIGHASH_ALL hash only
+ *  hashes its own script code and what follows it instead of copying and
+ *  reserializing the whole transaction. Other hash types go through
+ *  SignatureHash(). The results are the same as SignatureHash() for as long
+ *  as the transaction doesn't change other than in its scriptSigs.
+ */
+class CSignatureHashContext
+{
+private:
+    const CTransaction& txTo;
+    std::vector<unsigned char> vchData;
+    unsigned int nInputsBegin;
+    unsigned int nOutputsBegin;
+    std::vector<CHashWriter> vMidstate;
+    CHashWriter ssAnyoneCanPay;
+
+public:
+    explicit CSignatureHashContext(const CTransaction& txToIn);
+
+    const CTransaction& GetTransaction() const { return txTo; }
+    uint256 SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const;
+};
+
 bool IsCanonicalPubKey(const std::vector<unsigned char> &vchPubKey);
 bool IsCanonicalSignature(const std::vector<unsigned char> &vchSig);
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashContext* psighash=NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey);
@@ -678,9 +708,59 @@ bool IsMine(const CKeyStore& keystore, const CTxDestination &dest);
 bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet);
 bool ExtractDestinationAndMine(const CKeyStore &keystore, const CScript& scriptPubKey, CTxDestination& addressRet, bool *outMine);
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
-bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, const CSignatureHashContext* psighash=NULL);
+bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, const CSignatureHashContext* psighash=NULL);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashContext* psighash=NULL);
+
+/** Valid signature cache, to avoid doing expensive ECDSA signature checking
+ *  twice for every transaction (once when accepted into memory pool, and
+ *  again when accepted into the block chain).
+ *  Entries are salted SHA256 hashes of (signature hash, signature, public key),
+ *  so they are small and fixed size and peers can't aim collisions at them.
+ *  Two entries make up a cache line sized bucket. The buckets are split over
+ *  shards with a lock each, so the -par script threads rarely wait on each other.
+ */
+class CSignatureCache
+{
+private:
+    struct CBucket
+    {
+        uint256 entry[2];
+    };
+
+    struct CShard
+    {
+        boost::mutex mutex;
+        uint64 nLookups;
+        uint64 nHits;
+    };
+
+    static const unsigned int NUM_SHARDS = 32;
+    static const size_t BUCKET_ALIGN = 64;
+
+    SHA256_CTX ctxSalted;
+    std::vector<unsigned char> vchTable;
+    CBucket* pBuckets;
+    size_t nBuckets;
+    CShard shards[NUM_SHARDS];
+
+    CSignatureCache(const CSignatureCache&);
+    CSignatureCache& operator=(const CSignatureCache&);
+
+public:
+    /** nMaxCacheSize is in megabytes, clamped to 0..MAX_SIG_CACHE_SIZE */
+    explicit CSignatureCache(int64 nMaxCacheSize);
+
+    uint256 GetKey(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const;
+    bool Get(const uint256 &key);
+    void Set(const uint256 &key);
+    void GetStats(uint64& nLookups, uint64& nHits, uint64& nBytes);
+};
+
+/** Allocate the signature cache sized by -maxsigcachesize. Called from AppInit2
+ *  so the allocation doesn't happen on a script check thread. */
+void InitSignatureCache();
+void GetSignatureCacheStats(uint64& nLookups, uint64& nHits, uint64& nBytes);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
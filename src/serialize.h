@@ -1088,6 +1088,11 @@ public:
         vch.swap(data);
         CSerializeData().swap(vch);
     }
+
+    void Swap(CSerializeData &data) {
+        vch.swap(data);
+        nReadPos = 0;
+    }
 };
 
 
@@ -1358,4 +1363,39 @@ public:
     }
 };
 
+/** Reads the unread part of a CDataStream in place, without copying it or
+ *  moving the stream's read position, so a message can be looked at before
+ *  it's handled.
+ */
+class CDataStreamPeek
+{
+private:
+    const CDataStream& stream;
+    unsigned int nReadPos;
+
+public:
+    int nType;
+    int nVersion;
+
+    explicit CDataStreamPeek(const CDataStream& streamIn) :
+        stream(streamIn), nReadPos(0), nType(streamIn.nType), nVersion(streamIn.nVersion) {
+    }
+
+    CDataStreamPeek& read(char* pch, size_t nSize) {
+        if (nSize > stream.size() - nReadPos)
+            throw std::ios_base::failure("CDataStreamPeek::read() : end of data");
+        if (nSize > 0)
+            memcpy(pch, &stream.begin()[nReadPos], nSize);
+        nReadPos += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CDataStreamPeek& operator>>(T& obj) {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #endif
@@ -275,6 +275,10 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
 
     BOOST_CHECK_MESSAGE(nManyValidate < nOneValidate, "Signature cache timing failed");
 
+    uint64 nLookups, nHits, nBytes;
+    GetSignatureCacheStats(nLookups, nHits, nBytes);
+    BOOST_CHECK(nHits > 0 && nHits <= nLookups);
+
     // Empty a signature, validation should fail:
     CScript save = tx.vin[0].scriptSig;
     tx.vin[0].scriptSig = CScript();
@@ -287,17 +291,55 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
     BOOST_CHECK(!VerifySignature(CCoins(orphans[1], MEMPOOL_HEIGHT), tx, 1, flags, SIGHASH_ALL));
     std::swap(tx.vin[0].scriptSig, tx.vin[1].scriptSig);
 
-    // Exercise -maxsigcachesize code:
-    mapArgs["-maxsigcachesize"] = "10";
-    // Generate a new, different signature for vin[0] to trigger cache clear:
+    // Generate a new, different signature for vin[0]:
     CScript oldSig = tx.vin[0].scriptSig;
     BOOST_CHECK(SignSignature(keystore, orphans[0], tx, 0));
     BOOST_CHECK(tx.vin[0].scriptSig != oldSig);
     for (unsigned int j = 0; j < tx.vin.size(); j++)
         BOOST_CHECK(VerifySignature(CCoins(orphans[j], MEMPOOL_HEIGHT), tx, j, flags, SIGHASH_ALL));
-    mapArgs.erase("-maxsigcachesize");
 
     LimitOrphanTxSize(0);
 }
 
+BOOST_AUTO_TEST_CASE(DoS_sigcache)
+{
+    // A 1 MB table: 15625 buckets of two entries
+    CSignatureCache cache(1);
+    uint64 nLookups, nHits, nBytes;
+    cache.GetStats(nLookups, nHits, nBytes);
+    BOOST_CHECK_EQUAL(nBytes, 15625U * 64);
+    BOOST_CHECK_EQUAL(nLookups, 0U);
+
+    // Fill it to three times its capacity
+    std::vector<uint256> vKeys;
+    for (unsigned int i = 0; i < 3 * 2 * 15625; i++)
+    {
+        vKeys.push_back(GetRandHash());
+        cache.Set(vKeys.back());
+    }
+
+    // The newest entries are still there, most of the oldest were pushed out
+    unsigned int nOldHits = 0, nNewHits = 0;
+    for (unsigned int i = 0; i < 1000; i++)
+    {
+        nOldHits += cache.Get(vKeys[i]);
+        nNewHits += cache.Get(vKeys[vKeys.size() - 1 - i]);
+    }
+    BOOST_CHECK(cache.Get(vKeys.back()));
+    BOOST_CHECK(nNewHits > 900);
+    BOOST_CHECK(nOldHits < 500);
+
+    cache.GetStats(nLookups, nHits, nBytes);
+    BOOST_CHECK_EQUAL(nLookups, 2001U);
+    BOOST_CHECK_EQUAL(nHits, (uint64)(nOldHits + nNewHits + 1));
+    BOOST_CHECK_EQUAL(nBytes, 15625U * 64);
+
+    // Sizes are clamped, and a zero size table caches nothing
+    CSignatureCache cacheOff(-1);
+    cacheOff.Set(vKeys[0]);
+    BOOST_CHECK(!cacheOff.Get(vKeys[0]));
+    cacheOff.GetStats(nLookups, nHits, nBytes);
+    BOOST_CHECK_EQUAL(nBytes, 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
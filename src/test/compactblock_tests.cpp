@@ -0,0 +1,78 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(compactblock_tests)
+
+static CTransaction MakeTx(const uint256& hashPrev, int64 nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = hashPrev;
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_fill)
+{
+    CBlock block;
+    block.nBits = 0x1e0ffff0;
+    block.nTime = 1400000000;
+    CTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vin[0].scriptSig = CScript() << OP_1 << OP_2;
+    txCoinbase.vout.resize(1);
+    txCoinbase.vout[0].nValue = 5 * COIN;
+    block.vtx.push_back(txCoinbase);
+    for (int i = 0; i < 3; i++)
+        block.vtx.push_back(MakeTx(GetRandHash(), COIN));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    // The receiver has all but the last transaction
+    CTxMemPool pool;
+    {
+        LOCK(pool.cs);
+        for (int i = 1; i < 3; i++)
+            pool.addUnchecked(block.vtx[i].GetHash(), CTxMemPoolEntry(block.vtx[i], 1000, 0, 0, 0, 1));
+    }
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CBlockHeaderAndShortTxIDs(block);
+    CBlockHeaderAndShortTxIDs cmpctblock;
+    ss >> cmpctblock;
+    BOOST_CHECK_EQUAL(cmpctblock.vShortTxIDs.size(), 3U);
+    BOOST_CHECK(cmpctblock.GetShortID(block.vtx[1].GetHash()) == cmpctblock.vShortTxIDs[0]);
+
+    // Short IDs hash the txid in place; that must agree with the vector form
+    uint256 hashTx = block.vtx[1].GetHash();
+    for (unsigned int nLen = 29; nLen <= 32; nLen++)
+    {
+        vector<unsigned char> vch(hashTx.begin(), hashTx.begin() + nLen);
+        BOOST_CHECK_EQUAL(MurmurHash3(7, hashTx.begin(), nLen), MurmurHash3(7, vch));
+    }
+
+    CBlock blockFilled;
+    vector<unsigned int> vMissing;
+    cmpctblock.FillBlock(pool, blockFilled, vMissing);
+    BOOST_CHECK_EQUAL(vMissing.size(), 1U);
+    BOOST_CHECK_EQUAL(vMissing[0], 3U);
+    BOOST_CHECK(blockFilled.vtx[1] == block.vtx[1]);
+
+    blockFilled.vtx[3] = block.vtx[3];
+    BOOST_CHECK(blockFilled.GetHash() == block.GetHash());
+    BOOST_CHECK(blockFilled.BuildMerkleTree() == block.hashMerkleRoot);
+
+    // A short ID that appears twice can't be told apart, both are fetched
+    cmpctblock.vShortTxIDs[1] = cmpctblock.vShortTxIDs[0];
+    cmpctblock.FillBlock(pool, blockFilled, vMissing);
+    BOOST_CHECK_EQUAL(vMissing.size(), 3U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -34,7 +34,7 @@ BOOST_AUTO_TEST_CASE(darksend_payment_amount)
 BOOST_AUTO_TEST_CASE(darksend_payments)
 {
     darkSendPool.unitTest = true;
-    darkSendMasterNodes.clear();
+    masternodeList.Clear();
 
     CService addr;
     std::vector<unsigned char> vchSig;
@@ -49,11 +49,11 @@ BOOST_AUTO_TEST_CASE(darksend_payments)
     CTxIn t3 = CTxIn(n3, 0);
 
     CMasterNode mn1(addr, t1, CPubKey(), vchSig, 0, CPubKey());
-    darkSendMasterNodes.push_back(mn1);
+    masternodeList.Add(mn1);
     CMasterNode mn2(addr, t2, CPubKey(), vchSig, 0, CPubKey());
-    darkSendMasterNodes.push_back(mn2);
+    masternodeList.Add(mn2);
     CMasterNode mn3(addr, t3, CPubKey(), vchSig, 0, CPubKey());
-    darkSendMasterNodes.push_back(mn3);
+    masternodeList.Add(mn3);
 
     CMasternodePaymentWinner w1; w1.nBlockHeight = 100000; w1.vin = t1;
     CMasternodePaymentWinner w2; w2.nBlockHeight = 100000; w2.vin = t2;
@@ -138,10 +138,10 @@ BOOST_AUTO_TEST_CASE(set_collateral_address_testnet)
 BOOST_AUTO_TEST_CASE(darksend_denom)
 {
 
-    darkSendDenominations.push_back( (500   * COIN)+1 );
-    darkSendDenominations.push_back( (100   * COIN)+1 );
-    darkSendDenominations.push_back( (10    * COIN)+1 );
-    darkSendDenominations.push_back( (1     * COIN)+1 );
+    InitDarkSendDenominations();
+    BOOST_CHECK(darkSendDenominations.size() == 4);
+    BOOST_CHECK(IsDenominatedAmount((100 * COIN)+1));
+    BOOST_CHECK(!IsDenominatedAmount(100 * COIN));
 
     std::vector<CTxOut> vout1;
     std::vector<CTxOut> vout2;
@@ -289,7 +289,7 @@ BOOST_AUTO_TEST_CASE(darksend_session)
 
 BOOST_AUTO_TEST_CASE(darksend_masternode_search_by_vin)
 {
-    darkSendMasterNodes.clear();
+    masternodeList.Clear();
 
     uint256 n1 = 10000;
     uint256 n2 = 10001;
@@ -302,14 +302,171 @@ BOOST_AUTO_TEST_CASE(darksend_masternode_search_by_vin)
 
     //setup a couple fake masternodes
     CMasterNode mn1(addr, testVin1, CPubKey(), vchSig, 0, CPubKey());
-    darkSendMasterNodes.push_back(mn1);
+    BOOST_CHECK(masternodeList.Add(mn1));
 
     CMasterNode mn2(addr, testVin2, CPubKey(), vchSig, 0, CPubKey());
-    darkSendMasterNodes.push_back(mn2);
+    BOOST_CHECK(masternodeList.Add(mn2));
+    BOOST_CHECK(!masternodeList.Add(mn2)); //no duplicates
+    BOOST_CHECK(masternodeList.size() == 2);
+
+    CMasterNodePtr pmn;
+    BOOST_CHECK(!masternodeList.Get(testVinNotFound));
+    BOOST_CHECK((pmn = masternodeList.Get(testVin1)) && pmn->vin == testVin1);
+    BOOST_CHECK((pmn = masternodeList.Get(testVin2)) && pmn->vin == testVin2);
+
+    //the index stays right as the list grows
+    for (unsigned int i = 0; i < 100; i++)
+        masternodeList.Add(CMasterNode(addr, CTxIn(n3 + i + 1, 0), CPubKey(), vchSig, 0, CPubKey()));
+    BOOST_CHECK((pmn = masternodeList.Get(testVin1)) && pmn->vin == testVin1);
+    BOOST_CHECK((pmn = masternodeList.Get(CTxIn(n3 + 50, 0))) && pmn->vin == CTxIn(n3 + 50, 0));
+
+    masternodeList.Clear();
+}
+
+BOOST_AUTO_TEST_CASE(darksend_masternode_updates)
+{
+    masternodeList.Clear();
+
+    CService addr;
+    std::vector<unsigned char> vchSig;
+    CTxIn vin(uint256(40000), 0);
+    CTxIn vinNotFound(uint256(40001), 0);
+    CMasterNode mn(addr, vin, CPubKey(), vchSig, 100, CPubKey());
+    mn.unitTest = true;
+    mn.UpdateLastSeen();
+    BOOST_CHECK(masternodeList.Add(mn));
+
+    //updates swap in a new version of the entry, the one handed out before doesn't change
+    CMasterNodePtr pmnBefore = masternodeList.Get(vin);
+    CMasterNodePtr pmn;
+    BOOST_CHECK(pmnBefore && pmnBefore->allowFreeTx);
+    BOOST_CHECK(masternodeList.TakeFreeTx(vin));
+    BOOST_CHECK(!masternodeList.TakeFreeTx(vin));
+    BOOST_CHECK(pmnBefore->allowFreeTx);
+    BOOST_CHECK(masternodeList.UpdateLastDsq(vin, 7));
+    BOOST_CHECK((pmn = masternodeList.Get(vin)) && pmn->nLastDsq == 7 && pmn->allowFreeTx);
+    BOOST_CHECK(pmnBefore->nLastDsq == 0);
+
+    //only newer signatures and pings are taken
+    std::vector<unsigned char> vchSig2(65, 2);
+    BOOST_CHECK(!masternodeList.UpdateSignature(vin, CPubKey(), vchSig2, 100));
+    BOOST_CHECK(masternodeList.UpdateSignature(vin, CPubKey(), vchSig2, 101));
+    BOOST_CHECK((pmn = masternodeList.Get(vin)) && pmn->now == 101 && pmn->sig == vchSig2);
+    BOOST_CHECK(masternodeList.UpdateLastDseep(vin, 50));
+    BOOST_CHECK(!masternodeList.UpdateLastDseep(vin, 50));
+    BOOST_CHECK(!masternodeList.UpdateLastSeenAfter(vin, MASTERNODE_MIN_SECONDS));
+    BOOST_CHECK(masternodeList.UpdateLastSeen(vin, GetAdjustedTime() - MASTERNODE_MIN_SECONDS - 1));
+    BOOST_CHECK(masternodeList.UpdateLastSeenAfter(vin, MASTERNODE_MIN_SECONDS));
+    BOOST_CHECK(!masternodeList.UpdateLastSeen(vinNotFound));
+
+    //a stopped masternode is removed on the next cleanup
+    BOOST_CHECK(masternodeList.Disable(vin));
+    BOOST_CHECK(!masternodeList.Disable(vin));
+    masternodeList.CheckAndRemove();
+    BOOST_CHECK(!masternodeList.Has(vin));
+
+    masternodeList.Clear();
+}
 
-    BOOST_CHECK(GetMasternodeByVin(testVinNotFound) == -1);
-    BOOST_CHECK(GetMasternodeByVin(testVin1) == 0);
-    BOOST_CHECK(GetMasternodeByVin(testVin2) == 1);
+BOOST_AUTO_TEST_CASE(darksend_masternode_rank_cache)
+{
+    darkSendPool.unitTest = true;
+    masternodeList.Clear();
+
+    CService addr;
+    std::vector<unsigned char> vchSig;
+    std::vector<CTxIn> vecVin;
+    for (int i = 0; i < 3; i++) {
+        vecVin.push_back(CTxIn(uint256(20000 + i), 0));
+        CMasterNode mn(addr, vecVin.back(), CPubKey(), vchSig, 0, CPubKey());
+        mn.unitTest = true;
+        mn.UpdateLastSeen();
+        masternodeList.Add(mn);
+    }
+
+    uint64 nHits, nMisses;
+    masternodeList.GetRankCacheStats(nHits, nMisses);
+    uint64 nHitsStart = nHits, nMissesStart = nMisses;
+
+    // the first lookup computes the ranking, the others reuse it
+    std::set<int> setRanks;
+    CMasterNode mnRank;
+    BOOST_FOREACH(const CTxIn& vin, vecVin) {
+        int rank = masternodeList.GetMasternodeRank(vin, 1);
+        setRanks.insert(rank);
+        BOOST_CHECK(masternodeList.GetMasternodeByRank(rank, mnRank, 1) && mnRank.vin == vin);
+    }
+    BOOST_CHECK(setRanks.size() == 3 && *setRanks.begin() == 1 && *setRanks.rbegin() == 3);
+    CMasterNode mnCurrent, mnFirst;
+    BOOST_CHECK(masternodeList.GetCurrentMasterNode(mnCurrent, 1, 1) && masternodeList.GetMasternodeByRank(1, mnFirst, 1));
+    BOOST_CHECK(mnCurrent.vin == mnFirst.vin);
+
+    masternodeList.GetRankCacheStats(nHits, nMisses);
+    BOOST_CHECK(nMisses == nMissesStart + 1);
+    BOOST_CHECK(nHits == nHitsStart + 7);
+
+    // changing the list drops the cached rankings
+    CMasterNode mn(addr, CTxIn(uint256(20003), 0), CPubKey(), vchSig, 0, CPubKey());
+    mn.unitTest = true;
+    mn.UpdateLastSeen();
+    masternodeList.Add(mn);
+    BOOST_CHECK(masternodeList.GetMasternodeRank(mn.vin, 1) != -1);
+    masternodeList.GetRankCacheStats(nHits, nMisses);
+    BOOST_CHECK(nMisses == nMissesStart + 2);
+
+    // the rankings only hold enabled masternodes, so disabling one drops them as well
+    BOOST_CHECK(masternodeList.GetMasternodeByRank(4, mnRank, 1));
+    BOOST_CHECK(masternodeList.Disable(mn.vin));
+    BOOST_CHECK(masternodeList.GetMasternodeRank(mn.vin, 1) == -1);
+    BOOST_CHECK(!masternodeList.GetMasternodeByRank(4, mnRank, 1));
+    masternodeList.GetRankCacheStats(nHits, nMisses);
+    BOOST_CHECK(nMisses == nMissesStart + 3);
+
+    masternodeList.Clear();
+}
+
+BOOST_AUTO_TEST_CASE(darksend_masternode_cache_file)
+{
+    masternodeList.Clear();
+
+    CService addr("1.2.3.4:9999");
+    std::vector<unsigned char> vchSig(65, 1);
+    CTxIn vinFresh(uint256(30000), 0);
+    CTxIn vinExpired(uint256(30001), 0);
+
+    CMasterNode mnFresh(addr, vinFresh, CPubKey(), vchSig, 1234, CPubKey());
+    mnFresh.UpdateLastSeen();
+    mnFresh.nLastDsq = 42;
+    masternodeList.Add(mnFresh);
+    CMasterNode mnExpired(addr, vinExpired, CPubKey(), vchSig, 1234, CPubKey());
+    mnExpired.UpdateLastSeen(GetAdjustedTime() - MASTERNODE_REMOVAL_SECONDS - 1);
+    masternodeList.Add(mnExpired);
+
+    std::vector<CTxIn> vecAskedFor;
+    vecAskedFor.push_back(CTxIn(uint256(30002), 0));
+    CMasternodePayments payments;
+
+    CMasternodeDB mndb;
+    BOOST_CHECK(mndb.Write(masternodeList, payments, vecAskedFor));
+
+    masternodeList.Clear();
+    vecAskedFor.clear();
+    BOOST_CHECK(mndb.Read(masternodeList, payments, vecAskedFor));
+
+    // expired entries aren't loaded
+    BOOST_CHECK(masternodeList.size() == 1);
+    BOOST_CHECK(!masternodeList.Has(vinExpired));
+    CMasterNodePtr pmn = masternodeList.Get(vinFresh);
+    BOOST_CHECK(pmn);
+    if (pmn) {
+        BOOST_CHECK(pmn->addr == addr);
+        BOOST_CHECK(pmn->sig == vchSig);
+        BOOST_CHECK(pmn->now == 1234);
+        BOOST_CHECK(pmn->nLastDsq == 42);
+    }
+    BOOST_CHECK(vecAskedFor.size() == 1 && vecAskedFor[0] == CTxIn(uint256(30002), 0));
+
+    masternodeList.Clear();
 }
 
 BOOST_AUTO_TEST_CASE(darksend_add_entry)
@@ -350,13 +507,13 @@ BOOST_AUTO_TEST_CASE(darksend_masternode_class)
     CMasterNode mn(CService("10.10.10.10:9999"), CTxIn(1000, 0), pubkey, newSig, newNow, pubkey);
     mn.unitTest = true;
     mn.UpdateLastSeen();
-    mn.Check();
+    mn.Check(mn.IsInputUnspent());
     BOOST_CHECK(mn.enabled == 1); // ok
     mn.lastTimeSeen -= MASTERNODE_EXPIRATION_SECONDS;
-    mn.Check();
+    mn.Check(mn.IsInputUnspent());
     BOOST_CHECK(mn.enabled == 2); // hasn't pinged
     mn.lastTimeSeen -= MASTERNODE_EXPIRATION_SECONDS;
-    mn.Check();
+    mn.Check(mn.IsInputUnspent());
     BOOST_CHECK(mn.enabled == 4); // expired
 }
 
@@ -0,0 +1,162 @@
+#include <boost/test/unit_test.hpp>
+
+#include "hashblock.h"
+#include "serialize.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(hash9_tests)
+
+BOOST_AUTO_TEST_CASE(hash9_genesis)
+{
+    // Main net genesis block header
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << 1 << uint256(0) << uint256("0xe0028eb9648db56b1ac77cf090b99048a8007e2bb64b68f092c03c7f56a662c7");
+    ss << (unsigned int)1390095618 << (unsigned int)0x1e0ffff0 << (unsigned int)28917698;
+    BOOST_CHECK_EQUAL(ss.size(), 80U);
+
+    uint256 hashGenesis("0x00000ffd590b1485b3caadc19b22e6379c733355108f107a430458cdf3407ab6");
+    const unsigned char* pheader = (const unsigned char*)&ss[0];
+    BOOST_CHECK(Hash9(pheader, pheader + 80) == hashGenesis);
+
+    for (int k = X11_KERNEL_SCALAR; k <= X11_KERNEL_AVX2; k++)
+    {
+        uint256 hash;
+        Hash9Multi(&pheader, 80, 1, &hash, (X11Kernel)k);
+        BOOST_CHECK(hash == hashGenesis);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(hash9_multi_matches_scalar)
+{
+    unsigned char headers[X11_MAX_LANES][80];
+    const unsigned char* ppHeader[X11_MAX_LANES];
+    for (unsigned int i = 0; i < X11_MAX_LANES; i++)
+    {
+        for (unsigned int j = 0; j < sizeof(headers[i]); j++)
+            headers[i][j] = insecure_rand();
+        ppHeader[i] = headers[i];
+    }
+
+    // Every kernel and every lane count, including the partial vectors
+    for (int k = X11_KERNEL_SCALAR; k <= X11_KERNEL_AVX2; k++)
+    {
+        if (!X11KernelSupported((X11Kernel)k))
+            continue;
+        for (unsigned int nLanes = 1; nLanes <= X11_MAX_LANES; nLanes++)
+        {
+            uint256 hashes[X11_MAX_LANES];
+            Hash9Multi(ppHeader, 80, nLanes, hashes, (X11Kernel)k);
+            for (unsigned int i = 0; i < nLanes; i++)
+                BOOST_CHECK_MESSAGE(hashes[i] == Hash9(headers[i], headers[i] + 80),
+                                    strprintf("kernel %s lanes %u lane %u", X11KernelName((X11Kernel)k), nLanes, i));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(hash9_dispatch_matches_scalar)
+{
+    // The detected kernel must run here and be the fastest one that does
+    X11Kernel kernelDefault = X11DefaultKernel();
+    BOOST_CHECK(X11KernelSupported(kernelDefault));
+    for (int k = kernelDefault + 1; k <= X11_KERNEL_AVX2; k++)
+        BOOST_CHECK(!X11KernelSupported((X11Kernel)k));
+    BOOST_TEST_MESSAGE(strprintf("X11 default kernel: %s", X11KernelName(kernelDefault)));
+
+    unsigned char headers[X11_MAX_LANES][80];
+    const unsigned char* ppHeader[X11_MAX_LANES];
+    for (unsigned int i = 0; i < X11_MAX_LANES; i++)
+    {
+        for (unsigned int j = 0; j < sizeof(headers[i]); j++)
+            headers[i][j] = insecure_rand();
+        ppHeader[i] = headers[i];
+    }
+
+    // Hash9Multi() without a kernel argument, as the miner calls it, against
+    // the scalar kernel; a SIMD kernel this CPU lacks must fall back to scalar
+    for (unsigned int nLanes = 1; nLanes <= X11_MAX_LANES; nLanes++)
+    {
+        uint256 hashesScalar[X11_MAX_LANES];
+        uint256 hashesDefault[X11_MAX_LANES];
+        Hash9Multi(ppHeader, 80, nLanes, hashesScalar, X11_KERNEL_SCALAR);
+        Hash9Multi(ppHeader, 80, nLanes, hashesDefault);
+        for (unsigned int i = 0; i < nLanes; i++)
+            BOOST_CHECK_MESSAGE(hashesDefault[i] == hashesScalar[i],
+                                strprintf("kernel %s lanes %u lane %u", X11KernelName(kernelDefault), nLanes, i));
+
+        for (int k = X11_KERNEL_SSE2; k <= X11_KERNEL_AVX2; k++)
+        {
+            uint256 hashes[X11_MAX_LANES];
+            Hash9Multi(ppHeader, 80, nLanes, hashes, (X11Kernel)k);
+            for (unsigned int i = 0; i < nLanes; i++)
+                BOOST_CHECK_MESSAGE(hashes[i] == hashesScalar[i],
+                                    strprintf("kernel %s lanes %u lane %u", X11KernelName((X11Kernel)k), nLanes, i));
+        }
+    }
+
+    // The nonce scanner picks up the detected kernel by default
+    CX11NonceScanner scannerDefault(headers[0]);
+    CX11NonceScanner scannerScalar(headers[0], X11_KERNEL_SCALAR);
+    uint256 hashesDefault[X11_MAX_LANES];
+    uint256 hashesScalar[X11_MAX_LANES];
+    scannerDefault.Hash(12345, X11_MAX_LANES, hashesDefault);
+    scannerScalar.Hash(12345, X11_MAX_LANES, hashesScalar);
+    for (unsigned int i = 0; i < X11_MAX_LANES; i++)
+        BOOST_CHECK(hashesDefault[i] == hashesScalar[i]);
+}
+
+BOOST_AUTO_TEST_CASE(hash9_nonce_scanner)
+{
+    unsigned char header[80];
+    for (unsigned int j = 0; j < sizeof(header); j++)
+        header[j] = insecure_rand();
+
+    // Start just below the wrap so the nonce carries into every byte
+    CX11NonceScanner scanner(header);
+    unsigned int nNonce = 0xfffffffcU;
+    uint256 hashes[X11_MAX_LANES];
+    scanner.Hash(nNonce, X11_MAX_LANES, hashes);
+    for (unsigned int i = 0; i < X11_MAX_LANES; i++)
+    {
+        unsigned int n = nNonce + i;
+        header[76] = n; header[77] = n >> 8; header[78] = n >> 16; header[79] = n >> 24;
+        BOOST_CHECK(hashes[i] == Hash9(header, header + 80));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(hash9_benchmark)
+{
+    unsigned char header[80];
+    for (unsigned int j = 0; j < sizeof(header); j++)
+        header[j] = insecure_rand();
+
+    // Nonce scanning rate of every kernel this CPU runs. Reported only: a
+    // loaded test machine makes timings useless as assertions. The kernels
+    // must still agree on every hash they produce.
+    const unsigned int nRounds = 1000;
+    uint256 hashScalar;
+    for (int k = X11_KERNEL_SCALAR; k <= X11_KERNEL_AVX2; k++)
+    {
+        if (!X11KernelSupported((X11Kernel)k))
+            continue;
+        CX11NonceScanner scanner(header, (X11Kernel)k);
+        uint256 hashAll = 0;
+        int64 nStart = GetTimeMicros();
+        for (unsigned int n = 0; n < nRounds; n++)
+        {
+            uint256 hashes[X11_MAX_LANES];
+            scanner.Hash(n * X11_MAX_LANES, X11_MAX_LANES, hashes);
+            for (unsigned int i = 0; i < X11_MAX_LANES; i++)
+                hashAll ^= hashes[i];
+        }
+        int64 nElapsed = std::max(GetTimeMicros() - nStart, (int64)1);
+        BOOST_TEST_MESSAGE(strprintf("X11 kernel %s: %"PRI64d" hashes/s", X11KernelName((X11Kernel)k),
+                                     (int64)nRounds * X11_MAX_LANES * 1000000 / nElapsed));
+
+        if (k == X11_KERNEL_SCALAR)
+            hashScalar = hashAll;
+        else
+            BOOST_CHECK_MESSAGE(hashAll == hashScalar, X11KernelName((X11Kernel)k));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,100 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+extern bool AcceptBlockHeader(CBlockHeader& header, CValidationState& state, CBlockIndex** ppindex);
+extern map<uint256, CBlockIndex*> mapHeaderIndex;
+extern CBlockIndex* pindexBestHeader;
+
+BOOST_AUTO_TEST_SUITE(headers_tests)
+
+// A header on top of the main net genesis block, mined at its difficulty
+static CBlockHeader MakeHeader(unsigned int nTime, unsigned int nNonce)
+{
+    CBlockHeader header;
+    header.nVersion = 2;
+    header.hashPrevBlock = hashGenesisBlock;
+    header.hashMerkleRoot = uint256("0x0101010101010101010101010101010101010101010101010101010101010101");
+    header.nTime = nTime;
+    header.nBits = 0x1e0ffff0;
+    header.nNonce = nNonce;
+    return header;
+}
+
+BOOST_AUTO_TEST_CASE(headers_accept)
+{
+    CBlockHeader header = MakeHeader(1390095768, 377744);
+    uint256 hash = header.GetHash();
+    BOOST_CHECK(hash == uint256("0x0000011e49c06e0ae805c24b519eec09b3d307cb59815fbf307a19345c5c6693"));
+
+    // A header we have the block for gives back its index entry
+    CValidationState state;
+    CBlockIndex* pindex = NULL;
+    CBlockHeader genesis = pindexGenesisBlock->GetBlockHeader();
+    BOOST_CHECK(AcceptBlockHeader(genesis, state, &pindex));
+    BOOST_CHECK(pindex == pindexGenesisBlock);
+    BOOST_CHECK(!mapHeaderIndex.count(hashGenesisBlock));
+
+    // A new one is linked into the header index and becomes the best header
+    pindex = NULL;
+    BOOST_CHECK(AcceptBlockHeader(header, state, &pindex));
+    BOOST_CHECK(pindex != NULL && mapHeaderIndex.count(hash));
+    BOOST_CHECK(pindex->pprev == pindexGenesisBlock);
+    BOOST_CHECK_EQUAL(pindex->nHeight, 1);
+    BOOST_CHECK(pindex->nChainWork > pindexGenesisBlock->nChainWork);
+    BOOST_CHECK(pindexBestHeader == pindex);
+    BOOST_CHECK(!mapBlockIndex.count(hash));
+
+    // Receiving it again doesn't add another entry
+    CBlockIndex* pindexAgain = NULL;
+    BOOST_CHECK(AcceptBlockHeader(header, state, &pindexAgain));
+    BOOST_CHECK(pindexAgain == pindex);
+
+    // Not enough work for its bits
+    int nDoS = 0;
+    CBlockHeader headerBad = MakeHeader(1390095768, 377745);
+    CValidationState stateBad;
+    BOOST_CHECK(!AcceptBlockHeader(headerBad, stateBad, &pindexAgain));
+    BOOST_CHECK(stateBad.IsInvalid(nDoS) && nDoS == 50);
+    BOOST_CHECK(!mapHeaderIndex.count(headerBad.GetHash()));
+
+    // Valid work, but no later than the median time of its parent
+    CBlockHeader headerEarly = MakeHeader(1390095618, 606380);
+    CValidationState stateEarly;
+    BOOST_CHECK(!AcceptBlockHeader(headerEarly, stateEarly, &pindexAgain));
+    BOOST_CHECK(stateEarly.IsInvalid(nDoS) && nDoS == 0);
+    BOOST_CHECK(!mapHeaderIndex.count(headerEarly.GetHash()));
+
+    mapHeaderIndex.erase(hash);
+    delete pindex;
+    pindexBestHeader = NULL;
+}
+
+BOOST_AUTO_TEST_CASE(block_precheck)
+{
+    CBlock block;
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    block.vtx.push_back(tx);
+    *(CBlockHeader*)&block = MakeHeader(1390095768, 377744);
+    uint256 hash = block.GetHash();
+    block.fHashCached = false;
+
+    // The work is valid but the merkle root isn't; the hash is cached either way
+    std::vector<const CBlock*> vpblock(1, &block);
+    BOOST_CHECK(!CBlockPreCheck(vpblock)());
+    BOOST_CHECK(block.fHashCached && block.hashCached == hash);
+    BOOST_CHECK(block.GetHash() == hash);
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    block.vMerkleTree.clear();
+    BOOST_CHECK(!CBlockPreCheck(vpblock)());
+    BOOST_CHECK(block.GetHash() != hash);
+    BOOST_CHECK(block.GetHash() == Hash9(BEGIN(block.nVersion), END(block.nNonce)));
+    BOOST_CHECK(!block.vMerkleTree.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,247 @@
+#include <boost/test/unit_test.hpp>
+
+#include "keystore.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+// Transaction spending output 0 of hashPrev, paying out nValue
+static CTransaction MakeTx(const uint256& hashPrev, int64 nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = hashPrev;
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(mempool_ancestor_index)
+{
+    CTxMemPool pool;
+
+    // A chain parent -> child -> grandchild, plus an unrelated transaction
+    CTransaction txParent = MakeTx(GetRandHash(), 10 * COIN);
+    CTransaction txChild = MakeTx(txParent.GetHash(), 9 * COIN);
+    CTransaction txGrandChild = MakeTx(txChild.GetHash(), 8 * COIN);
+    CTransaction txOther = MakeTx(GetRandHash(), 5 * COIN);
+
+    LOCK(pool.cs);
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0, 0, 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 50000, 0, 0, 0, 1));
+    pool.addUnchecked(txGrandChild.GetHash(), CTxMemPoolEntry(txGrandChild, 2000, 0, 0, 0, 1));
+    pool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 10000, 0, 0, 0, 1));
+    BOOST_CHECK_EQUAL(pool.size(), 4U);
+
+    CTxMemPool::txiter itChild = pool.mapTx.find(txChild.GetHash());
+    CTxMemPool::txiter itGrandChild = pool.mapTx.find(txGrandChild.GetHash());
+    BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 2U);
+    BOOST_CHECK_EQUAL(itChild->GetFeesWithAncestors(), 51000);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 3U);
+    BOOST_CHECK_EQUAL(itGrandChild->GetFeesWithAncestors(), 53000);
+    BOOST_CHECK_EQUAL(itGrandChild->GetSizeWithAncestors(), (uint64)(itGrandChild->GetTxSize() * 3));
+
+    // The fee rate index orders by the transaction alone
+    BOOST_CHECK(pool.mapTx.get<fee_rate>().rbegin()->GetTx() == txChild);
+    BOOST_CHECK(pool.mapTx.get<fee_rate>().begin()->GetTx() == txParent);
+
+    // The ancestor index puts the child's package ahead of the unrelated transaction
+    BOOST_CHECK(pool.mapTx.get<ancestor_score>().rbegin()->GetTx() == txChild);
+
+    // Confirming the parent takes it out of its descendants' packages
+    pool.remove(txParent);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 1U);
+    BOOST_CHECK_EQUAL(itChild->GetFeesWithAncestors(), 50000);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 2U);
+    BOOST_CHECK_EQUAL(itGrandChild->GetFeesWithAncestors(), 52000);
+
+    // A transaction coming back from a disconnected block is linked to its children again
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0, 0, 1));
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 3U);
+
+    // Removing recursively drops the whole chain
+    pool.remove(txParent, true);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+    BOOST_CHECK(pool.exists(txOther.GetHash()));
+    BOOST_CHECK(pool.mapNextTx.size() == 1);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim)
+{
+    CTxMemPool pool;
+
+    // A cheap parent paid for by its child, and two unrelated transactions
+    CTransaction txParent = MakeTx(GetRandHash(), 10 * COIN);
+    CTransaction txChild = MakeTx(txParent.GetHash(), 9 * COIN);
+    CTransaction txLow = MakeTx(GetRandHash(), 5 * COIN);
+    CTransaction txHigh = MakeTx(GetRandHash(), 5 * COIN);
+
+    LOCK(pool.cs);
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0, 0, 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 100000, 0, 0, 0, 1));
+    pool.addUnchecked(txLow.GetHash(), CTxMemPoolEntry(txLow, 1000, 0, 0, 0, 1));
+    pool.addUnchecked(txHigh.GetHash(), CTxMemPoolEntry(txHigh, 60000, 0, 0, 0, 1));
+
+    CTxMemPool::txiter itParent = pool.mapTx.find(txParent.GetHash());
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 2U);
+    BOOST_CHECK_EQUAL(itParent->GetFeesWithDescendants(), 100000);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), (uint64)itParent->GetTxSize() * 4);
+
+    // The parent is kept by its child, so the unrelated low fee transaction goes first
+    size_t nUsage = pool.DynamicMemoryUsage();
+    std::vector<uint256> vRemoved;
+    pool.TrimToSize(nUsage - 1, &vRemoved);
+    BOOST_CHECK_EQUAL(vRemoved.size(), 1U);
+    BOOST_CHECK(!pool.exists(txLow.GetHash()));
+    BOOST_CHECK(pool.DynamicMemoryUsage() < nUsage);
+    BOOST_CHECK(pool.GetMinFeeRate() > 0);
+
+    // Then the package with the lower fee rate, parent and child together
+    vRemoved.clear();
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1, &vRemoved);
+    BOOST_CHECK_EQUAL(vRemoved.size(), 2U);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+    BOOST_CHECK(pool.exists(txHigh.GetHash()));
+    BOOST_CHECK(pool.mapNextTx.size() == 1);
+
+    pool.TrimToSize(0);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_chain_limits)
+{
+    CTxMemPool pool;
+    LOCK(pool.cs);
+    string strError;
+
+    // A chain as long as allowed, the next link is too long
+    uint256 hashPrev = GetRandHash();
+    for (unsigned int i = 0; i < MEMPOOL_MAX_ANCESTORS; i++)
+    {
+        CTransaction tx = MakeTx(hashPrev, COIN);
+        BOOST_CHECK(pool.CheckChainLimits(tx, strError));
+        pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 1000, 0, 0, 0, 1));
+        hashPrev = tx.GetHash();
+    }
+    BOOST_CHECK(!pool.CheckChainLimits(MakeTx(hashPrev, COIN), strError));
+
+    // A parent with as many children as allowed, one more is too many
+    pool.clear();
+    CTransaction txParent = MakeTx(GetRandHash(), COIN);
+    txParent.vout.resize(MEMPOOL_MAX_DESCENDANTS, txParent.vout[0]);
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0, 0, 1));
+    for (unsigned int i = 0; i < MEMPOOL_MAX_DESCENDANTS; i++)
+    {
+        CTransaction tx = MakeTx(txParent.GetHash(), COIN);
+        tx.vin[0].prevout.n = i;
+        if (i < MEMPOOL_MAX_DESCENDANTS - 1)
+        {
+            BOOST_CHECK(pool.CheckChainLimits(tx, strError));
+            pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 1000, 0, 0, 0, 1));
+        }
+        else
+            BOOST_CHECK(!pool.CheckChainLimits(tx, strError));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(mempool_entry_sequence)
+{
+    CTxMemPool pool;
+    CTransaction txA = MakeTx(GetRandHash(), COIN);
+    CTransaction txB = MakeTx(GetRandHash(), COIN);
+
+    LOCK(pool.cs);
+    pool.addUnchecked(txA.GetHash(), CTxMemPoolEntry(txA, 1000, 0, 0, 0, 1));
+    uint64 nSequence = pool.GetSequence();
+    pool.addUnchecked(txB.GetHash(), CTxMemPoolEntry(txB, 1000, 0, 0, 0, 1));
+    BOOST_CHECK_EQUAL(pool.GetSequence(), nSequence + 1);
+
+    // Only what arrived after nSequence is found past it
+    const indexed_transaction_set::index<entry_sequence>::type& bySequence = pool.mapTx.get<entry_sequence>();
+    indexed_transaction_set::index<entry_sequence>::type::const_iterator it = bySequence.upper_bound(nSequence);
+    BOOST_CHECK(it != bySequence.end() && it->GetTx() == txB);
+    BOOST_CHECK(++it == bySequence.end());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_entry_priority)
+{
+    CTransaction tx = MakeTx(GetRandHash(), COIN);
+    CTxMemPoolEntry entry(tx, 0, 0, 10.0 * COIN, COIN, 100);
+    unsigned int nSize = entry.GetTxSize();
+    BOOST_CHECK_EQUAL(entry.GetPriority(100), 10.0 * COIN / nSize);
+    // coins from the chain keep aging
+    BOOST_CHECK_EQUAL(entry.GetPriority(110), 20.0 * COIN / nSize);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_persist)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(key.GetPubKey().GetID());
+
+    // A confirmed output, spent by a parent and child in the pool
+    CTransaction txFund = MakeTx(GetRandHash(), 10 * COIN);
+    txFund.vout[0].scriptPubKey = scriptPubKey;
+    CTransaction txParent = MakeTx(txFund.GetHash(), 9 * COIN);
+    txParent.vout[0].scriptPubKey = scriptPubKey;
+    BOOST_CHECK(SignSignature(keystore, txFund, txParent, 0));
+    CTransaction txChild = MakeTx(txParent.GetHash(), 8 * COIN);
+    txChild.vout[0].scriptPubKey = scriptPubKey;
+    BOOST_CHECK(SignSignature(keystore, txParent, txChild, 0));
+    {
+        LOCK(cs_main);
+        pcoinsTip->SetCoins(txFund.GetHash(), CCoins(txFund, 1));
+        mempool.clear();
+        CValidationState state;
+        BOOST_CHECK(mempool.accept(state, txParent, true, true, NULL, false, true, 1400000000));
+        BOOST_CHECK(mempool.accept(state, txChild, true, true, NULL, false, true, 1400000060));
+    }
+
+    BOOST_CHECK(DumpMempool());
+    mempool.clear();
+    BOOST_CHECK(LoadMempool());
+
+    // Both are back, with the times they first arrived
+    {
+        LOCK(mempool.cs);
+        BOOST_CHECK_EQUAL(mempool.mapTx.size(), 2U);
+        CTxMemPool::txiter itParent = mempool.mapTx.find(txParent.GetHash());
+        CTxMemPool::txiter itChild = mempool.mapTx.find(txChild.GetHash());
+        BOOST_CHECK(itParent != mempool.mapTx.end() && itParent->GetTime() == 1400000000);
+        BOOST_CHECK(itChild != mempool.mapTx.end() && itChild->GetTime() == 1400000060);
+        if (itChild != mempool.mapTx.end())
+            BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 2U);
+    }
+
+    // A damaged file is refused as a whole
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    FILE* file = fopen(pathMempool.string().c_str(), "r+b");
+    BOOST_CHECK(file != NULL);
+    if (file)
+    {
+        fseek(file, 10, SEEK_SET);
+        int c = fgetc(file);
+        fseek(file, 10, SEEK_SET);
+        fputc(c ^ 0xff, file);
+        fclose(file);
+    }
+    mempool.clear();
+    BOOST_CHECK(!LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 0U);
+
+    boost::filesystem::remove(pathMempool);
+    LOCK(cs_main);
+    pcoinsTip->SetCoins(txFund.GetHash(), CCoins());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
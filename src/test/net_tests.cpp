@@ -0,0 +1,133 @@
+#include <algorithm>
+
+#include <boost/test/unit_test.hpp>
+
+#include "net.h"
+#include "hash.h"
+
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
+
+// Tests this internal-to-net.cpp method:
+extern bool SocketServiceNode(CNode* pnode);
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(netmessage_receive)
+{
+    std::vector<char> vPayload(100000);
+    for (unsigned int i = 0; i < vPayload.size(); i++)
+        vPayload[i] = (char)(i * 7);
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+
+    CMessageHeader hdr("block", vPayload.size());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << hdr;
+
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0)), "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    // Part of the payload copied in with the header, the rest received straight into the message
+    std::vector<char> vFirst(ssHeader.begin(), ssHeader.end());
+    vFirst.insert(vFirst.end(), vPayload.begin(), vPayload.begin() + 1000);
+    BOOST_CHECK(node.ReceiveMsgBytes(&vFirst[0], vFirst.size()));
+    CNetMessage& msg = node.vRecvMsg.back();
+    BOOST_CHECK_EQUAL(msg.GetDataRemaining(), vPayload.size() - 1000);
+    memcpy(msg.GetDataSpace(), &vPayload[1000], vPayload.size() - 1000);
+    msg.DataReceived(vPayload.size() - 1000);
+
+    BOOST_CHECK(msg.complete());
+    BOOST_CHECK(msg.GetChecksumHash() == hash);
+    BOOST_CHECK(std::equal(vPayload.begin(), vPayload.end(), msg.vRecv.begin()));
+
+    // The next large message gets the buffer back
+    const char* pchBuffer = &msg.vRecv[0];
+    msg.Recycle();
+    node.vRecvMsg.clear();
+    BOOST_CHECK(node.ReceiveMsgBytes(&ssHeader[0], ssHeader.size()));
+    BOOST_CHECK(&node.vRecvMsg.back().vRecv[0] == pchBuffer);
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_shared)
+{
+    std::vector<unsigned char> vch(1000, 0x5a);
+    int64 nTime = 1400000000;
+
+    CNode node1(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0)), "", true);
+    CNode node2(INVALID_SOCKET, CAddress(CService("127.0.0.2", 0)), "", true);
+    node1.PushMessage("dseep", vch, nTime);
+
+    // Serialized once, the same bytes PushMessage puts on the wire
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << vch << nTime;
+    CNetMessageRef msg = MakeNetMessage("dseep", ss);
+    BOOST_CHECK_EQUAL(node1.vSendMsg.size(), 1U);
+    BOOST_CHECK(*node1.vSendMsg.front() == *msg);
+
+    // and queued to every peer without a copy
+    node1.PushSharedMessage(msg);
+    node2.PushSharedMessage(msg);
+    BOOST_CHECK(node1.vSendMsg.back() == msg && node2.vSendMsg.back() == msg);
+    BOOST_CHECK_EQUAL(node2.nSendSize, msg->size());
+}
+
+#ifndef WIN32
+// Read whatever the other end of a socket pair has sent
+static size_t DrainSocket(SOCKET hSocket)
+{
+    char pchBuf[0x10000];
+    size_t nTotal = 0;
+    int nBytes;
+    while ((nBytes = recv(hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT)) > 0)
+        nTotal += nBytes;
+    return nTotal;
+}
+
+BOOST_AUTO_TEST_CASE(socket_partial_send)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CNode node(fds[0], CAddress(CService("127.0.0.1", 0)), "", true);
+
+    // A message larger than the socket buffer is only partly sent
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << std::vector<unsigned char>(4000000, 0x5a);
+    CNetMessageRef msg = MakeNetMessage("block", ss);
+    node.PushSharedMessage(msg);
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), 1U);
+    BOOST_CHECK(node.nSendOffset > 0 && node.nSendOffset < msg->size());
+
+    // The peer sends us something, but there is no EPOLLOUT yet: nothing is read
+    // while the send queue still has data
+    CDataStream ssPing(SER_NETWORK, PROTOCOL_VERSION);
+    ssPing << (uint64)1;
+    CNetMessageRef msgPing = MakeNetMessage("ping", ssPing);
+    BOOST_CHECK(send(fds[1], &(*msgPing)[0], msgPing->size(), MSG_DONTWAIT) == (int)msgPing->size());
+    node.fSocketReadable = true;
+    node.fSocketWritable = false;
+    BOOST_CHECK(!SocketServiceNode(&node));
+    BOOST_CHECK(node.vRecvMsg.empty());
+    BOOST_CHECK(node.fSocketReadable);
+
+    // Each EPOLLOUT sends more, and the ping is only read once the queue is empty
+    size_t nReceived = 0;
+    for (int i = 0; i < 1000 && !node.vSendMsg.empty(); i++)
+    {
+        BOOST_CHECK(node.vRecvMsg.empty());
+        nReceived += DrainSocket(fds[1]);
+        node.fSocketWritable = true;
+        SocketServiceNode(&node);
+    }
+    nReceived += DrainSocket(fds[1]);
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+    BOOST_CHECK_EQUAL(nReceived, msg->size());
+    BOOST_CHECK(!node.vRecvMsg.empty() && node.vRecvMsg.back().complete());
+
+    close(fds[1]);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
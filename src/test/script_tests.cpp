@@ -448,4 +448,40 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     BOOST_CHECK(combined == partial3c);
 }
 
+BOOST_AUTO_TEST_CASE(script_sighash_context)
+{
+    CTransaction txTo;
+    txTo.nLockTime = 12345;
+    txTo.vin.resize(5);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        txTo.vin[i].prevout.hash = GetRandHash();
+        txTo.vin[i].prevout.n = i;
+        txTo.vin[i].scriptSig = CScript() << OP_1 << i;
+        txTo.vin[i].nSequence = i;
+    }
+    txTo.vout.resize(3);
+    for (unsigned int i = 0; i < txTo.vout.size(); i++)
+    {
+        txTo.vout[i].nValue = (i + 1) * COIN;
+        txTo.vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << i << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    CScript scriptCode = CScript() << OP_CODESEPARATOR << OP_2 << OP_CHECKSIG << OP_CODESEPARATOR;
+
+    // Same hashes as SignatureHash for every input and hash type, and the
+    // SIGHASH_SINGLE inputs past the last output
+    CSignatureHashContext sighash(txTo);
+    int pHashTypes[] = { SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE, 0 };
+    for (unsigned int i = 0; i < txTo.vin.size() + 1; i++)
+        for (unsigned int j = 0; j < sizeof(pHashTypes) / sizeof(pHashTypes[0]); j++)
+        {
+            BOOST_CHECK(sighash.SignatureHash(scriptCode, i, pHashTypes[j]) == SignatureHash(scriptCode, txTo, i, pHashTypes[j]));
+            BOOST_CHECK(sighash.SignatureHash(scriptCode, i, pHashTypes[j] | SIGHASH_ANYONECANPAY) == SignatureHash(scriptCode, txTo, i, pHashTypes[j] | SIGHASH_ANYONECANPAY));
+        }
+
+    // The context is still good after a scriptSig is replaced
+    txTo.vin[2].scriptSig = CScript() << OP_3 << OP_4;
+    BOOST_CHECK(sighash.SignatureHash(scriptCode, 2, SIGHASH_ALL) == SignatureHash(scriptCode, txTo, 2, SIGHASH_ALL));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
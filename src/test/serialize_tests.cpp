@@ -42,4 +42,27 @@ BOOST_AUTO_TEST_CASE(varints)
 
 }
 
+BOOST_AUTO_TEST_CASE(peek)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    int64 nFirst = 1, nSecond = 2;
+    std::vector<unsigned char> vch(3, 0xab);
+    ss << nFirst << vch << nSecond;
+    ss >> nFirst;
+
+    // Reads the unread part, all of it, and leaves the stream as it was
+    int64 n = 0;
+    std::vector<unsigned char> vchPeeked;
+    CDataStreamPeek peek(ss);
+    peek >> vchPeeked >> n;
+    BOOST_CHECK(vchPeeked == vch);
+    BOOST_CHECK_EQUAL(n, 2);
+    BOOST_CHECK_THROW(peek >> n, std::ios_base::failure);
+
+    std::vector<unsigned char> vchRead;
+    ss >> vchRead >> n;
+    BOOST_CHECK(vchRead == vch);
+    BOOST_CHECK_EQUAL(n, 2);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -27,7 +27,8 @@ struct TestingSetup {
         mapArgs["-datadir"] = pathTemp.string();
         pblocktree = new CBlockTreeDB(1 << 20, true);
         pcoinsdbview = new CCoinsViewDB(1 << 23, true);
-        pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+        coinsFlusher.SetBackend(*pcoinsdbview);
+        pcoinsTip = new CCoinsViewCache(coinsFlusher);
         InitBlockIndex();
         bool fFirstRun;
         pwalletMain = new CWallet("wallet.dat");
@@ -36,6 +37,7 @@ struct TestingSetup {
         nScriptCheckThreads = 3;
         for (int i=0; i < nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        threadGroup.create_thread(&ThreadFlushCoins);
     }
     ~TestingSetup()
     {
@@ -43,6 +45,7 @@ struct TestingSetup {
         threadGroup.join_all();
         delete pwalletMain;
         pwalletMain = NULL;
+        coinsFlusher.WaitForFlush();
         delete pcoinsTip;
         delete pcoinsdbview;
         delete pblocktree;
@@ -273,4 +273,200 @@ BOOST_AUTO_TEST_CASE(test_IsStandard)
     BOOST_CHECK(!t.IsStandard());
 }
 
+BOOST_AUTO_TEST_CASE(test_CachedHash)
+{
+    CTransaction t;
+    t.vin.resize(1);
+    t.vin[0].prevout.hash = GetRandHash();
+    t.vin[0].prevout.n = 0;
+    t.vout.resize(1);
+    t.vout[0].nValue = 1*CENT;
+    uint256 hashOld = t.GetHash();
+    BOOST_CHECK(hashOld == SerializeHash(t));
+
+    // In-place changes are picked up, and undoing them brings the old hash back
+    t.vout[0].nValue = 2*CENT;
+    BOOST_CHECK(t.GetHash() != hashOld);
+    BOOST_CHECK(t.GetHash() == SerializeHash(t));
+    t.vin[0].scriptSig = CScript() << OP_1;
+    BOOST_CHECK(t.GetHash() == SerializeHash(t));
+    t.vin[0].scriptSig = CScript();
+    t.vout[0].nValue = 1*CENT;
+    BOOST_CHECK(t.GetHash() == hashOld);
+    t.vout.push_back(CTxOut());
+    BOOST_CHECK(t.GetHash() == SerializeHash(t));
+    t.vout.pop_back();
+
+    // Deserializing into a transaction replaces the cached hash
+    CTransaction t2;
+    t2.vout.resize(1);
+    t2.GetHash();
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << t;
+    ss >> t2;
+    BOOST_CHECK(t2.GetHash() == t.GetHash());
+
+    // So does SetNull()
+    t2.SetNull();
+    BOOST_CHECK(t2.GetHash() == SerializeHash(CTransaction()));
+
+    // Block headers do the same
+    CBlockHeader header;
+    header.nNonce = 1;
+    uint256 hashHeader = header.GetHash();
+    header.nNonce = 2;
+    BOOST_CHECK(header.GetHash() != hashHeader);
+    header.nNonce = 1;
+    BOOST_CHECK(header.GetHash() == hashHeader);
+
+    // Copies carry the cached hashes along
+    CTransaction t3(t);
+    BOOST_CHECK(t3.GetHash() == t.GetHash());
+    t3 = t2;
+    BOOST_CHECK(t3.GetHash() == t2.GetHash());
+    CBlockHeader header2(header);
+    BOOST_CHECK(header2.GetHash() == hashHeader);
+}
+
+static void HashShared(const CTransaction* ptx, const CBlockHeader* pheader, bool* pfOk)
+{
+    uint256 hashTx = SerializeHash(*ptx);
+    uint256 hashHeader = Hash9(BEGIN(pheader->nVersion), END(pheader->nNonce));
+    for (int i = 0; i < 100; i++)
+        if (ptx->GetHash() != hashTx || pheader->GetHash() != hashHeader)
+            *pfOk = false;
+}
+
+BOOST_AUTO_TEST_CASE(test_CachedHash_threads)
+{
+    // Threads hashing the same objects, as the script check threads do
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    CBlockHeader header;
+    header.nNonce = 7;
+
+    bool fOk[4] = {true, true, true, true};
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 4; i++)
+        threadGroup.create_thread(boost::bind(&HashShared, &tx, &header, &fOk[i]));
+    threadGroup.join_all();
+    for (int i = 0; i < 4; i++)
+        BOOST_CHECK(fOk[i]);
+}
+
+// Base view that records what a cache flush hands to it
+class CCoinsViewRecorder : public CCoinsView
+{
+public:
+    std::map<uint256, CCoins> mapCoins;
+    unsigned int nWritten;
+
+    CCoinsViewRecorder() : nWritten(0) {}
+
+    bool GetCoins(const uint256 &txid, CCoins &coins)
+    {
+        std::map<uint256, CCoins>::const_iterator it = mapCoins.find(txid);
+        if (it == mapCoins.end())
+            return false;
+        coins = it->second;
+        return true;
+    }
+    bool HaveCoins(const uint256 &txid) { return mapCoins.count(txid) > 0; }
+    bool BatchWrite(CCoinsMap &mapWrite, CBlockIndex *pindex)
+    {
+        for (CCoinsMap::iterator it = mapWrite.begin(); it != mapWrite.end(); it++) {
+            if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+                continue;
+            nWritten++;
+            if (it->second.coins.IsPruned())
+                mapCoins.erase(it->first);
+            else
+                mapCoins[it->first] = it->second.coins;
+        }
+        return true;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(test_CoinsCacheFlush)
+{
+    CCoinsViewRecorder base;
+    CCoins coins;
+    coins.vout.resize(1);
+    coins.vout[0].nValue = 1*CENT;
+    coins.vout[0].scriptPubKey = CScript() << OP_1;
+    uint256 hashRead = GetRandHash();
+    base.mapCoins[hashRead] = coins;
+
+    // Entries that were only read are not written back
+    {
+        CCoinsViewCache cache(base);
+        BOOST_CHECK(cache.HaveCoins(hashRead));
+        BOOST_CHECK(cache.AccessCoins(hashRead).vout[0].nValue == 1*CENT);
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK_EQUAL(base.nWritten, 0U);
+    }
+
+    // Modified entries are
+    {
+        CCoinsViewCache cache(base);
+        cache.GetCoins(hashRead).vout[0].nValue = 2*CENT;
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK_EQUAL(base.nWritten, 1U);
+        BOOST_CHECK(base.mapCoins[hashRead].vout[0].nValue == 2*CENT);
+    }
+
+    // An entry the base only knows as pruned is created and spent in a child
+    // cache: it is dropped on the way down and never reaches the base
+    {
+        uint256 hashNew = GetRandHash();
+        base.mapCoins[hashNew] = CCoins();
+        CCoinsViewCache cache(base);
+        CCoinsViewCache cacheChild(cache);
+        BOOST_CHECK(cacheChild.HaveCoins(hashNew));
+        BOOST_CHECK(cacheChild.SetCoins(hashNew, coins));
+        CTxInUndo undo;
+        BOOST_CHECK(cacheChild.GetCoins(hashNew).Spend(COutPoint(hashNew, 0), undo));
+        BOOST_CHECK(cacheChild.Flush());
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK_EQUAL(base.nWritten, 1U);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_CoinsCacheBackgroundFlush)
+{
+    CCoinsViewRecorder base;
+    CCoinsViewFlusher flusher(base);
+    CCoinsViewCache cache(flusher);
+    size_t nEmptyUsage = cache.DynamicMemoryUsage();
+
+    CCoins coins;
+    coins.vout.resize(1);
+    coins.vout[0].nValue = 1*CENT;
+    coins.vout[0].scriptPubKey = CScript() << OP_1;
+    uint256 hash = GetRandHash();
+    BOOST_CHECK(cache.SetCoins(hash, coins));
+    size_t nUsage = cache.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > nEmptyUsage);
+
+    // Growing an entry in place is picked up by the next measurement
+    cache.GetCoins(hash).vout.resize(100);
+    BOOST_CHECK(cache.DynamicMemoryUsage() > nUsage);
+
+    // The queued batch is visible through the flusher until it is written
+    BOOST_CHECK(cache.FlushAsync());
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    BOOST_CHECK(flusher.IsFlushing());
+    BOOST_CHECK(cache.HaveCoins(hash));
+    BOOST_CHECK(cache.AccessCoins(hash).vout[0].nValue == 1*CENT);
+    BOOST_CHECK(!base.HaveCoins(hash));
+
+    BOOST_CHECK(flusher.WaitForFlush());
+    BOOST_CHECK(!flusher.IsFlushing());
+    BOOST_CHECK(base.HaveCoins(hash));
+    BOOST_CHECK_EQUAL(base.mapCoins[hash].vout.size(), 100U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
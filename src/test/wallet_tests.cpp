@@ -1,5 +1,6 @@
 #include <boost/test/unit_test.hpp>
 
+#include "init.h"
 #include "main.h"
 #include "wallet.h"
 
@@ -291,4 +292,230 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+BOOST_AUTO_TEST_CASE(wallet_unspent_index)
+{
+    LOCK(pwalletMain->cs_wallet);
+    int64 nBalance = pwalletMain->GetUnconfirmedBalance();
+
+    // One output to us, one to someone else
+    CPubKey pubkey = pwalletMain->GenerateNewKey();
+    CWalletTx wtx;
+    wtx.vin.resize(1);
+    wtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    wtx.vout.resize(2);
+    wtx.vout[0].nValue = 5 * COIN;
+    wtx.vout[0].scriptPubKey.SetDestination(pubkey.GetID());
+    wtx.vout[1].nValue = 3 * COIN;
+    wtx.vout[1].scriptPubKey = CScript() << OP_1;
+    BOOST_CHECK(pwalletMain->AddToWallet(wtx));
+    BOOST_CHECK(pwalletMain->mapUnspent.count(wtx.GetHash()));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nBalance + 5 * COIN);
+
+    // Spending our output takes the transaction out of the index
+    CWalletTx wtxSpend;
+    wtxSpend.vin.resize(1);
+    wtxSpend.vin[0].prevout = COutPoint(wtx.GetHash(), 0);
+    wtxSpend.vout.resize(1);
+    wtxSpend.vout[0].nValue = 5 * COIN;
+    wtxSpend.vout[0].scriptPubKey = CScript() << OP_1;
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxSpend));
+    BOOST_CHECK(!pwalletMain->mapUnspent.count(wtx.GetHash()));
+    BOOST_CHECK(!pwalletMain->mapUnspent.count(wtxSpend.GetHash()));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nBalance);
+
+    pwalletMain->EraseFromWallet(wtxSpend.GetHash());
+    pwalletMain->EraseFromWallet(wtx.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(wallet_balance_cache)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    InitDarkSendDenominations();
+    int nDarksendRoundsSave = nDarksendRounds;
+    nDarksendRounds = 1;
+
+    // Fill the caches
+    int64 nBalance = pwalletMain->GetBalance();
+    int64 nUnconfirmed = pwalletMain->GetUnconfirmedBalance();
+    int64 nAnonymized = pwalletMain->GetAnonymizedBalance();
+
+    // A new wallet transaction: a denominated payment to us from someone else
+    CWalletTx wtxIn;
+    wtxIn.vin.resize(1);
+    wtxIn.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    wtxIn.vout.resize(1);
+    wtxIn.vout[0].nValue = COIN + 1;
+    wtxIn.vout[0].scriptPubKey.SetDestination(pwalletMain->GenerateNewKey().GetID());
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxIn));
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), nBalance);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + COIN + 1);
+
+    // Mix it once into another denominated output of ours, confirmed in the genesis block
+    CWalletTx wtxMixed;
+    wtxMixed.vin.resize(1);
+    wtxMixed.vin[0].prevout = COutPoint(wtxIn.GetHash(), 0);
+    wtxMixed.vout.resize(1);
+    wtxMixed.vout[0].nValue = COIN + 1;
+    wtxMixed.vout[0].scriptPubKey.SetDestination(pwalletMain->GenerateNewKey().GetID());
+    wtxMixed.hashBlock = hashGenesisBlock;
+    wtxMixed.nIndex = 0;
+    wtxMixed.fMerkleVerified = true;
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxMixed));
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), nBalance + COIN + 1);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+
+    // The mixed output has 0 rounds: it only counts as anonymized once fewer rounds are asked for
+    BOOST_CHECK_EQUAL(pwalletMain->GetAnonymizedBalance(), nAnonymized);
+    nDarksendRounds = 0;
+    int64 nAnonymizedZero = pwalletMain->GetAnonymizedBalance();
+    BOOST_CHECK(nAnonymizedZero >= nAnonymized + COIN + 1);
+    nDarksendRounds = 1;
+    BOOST_CHECK_EQUAL(pwalletMain->GetAnonymizedBalance(), nAnonymized);
+    nDarksendRounds = 0;
+
+    // A new tip on another branch takes the genesis block, and with it the mixed
+    // transaction, out of the main chain. Nothing in the wallet changed.
+    CBlockIndex* pindexBestSave = pindexBest;
+    CBlockIndex indexFork;
+    pindexBest = &indexFork;
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), nBalance);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + COIN + 1);
+    BOOST_CHECK_EQUAL(pwalletMain->GetAnonymizedBalance(), nAnonymizedZero - COIN - 1);
+    pindexBest = pindexBestSave;
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), nBalance + COIN + 1);
+    BOOST_CHECK_EQUAL(pwalletMain->GetAnonymizedBalance(), nAnonymizedZero);
+
+    nDarksendRounds = nDarksendRoundsSave;
+    pwalletMain->EraseFromWallet(wtxMixed.GetHash());
+    pwalletMain->EraseFromWallet(wtxIn.GetHash());
+}
+
+// The blocks of wallet_parallel_rescan, read in place of the block files
+static vector<CBlock> vScanBlocks;
+
+static bool ReadScanTestBlock(CBlock& block, const CBlockIndex* pindex)
+{
+    block = vScanBlocks[pindex->nHeight];
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(wallet_parallel_rescan)
+{
+    LOCK(cs_main);
+
+    CKey key, keyScript, keyForeign;
+    key.MakeNewKey(true);
+    keyScript.MakeNewKey(true);
+    keyForeign.MakeNewKey(true);
+    CScript scriptKeyHash, scriptPubKey, scriptInner, scriptScriptHash, scriptMultisig, scriptForeign;
+    scriptKeyHash.SetDestination(key.GetPubKey().GetID());
+    scriptPubKey << key.GetPubKey() << OP_CHECKSIG;
+    scriptInner.SetDestination(keyScript.GetPubKey().GetID());
+    scriptScriptHash.SetDestination(scriptInner.GetID());
+    std::vector<CPubKey> vMultisigKeys;
+    vMultisigKeys.push_back(key.GetPubKey());
+    vMultisigKeys.push_back(keyForeign.GetPubKey());
+    scriptMultisig.SetMultisig(1, vMultisigKeys);
+    scriptForeign.SetDestination(keyForeign.GetPubKey().GetID());
+
+    CWallet walletSerial, walletParallel;
+    CWallet* pwallets[] = { &walletSerial, &walletParallel };
+    BOOST_FOREACH(CWallet* pwallet, pwallets)
+    {
+        LOCK(pwallet->cs_wallet);
+        pwallet->AddKeyPubKey(key, key.GetPubKey());
+        pwallet->AddKeyPubKey(keyScript, keyScript.GetPubKey());
+        pwallet->AddCScript(scriptInner);
+    }
+
+    // 150 blocks, so the workers go round the 64 block window twice. Every block has a coinbase
+    // and a payment that aren't ours; the wallet's transactions sit on both sides of the window
+    // boundaries. The multisig payment needs a key we don't have, so it's flagged by the workers
+    // but not taken.
+    const int nBlocks = 150;
+    vScanBlocks.assign(nBlocks, CBlock());
+    vector<CBlockIndex> vIndex(nBlocks);
+    vector<uint256> vHashes(nBlocks);
+    uint256 hashTxMine;
+    set<uint256> setExpected;
+    for (int i = 0; i < nBlocks; i++)
+    {
+        CBlock& block = vScanBlocks[i];
+        block.nVersion = 1;
+        block.hashPrevBlock = i > 0 ? vHashes[i - 1] : 0;
+        block.nTime = 1400000000 + i * 150;
+
+        CTransaction txCoinbase;
+        txCoinbase.vin.resize(1);
+        txCoinbase.vin[0].prevout.SetNull();
+        txCoinbase.vin[0].scriptSig = CScript() << i;
+        txCoinbase.vout.push_back(CTxOut(5 * COIN, i == 140 ? scriptKeyHash : scriptForeign));
+        block.vtx.push_back(txCoinbase);
+
+        CTransaction txForeign;
+        txForeign.vin.push_back(CTxIn(COutPoint(uint256(1000 + i), 0)));
+        txForeign.vout.push_back(CTxOut(COIN, scriptForeign));
+        block.vtx.push_back(txForeign);
+
+        CTransaction tx;
+        tx.vin.push_back(CTxIn(COutPoint(uint256(2000 + i), 0)));
+        if (i == 3 || i == 63 || i == 64 || i == 149)
+        {
+            tx.vout.push_back(CTxOut(COIN, i == 3 ? scriptKeyHash : i == 63 ? scriptPubKey : i == 64 ? scriptScriptHash : scriptMultisig));
+            block.vtx.push_back(tx);
+            if (i == 3)
+                hashTxMine = tx.GetHash();
+            if (i != 149)
+                setExpected.insert(tx.GetHash());
+        }
+        else if (i == 100)
+        {
+            // spends the payment of block 3, without paying us anything
+            tx.vin[0].prevout = COutPoint(hashTxMine, 0);
+            tx.vout.push_back(CTxOut(COIN, scriptForeign));
+            block.vtx.push_back(tx);
+            setExpected.insert(tx.GetHash());
+        }
+        if (i == 140)
+            setExpected.insert(txCoinbase.GetHash());
+
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        vHashes[i] = block.GetHash();
+        vIndex[i].phashBlock = &vHashes[i];
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = i > 0 ? &vIndex[i - 1] : NULL;
+        vIndex[i].pnext = i + 1 < nBlocks ? &vIndex[i + 1] : NULL;
+    }
+
+    BOOST_CHECK_EQUAL(walletSerial.ScanForWalletTransactions(&vIndex[0], false, 0, ReadScanTestBlock), (int)setExpected.size());
+    BOOST_CHECK_EQUAL(walletParallel.ScanForWalletTransactions(&vIndex[0], false, 4, ReadScanTestBlock), (int)setExpected.size());
+
+    // A second rescan only finds something new with fUpdate
+    BOOST_CHECK_EQUAL(walletParallel.ScanForWalletTransactions(&vIndex[0], false, 4, ReadScanTestBlock), 0);
+    BOOST_CHECK_EQUAL(walletSerial.ScanForWalletTransactions(&vIndex[0], true, 0, ReadScanTestBlock),
+                      walletParallel.ScanForWalletTransactions(&vIndex[0], true, 4, ReadScanTestBlock));
+
+    // Both wallets hold the same transactions, in the same blocks, spent the same way
+    LOCK2(walletSerial.cs_wallet, walletParallel.cs_wallet);
+    BOOST_CHECK_EQUAL(walletSerial.mapWallet.size(), setExpected.size());
+    BOOST_CHECK_EQUAL(walletParallel.mapWallet.size(), setExpected.size());
+    BOOST_FOREACH(const uint256& hash, setExpected)
+    {
+        BOOST_CHECK(walletSerial.mapWallet.count(hash));
+        BOOST_CHECK(walletParallel.mapWallet.count(hash));
+        if (!walletSerial.mapWallet.count(hash) || !walletParallel.mapWallet.count(hash))
+            continue;
+        const CWalletTx& wtxSerial = walletSerial.mapWallet[hash];
+        const CWalletTx& wtxParallel = walletParallel.mapWallet[hash];
+        BOOST_CHECK(wtxParallel.hashBlock == wtxSerial.hashBlock);
+        BOOST_CHECK_EQUAL(wtxParallel.nIndex, wtxSerial.nIndex);
+        BOOST_CHECK(wtxParallel.vMerkleBranch == wtxSerial.vMerkleBranch);
+        BOOST_CHECK(wtxParallel.vfSpent == wtxSerial.vfSpent);
+    }
+    BOOST_CHECK(walletParallel.mapWallet[hashTxMine].hashBlock == vHashes[3]);
+    BOOST_CHECK(walletParallel.mapWallet[hashTxMine].IsSpent(0));
+
+    vScanBlocks.clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -11,6 +11,7 @@
 #include "base58.h"
 #include "coincontrol.h"
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 
@@ -52,6 +53,7 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
 {
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
         return false;
+    ClearDarksendRounds();
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
@@ -85,6 +87,9 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    ClearDarksendRounds();
+    // outputs paying to the script are ours now
+    MarkDirty();
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -357,6 +362,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
                     LogPrintf("WalletUpdateSpent found spent coin %sDRK %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    UpdateUnspent(wtx);
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -368,9 +374,30 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
+        mapUnspent.clear();
+        MarkBalancesDirty();
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        {
             item.second.MarkDirty();
+            UpdateUnspent(item.second);
+        }
+    }
+}
+
+void CWallet::UpdateUnspent(const CWalletTx& wtx)
+{
+    LOCK(cs_wallet);
+    MarkBalancesDirty();
+    uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+        {
+            mapUnspent[hash] = &wtx;
+            return;
+        }
     }
+    mapUnspent.erase(hash);
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
@@ -385,6 +412,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         bool fInsertedNew = ret.second;
         if (fInsertedNew)
         {
+            // cached Darksend rounds that found this transaction missing are wrong now
+            if (setDarksendRoundsMissing.count(hash))
+                ClearDarksendRounds();
+
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
 
@@ -484,9 +515,17 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             }
         }
 #endif
+        UpdateUnspent(wtx);
+
         // since AddToWallet is called directly for self-originating transactions, check for consumption of own coins
         WalletUpdateSpent(wtx);
 
+        // fill in the Darksend rounds of the new outputs while their inputs are still cached
+        if (fInsertedNew && this == pwalletMain)
+            for (unsigned int i = 0; i < wtx.vout.size(); i++)
+                if (IsMine(wtx.vout[i]))
+                    GetInputDarksendRounds(CTxIn(hash, i));
+
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
 
@@ -532,12 +571,25 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
+        mapUnspent.erase(hash);
+        MarkBalancesDirty();
         if (mapWallet.erase(hash))
+        {
             CWalletDB(strWalletFile).EraseTx(hash);
+            ClearDarksendRounds();
+        }
     }
     return true;
 }
 
+void CWallet::ClearDarksendRounds()
+{
+    LOCK(cs_wallet);
+    mapDarksendRounds.clear();
+    setDarksendRoundsMissing.clear();
+    MarkBalancesDirty();
+}
+
 
 bool CWallet::IsMine(const CTxIn &txin) const
 {
@@ -581,10 +633,8 @@ int64 CWallet::IsDenominated(const CTxIn &txin) const
         {
             const CWalletTx& prev = (*mi).second;
             if (txin.prevout.n < prev.vout.size()){
-                BOOST_FOREACH(int64 d, darkSendDenominations){
-                    if(prev.vout[txin.prevout.n].nValue == d) {
-                        return true;
-                    }
+                if(IsDenominatedAmount(prev.vout[txin.prevout.n].nValue)) {
+                    return true;
                 }
             }
         }
@@ -791,27 +841,236 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+//
+// Parallel rescan
+//
+// Worker threads read the blocks of the rescan from disk a window ahead of
+// the wallet and flag the transactions that pay to one of our keys or
+// scripts, using a copy of the key and script IDs so they don't contend on
+// the keystore lock. ScanForWalletTransactions() then takes the blocks in
+// chain order and only hands the flagged transactions, and those that spend
+// or update wallet transactions, to AddToWalletIfInvolvingMe.
+//
+
+namespace {
+
+static const unsigned int MAX_SCAN_THREADS = 8;
+static const unsigned int SCAN_WINDOW = 64;
+
+// The wallet's key and script IDs at the start of the rescan
+struct CScanFilter
+{
+    set<CKeyID> setKeys;
+    set<CScriptID> setScripts;
+
+    // Cheap superset of IsMine(): the exact check is left to AddToWalletIfInvolvingMe
+    bool MayBeMine(const CTxOut& txout) const
+    {
+        vector<vector<unsigned char> > vSolutions;
+        txnouttype whichType;
+        if (!Solver(txout.scriptPubKey, whichType, vSolutions))
+            return false;
+
+        switch (whichType)
+        {
+        case TX_PUBKEY:
+            return setKeys.count(CPubKey(vSolutions[0]).GetID()) > 0;
+        case TX_PUBKEYHASH:
+            return setKeys.count(CKeyID(uint160(vSolutions[0]))) > 0;
+        case TX_SCRIPTHASH:
+            return setScripts.count(CScriptID(uint160(vSolutions[0]))) > 0;
+        case TX_MULTISIG:
+            for (unsigned int i = 1; i < vSolutions.size() - 1; i++)
+                if (setKeys.count(CPubKey(vSolutions[i]).GetID()))
+                    return true;
+            return false;
+        default:
+            return false;
+        }
+    }
+};
+
+// A block of the rescan as prepared by a worker
+struct CScanBlock
+{
+    CBlock block;
+    vector<uint256> vHashes;
+    vector<bool> vfMayBeMine;
+    bool fReady;
+
+    CScanBlock() : fReady(false) {}
+};
+
+class CScanQueue
+{
+private:
+    const vector<CBlockIndex*>& vBlocks;
+    const CScanFilter& filter;
+    CWallet::ScanBlockReader readBlock;
+
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condScan;
+    vector<CScanBlock> vWindow;
+    // next block for a worker, first block not yet consumed by the scan
+    unsigned int nNext, nConsumed;
+    bool fQuit;
+
+public:
+    CScanQueue(const vector<CBlockIndex*>& vBlocksIn, const CScanFilter& filterIn, CWallet::ScanBlockReader readBlockIn) :
+        vBlocks(vBlocksIn), filter(filterIn), readBlock(readBlockIn), vWindow(SCAN_WINDOW), nNext(0), nConsumed(0), fQuit(false) {}
+
+    void Worker()
+    {
+        while (true)
+        {
+            unsigned int i;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fQuit && nNext < vBlocks.size() && nNext >= nConsumed + SCAN_WINDOW)
+                    condWorker.wait(lock);
+                if (fQuit || nNext >= vBlocks.size())
+                    return;
+                i = nNext++;
+            }
+
+            // The slot was released by the scan before nNext could reach i
+            CScanBlock& scan = vWindow[i % SCAN_WINDOW];
+            scan.block.SetNull();
+            readBlock(scan.block, vBlocks[i]);
+            scan.vHashes.resize(scan.block.vtx.size());
+            scan.vfMayBeMine.assign(scan.block.vtx.size(), false);
+            for (unsigned int n = 0; n < scan.block.vtx.size(); n++)
+            {
+                const CTransaction& tx = scan.block.vtx[n];
+                scan.vHashes[n] = tx.GetHash();
+                BOOST_FOREACH(const CTxOut& txout, tx.vout)
+                {
+                    if (filter.MayBeMine(txout))
+                    {
+                        scan.vfMayBeMine[n] = true;
+                        break;
+                    }
+                }
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            scan.fReady = true;
+            condScan.notify_one();
+        }
+    }
+
+    // Wait for block i, which must be the next one in order
+    CScanBlock& Get(unsigned int i)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CScanBlock& scan = vWindow[i % SCAN_WINDOW];
+        while (!scan.fReady)
+            condScan.wait(lock);
+        return scan;
+    }
+
+    void Release(unsigned int i)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        vWindow[i % SCAN_WINDOW].fReady = false;
+        nConsumed = i + 1;
+        condWorker.notify_all();
+    }
+
+    void Quit()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+        condWorker.notify_all();
+    }
+};
+
+static bool ReadScanBlock(CBlock& block, const CBlockIndex* pindex)
+{
+    return block.ReadFromDisk(pindex);
+}
+
+} // anon namespace
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+{
+    unsigned int nThreads = std::max(1U, std::min(boost::thread::hardware_concurrency(), MAX_SCAN_THREADS));
+    return ScanForWalletTransactions(pindexStart, fUpdate, nThreads, ReadScanBlock);
+}
+
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, unsigned int nThreads, ScanBlockReader readBlock)
 {
     int ret = 0;
 
-    CBlockIndex* pindex = pindexStart;
+    if (nThreads == 0)
     {
         LOCK(cs_wallet);
-        while (pindex)
+        for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
         {
             CBlock block;
-            block.ReadFromDisk(pindex);
+            readBlock(block, pindex);
             BOOST_FOREACH(CTransaction& tx, block.vtx)
-            {
                 if (AddToWalletIfInvolvingMe(tx.GetHash(), tx, &block, fUpdate))
                     ret++;
+        }
+        return ret;
+    }
+
+    vector<CBlockIndex*> vBlocks;
+    for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
+        vBlocks.push_back(pindex);
+    if (vBlocks.empty())
+        return 0;
+
+    {
+        LOCK(cs_wallet);
+
+        CScanFilter filter;
+        GetKeys(filter.setKeys);
+        GetCScripts(filter.setScripts);
+
+        CScanQueue queue(vBlocks, filter, readBlock);
+        boost::thread_group threadGroup;
+        for (unsigned int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CScanQueue::Worker, &queue));
+
+        try {
+            int nLastPercent = -1;
+            for (unsigned int i = 0; i < vBlocks.size(); i++)
+            {
+                int nPercent = (int)((uint64)i * 100 / vBlocks.size());
+                if (nPercent != nLastPercent)
+                {
+                    nLastPercent = nPercent;
+                    if (!fSucessfullyLoaded)
+                        uiInterface.InitMessage(strprintf(_("Rescanning... (%d%%)"), nPercent));
+                    else if (nPercent % 10 == 0)
+                        LogPrintf("Rescanning... %d%%\n", nPercent);
+                }
+
+                CScanBlock& scan = queue.Get(i);
+                for (unsigned int n = 0; n < scan.block.vtx.size(); n++)
+                {
+                    const CTransaction& tx = scan.block.vtx[n];
+                    bool fInvolved = scan.vfMayBeMine[n] || mapWallet.count(scan.vHashes[n]);
+                    for (unsigned int j = 0; !fInvolved && j < tx.vin.size(); j++)
+                        fInvolved = mapWallet.count(tx.vin[j].prevout.hash) > 0;
+                    if (fInvolved && AddToWalletIfInvolvingMe(scan.vHashes[n], tx, &scan.block, fUpdate))
+                        ret++;
+                }
+                queue.Release(i);
             }
-            pindex = pindex->pnext;
+        } catch (...) {
+            queue.Quit();
+            threadGroup.join_all();
+            throw;
         }
+        queue.Quit();
+        threadGroup.join_all();
     }
     return ret;
 }
@@ -852,6 +1111,7 @@ void CWallet::ReacceptWalletTransactions()
                     LogPrintf("ReacceptWalletTransactions found spent coin %sDRK %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    UpdateUnspent(wtx);
                 }
             }
             else
@@ -951,16 +1211,46 @@ void CWallet::ResendWalletTransactions(uint256 txid)
 //
 
 
-int64 CWallet::GetBalance() const
+// Sum up the balances from the unspent outputs index
+CWalletBalances CWallet::ComputeBalances() const
+{
+    CWalletBalances balances;
+    {
+        LOCK(cs_wallet);
+        for (map<uint256, const CWalletTx*>::const_iterator it = mapUnspent.begin(); it != mapUnspent.end(); ++it)
+        {
+            const CWalletTx* pcoin = (*it).second;
+            bool fConfirmed = pcoin->IsConfirmed();
+            if (fConfirmed)
+                balances.nBalance += pcoin->GetAvailableCredit();
+            if (!pcoin->IsFinal() || !fConfirmed)
+                balances.nUnconfirmed += pcoin->GetAvailableCredit();
+            balances.nImmature += pcoin->GetImmatureCredit();
+        }
+    }
+
+    return balances;
+}
+
+int64 CWallet::ComputeAnonymizedBalance() const
 {
     int64 nTotal = 0;
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (map<uint256, const CWalletTx*>::const_iterator it = mapUnspent.begin(); it != mapUnspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsConfirmed()){
-                nTotal += pcoin->GetAvailableCredit();
+            const CWalletTx* pcoin = (*it).second;
+            if (!pcoin->IsConfirmed())
+                continue;
+            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
+                CTxIn vin = CTxIn(pcoin->GetHash(), i);
+
+                if(pcoin->IsSpent(i) || !IsMine(pcoin->vout[i]) || !IsDenominated(vin)) continue;
+
+                int rounds = GetInputDarksendRounds(vin);
+                if(rounds >= nDarksendRounds){
+                    nTotal += pcoin->vout[i].nValue;
+                }
             }
         }
     }
@@ -968,7 +1258,28 @@ int64 CWallet::GetBalance() const
     return nTotal;
 }
 
-int64 CWallet::GetAnonymizedBalance() const
+// Sum up the balances from every wallet transaction, independent of
+// mapUnspent and of the balance cache
+CWalletBalances CWallet::RecountBalances() const
+{
+    CWalletBalances balances;
+    {
+        LOCK(cs_wallet);
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        {
+            const CWalletTx* pcoin = &(*it).second;
+            if (pcoin->IsConfirmed())
+                balances.nBalance += pcoin->GetAvailableCredit();
+            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
+                balances.nUnconfirmed += pcoin->GetAvailableCredit();
+            balances.nImmature += pcoin->GetImmatureCredit();
+        }
+    }
+
+    return balances;
+}
+
+int64 CWallet::RecountAnonymizedBalance() const
 {
     int64 nTotal = 0;
     {
@@ -978,15 +1289,13 @@ int64 CWallet::GetAnonymizedBalance() const
             const CWalletTx* pcoin = &(*it).second;
             if (pcoin->IsConfirmed()){
                 for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                    
-                    COutput out = COutput(pcoin, i, pcoin->GetDepthInMainChain());
-                    CTxIn vin = CTxIn(out.tx->GetHash(), out.i);  
+                    CTxIn vin = CTxIn(pcoin->GetHash(), i);
 
                     if(pcoin->IsSpent(i) || !IsMine(pcoin->vout[i]) || !IsDenominated(vin)) continue;
-                    
+
                     int rounds = GetInputDarksendRounds(vin);
                     if(rounds >= nDarksendRounds){
-                        nTotal += pcoin->vout[i].nValue;                    
+                        nTotal += pcoin->vout[i].nValue;
                     }
                 }
             }
@@ -996,6 +1305,58 @@ int64 CWallet::GetAnonymizedBalance() const
     return nTotal;
 }
 
+// Balances are polled by the UI and RPC far more often than the wallet or the
+// chain tip changes, so they are only recomputed after one of those did.
+// -checkbalances compares the cached totals against a recount over mapWallet
+// on every call and logs any difference.
+CWalletBalances CWallet::GetBalances() const
+{
+    LOCK(cs_wallet);
+    if (!fBalancesCached || pindexBalances != pindexBest)
+    {
+        pindexBalances = pindexBest;
+        balancesCached = ComputeBalances();
+        fBalancesCached = true;
+    }
+
+    if (GetBoolArg("-checkbalances", false))
+    {
+        CWalletBalances balances = RecountBalances();
+        if (!(balances == balancesCached))
+            LogPrintf("ERROR: GetBalances() : cached balances %s/%s/%s, expected %s/%s/%s\n",
+                FormatMoney(balancesCached.nBalance).c_str(), FormatMoney(balancesCached.nUnconfirmed).c_str(),
+                FormatMoney(balancesCached.nImmature).c_str(), FormatMoney(balances.nBalance).c_str(),
+                FormatMoney(balances.nUnconfirmed).c_str(), FormatMoney(balances.nImmature).c_str());
+    }
+    return balancesCached;
+}
+
+int64 CWallet::GetBalance() const
+{
+    return GetBalances().nBalance;
+}
+
+int64 CWallet::GetAnonymizedBalance() const
+{
+    LOCK(cs_wallet);
+    if (!fAnonymizedCached || pindexAnonymized != pindexBest || nAnonymizedDarksendRounds != nDarksendRounds)
+    {
+        pindexAnonymized = pindexBest;
+        nAnonymizedDarksendRounds = nDarksendRounds;
+        nAnonymizedCached = ComputeAnonymizedBalance();
+        fAnonymizedCached = true;
+    }
+
+    if (GetBoolArg("-checkbalances", false))
+    {
+        int64 nAnonymized = RecountAnonymizedBalance();
+        if (nAnonymized != nAnonymizedCached)
+            LogPrintf("ERROR: GetAnonymizedBalance() : cached balance %s, expected %s\n",
+                FormatMoney(nAnonymizedCached).c_str(), FormatMoney(nAnonymized).c_str());
+    }
+    return nAnonymizedCached;
+}
+
 double CWallet::GetAverageAnonymizedRounds() const
 {
     double fTotal = 0;
@@ -1003,9 +1364,9 @@ double CWallet::GetAverageAnonymizedRounds() const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (map<uint256, const CWalletTx*>::const_iterator it = mapUnspent.begin(); it != mapUnspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
             for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
                 
                 COutput out = COutput(pcoin, i, pcoin->GetDepthInMainChain());
@@ -1031,15 +1392,14 @@ int64 CWallet::GetDenominatedBalance(bool onlyDenom, bool onlyUnconfirmed) const
     int64 nTotal = 0;
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (map<uint256, const CWalletTx*>::const_iterator it = mapUnspent.begin(); it != mapUnspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
 
             bool isDenom = false;
             for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                BOOST_FOREACH(int64 d, darkSendDenominations)
-                    if(pcoin->vout[i].nValue == d)
-                        isDenom = true;
+                if(IsDenominatedAmount(pcoin->vout[i].nValue))
+                    isDenom = true;
 
             if(onlyUnconfirmed){
                 if (!pcoin->IsFinal() || !pcoin->IsConfirmed()){
@@ -1060,31 +1420,12 @@ int64 CWallet::GetDenominatedBalance(bool onlyDenom, bool onlyUnconfirmed) const
 
 int64 CWallet::GetUnconfirmedBalance() const
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nUnconfirmed;
 }
 
 int64 CWallet::GetImmatureBalance() const
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nImmature;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -1094,9 +1435,9 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (map<uint256, const CWalletTx*>::const_iterator it = mapUnspent.begin(); it != mapUnspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
 
             if (!pcoin->IsFinal())
                 continue;
@@ -1117,10 +1458,7 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
                    int rounds = GetInputDarksendRounds(vin);
                    if(rounds >= nDarksendRounds) found = true;
                 } else if(coin_type == ONLY_NONDENOMINATED) {
-                    found = true;
-                    BOOST_FOREACH(int64 d, darkSendDenominations)
-                        if(pcoin->vout[i].nValue == d)
-                            found = false;
+                    found = !IsDenominatedAmount(pcoin->vout[i].nValue);
 
                 } else {
                     found = true;
@@ -1454,9 +1792,8 @@ bool CWallet::CreateTransaction(std::vector<pair<CScript, int64> >& vecSend,
     int64 nValue = 0;
     BOOST_FOREACH (PAIRTYPE(CScript, int64)& s, vecSend)
     {
-        BOOST_FOREACH(int64 d, darkSendDenominations)
-            if(s.second == d)
-                s.second -= 1; //denominations are reserved, subtract 1 satoshi (10.00000001 will become 10DRK)
+        if(IsDenominatedAmount(s.second))
+            s.second -= 1; //denominations are reserved, subtract 1 satoshi (10.00000001 will become 10DRK)
 
         if (nValue < 0)
         {
@@ -1589,8 +1926,9 @@ bool CWallet::CreateTransaction(std::vector<pair<CScript, int64> >& vecSend,
                 
                 // Sign
                 int nIn = 0;
+                CSignatureHashContext sighash(wtxNew);
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++))
+                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++, SIGHASH_ALL, &sighash))
                     {
                         strFailReason = _("Signing transaction failed");
                         return false;
@@ -1661,6 +1999,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std:
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdateUnspent(coin);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
@@ -1907,6 +2246,8 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    MarkDirty();
+
     return DB_LOAD_OK;
 }
 
@@ -2359,6 +2700,7 @@ void CWallet::UpdatedTransaction(const uint256 &hashTx)
         // Only notify UI if this transaction is in this wallet
         map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
         if (mi != mapWallet.end()){
+            MarkBalancesDirty();
             NotifyTransactionChanged(this, hashTx, CT_UPDATED);
         }
     }
@@ -75,6 +75,21 @@ public:
     )
 };
 
+/** The wallet's balances by category, see CWallet::GetBalances() */
+struct CWalletBalances
+{
+    int64 nBalance;
+    int64 nUnconfirmed;
+    int64 nImmature;
+
+    CWalletBalances() : nBalance(0), nUnconfirmed(0), nImmature(0) {}
+
+    bool operator==(const CWalletBalances& b) const
+    {
+        return nBalance == b.nBalance && nUnconfirmed == b.nUnconfirmed && nImmature == b.nImmature;
+    }
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -90,6 +105,25 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // Balances computed at the tip pindexBalances, valid until it changes or the wallet
+    // marks them dirty
+    mutable bool fBalancesCached;
+    mutable CWalletBalances balancesCached;
+    mutable const CBlockIndex* pindexBalances;
+
+    // The anonymized balance walks the Darksend rounds of every denominated output, so it
+    // is cached on its own and only computed when asked for. It also depends on nDarksendRounds.
+    mutable bool fAnonymizedCached;
+    mutable int64 nAnonymizedCached;
+    mutable const CBlockIndex* pindexAnonymized;
+    mutable int nAnonymizedDarksendRounds;
+
+    CWalletBalances ComputeBalances() const;
+    int64 ComputeAnonymizedBalance() const;
+    // Reference totals for -checkbalances, summed over every transaction in mapWallet
+    CWalletBalances RecountBalances() const;
+    int64 RecountAnonymizedBalance() const;
+
 public:
     bool SelectCoins(int64 nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl *coinControl=NULL, AvailableCoinsType coin_type=ALL_COINS) const;
     bool SelectCoinsDark(int64 nValueMin, int64 nValueMax, std::vector<CTxIn>& setCoinsRet, int64& nValueRet, int nDarksendRoundsMin, int nDarksendRoundsMax, bool& hasFeeInput) const;
@@ -117,6 +151,12 @@ public:
         nWalletVersion = FEATURE_BASE;
         nWalletMaxVersion = FEATURE_BASE;
         fFileBacked = false;
+        fBalancesCached = false;
+        pindexBalances = NULL;
+        fAnonymizedCached = false;
+        nAnonymizedCached = 0;
+        pindexAnonymized = NULL;
+        nAnonymizedDarksendRounds = 0;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
@@ -126,6 +166,12 @@ public:
         nWalletVersion = FEATURE_BASE;
         nWalletMaxVersion = FEATURE_BASE;
         strWalletFile = strWalletFileIn;
+        fBalancesCached = false;
+        pindexBalances = NULL;
+        fAnonymizedCached = false;
+        nAnonymizedCached = 0;
+        pindexAnonymized = NULL;
+        nAnonymizedDarksendRounds = 0;
         fFileBacked = true;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
@@ -142,6 +188,18 @@ public:
 
     std::set<COutPoint> setLockedCoins;
 
+    // Darksend rounds of an outpoint at a given recursion depth, see GetInputDarksendRounds().
+    // The result only depends on which transactions and keys the wallet has, so entries stay valid
+    // until a transaction that was looked up and missing arrives, a transaction or key is removed or
+    // added, or the chain reorganizes.
+    std::map<std::pair<COutPoint, int>, int> mapDarksendRounds;
+    // transactions the cached rounds found missing from the wallet
+    std::set<uint256> setDarksendRoundsMissing;
+
+    // Transactions with outputs of ours that aren't spent yet. Balances and coin selection
+    // walk these instead of the whole history in mapWallet, see UpdateUnspent().
+    std::map<uint256, const CWalletTx*> mapUnspent;
+
     // check whether we are allowed to upgrade (or already support) to the named feature
     bool CanSupportFeature(enum WalletFeature wf) { return nWalletMaxVersion >= wf; }
     std::string Denominate(CWalletTx& wtxDenominate);
@@ -190,13 +248,21 @@ public:
     TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
 
     void MarkDirty();
+    void UpdateUnspent(const CWalletTx& wtx);
     bool AddToWallet(const CWalletTx& wtxIn);
     bool AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate = false, bool fFindBlock = false);
     bool EraseFromWallet(uint256 hash);
+    void ClearDarksendRounds();
     void WalletUpdateSpent(const CTransaction& prevout);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    // As above, with the blocks read by readBlock on nThreads worker threads. With no threads
+    // the blocks are read and scanned one after the other, every transaction checked in full.
+    typedef bool (*ScanBlockReader)(CBlock& block, const CBlockIndex* pindex);
+    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, unsigned int nThreads, ScanBlockReader readBlock);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(uint256 txid=0);
+    CWalletBalances GetBalances() const;
+    void MarkBalancesDirty() { fBalancesCached = false; fAnonymizedCached = false; }
     int64 GetBalance() const;
     int64 GetAnonymizedBalance() const;
     double GetAverageAnonymizedRounds() const;
@@ -787,8 +853,7 @@ public:
     int Priority() const
     {
         if(tx->vout[i].nValue == DARKSEND_FEE) return -20000;
-        BOOST_FOREACH(int64 d, darkSendDenominations) 
-            if(tx->vout[i].nValue == d) return 10000;
+        if(IsDenominatedAmount(tx->vout[i].nValue)) return 10000;
         if(tx->vout[i].nValue < 1*COIN) return 20000;
 
         //nondenom return largest first